@@ -0,0 +1,440 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ *  ConnectionRegistry.c
+ *
+ *	A packed array of the entries on one thread.  Each entry remembers its
+ *	slot, so removing one moves the last entry into the hole instead of
+ *	searching, and the array never has gaps to skip when it is walked.
+ *	Walking runs from the end, so an entry removed as it is visited only
+ *	ever pulls in one that has been visited already.  A shared registry takes
+ *	a lock around all of that, for connections that each run on a thread of
+ *	their own.
+ */
+
+#pragma mark Includes
+#include "ConnectionRegistry.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kMinCapacity		16
+
+// How often a drain looks for more connections that have gone idle.
+static const CFTimeInterval kSweepInterval = 0.25;
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct __ConnectionRegistry {
+	CFAllocatorRef		_alloc;			// Allocator used to allocate this
+	volatile UInt32		_rc;			// Number of times retained, changed atomically
+	
+	Boolean				_shared;		// Entries come and go from any thread
+	pthread_mutex_t		_lock;			// Guards everything below, if shared
+	
+	ConnectionRegistryEntry** _slots;	// Entries, packed from the front
+	CFIndex				_count;			// Number of entries in the registry
+	CFIndex				_capacity;		// Room in _slots
+	
+	CFRunLoopTimerRef	_sweepTimer;	// Sweeps while draining
+	CFAbsoluteTime		_deadline;		// When the drain closes whatever is left
+} ConnectionRegistry;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static ConnectionRegistryRef _ConnectionRegistryCreate(CFAllocatorRef alloc, Boolean shared);
+static void _ConnectionRegistryLock(ConnectionRegistry* registry);
+static void _ConnectionRegistryUnlock(ConnectionRegistry* registry);
+static Boolean _ConnectionRegistryGrow(ConnectionRegistry* registry);
+static CFIndex _ConnectionRegistryClose(ConnectionRegistry* registry, Boolean idleOnly);
+static void _ConnectionRegistryStopSweeping(ConnectionRegistry* registry);
+
+static void _SweepTimerCallBack(CFRunLoopTimerRef timer, ConnectionRegistry* registry);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ ConnectionRegistryRef
+ConnectionRegistryCreate(CFAllocatorRef alloc) {
+
+	return _ConnectionRegistryCreate(alloc, FALSE);
+}
+
+
+/* extern */ ConnectionRegistryRef
+ConnectionRegistryCreateShared(CFAllocatorRef alloc) {
+
+	return _ConnectionRegistryCreate(alloc, TRUE);
+}
+
+
+/* extern */ ConnectionRegistryRef
+ConnectionRegistryRetain(ConnectionRegistryRef registry) {
+
+	// Bump the retain count.  Entries on other threads hold a shared one.
+	__sync_add_and_fetch(&(((ConnectionRegistry*)registry)->_rc), 1);
+	
+	return registry;
+}
+
+
+/* extern */ void
+ConnectionRegistryRelease(ConnectionRegistryRef registry) {
+
+	ConnectionRegistry* r = (ConnectionRegistry*)registry;
+	
+	// Decrease the retain count, and destroy the object if not being held.
+	if (__sync_sub_and_fetch(&(r->_rc), 1) == 0) {
+	
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef alloc = r->_alloc;
+		
+		// Entry owners hold the registry, so none can be left at this point.
+		assert(r->_count == 0);
+		
+		_ConnectionRegistryStopSweeping(r);
+		
+		if (r->_slots != NULL)
+			CFAllocatorDeallocate(alloc, r->_slots);
+		
+		if (r->_shared)
+			pthread_mutex_destroy(&(r->_lock));
+		
+		// Free the memory in use by the registry.
+		CFAllocatorDeallocate(alloc, r);
+		
+		// Release the allocator.
+		if (alloc)
+			CFRelease(alloc);
+	}
+}
+
+
+/* extern */ void
+ConnectionRegistryEntryInit(ConnectionRegistryEntry* entry, const ConnectionRegistryCallBacks* callbacks, void* info) {
+
+	memset(entry, 0, sizeof(entry[0]));
+	
+	entry->_slot = kCFNotFound;
+	entry->_callbacks = callbacks;
+	entry->_info = info;
+}
+
+
+/* extern */ Boolean
+ConnectionRegistryAdd(ConnectionRegistryRef registry, ConnectionRegistryEntry* entry) {
+
+	ConnectionRegistry* r = (ConnectionRegistry*)registry;
+	Boolean added = FALSE;
+	
+	assert(entry->_registry == NULL);
+	
+	_ConnectionRegistryLock(r);
+	
+	// Make room if the slots are full.
+	if ((r->_count < r->_capacity) || _ConnectionRegistryGrow(r)) {
+	
+		// It goes on the end.
+		entry->_registry = registry;
+		entry->_slot = r->_count;
+		r->_slots[r->_count++] = entry;
+		
+		added = TRUE;
+	}
+	
+	_ConnectionRegistryUnlock(r);
+	
+	return added;
+}
+
+
+/* extern */ void
+ConnectionRegistryRemove(ConnectionRegistryEntry* entry) {
+
+	ConnectionRegistry* r = (ConnectionRegistry*)entry->_registry;
+	
+	// Nothing to do for an entry that isn't in a registry.
+	if (r == NULL)
+		return;
+	
+	_ConnectionRegistryLock(r);
+	
+	assert(r->_slots[entry->_slot] == entry);
+	
+	// The last one fills the hole, which is a no-op when it is the last.
+	r->_slots[entry->_slot] = r->_slots[--(r->_count)];
+	r->_slots[entry->_slot]->_slot = entry->_slot;
+	
+	entry->_registry = NULL;
+	entry->_slot = kCFNotFound;
+	
+	_ConnectionRegistryUnlock(r);
+}
+
+
+/* extern */ CFIndex
+ConnectionRegistryGetCount(ConnectionRegistryRef registry) {
+
+	ConnectionRegistry* r = (ConnectionRegistry*)registry;
+	CFIndex count;
+	
+	_ConnectionRegistryLock(r);
+	count = r->_count;
+	_ConnectionRegistryUnlock(r);
+	
+	return count;
+}
+
+
+/* extern */ Boolean
+ConnectionRegistryIsShared(ConnectionRegistryRef registry) {
+
+	return ((ConnectionRegistry*)registry)->_shared;
+}
+
+
+/* extern */ void
+ConnectionRegistryApply(ConnectionRegistryRef registry, ConnectionRegistryApplier applier, void* context) {
+
+	ConnectionRegistry* r = (ConnectionRegistry*)registry;
+	CFIndex i;
+	
+	_ConnectionRegistryLock(r);
+	
+	// From the end, so the applier can remove the one it's given.
+	for (i = r->_count; i-- > 0; ) {
+		ConnectionRegistryEntry* entry = r->_slots[i];
+		applier(entry, entry->_info, context);
+	}
+	
+	_ConnectionRegistryUnlock(r);
+}
+
+
+/* extern */ CFIndex
+ConnectionRegistryCloseIdle(ConnectionRegistryRef registry) {
+
+	return _ConnectionRegistryClose((ConnectionRegistry*)registry, TRUE);
+}
+
+
+/* extern */ CFIndex
+ConnectionRegistryCloseAll(ConnectionRegistryRef registry) {
+
+	return _ConnectionRegistryClose((ConnectionRegistry*)registry, FALSE);
+}
+
+
+/* extern */ Boolean
+ConnectionRegistryDrain(ConnectionRegistryRef registry, CFAbsoluteTime deadline) {
+
+	ConnectionRegistry* r = (ConnectionRegistry*)registry;
+	
+	r->_deadline = deadline;
+	
+	// Whatever isn't doing anything can go right away.
+	ConnectionRegistryCloseIdle(registry);
+	
+	// Keep sweeping for the rest, unless already doing so.
+	if ((ConnectionRegistryGetCount(registry) > 0) && (r->_sweepTimer == NULL)) {
+	
+		CFRunLoopTimerContext timerCtxt = {0, r, NULL, NULL, NULL};
+		
+		r->_sweepTimer = CFRunLoopTimerCreate(r->_alloc,
+											  CFAbsoluteTimeGetCurrent() + kSweepInterval,
+											  kSweepInterval,
+											  0,		// flags
+											  0,		// order
+											  (CFRunLoopTimerCallBack)&_SweepTimerCallBack,
+											  &timerCtxt);
+		
+		// Fail if unable to create the timer.
+		if (r->_sweepTimer == NULL)
+			return FALSE;
+		
+		CFRunLoopAddTimer(CFRunLoopGetCurrent(), r->_sweepTimer, kCFRunLoopCommonModes);
+	}
+	
+	return TRUE;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ ConnectionRegistryRef
+_ConnectionRegistryCreate(CFAllocatorRef alloc, Boolean shared) {
+
+	// Allocate the buffer for the registry.
+	ConnectionRegistry* registry = CFAllocatorAllocate(alloc, sizeof(registry[0]), 0);
+	
+	// Fail if unable to create the registry.
+	if (registry == NULL)
+		return NULL;
+	
+	memset(registry, 0, sizeof(registry[0]));
+	
+	// Save the allocator for deallocating later.
+	registry->_alloc = alloc ? CFRetain(alloc) : NULL;
+	
+	// Recursive, so an entry on the sweeping thread can still close itself
+	// and take itself out from inside the sweep.
+	if (shared) {
+	
+		pthread_mutexattr_t attributes;
+		
+		pthread_mutexattr_init(&attributes);
+		pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&(registry->_lock), &attributes);
+		pthread_mutexattr_destroy(&attributes);
+		
+		registry->_shared = TRUE;
+	}
+	
+	// Bump the retain count.  The slots come with the first entry.
+	return ConnectionRegistryRetain((ConnectionRegistryRef)registry);
+}
+
+
+/* static */ void
+_ConnectionRegistryLock(ConnectionRegistry* registry) {
+
+	// Only a shared registry needs one.
+	if (registry->_shared)
+		pthread_mutex_lock(&(registry->_lock));
+}
+
+
+/* static */ void
+_ConnectionRegistryUnlock(ConnectionRegistry* registry) {
+
+	if (registry->_shared)
+		pthread_mutex_unlock(&(registry->_lock));
+}
+
+
+/* static */ Boolean
+_ConnectionRegistryGrow(ConnectionRegistry* registry) {
+
+	CFIndex capacity = (registry->_capacity < kMinCapacity) ? kMinCapacity : (registry->_capacity * 2);
+	ConnectionRegistryEntry** slots;
+	
+	// Doubling keeps adds constant time overall.
+	if (registry->_slots == NULL)
+		slots = CFAllocatorAllocate(registry->_alloc, capacity * sizeof(slots[0]), 0);
+	else
+		slots = CFAllocatorReallocate(registry->_alloc, registry->_slots, capacity * sizeof(slots[0]), 0);
+	
+	if (slots == NULL)
+		return FALSE;
+	
+	registry->_slots = slots;
+	registry->_capacity = capacity;
+	
+	return TRUE;
+}
+
+
+/* static */ CFIndex
+_ConnectionRegistryClose(ConnectionRegistry* registry, Boolean idleOnly) {
+
+	CFIndex closed = 0;
+	CFIndex i;
+	
+	_ConnectionRegistryLock(registry);
+	
+	// From the end, since each close takes its entry out.
+	for (i = registry->_count; i-- > 0; ) {
+	
+		ConnectionRegistryEntry* entry = registry->_slots[i];
+		const ConnectionRegistryCallBacks* callbacks = entry->_callbacks;
+		
+		if (idleOnly && ((callbacks->isIdle == NULL) || !callbacks->isIdle(entry, entry->_info)))
+			continue;
+		
+		callbacks->close(entry, entry->_info);
+		closed++;
+		
+		// The close has to have let go of it, or this would never finish.
+		// Shared entries may only be asked to, and go later on their own.
+		assert(registry->_shared || (i >= registry->_count) || (registry->_slots[i] != entry));
+	}
+	
+	_ConnectionRegistryUnlock(registry);
+	
+	return closed;
+}
+
+
+/* static */ void
+_ConnectionRegistryStopSweeping(ConnectionRegistry* registry) {
+
+	// Invalidate and release the timer if there is one.
+	if (registry->_sweepTimer != NULL) {
+		CFRunLoopTimerRef timer = registry->_sweepTimer;
+		registry->_sweepTimer = NULL;
+		CFRunLoopTimerInvalidate(timer);
+		CFRelease(timer);
+	}
+}
+
+
+/* static */ void
+_SweepTimerCallBack(CFRunLoopTimerRef timer, ConnectionRegistry* registry) {
+
+	assert(timer == registry->_sweepTimer);
+	
+	// Out of time, everyone goes.  Otherwise just the ones gone idle.
+	_ConnectionRegistryClose(registry, CFAbsoluteTimeGetCurrent() < registry->_deadline);
+	
+	// Nothing left to wait for.
+	if (ConnectionRegistryGetCount((ConnectionRegistryRef)registry) == 0)
+		_ConnectionRegistryStopSweeping(registry);
+}
@@ -0,0 +1,188 @@
+
+#ifndef __CONNECTIONREGISTRY__
+#define __CONNECTIONREGISTRY__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+typedef struct __ConnectionRegistry* ConnectionRegistryRef;
+
+typedef struct ConnectionRegistryEntry ConnectionRegistryEntry;
+
+
+/*
+** ConnectionRegistryCallBacks
+**
+** How the registry sweeps an entry.  The functions are called on the
+** registry's thread with the entry's info.  In a shared registry they are
+** called on the sweeping thread with the registry locked, so an entry
+** that lives on another thread must not wait on it from them.
+**
+** version	Set to 0.
+**
+** close	Closes the connection.  It must remove the entry before it
+**			returns; that is usually the connection going away.  In a
+**			shared registry it may instead ask the connection's own
+**			thread to, and return.
+**
+** isIdle	Returns TRUE if the connection has nothing in flight, so
+**			closing it loses nothing.  NULL means it never is.  In a
+**			shared registry it may instead ask the connection's own
+**			thread to look, and close it there if so, and return FALSE.
+*/
+typedef struct {
+	CFIndex				version;
+	void				(*close)(ConnectionRegistryEntry* entry, void* info);
+	Boolean				(*isIdle)(ConnectionRegistryEntry* entry, void* info);
+} ConnectionRegistryCallBacks;
+
+
+/*
+** ConnectionRegistryEntry
+**
+** One connection in a registry.  Entries are embedded in their owner and
+** remember their slot, so adding and removing one is constant time and
+** removing never allocates.  Treat the fields as private.
+*/
+struct ConnectionRegistryEntry {
+	ConnectionRegistryRef _registry;	// Registry the entry is in, if any
+	CFIndex				_slot;			// Its index in the registry's slots
+	const ConnectionRegistryCallBacks* _callbacks;	// How to sweep it
+	void*				_info;			// Passed to the callbacks
+};
+
+
+typedef void (*ConnectionRegistryApplier)(ConnectionRegistryEntry* entry, void* info, void* context);
+
+
+/*
+** ConnectionRegistryCreate
+**
+** Create a registry of the connections on one thread.  The entries sit
+** packed in a single array, so walking them for a count or a sweep
+** touches nothing else.  Like a timer wheel, a registry belongs to the
+** thread whose run loop its connections are on, and all adds, removes
+** and sweeps must happen there.
+**
+** alloc		Allocator to use for allocating.  NULL indicates
+**				the default allocator.
+*/
+ConnectionRegistryRef ConnectionRegistryCreate(CFAllocatorRef alloc);
+
+
+/*
+** ConnectionRegistryCreateShared
+**
+** Create a registry of connections that each run on a thread, or a
+** dispatch queue, of their own.  Adds, removes and counts may happen on
+** any thread, under a lock.  Sweeps still run wherever they are started,
+** and a drain's timer on that thread's run loop.  A sweep waits out a
+** concurrent add or remove, and nothing more, since the callbacks hand
+** their work to the connections' own threads.
+**
+** alloc		Allocator to use for allocating.  NULL indicates
+**				the default allocator.
+*/
+ConnectionRegistryRef ConnectionRegistryCreateShared(CFAllocatorRef alloc);
+
+ConnectionRegistryRef ConnectionRegistryRetain(ConnectionRegistryRef registry);
+void ConnectionRegistryRelease(ConnectionRegistryRef registry);
+
+
+/*
+** ConnectionRegistryEntryInit
+**
+** Prepares an entry for use.  An initialized entry not in a registry may
+** be removed any number of times.  The callbacks are not copied, so they
+** must outlive the entry.
+*/
+void ConnectionRegistryEntryInit(ConnectionRegistryEntry* entry, const ConnectionRegistryCallBacks* callbacks, void* info);
+
+
+/*
+** ConnectionRegistryAdd
+**
+** Puts the entry in the registry.  Returns FALSE if there was no room and
+** it could not be grown.  The entry must not be in a registry already.
+*/
+Boolean ConnectionRegistryAdd(ConnectionRegistryRef registry, ConnectionRegistryEntry* entry);
+
+
+/*
+** ConnectionRegistryRemove
+**
+** Takes the entry out of its registry, if it is in one.  The last entry
+** moves into its slot.
+*/
+void ConnectionRegistryRemove(ConnectionRegistryEntry* entry);
+
+
+/*
+** ConnectionRegistryGetCount
+**
+** Returns the number of entries in the registry.  Another thread may call
+** this for an estimate, since the count is a single word that only the
+** registry's own thread changes.  A shared registry counts under its lock.
+*/
+CFIndex ConnectionRegistryGetCount(ConnectionRegistryRef registry);
+
+
+/*
+** ConnectionRegistryIsShared
+**
+** Returns TRUE if the registry was created with
+** ConnectionRegistryCreateShared.
+*/
+Boolean ConnectionRegistryIsShared(ConnectionRegistryRef registry);
+
+
+/*
+** ConnectionRegistryApply
+**
+** Calls the applier once for every entry, with the entry's info and the
+** given context.  The applier may remove the entry it is given, closing
+** it for instance, but no other.  On a shared registry it is called with
+** the registry locked.
+*/
+void ConnectionRegistryApply(ConnectionRegistryRef registry, ConnectionRegistryApplier applier, void* context);
+
+
+/*
+** ConnectionRegistryCloseIdle
+**
+** Closes every entry whose isIdle callback says so.  Returns the number
+** closed, or asked to close in a shared registry.
+*/
+CFIndex ConnectionRegistryCloseIdle(ConnectionRegistryRef registry);
+
+
+/*
+** ConnectionRegistryCloseAll
+**
+** Closes every entry.  Returns the number closed, or asked to close in a
+** shared registry.
+*/
+CFIndex ConnectionRegistryCloseAll(ConnectionRegistryRef registry);
+
+
+/*
+** ConnectionRegistryDrain
+**
+** Closes the idle entries now and keeps sweeping, from a timer on the
+** current run loop, as more go idle.  Whatever is left at the deadline
+** is closed regardless.  The timer stops once the registry is empty.
+** Draining again moves the deadline.
+*/
+Boolean ConnectionRegistryDrain(ConnectionRegistryRef registry, CFAbsoluteTime deadline);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __CONNECTIONREGISTRY__ */
@@ -0,0 +1,693 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  EchoBench.c
+ *
+ *	Load generator for the echo server.  It opens a number of connections,
+ *	keeps a fixed number of lines in flight on each one, and times every line
+ *	from when it is queued to when its echo's linefeed comes back.  Everything
+ *	runs on one run loop, so the client is cheap next to the server it loads.
+ *	Totals and round trip times are kept with the server's own Statistics, and
+ *	the summary goes to stdout as "name value" lines for scripts to compare.
+ */
+
+#pragma mark Includes
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "Statistics.h"
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kServiceType		CFSTR("_echo._tcp.")
+#define kServiceDomain		CFSTR("local.")
+
+#define kConnections		64
+#define kLineSize			64			// Bytes per line, including the linefeed
+#define kDepth				16			// Lines in flight per connection
+#define kDuration			10			// Seconds of load
+#define kResolveTimeOut		5			// Seconds to find the server
+
+#define kReadSize			(64 * 1024)
+
+// A server that goes away must show up as EPIPE, not kill the client.
+#if defined(MSG_NOSIGNAL)
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+	const char*			host;			// Server to connect to, or NULL to browse
+	const char*			port;			// Its port
+	CFIndex				connections;	// Number of connections to open
+	CFIndex				lineSize;		// Bytes per line, including the linefeed
+	CFIndex				depth;			// Lines kept in flight per connection
+	CFTimeInterval		duration;		// How long to keep up the load
+} BenchOptions;
+
+typedef struct Bench Bench;
+
+typedef struct {
+	Bench*				_bench;			// Run the connection belongs to
+	CFSocketRef			_socket;		// Connection to the server
+	
+	CFAbsoluteTime*		_queued;		// When each line in flight was queued, a ring of depth entries
+	CFIndex				_oldest;		// Ring index of the oldest line in flight
+	CFIndex				_inFlight;		// Lines queued and not yet echoed
+	
+	UInt64				_written;		// Bytes written so far
+	UInt64				_unwritten;		// Bytes queued but not yet written
+} BenchConnection;
+
+struct Bench {
+	BenchOptions		_options;		// What to run
+	StatisticsShardRef	_shard;			// Where to count it
+	
+	UInt8*				_lines;			// depth lines back to back, for writing
+	CFIndex				_linesLength;	// Length of _lines
+	
+	BenchConnection*	_connections;	// Every connection
+	CFIndex				_alive;			// Connections still open
+	Boolean				_stopping;		// Time is up, so queue no more lines
+};
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static Boolean BenchParseOptions(int argc, char* const argv[], BenchOptions* options);
+static Boolean BenchCopyAddress(const BenchOptions* options, struct sockaddr_storage* address, socklen_t* length);
+static Boolean BenchBrowse(struct sockaddr_storage* address, socklen_t* length);
+static Boolean BenchOpenConnection(Bench* bench, BenchConnection* connection, const struct sockaddr* address, socklen_t length);
+static void BenchCloseConnection(BenchConnection* connection, Boolean failed);
+static void BenchQueueLines(BenchConnection* connection, CFAbsoluteTime now);
+static void BenchHandleRead(BenchConnection* connection);
+static void BenchHandleWrite(BenchConnection* connection);
+static void BenchReport(Bench* bench, StatisticsRef stats, CFTimeInterval elapsed);
+static SInt64 BenchGetNumber(CFDictionaryRef dict, CFStringRef key);
+
+static void SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, BenchConnection* connection);
+static void TimerCallBack(CFRunLoopTimerRef timer, Bench* bench);
+static void BrowserCallBack(CFNetServiceBrowserRef browser, CFOptionFlags flags, CFTypeRef domainOrService, CFStreamError* error, CFNetServiceRef* found);
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ Boolean
+BenchParseOptions(int argc, char* const argv[], BenchOptions* options) {
+
+	int ch;
+	
+	options->host = NULL;
+	options->port = NULL;
+	options->connections = kConnections;
+	options->lineSize = kLineSize;
+	options->depth = kDepth;
+	options->duration = kDuration;
+	
+	while ((ch = getopt(argc, argv, "h:p:c:s:d:t:")) != -1) {
+	
+		switch (ch) {
+			case 'h': options->host = optarg; break;
+			case 'p': options->port = optarg; break;
+			case 'c': options->connections = strtol(optarg, NULL, 10); break;
+			case 's': options->lineSize = strtol(optarg, NULL, 10); break;
+			case 'd': options->depth = strtol(optarg, NULL, 10); break;
+			case 't': options->duration = strtod(optarg, NULL); break;
+			default: return FALSE;
+		}
+	}
+	
+	// A host needs a port; without either, browse for the server.
+	if ((options->host != NULL) && (options->port == NULL))
+		return FALSE;
+	
+	if ((options->port != NULL) && (options->host == NULL))
+		options->host = "localhost";
+	
+	return (optind == argc) &&
+		   (options->connections > 0) &&
+		   (options->lineSize > 0) &&
+		   (options->depth > 0) &&
+		   (options->duration > 0);
+}
+
+
+/* static */ Boolean
+BenchCopyAddress(const BenchOptions* options, struct sockaddr_storage* address, socklen_t* length) {
+
+	struct addrinfo hints, *found = NULL;
+	
+	// Without a host, ask Bonjour for the server.
+	if (options->host == NULL)
+		return BenchBrowse(address, length);
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	
+	if ((getaddrinfo(options->host, options->port, &hints, &found) != 0) || (found == NULL))
+		return FALSE;
+	
+	// Take the first address; every connection goes to the same one.
+	memcpy(address, found->ai_addr, found->ai_addrlen);
+	*length = found->ai_addrlen;
+	
+	freeaddrinfo(found);
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+BenchBrowse(struct sockaddr_storage* address, socklen_t* length) {
+
+	Boolean result = FALSE;
+	CFNetServiceRef found = NULL;
+	CFNetServiceBrowserRef browser = NULL;
+	CFNetServiceClientContext browserCtxt = {0, &found, NULL, NULL, NULL};
+	
+	do {
+		CFIndex i;
+		CFArrayRef addresses;
+		CFStreamError error = {0, 0};
+		
+		browser = CFNetServiceBrowserCreate(kCFAllocatorDefault,
+											(CFNetServiceBrowserClientCallBack)&BrowserCallBack,
+											&browserCtxt);
+		if (browser == NULL)
+			break;
+		
+		CFNetServiceBrowserScheduleWithRunLoop(browser, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+		
+		if (!CFNetServiceBrowserSearchForServices(browser, kServiceDomain, kServiceType, &error))
+			break;
+		
+		// The callback stops the run loop at the first service that turns up.
+		CFRunLoopRunInMode(kCFRunLoopDefaultMode, kResolveTimeOut, FALSE);
+		
+		if (found == NULL)
+			break;
+		
+		// Resolve it in place; without a client this blocks until done.
+		if (!CFNetServiceResolveWithTimeout(found, kResolveTimeOut, &error))
+			break;
+		
+		addresses = CFNetServiceGetAddressing(found);
+		if (addresses == NULL)
+			break;
+		
+		// Prefer IPv4, which the server always listens on.
+		for (i = 0; i < CFArrayGetCount(addresses); i++) {
+		
+			CFDataRef data = (CFDataRef)CFArrayGetValueAtIndex(addresses, i);
+			const struct sockaddr* addr = (const struct sockaddr*)CFDataGetBytePtr(data);
+			
+			if ((CFDataGetLength(data) > (CFIndex)sizeof(address[0])) || (result && (addr->sa_family != AF_INET)))
+				continue;
+			
+			memcpy(address, addr, CFDataGetLength(data));
+			*length = (socklen_t)CFDataGetLength(data);
+			result = TRUE;
+			
+			if (addr->sa_family == AF_INET)
+				break;
+		}
+	
+	} while (0);
+	
+	if (browser != NULL) {
+		CFNetServiceBrowserStopSearch(browser, NULL);
+		CFNetServiceBrowserUnscheduleFromRunLoop(browser, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+		CFNetServiceBrowserInvalidate(browser);
+		CFRelease(browser);
+	}
+	
+	if (found != NULL)
+		CFRelease(found);
+	
+	return result;
+}
+
+
+/* static */ Boolean
+BenchOpenConnection(Bench* bench, BenchConnection* connection, const struct sockaddr* address, socklen_t length) {
+
+	CFSocketNativeHandle native = -1;
+	
+	do {
+		int yes = 1, flags;
+		CFRunLoopSourceRef src;
+		CFSocketContext socketCtxt = {0, connection, NULL, NULL, NULL};
+		
+		connection->_bench = bench;
+		
+		connection->_queued = malloc(bench->_options.depth * sizeof(connection->_queued[0]));
+		if (connection->_queued == NULL)
+			break;
+		
+		native = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+		if (native == -1)
+			break;
+		
+		// Connecting synchronously keeps setup simple; it's not what's measured.
+		if (connect(native, address, length) == -1)
+			break;
+		
+		// Small lines must go out as they are queued, not when Nagle allows.
+		setsockopt(native, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		
+#if defined(SO_NOSIGPIPE)
+		setsockopt(native, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+		
+		flags = fcntl(native, F_GETFL, 0);
+		if ((flags == -1) || (fcntl(native, F_SETFL, flags | O_NONBLOCK) == -1))
+			break;
+		
+		// Reads re-enable themselves; writes are asked for when a write falls short.
+		connection->_socket = CFSocketCreateWithNative(kCFAllocatorDefault,
+													   native,
+													   kCFSocketReadCallBack | kCFSocketWriteCallBack,
+													   (CFSocketCallBack)&SocketCallBack,
+													   &socketCtxt);
+		if (connection->_socket == NULL)
+			break;
+		
+		// The socket owns the descriptor now.
+		native = -1;
+		
+		src = CFSocketCreateRunLoopSource(kCFAllocatorDefault, connection->_socket, 0);
+		if (src == NULL)
+			break;
+		
+		CFRunLoopAddSource(CFRunLoopGetCurrent(), src, kCFRunLoopDefaultMode);
+		CFRelease(src);
+		
+		StatisticsAdd(bench->_shard, kStatisticsOpens, 1);
+		bench->_alive++;
+		
+		return TRUE;
+	
+	} while (0);
+	
+	if (native != -1)
+		close(native);
+	
+	if (connection->_socket != NULL) {
+		CFSocketInvalidate(connection->_socket);
+		CFRelease(connection->_socket);
+		connection->_socket = NULL;
+	}
+	
+	return FALSE;
+}
+
+
+/* static */ void
+BenchCloseConnection(BenchConnection* connection, Boolean failed) {
+
+	if (connection->_socket == NULL)
+		return;
+	
+	CFSocketInvalidate(connection->_socket);
+	CFRelease(connection->_socket);
+	connection->_socket = NULL;
+	
+	StatisticsAdd(connection->_bench->_shard, kStatisticsCloses, 1);
+	if (failed)
+		StatisticsAdd(connection->_bench->_shard, kStatisticsErrors, 1);
+	
+	// Nothing left to measure once every connection is gone.
+	if ((--connection->_bench->_alive == 0) && !connection->_bench->_stopping)
+		CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+
+/* static */ void
+BenchQueueLines(BenchConnection* connection, CFAbsoluteTime now) {
+
+	Bench* bench = connection->_bench;
+	
+	if (bench->_stopping)
+		return;
+	
+	// Top the pipeline back up to its depth.
+	while (connection->_inFlight < bench->_options.depth) {
+	
+		CFIndex slot = (connection->_oldest + connection->_inFlight) % bench->_options.depth;
+		
+		connection->_queued[slot] = now;
+		connection->_inFlight++;
+		connection->_unwritten += bench->_options.lineSize;
+	}
+}
+
+
+/* static */ void
+BenchHandleRead(BenchConnection* connection) {
+
+	Bench* bench = connection->_bench;
+	CFIndex lines = 0;
+	CFAbsoluteTime now;
+	UInt8 buffer[kReadSize];
+	
+	ssize_t bytesRead = read(CFSocketGetNative(connection->_socket), buffer, sizeof(buffer));
+	
+	if (bytesRead <= 0) {
+		if ((bytesRead == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+			BenchCloseConnection(connection, TRUE);
+		return;
+	}
+	
+	now = CFAbsoluteTimeGetCurrent();
+	StatisticsAdd(bench->_shard, kStatisticsBytesIn, bytesRead);
+	
+	// Every linefeed completes the oldest line in flight.
+	{
+		const UInt8* at = buffer;
+		const UInt8* end = buffer + bytesRead;
+		
+		while ((at < end) && ((at = memchr(at, '\n', end - at)) != NULL)) {
+		
+			// The server echoed more than was sent.
+			if (connection->_inFlight == 0) {
+				BenchCloseConnection(connection, TRUE);
+				return;
+			}
+			
+			StatisticsRecordLatency(bench->_shard, now - connection->_queued[connection->_oldest], 1);
+			connection->_oldest = (connection->_oldest + 1) % bench->_options.depth;
+			connection->_inFlight--;
+			lines++;
+			at++;
+		}
+	}
+	
+	StatisticsAdd(bench->_shard, kStatisticsLines, lines);
+	
+	// Replace what came back and send it right away.
+	if (lines > 0) {
+		BenchQueueLines(connection, now);
+		BenchHandleWrite(connection);
+	}
+}
+
+
+/* static */ void
+BenchHandleWrite(BenchConnection* connection) {
+
+	Bench* bench = connection->_bench;
+	
+	while (connection->_unwritten > 0) {
+	
+		// _lines holds whole lines back to back, so after starting mid-line
+		// at the right offset it runs on into as many more as are queued.
+		CFIndex offset = (CFIndex)(connection->_written % bench->_options.lineSize);
+		CFIndex length = bench->_linesLength - offset;
+		ssize_t bytesWritten;
+		
+		if ((UInt64)length > connection->_unwritten)
+			length = (CFIndex)connection->_unwritten;
+		
+		bytesWritten = send(CFSocketGetNative(connection->_socket), bench->_lines + offset, length, kSendFlags);
+		
+		if (bytesWritten > 0) {
+			connection->_written += bytesWritten;
+			connection->_unwritten -= bytesWritten;
+			StatisticsAdd(bench->_shard, kStatisticsBytesOut, bytesWritten);
+		}
+		
+		// Full, so wait to hear that there's room.
+		else if ((bytesWritten == -1) && (errno == EAGAIN)) {
+			CFSocketEnableCallBacks(connection->_socket, kCFSocketWriteCallBack);
+			break;
+		}
+		
+		else if ((bytesWritten == -1) && (errno == EINTR))
+			continue;
+		
+		else {
+			BenchCloseConnection(connection, TRUE);
+			break;
+		}
+	}
+}
+
+
+/* static */ void
+BenchReport(Bench* bench, StatisticsRef stats, CFTimeInterval elapsed) {
+
+	CFDictionaryRef totals = StatisticsCopyDictionary(stats);
+	CFDictionaryRef latency;
+	SInt64 lines, bytes;
+	
+	if (totals == NULL)
+		return;
+	
+	latency = (CFDictionaryRef)CFDictionaryGetValue(totals, CFSTR("LineLatency"));
+	lines = BenchGetNumber(totals, CFSTR("Lines"));
+	bytes = BenchGetNumber(totals, CFSTR("BytesIn"));
+	
+	printf("connections %ld\n", (long)BenchGetNumber(totals, CFSTR("Opens")));
+	printf("errors %ld\n", (long)BenchGetNumber(totals, CFSTR("Errors")));
+	printf("line_size %ld\n", (long)bench->_options.lineSize);
+	printf("depth %ld\n", (long)bench->_options.depth);
+	printf("seconds %.3f\n", elapsed);
+	printf("msgs %lld\n", (long long)lines);
+	printf("msgs_per_sec %.0f\n", lines / elapsed);
+	printf("mb_per_sec %.2f\n", bytes / elapsed / (1024.0 * 1024.0));
+	
+	if (latency != NULL) {
+		printf("rtt_p50_us %lld\n", (long long)BenchGetNumber(latency, CFSTR("P50")));
+		printf("rtt_p90_us %lld\n", (long long)BenchGetNumber(latency, CFSTR("P90")));
+		printf("rtt_p99_us %lld\n", (long long)BenchGetNumber(latency, CFSTR("P99")));
+		printf("rtt_p999_us %lld\n", (long long)BenchGetNumber(latency, CFSTR("P999")));
+		printf("rtt_max_us %lld\n", (long long)BenchGetNumber(latency, CFSTR("Max")));
+	}
+	
+	CFRelease(totals);
+}
+
+
+/* static */ SInt64
+BenchGetNumber(CFDictionaryRef dict, CFStringRef key) {
+
+	SInt64 value = 0;
+	CFNumberRef number = (CFNumberRef)CFDictionaryGetValue(dict, key);
+	
+	if (number != NULL)
+		CFNumberGetValue(number, kCFNumberSInt64Type, &value);
+	
+	return value;
+}
+
+
+#pragma mark -
+#pragma mark Static Callback Functions
+
+/* static */ void
+SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, BenchConnection* connection) {
+
+	if (type == kCFSocketReadCallBack)
+		BenchHandleRead(connection);
+	
+	// Reading may have closed it.
+	else if ((type == kCFSocketWriteCallBack) && (connection->_socket != NULL))
+		BenchHandleWrite(connection);
+}
+
+
+/* static */ void
+TimerCallBack(CFRunLoopTimerRef timer, Bench* bench) {
+
+	// Time's up.  Lines still in flight are not counted.
+	bench->_stopping = TRUE;
+	CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+
+/* static */ void
+BrowserCallBack(CFNetServiceBrowserRef browser, CFOptionFlags flags, CFTypeRef domainOrService, CFStreamError* error, CFNetServiceRef* found) {
+
+	// Take the first service that appears.
+	if ((*found == NULL) && (error->error == 0) && ((flags & (kCFNetServiceFlagIsDomain | kCFNetServiceFlagRemove)) == 0)) {
+		*found = (CFNetServiceRef)CFRetain(domainOrService);
+		CFRunLoopStop(CFRunLoopGetCurrent());
+	}
+}
+
+
+#pragma mark -
+
+int main (int argc, char * const argv[]) {
+
+	Bench bench;
+	StatisticsRef stats = NULL;
+	CFRunLoopTimerRef timer = NULL;
+	int result = 1;
+	
+	memset(&bench, 0, sizeof(bench));
+	
+	if (!BenchParseOptions(argc, argv, &(bench._options))) {
+		fprintf(stderr, "usage: EchoBench [-h host -p port] [-c connections] [-s line size] [-d depth] [-t seconds]\n"
+						"       Without a host, the first _echo._tcp. service found is used.\n");
+		return 2;
+	}
+	
+	do {
+		CFIndex i;
+		CFAbsoluteTime start;
+		struct sockaddr_storage address;
+		socklen_t length = 0;
+		CFRunLoopTimerContext timerCtxt = {0, &bench, NULL, NULL, NULL};
+		
+		if (!BenchCopyAddress(&(bench._options), &address, &length)) {
+			fprintf(stderr, "EchoBench - Couldn't find the server\n");
+			break;
+		}
+		
+		stats = StatisticsCreate(kCFAllocatorDefault);
+		if ((stats == NULL) || ((bench._shard = StatisticsGetShard(stats)) == NULL))
+			break;
+		
+		// Lay out depth lines of lowercase letters, each ending in a linefeed.
+		bench._linesLength = bench._options.depth * bench._options.lineSize;
+		bench._lines = malloc(bench._linesLength);
+		if (bench._lines == NULL)
+			break;
+		
+		for (i = 0; i < bench._linesLength; i++)
+			bench._lines[i] = ((i % bench._options.lineSize) == (bench._options.lineSize - 1)) ? '\n' : ('a' + (i % 26));
+		
+		bench._connections = calloc(bench._options.connections, sizeof(bench._connections[0]));
+		if (bench._connections == NULL)
+			break;
+		
+		for (i = 0; i < bench._options.connections; i++) {
+			if (!BenchOpenConnection(&bench, &(bench._connections[i]), (const struct sockaddr*)&address, length)) {
+				fprintf(stderr, "EchoBench - Couldn't open connection %ld (%d)\n", (long)i, errno);
+				break;
+			}
+		}
+		
+		if (i < bench._options.connections)
+			break;
+		
+		start = CFAbsoluteTimeGetCurrent();
+		
+		// Fill every pipeline at once; the first write callbacks send them.
+		for (i = 0; i < bench._options.connections; i++)
+			BenchQueueLines(&(bench._connections[i]), start);
+		
+		timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+									 start + bench._options.duration,
+									 0,
+									 0,
+									 0,
+									 (CFRunLoopTimerCallBack)&TimerCallBack,
+									 &timerCtxt);
+		if (timer == NULL)
+			break;
+		
+		CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
+		
+		CFRunLoopRun();
+		
+		BenchReport(&bench, stats, CFAbsoluteTimeGetCurrent() - start);
+		
+		// Gate on a clean run that got something echoed.
+		if (bench._alive == bench._options.connections) {
+			CFDictionaryRef totals = StatisticsCopyDictionary(stats);
+			if (totals != NULL) {
+				if (BenchGetNumber(totals, CFSTR("Lines")) > 0)
+					result = 0;
+				CFRelease(totals);
+			}
+		}
+	
+	} while (0);
+	
+	if (timer != NULL) {
+		CFRunLoopTimerInvalidate(timer);
+		CFRelease(timer);
+	}
+	
+	if (bench._connections != NULL) {
+	
+		CFIndex i;
+		
+		bench._stopping = TRUE;
+		
+		for (i = 0; i < bench._options.connections; i++) {
+			BenchCloseConnection(&(bench._connections[i]), FALSE);
+			free(bench._connections[i]._queued);
+		}
+		
+		free(bench._connections);
+	}
+	
+	free(bench._lines);
+	
+	if (stats != NULL)
+		StatisticsRelease(stats);
+	
+	return result;
+}
@@ -0,0 +1,463 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma mark Includes
+#include "EchoBuffer.h"
+
+#include <assert.h>
+#include <string.h>
+
+/*
+** The backwards search has no libc equivalent on every platform, so it is
+** vectorized by hand where SSE2 or NEON is available.  Define
+** ECHOBUFFER_NO_SIMD to force the plain byte loop.
+*/
+#if !defined(ECHOBUFFER_NO_SIMD)
+#if defined(__SSE2__)
+#define ECHOBUFFER_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ECHOBUFFER_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+static const CFIndex kMinimumCapacity = 4096;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static CFIndex _EchoBufferSearchBackward(const UInt8* bytes, CFIndex length, UInt8 value);
+static void _EchoBufferCopyIn(UInt8* bytes, CFIndex capacity, UInt64 offset, const UInt8* src, CFIndex length);
+static Boolean _EchoBufferGrow(EchoBuffer* buffer, CFIndex needed);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ void
+EchoBufferInit(EchoBuffer* buffer, CFAllocatorRef alloc) {
+
+	memset(buffer, 0, sizeof(buffer[0]));
+	
+	// Save the allocator for the storage.
+	if (alloc)
+		buffer->_alloc = CFRetain(alloc);
+}
+
+
+/* extern */ void
+EchoBufferDestroy(EchoBuffer* buffer) {
+
+	// Free the storage if any was ever allocated.
+	if (buffer->_bytes != NULL)
+		CFAllocatorDeallocate(buffer->_alloc, buffer->_bytes);
+	
+	// Release the allocator.
+	if (buffer->_alloc)
+		CFRelease(buffer->_alloc);
+	
+	memset(buffer, 0, sizeof(buffer[0]));
+}
+
+
+/* extern */ CFIndex
+EchoBufferGetLength(const EchoBuffer* buffer) {
+
+	return (CFIndex)(buffer->_tail - buffer->_head);
+}
+
+
+/* extern */ CFIndex
+EchoBufferGetCapacity(const EchoBuffer* buffer) {
+
+	return buffer->_capacity;
+}
+
+
+/* extern */ Boolean
+EchoBufferReserve(EchoBuffer* buffer, CFIndex length) {
+
+	// Make room if the bytes don't fit in the free space.
+	if ((buffer->_capacity - EchoBufferGetLength(buffer)) < length)
+		return _EchoBufferGrow(buffer, EchoBufferGetLength(buffer) + length);
+	
+	return TRUE;
+}
+
+
+/* extern */ UInt8*
+EchoBufferGetFreePtr(EchoBuffer* buffer, CFIndex* length) {
+
+	CFIndex space = buffer->_capacity - EchoBufferGetLength(buffer);
+	CFIndex index, contiguous;
+	
+	// No storage or no room means nothing to point at.
+	if (space == 0) {
+		*length = 0;
+		return NULL;
+	}
+	
+	// Free space runs from the tail to either the head or the end of storage.
+	index = (CFIndex)(buffer->_tail & (buffer->_capacity - 1));
+	contiguous = buffer->_capacity - index;
+	
+	*length = (space < contiguous) ? space : contiguous;
+	
+	return buffer->_bytes + index;
+}
+
+
+/* extern */ CFIndex
+EchoBufferGetFreeVectors(EchoBuffer* buffer, CFIndex length, struct iovec vectors[2]) {
+
+	CFIndex space = buffer->_capacity - EchoBufferGetLength(buffer);
+	CFIndex first;
+	UInt8* start = EchoBufferGetFreePtr(buffer, &first);
+	
+	if (length > space)
+		length = space;
+	
+	// The contiguous run past the tail may already cover it.
+	if (first >= length) {
+		vectors[0].iov_base = start;
+		vectors[0].iov_len = length;
+		return 1;
+	}
+	
+	// Otherwise the rest is free space at the front of the storage.
+	vectors[0].iov_base = start;
+	vectors[0].iov_len = first;
+	vectors[1].iov_base = buffer->_bytes;
+	vectors[1].iov_len = length - first;
+	
+	return 2;
+}
+
+
+/* extern */ void
+EchoBufferCommit(EchoBuffer* buffer, CFIndex length) {
+
+	assert(length <= (buffer->_capacity - EchoBufferGetLength(buffer)));
+	
+	// The bytes are already in place, so just move the tail.
+	buffer->_tail += length;
+}
+
+
+/* extern */ Boolean
+EchoBufferAppendBytes(EchoBuffer* buffer, const UInt8* bytes, CFIndex length) {
+
+	// Make room if the bytes don't fit in the free space.
+	if (!EchoBufferReserve(buffer, length))
+		return FALSE;
+	
+	// Copy the bytes in at the tail, wrapping if needed.
+	_EchoBufferCopyIn(buffer->_bytes, buffer->_capacity, buffer->_tail, bytes, length);
+	buffer->_tail += length;
+	
+	return TRUE;
+}
+
+
+/* extern */ const UInt8*
+EchoBufferGetBytePtr(const EchoBuffer* buffer, CFIndex* length) {
+
+	CFIndex total = EchoBufferGetLength(buffer);
+	CFIndex index, contiguous;
+	
+	// Nothing buffered means nothing to point at.
+	if (total == 0) {
+		*length = 0;
+		return NULL;
+	}
+	
+	// Bytes run from the head to either the tail or the end of storage.
+	index = (CFIndex)(buffer->_head & (buffer->_capacity - 1));
+	contiguous = buffer->_capacity - index;
+	
+	*length = (total < contiguous) ? total : contiguous;
+	
+	return buffer->_bytes + index;
+}
+
+
+/* extern */ CFIndex
+EchoBufferGetVectors(const EchoBuffer* buffer, CFIndex length, struct iovec vectors[2]) {
+
+	CFIndex first;
+	const UInt8* start = EchoBufferGetBytePtr(buffer, &first);
+	
+	assert(length <= EchoBufferGetLength(buffer));
+	
+	// The contiguous run from the head may already cover it.
+	if (first >= length) {
+		vectors[0].iov_base = (void*)start;
+		vectors[0].iov_len = length;
+		return 1;
+	}
+	
+	// Otherwise the rest picks up at the front of the storage.
+	vectors[0].iov_base = (void*)start;
+	vectors[0].iov_len = first;
+	vectors[1].iov_base = buffer->_bytes;
+	vectors[1].iov_len = length - first;
+	
+	return 2;
+}
+
+
+/* extern */ void
+EchoBufferCopyBytes(const EchoBuffer* buffer, CFIndex start, CFIndex length, UInt8* bytes) {
+
+	assert((start >= 0) && (length >= 0) && ((start + length) <= EchoBufferGetLength(buffer)));
+	
+	while (length > 0) {
+	
+		// Copy the contiguous run beginning at start.
+		CFIndex index = (CFIndex)((buffer->_head + start) & (buffer->_capacity - 1));
+		CFIndex count = buffer->_capacity - index;
+		
+		if (count > length)
+			count = length;
+		
+		memcpy(bytes, buffer->_bytes + index, count);
+		
+		// Continue with the wrapped portion.
+		bytes += count;
+		start += count;
+		length -= count;
+	}
+}
+
+
+/* extern */ CFIndex
+EchoBufferFindByte(const EchoBuffer* buffer, CFIndex start, UInt8 value) {
+
+	CFIndex total = EchoBufferGetLength(buffer);
+	
+	while (start < total) {
+	
+		// Search the contiguous run beginning at start.
+		CFIndex index = (CFIndex)((buffer->_head + start) & (buffer->_capacity - 1));
+		CFIndex length = buffer->_capacity - index;
+		const UInt8* found;
+		
+		if (length > (total - start))
+			length = total - start;
+		
+		found = (const UInt8*)memchr(buffer->_bytes + index, value, length);
+		if (found != NULL)
+			return start + (found - (buffer->_bytes + index));
+		
+		// Continue with the wrapped portion.
+		start += length;
+	}
+	
+	return kCFNotFound;
+}
+
+
+/* extern */ CFIndex
+EchoBufferFindLastByte(const EchoBuffer* buffer, CFIndex start, UInt8 value) {
+
+	CFIndex end = EchoBufferGetLength(buffer);
+	
+	while (end > start) {
+	
+		// Search the contiguous run that ends at end, newest bytes first.
+		CFIndex index = (CFIndex)((buffer->_head + end - 1) & (buffer->_capacity - 1));
+		CFIndex length = index + 1;
+		CFIndex found;
+		
+		if (length > (end - start))
+			length = end - start;
+		
+		found = _EchoBufferSearchBackward(buffer->_bytes + index + 1 - length, length, value);
+		if (found != kCFNotFound)
+			return end - length + found;
+		
+		// Continue with the portion before the wrap.
+		end -= length;
+	}
+	
+	return kCFNotFound;
+}
+
+
+/* extern */ void
+EchoBufferConsume(EchoBuffer* buffer, CFIndex length) {
+
+	assert(length <= EchoBufferGetLength(buffer));
+	
+	// Moving the head is all that's required.
+	buffer->_head += length;
+	
+	// Once empty, start over at the front so free space is contiguous.
+	if (buffer->_head == buffer->_tail)
+		buffer->_head = buffer->_tail = 0;
+}
+
+
+/* extern */ CFIndex
+EchoBufferTrim(EchoBuffer* buffer) {
+
+	CFIndex freed = buffer->_capacity;
+	
+	// Nothing to free, or still in use.
+	if ((buffer->_bytes == NULL) || (buffer->_head != buffer->_tail))
+		return 0;
+	
+	// The offsets carry on as they are; only the storage goes.
+	CFAllocatorDeallocate(buffer->_alloc, buffer->_bytes);
+	buffer->_bytes = NULL;
+	buffer->_capacity = 0;
+	
+	return freed;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ CFIndex
+_EchoBufferSearchBackward(const UInt8* bytes, CFIndex length, UInt8 value) {
+
+#if defined(ECHOBUFFER_SSE2)
+	__m128i needle = _mm_set1_epi8((char)value);
+	
+	// Compare sixteen bytes at a time from the end.
+	while (length >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + length - 16));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+		
+		// The highest set bit is the last match in the chunk.
+		if (mask != 0)
+			return length - 16 + (31 - __builtin_clz(mask));
+		
+		length -= 16;
+	}
+#elif defined(ECHOBUFFER_NEON)
+	uint8x16_t needle = vdupq_n_u8(value);
+	
+	// Compare sixteen bytes at a time from the end.
+	while (length >= 16) {
+		uint8x16_t matches = vceqq_u8(vld1q_u8(bytes + length - 16), needle);
+		
+		// Narrow the comparison to a nibble per byte.
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+		
+		// The highest set nibble is the last match in the chunk.
+		if (mask != 0)
+			return length - 16 + ((63 - __builtin_clzll(mask)) >> 2);
+		
+		length -= 16;
+	}
+#endif
+
+	// Finish whatever is left a byte at a time.
+	while (length > 0) {
+		if (bytes[--length] == value)
+			return length;
+	}
+	
+	return kCFNotFound;
+}
+
+
+/* static */ void
+_EchoBufferCopyIn(UInt8* bytes, CFIndex capacity, UInt64 offset, const UInt8* src, CFIndex length) {
+
+	CFIndex index = (CFIndex)(offset & (capacity - 1));
+	CFIndex first = capacity - index;
+	
+	if (first > length)
+		first = length;
+	
+	// Copy up to the end of the storage and wrap the remainder to the front.
+	memcpy(bytes + index, src, first);
+	memcpy(bytes, src + first, length - first);
+}
+
+
+/* static */ Boolean
+_EchoBufferGrow(EchoBuffer* buffer, CFIndex needed) {
+
+	CFIndex capacity = buffer->_capacity ? buffer->_capacity : kMinimumCapacity;
+	UInt8* bytes;
+	UInt64 offset = buffer->_head;
+	
+	// Keep the capacity a power of two so offsets can be masked.
+	while (capacity < needed)
+		capacity <<= 1;
+	
+	bytes = CFAllocatorAllocate(buffer->_alloc, capacity, 0);
+	
+	// Fail if unable to allocate the new storage.
+	if (bytes == NULL)
+		return FALSE;
+	
+	// Move the unconsumed bytes over.  They keep their stream offsets, so
+	// they land wherever those offsets map in the larger storage.
+	while (offset < buffer->_tail) {
+	
+		CFIndex index = (CFIndex)(offset & (buffer->_capacity - 1));
+		CFIndex length = buffer->_capacity - index;
+		
+		if (length > (CFIndex)(buffer->_tail - offset))
+			length = (CFIndex)(buffer->_tail - offset);
+		
+		_EchoBufferCopyIn(bytes, capacity, offset, buffer->_bytes + index, length);
+		offset += length;
+	}
+	
+	// Toss the old storage.
+	if (buffer->_bytes != NULL)
+		CFAllocatorDeallocate(buffer->_alloc, buffer->_bytes);
+	
+	buffer->_bytes = bytes;
+	buffer->_capacity = capacity;
+	
+	return TRUE;
+}
@@ -0,0 +1,203 @@
+
+#ifndef __ECHOBUFFER__
+#define __ECHOBUFFER__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <sys/uio.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+** EchoBuffer
+**
+** Growable ring buffer of bytes.  Bytes are appended at the tail and
+** consumed from the head without moving whatever remains, so consuming
+** is constant time regardless of how much is buffered.  The storage is
+** always a power of two in size and only grows when an append does not
+** fit in the free space.
+**
+** The structure is meant to be embedded in its owner; treat the fields
+** as private.
+*/
+typedef struct {
+	CFAllocatorRef		_alloc;			// Allocator used for the storage
+	UInt8*				_bytes;			// Storage, _capacity bytes long
+	CFIndex				_capacity;		// Size of the storage (power of two)
+	UInt64				_head;			// Stream offset of the first unconsumed byte
+	UInt64				_tail;			// Stream offset just past the last byte
+} EchoBuffer;
+
+
+/*
+** EchoBufferInit
+**
+** Prepares an embedded buffer for use.  No storage is allocated until
+** the first append.
+**
+** buffer	Buffer to initialize.  Must be non-NULL.
+**
+** alloc	Allocator to use for the storage.  NULL indicates the
+**			default allocator.
+*/
+void EchoBufferInit(EchoBuffer* buffer, CFAllocatorRef alloc);
+
+
+/*
+** EchoBufferDestroy
+**
+** Releases the storage held by the buffer.  The buffer must be
+** initialized again before it is reused.
+*/
+void EchoBufferDestroy(EchoBuffer* buffer);
+
+
+/*
+** EchoBufferGetLength
+**
+** Returns the number of bytes appended but not yet consumed.
+*/
+CFIndex EchoBufferGetLength(const EchoBuffer* buffer);
+
+
+/*
+** EchoBufferGetCapacity
+**
+** Returns the size of the storage, zero while none is allocated.
+*/
+CFIndex EchoBufferGetCapacity(const EchoBuffer* buffer);
+
+
+/*
+** EchoBufferAppendBytes
+**
+** Copies the bytes onto the tail of the buffer, growing the storage if
+** necessary.  Returns FALSE if the storage could not be grown, in which
+** case the buffer is left untouched.
+*/
+Boolean EchoBufferAppendBytes(EchoBuffer* buffer, const UInt8* bytes, CFIndex length);
+
+
+/*
+** EchoBufferReserve
+**
+** Grows the storage if needed so that at least length bytes are free.
+** Returns FALSE if the storage could not be grown.
+*/
+Boolean EchoBufferReserve(EchoBuffer* buffer, CFIndex length);
+
+
+/*
+** EchoBufferGetFreePtr
+**
+** Returns a pointer to the free space just past the tail and sets length
+** to the number of free bytes that are contiguous from there.  Data can
+** be placed there directly, for instance by a read, and then added to
+** the buffer with EchoBufferCommit.
+*/
+UInt8* EchoBufferGetFreePtr(EchoBuffer* buffer, CFIndex* length);
+
+
+/*
+** EchoBufferCommit
+**
+** Adds length bytes, already written at EchoBufferGetFreePtr, to the
+** tail of the buffer.
+*/
+void EchoBufferCommit(EchoBuffer* buffer, CFIndex length);
+
+
+/*
+** EchoBufferGetFreeVectors
+**
+** Describes up to length bytes of free space past the tail, in as many
+** as two pieces when it wraps, for a scatter read.  Returns the number
+** of vectors filled in.  Add what was read with EchoBufferCommit.
+*/
+CFIndex EchoBufferGetFreeVectors(EchoBuffer* buffer, CFIndex length, struct iovec vectors[2]);
+
+
+/*
+** EchoBufferGetBytePtr
+**
+** Returns a pointer to the first unconsumed byte and sets length to the
+** number of bytes that are contiguous from there.  Once the data wraps
+** this is less than EchoBufferGetLength; consume these bytes to reach
+** the rest.
+*/
+const UInt8* EchoBufferGetBytePtr(const EchoBuffer* buffer, CFIndex* length);
+
+
+/*
+** EchoBufferGetVectors
+**
+** Describes the first length unconsumed bytes, in as many as two pieces
+** when they wrap, for a gather write.  Returns the number of vectors
+** filled in.
+*/
+CFIndex EchoBufferGetVectors(const EchoBuffer* buffer, CFIndex length, struct iovec vectors[2]);
+
+
+/*
+** EchoBufferCopyBytes
+**
+** Copies length unconsumed bytes, starting at index start relative to the
+** head, out to bytes, following them across the wrap.  The range must be
+** within the buffer.
+*/
+void EchoBufferCopyBytes(const EchoBuffer* buffer, CFIndex start, CFIndex length, UInt8* bytes);
+
+
+/*
+** EchoBufferFindByte
+**
+** Searches the unconsumed bytes, starting at index start relative to the
+** head, for the given value.  Returns its index relative to the head or
+** kCFNotFound.
+*/
+CFIndex EchoBufferFindByte(const EchoBuffer* buffer, CFIndex start, UInt8 value);
+
+
+/*
+** EchoBufferFindLastByte
+**
+** Searches the unconsumed bytes backwards from the tail for the given
+** value, stopping at index start relative to the head.  Passing the
+** length seen on a previous search limits the work to newly appended
+** bytes.  Returns its index relative to the head or kCFNotFound.
+**
+** Where SSE2 or NEON is available the search runs sixteen bytes at a
+** time; define ECHOBUFFER_NO_SIMD to disable it.
+*/
+CFIndex EchoBufferFindLastByte(const EchoBuffer* buffer, CFIndex start, UInt8 value);
+
+
+/*
+** EchoBufferConsume
+**
+** Removes length bytes from the head of the buffer.  This does not move
+** or free any storage.  Indexes returned earlier become relative to the
+** new head.
+*/
+void EchoBufferConsume(EchoBuffer* buffer, CFIndex length);
+
+
+/*
+** EchoBufferTrim
+**
+** Frees the storage if every byte has been consumed, so an idle buffer
+** costs nothing beyond the structure.  The next reserve or append takes
+** fresh storage from the allocator.  Returns the number of bytes freed.
+*/
+CFIndex EchoBufferTrim(EchoBuffer* buffer);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __ECHOBUFFER__ */
@@ -39,30 +39,119 @@
 
 #pragma mark Includes
 #include "EchoContext.h"
+#include "EchoBuffer.h"
+#include "EchoFraming.h"
+#include "EchoTrace.h"
 
 #include <CoreServices/CoreServices.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(__APPLE__)
+#define ECHOCONTEXT_DISPATCH 1
+#include <dispatch/dispatch.h>
+#endif
+
 
 #pragma mark -
 #pragma mark Type Declarations
 
+// Line batches tracked for latency; beyond this they are merged.
+#define kMaxLineBatches		8
+
+typedef struct {
+	UInt64				_end;			// Stream offset just past the batch's last line
+	CFAbsoluteTime		_received;		// When its last byte was read
+	CFIndex				_lines;			// Lines in the batch
+} EchoContextLineBatch;
+
+// Shared by a connection's two dispatch sources once it closes; whichever
+// finishes cancelling last closes the descriptor.
+typedef struct {
+	CFSocketNativeHandle _nativeSocket;	// Descriptor the sources were watching
+	CFIndex				_sources;		// Sources still to finish cancelling
+	void*				_context;		// Connection each of them holds a retain on
+} EchoContextDispatchClose;
+
 typedef struct {
 	CFAllocatorRef		_alloc;			// Allocator used to allocate this
-	UInt32				_retainCount;	// Number of times retained.
+	volatile UInt32		_retainCount;	// Number of times retained, changed atomically
+	
+	EchoContextOptions	_options;		// Tuning, with defaults filled in
+	EchoContextProtocol	_protocol;		// Framing, copied from the options
 	
 	CFRunLoopTimerRef	_timer;			// Timer for controlling timeouts
+	TimerWheelEntry		_timeout;		// Or the timeout on a shared wheel
+	ConnectionRegistryEntry _entry;		// Place in the registry, while open
+	CFRunLoopTimerRef	_flushTimer;	// Ends a hold on output, when coalescing
+	CFRunLoopTimerRef	_throttleTimer;	// Lifts a throttle, when rate limited
+	
+	CFAbsoluteTime		_opened;		// When the connection was opened
+	CFAbsoluteTime		_lastRead;		// When bytes last arrived, or zero
+	CFAbsoluteTime		_lastWrite;		// When output last moved or started waiting
 	
 	CFReadStreamRef		_inStream;		// Incoming data stream
 	CFWriteStreamRef	_outStream;		// Outgoing data stream
 	
-	CFMutableDataRef	_rcvdBytes;		// Buffer of received bytes
+	CFSocketNativeHandle _nativeSocket;	// Connection for native i/o, until a _socket owns it
+	CFSocketRef			_socket;		// Socket i/o notifications
+	EventEngineWatch	_watch;			// Or the connection's place on the event engine
+	
+#if defined(ECHOCONTEXT_DISPATCH)
+	dispatch_queue_t	_queue;			// Or the serial queue its dispatch sources run on
+	dispatch_source_t	_readSource;	// Readable notifications
+	dispatch_source_t	_writeSource;	// Writable notifications, resumed while output backs up
+	dispatch_source_t	_timeOutSource;	// Timeout, instead of _timer
+	dispatch_source_t	_flushSource;	// Ends a hold on output, instead of _flushTimer
+	dispatch_source_t	_throttleSource; // Lifts a throttle, instead of _throttleTimer
+	CFAbsoluteTime		_armed;			// Time the timeout source is set for
+	Boolean				_readSuspended;	// Read source is suspended
+	Boolean				_writeSuspended; // Write source is suspended
+	Boolean				_started;		// Timer sources were resumed, on the queue
+	EchoContextDispatchClose* _closer;	// Handed to the sources when closing
+#endif
+	
+	EchoBuffer			_rcvdBytes;		// Ring buffer of received bytes
+	CFIndex				_scanned;		// Leading bytes already searched for a linefeed
+	CFIndex				_ready;			// Leading bytes ending in a linefeed, ready to echo
+	Boolean				_paused;		// Reading is held off until the buffer drains
+	Boolean				_holding;		// Output is held off so more can gather
+	
+	Boolean				_limited;		// Some rate limit applies
+	Boolean				_throttled;		// Reading is held off until a limit allows more
+	CFAbsoluteTime		_throttledUntil;	// When the throttle lifts
+	RateLimiterBucket	_byteBucket;	// The connection's own byte limit
+	RateLimiterBucket	_lineBucket;	// And line limit
+	RateLimiterClientRef _client;		// Buckets shared with its address, if any
+	TrafficRecorderShardRef _recorderShard;	// Where its records gather, while open
+	UInt64				_recorded;		// Number in the capture, while open
+	
+	StatisticsShardRef	_shard;			// This thread's counters, if counting
+	Boolean				_isOpen;		// Counted as open and not yet as closed
+	UInt64				_written;		// Bytes echoed so far
+	EchoContextLineBatch _batches[kMaxLineBatches];	// Lines ready but not yet echoed, oldest first
+	CFIndex				_batchCount;	// Number of batches in use
 } EchoContext;
 
 
 #pragma mark -
 #pragma mark Constant Definitions
 
-static const CFTimeInterval kTimeOutInSeconds = 60;
+static const CFTimeInterval kDefaultIdleTimeOut = 60;
+
+static const CFIndex kDefaultReadSize = 64 * 1024;
+static const CFIndex kDefaultReadBudget = 256 * 1024;
+static const CFIndex kDefaultHighWaterMark = 1024 * 1024;
+
+// Far enough off that an idle flush timer never fires.
+static const CFAbsoluteTime kFlushTimerIdle = 1.0e12;
 
 static const CFOptionFlags kReadEvents = kCFStreamEventHasBytesAvailable |
                                          kCFStreamEventErrorOccurred |
@@ -71,26 +160,128 @@ static const CFOptionFlags kReadEvents = kCFStreamEventHasBytesAvailable |
 static const CFOptionFlags kWriteEvents = kCFStreamEventCanAcceptBytes |
 										  kCFStreamEventErrorOccurred;
 
+static const CFOptionFlags kSocketEvents = kCFSocketReadCallBack |
+										   kCFSocketWriteCallBack;
+
+// A peer that goes away must show up as EPIPE, not kill the process.
+#if defined(MSG_NOSIGNAL)
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+#if defined(ECHOCONTEXT_DISPATCH)
+// Its address marks a connection's queue, so Close can tell it's on it.
+static char kQueueKey;
+
+// Slack allowed on timeouts, so dispatch can coalesce their wakeups.
+static const CFTimeInterval kTimeOutLeeway = 0.25;
+#endif
+
 
 #pragma mark -
 #pragma mark Static Function Declarations
 
+static Boolean _EchoContextOpenStreams(EchoContext* context, CFRunLoopRef runLoop);
+static Boolean _EchoContextOpenSocket(EchoContext* context, CFRunLoopRef runLoop);
+static Boolean _EchoContextOpenEvents(EchoContext* context);
+static Boolean _EchoContextOpenDispatch(EchoContext* context);
+static Boolean _EchoContextStartDispatch(EchoContext* context);
+static void _EchoContextCloseDispatch(EchoContext* context);
+static Boolean _EchoContextPrepareNative(CFSocketNativeHandle nativeSocket);
+static CFSocketNativeHandle _EchoContextGetNative(EchoContext* context);
+static void _EchoContextUpdateEvents(EchoContext* context);
+static void _EchoContextUpdateSources(EchoContext* context, CFOptionFlags events);
+static CFIndex _EchoContextReadStream(EchoContext* context, CFIndex budget);
+static CFIndex _EchoContextReadSocket(EchoContext* context, CFIndex budget);
+static Boolean _EchoContextWriteStream(EchoContext* context);
+static Boolean _EchoContextWriteSocket(EchoContext* context);
+static Boolean _EchoContextFrame(EchoContext* context);
+static void _EchoContextTransform(EchoContext* context, CFIndex from, CFIndex to);
+static CFIndex _EchoContextFrameLines(const EchoBuffer* buffer, CFIndex ready, CFIndex scanned, CFIndex* frames, void* info);
+static CFIndex _EchoContextFrameLengths(const EchoBuffer* buffer, CFIndex ready, CFIndex scanned, CFIndex* frames, void* info);
+static void _EchoContextStopReading(EchoContext* context);
+static void _EchoContextStartReading(EchoContext* context);
+static void _EchoContextPauseReading(EchoContext* context);
+static void _EchoContextResumeReading(EchoContext* context);
+static CFIndex _EchoContextGetReadBudget(EchoContext* context);
+static void _EchoContextCharge(EchoContext* context, CFIndex bytes, CFIndex lines);
+static void _EchoContextThrottle(EchoContext* context, CFAbsoluteTime until);
+static void _EchoContextLiftThrottle(EchoContext* context);
+static CFAbsoluteTime _EchoContextGetDeadline(EchoContext* context);
+static void _EchoContextResetTimeOut(EchoContext* context);
+#if defined(ECHOCONTEXT_DISPATCH)
+static void _EchoContextArmTimeOut(EchoContext* context, CFAbsoluteTime deadline);
+static dispatch_time_t _EchoContextGetDispatchTime(CFAbsoluteTime time);
+static void _EchoContextEnterQueue(EchoContext* context);
+static dispatch_source_t _EchoContextCreateTimerSource(EchoContext* context, dispatch_function_t handler);
+#endif
+static void _EchoContextCount(EchoContext* context, StatisticsCounter counter, UInt64 amount);
+static void _EchoContextNoteLines(EchoContext* context, CFIndex lines, CFIndex ready);
+static void _EchoContextNoteWritten(EchoContext* context, CFIndex length, CFAbsoluteTime now);
+static Boolean _EchoContextReserve(EchoContext* context);
+static void _EchoContextTrim(EchoContext* context);
+
 static void _EchoContextHandleHasBytesAvailable(EchoContext* context);
 static void _EchoContextHandleEndEncountered(EchoContext* context);
 static void _EchoContextHandleCanAcceptBytes(EchoContext* context);
 static void _EchoContextHandleErrorOccurred(EchoContext* context);
 static void _EchoContextHandleTimeOut(EchoContext* context);
+static void _EchoContextHandleSweep(EchoContext* context);
 
 static void _ReadStreamCallBack(CFReadStreamRef inStream, CFStreamEventType type, EchoContext* context);
 static void _WriteStreamCallBack(CFWriteStreamRef outStream, CFStreamEventType type, EchoContext* context);
+static void _SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void* data, EchoContext* context);
+static void _EventCallBack(EventEngineWatch* watch, CFOptionFlags events, EchoContext* context);
 static void _TimerCallBack(CFRunLoopTimerRef timer, EchoContext* context);
+static void _FlushTimerCallBack(CFRunLoopTimerRef timer, EchoContext* context);
+static void _ThrottleTimerCallBack(CFRunLoopTimerRef timer, EchoContext* context);
+static void _TimerWheelCallBack(TimerWheelEntry* entry, EchoContext* context);
+static void _RegistryCloseCallBack(ConnectionRegistryEntry* entry, EchoContext* context);
+static Boolean _RegistryIsIdleCallBack(ConnectionRegistryEntry* entry, EchoContext* context);
+#if defined(ECHOCONTEXT_DISPATCH)
+static void _ReadSourceCallBack(EchoContext* context);
+static void _WriteSourceCallBack(EchoContext* context);
+static void _TimeOutSourceCallBack(EchoContext* context);
+static void _FlushSourceCallBack(EchoContext* context);
+static void _ThrottleSourceCallBack(EchoContext* context);
+static void _StartCallBack(EchoContext* context);
+static void _CloseCallBack(EchoContext* context);
+static void _SweepCallBack(EchoContext* context);
+static void _IdleSweepCallBack(EchoContext* context);
+static void _RegistryQueueCloseCallBack(ConnectionRegistryEntry* entry, EchoContext* context);
+static Boolean _RegistryQueueIsIdleCallBack(ConnectionRegistryEntry* entry, EchoContext* context);
+static void _TimerCancelCallBack(EchoContext* context);
+static void _SourceCancelCallBack(EchoContextDispatchClose* closer);
+#endif
+
+
+// How a registry sweeps a connection.
+static const ConnectionRegistryCallBacks kRegistryCallBacks = {0,
+															  (void(*)(ConnectionRegistryEntry*, void*))&_RegistryCloseCallBack,
+															  (Boolean(*)(ConnectionRegistryEntry*, void*))&_RegistryIsIdleCallBack};
+
+#if defined(ECHOCONTEXT_DISPATCH)
+// How a shared registry sweeps one on a queue, from another thread.
+static const ConnectionRegistryCallBacks kQueueRegistryCallBacks = {0,
+																   (void(*)(ConnectionRegistryEntry*, void*))&_RegistryQueueCloseCallBack,
+																   (Boolean(*)(ConnectionRegistryEntry*, void*))&_RegistryQueueIsIdleCallBack};
+#endif
+
+
+#pragma mark -
+#pragma mark Extern Constant Definitions
+
+/* extern */ const EchoContextProtocol kEchoContextLineProtocol = {0, NULL, NULL, NULL, NULL, &_EchoContextFrameLines, NULL};
+/* extern */ const EchoContextProtocol kEchoContextRawProtocol = {0, NULL, NULL, NULL, NULL, NULL, NULL};
+/* extern */ const EchoContextProtocol kEchoContextLengthProtocol = {0, NULL, NULL, NULL, NULL, &_EchoContextFrameLengths, NULL};
 
 
 #pragma mark -
 #pragma mark Extern Function Definitions (API)
 
 /* extern */ EchoContextRef
-EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket) {
+EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket, const EchoContextOptions* options) {
 
 	EchoContext* context = NULL;
 
@@ -103,14 +294,123 @@ EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket) {
 			break;
 		
 		memset(context, 0, sizeof(context[0]));
+		context->_nativeSocket = -1;
 		
 		// Save the allocator for deallocating later.
 		if (alloc)
 			context->_alloc = CFRetain(alloc);
 		
+		// Set up the receive buffer.  Storage is allocated as bytes arrive.
+		EchoBufferInit(&(context->_rcvdBytes), alloc);
+		
+		// Copy the options and fill in defaults for anything unspecified.
+		if (options)
+			memcpy(&(context->_options), options, sizeof(context->_options));
+		
+		if (context->_options.readSize <= 0)
+			context->_options.readSize = kDefaultReadSize;
+		
+		if (context->_options.readBudget <= 0)
+			context->_options.readBudget = kDefaultReadBudget;
+		
+		if (context->_options.idleTimeOut <= 0)
+			context->_options.idleTimeOut = kDefaultIdleTimeOut;
+		
+		if (context->_options.firstByteTimeOut <= 0)
+			context->_options.firstByteTimeOut = context->_options.idleTimeOut;
+		
+		if (context->_options.writeStallTimeOut <= 0)
+			context->_options.writeStallTimeOut = context->_options.idleTimeOut;
+		
+		if (context->_options.highWaterMark <= 0)
+			context->_options.highWaterMark = kDefaultHighWaterMark;
+		
+		if ((context->_options.lowWaterMark <= 0) || (context->_options.lowWaterMark >= context->_options.highWaterMark))
+			context->_options.lowWaterMark = context->_options.highWaterMark / 2;
+		
+		// Reading pauses once the high water mark is buffered, so a line has to
+		// be found too long before it gets that far or it would stall.
+		context->_options.maxLineLength = EchoFramingGetMaxLength(context->_options.maxLineLength, context->_options.highWaterMark);
+		
+		// Likewise a hold waiting on more than can be buffered.
+		if ((context->_options.coalesceBytes <= 0) || (context->_options.coalesceBytes > context->_options.highWaterMark))
+			context->_options.coalesceBytes = (context->_options.readSize < context->_options.highWaterMark) ? context->_options.readSize : context->_options.highWaterMark;
+		
+		// Latency sensitive clients want their echoes out at once.  Failure
+		// only costs latency, so it's not fatal.
+		if (context->_options.noDelay) {
+			int yes = 1;
+			setsockopt(nativeSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		}
+		
+		// Copy the protocol, and hold on to its info.
+		memcpy(&(context->_protocol),
+			   context->_options.protocol ? context->_options.protocol : &kEchoContextLineProtocol,
+			   sizeof(context->_protocol));
+		context->_options.protocol = &(context->_protocol);
+		
+		if (context->_protocol.info && context->_protocol.retain)
+			context->_protocol.info = (void*)context->_protocol.retain(context->_protocol.info);
+		
+		// Dispatch timers stand in for a wheel, which belongs to one thread.
+		// So does a registry, unless it's a shared one.
+		if (context->_options.ioMode == kEchoContextIODispatch) {
+			context->_options.timerWheel = NULL;
+			
+			if ((context->_options.registry != NULL) && !ConnectionRegistryIsShared(context->_options.registry))
+				context->_options.registry = NULL;
+		}
+		
+		// Hold on to the shared wheel, if there is one.
+		if (context->_options.timerWheel)
+			TimerWheelRetain(context->_options.timerWheel);
+		
+		// Likewise the statistics and the registry.
+		if (context->_options.statistics)
+			StatisticsRetain(context->_options.statistics);
+		
+		if (context->_options.registry)
+			ConnectionRegistryRetain(context->_options.registry);
+		
+		// Limits shared by the client's address are found by its peer name,
+		// which only the socket itself still has.
+		if (context->_options.rateLimiter) {
+		
+			struct sockaddr_storage address;
+			socklen_t length = sizeof(address);
+			
+			RateLimiterRetain(context->_options.rateLimiter);
+			
+			if (getpeername(nativeSocket, (struct sockaddr*)&address, &length) == 0)
+				context->_client = RateLimiterAttach(context->_options.rateLimiter, (struct sockaddr*)&address);
+		}
+		
+		if (context->_options.recorder)
+			TrafficRecorderRetain(context->_options.recorder);
+		
+		// And its own.
+		RateLimiterBucketInit(&(context->_byteBucket), context->_options.byteRate, context->_options.byteBurst);
+		RateLimiterBucketInit(&(context->_lineBucket), context->_options.lineRate, context->_options.lineBurst);
+		context->_limited = (context->_options.byteRate > 0) || (context->_options.lineRate > 0) || (context->_client != NULL);
+		
+		TimerWheelEntryInit(&(context->_timeout), (TimerWheelCallBack)&_TimerWheelCallBack, context);
+#if defined(ECHOCONTEXT_DISPATCH)
+		// On a queue, sweeps have to go through the queue.
+		if (context->_options.ioMode == kEchoContextIODispatch)
+			ConnectionRegistryEntryInit(&(context->_entry), &kQueueRegistryCallBacks, context);
+		else
+#endif
+		ConnectionRegistryEntryInit(&(context->_entry), &kRegistryCallBacks, context);
+		
 		// Bump the retain count.
 		EchoContextRetain((EchoContextRef)context);
 		
+		// Native i/o works on the socket itself; hold it until opened.
+		if (context->_options.ioMode != kEchoContextIOStream) {
+			context->_nativeSocket = nativeSocket;
+			return (EchoContextRef)context;
+		}
+		
 		// Create the streams for the incoming socket connection.
 		CFStreamCreatePairWithSocket(alloc, nativeSocket, &(context->_inStream), &(context->_outStream));
 
@@ -121,13 +421,6 @@ EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket) {
 		// Give up ownership of the native socket.
 		CFReadStreamSetProperty(context->_inStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
 			
-		// Create the receive buffer of no fixed size.
-		context->_rcvdBytes = CFDataCreateMutable(alloc, 0);
-		
-		// Fail if unable to create receive buffer.
-		if (context->_rcvdBytes == NULL)
-			break;
-			
 		return (EchoContextRef)context;
 		
 	} while (0);
@@ -142,9 +435,10 @@ EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket) {
 /* extern */ EchoContextRef
 EchoContextRetain(EchoContextRef context) {
 	
-	// Bump the retain count if context is good.
+	// Bump the retain count if context is good.  With dispatch, queues on
+	// different threads retain and release at once.
 	if (context != NULL)
-		((EchoContext*)context)->_retainCount++;
+		__sync_add_and_fetch(&(((EchoContext*)context)->_retainCount), 1);
 		
 	return context;
 }
@@ -155,19 +449,15 @@ EchoContextRelease(EchoContextRef context) {
 
 	if (context != NULL) {
 		
-		// Decrease the retain count.
-		((EchoContext*)context)->_retainCount--;
-		
-		// Don't dispose until the count goes to zero.
-		if (((EchoContext*)context)->_retainCount > 0)
+		// Decrease the retain count, and don't dispose until it goes to zero.
+		if (__sync_sub_and_fetch(&(((EchoContext*)context)->_retainCount), 1) != 0)
 			return;
 		
 		// Hold locally so deallocation can happen and then safely release.
 		CFAllocatorRef alloc = ((EchoContext*)context)->_alloc;
 		
-		// Release the buffer if there is one.
-		if (((EchoContext*)context)->_rcvdBytes != NULL)
-			CFRelease(((EchoContext*)context)->_rcvdBytes);
+		// Release the receive buffer's storage.
+		EchoBufferDestroy(&(((EchoContext*)context)->_rcvdBytes));
 		
 		// Invalidate and release the timer.
 		if (((EchoContext*)context)->_timer != NULL) {
@@ -177,6 +467,36 @@ EchoContextRelease(EchoContextRef context) {
 		
 		// Close the i/o streams.
 		EchoContextClose(context);
+		
+#if defined(ECHOCONTEXT_DISPATCH)
+		// The queue outlives the sources, so it goes last.
+		if (((EchoContext*)context)->_queue != NULL)
+			dispatch_release(((EchoContext*)context)->_queue);
+#endif
+		
+		// Let go of the shared wheel.
+		if (((EchoContext*)context)->_options.timerWheel)
+			TimerWheelRelease(((EchoContext*)context)->_options.timerWheel);
+		
+		// And the statistics.
+		if (((EchoContext*)context)->_options.statistics)
+			StatisticsRelease(((EchoContext*)context)->_options.statistics);
+		
+		// And the registry.
+		if (((EchoContext*)context)->_options.registry)
+			ConnectionRegistryRelease(((EchoContext*)context)->_options.registry);
+		
+		// And the rate limiter.
+		if (((EchoContext*)context)->_options.rateLimiter)
+			RateLimiterRelease(((EchoContext*)context)->_options.rateLimiter);
+		
+		// And the recorder.
+		if (((EchoContext*)context)->_options.recorder)
+			TrafficRecorderRelease(((EchoContext*)context)->_options.recorder);
+		
+		// And the protocol's info.
+		if (((EchoContext*)context)->_protocol.info && ((EchoContext*)context)->_protocol.release)
+			((EchoContext*)context)->_protocol.release(((EchoContext*)context)->_protocol.info);
 			
 		// Free the memory in use by the context.
 		CFAllocatorDeallocate(alloc, context);
@@ -192,47 +512,109 @@ EchoContextRelease(EchoContextRef context) {
 EchoContextOpen(EchoContextRef context) {
 
 	do {
-		Boolean didSet;
+		Boolean didOpen;
 		CFRunLoopRef runLoop = CFRunLoopGetCurrent();
 		
-		CFStreamClientContext streamCtxt = {0, context, (void*(*)(void*))&EchoContextRetain, (void(*)(void*))&EchoContextRelease, NULL};
 		CFRunLoopTimerContext timerCtxt = {0, context, (const void*(*)(const void*))&EchoContextRetain, (void(*)(const void*))&EchoContextRelease, NULL};
 		
-		// Set the client on the read stream.
-		didSet = CFReadStreamSetClient(((EchoContext*)context)->_inStream,
-									   kReadEvents,
-									   (CFReadStreamClientCallBack)&_ReadStreamCallBack,
-									   &streamCtxt);
-									   
-		// Fail if unable to set the client.
-		if (!didSet)
+		// Hook up whichever i/o path the context was created for.
+		if (((EchoContext*)context)->_inStream != NULL)
+			didOpen = _EchoContextOpenStreams((EchoContext*)context, runLoop);
+		else if (((EchoContext*)context)->_options.ioMode == kEchoContextIOEvent)
+			didOpen = _EchoContextOpenEvents((EchoContext*)context);
+		else if (((EchoContext*)context)->_options.ioMode == kEchoContextIODispatch)
+			didOpen = _EchoContextOpenDispatch((EchoContext*)context);
+		else
+			didOpen = _EchoContextOpenSocket((EchoContext*)context, runLoop);
+		
+		// Fail if unable to get the i/o going.
+		if (!didOpen)
 			break;
 		
-		// Set the client on the write stream.
-		didSet = CFWriteStreamSetClient(((EchoContext*)context)->_outStream,
-										kWriteEvents,
-										(CFWriteStreamClientCallBack)&_WriteStreamCallBack,
-										&streamCtxt);
+		// The client's first byte is due from now.
+		((EchoContext*)context)->_opened = CFAbsoluteTimeGetCurrent();
+		
+		// Count on this thread's shard, which is the only one the context runs on.
+		if (((EchoContext*)context)->_options.statistics != NULL)
+			((EchoContext*)context)->_shard = StatisticsGetShard(((EchoContext*)context)->_options.statistics);
+		
+		((EchoContext*)context)->_isOpen = TRUE;
+		_EchoContextCount((EchoContext*)context, kStatisticsOpens, 1);
+		_EchoContextCount((EchoContext*)context, kStatisticsMemoryAllocated, sizeof(EchoContext));
+		ECHOTRACE_CONN_OPEN(context, _EchoContextGetNative((EchoContext*)context));
+		
+		// The shard of the thread it opens on, for the rest of its life.
+		if (((EchoContext*)context)->_options.recorder != NULL)
+			((EchoContext*)context)->_recorderShard = TrafficRecorderGetShard(((EchoContext*)context)->_options.recorder);
+		
+		if (((EchoContext*)context)->_recorderShard != NULL)
+			((EchoContext*)context)->_recorded = TrafficRecorderOpen(((EchoContext*)context)->_recorderShard);
 		
-		// Fail if unable to set the client.
-		if (!didSet)
+		// List it with the server, so a sweep can find it.  Dispatch waits
+		// until it starts on its queue, so no sweep gets there first.
+		if ((((EchoContext*)context)->_options.registry != NULL) &&
+			(((EchoContext*)context)->_options.ioMode != kEchoContextIODispatch) &&
+			!ConnectionRegistryAdd(((EchoContext*)context)->_options.registry, &(((EchoContext*)context)->_entry)))
+		{
 			break;
+		}
+		
+		// Dispatch brings its own timers, and events flow the moment its
+		// sources resume, so that's the last thing done.
+		if (((EchoContext*)context)->_options.ioMode == kEchoContextIODispatch) {
+			if (!_EchoContextStartDispatch((EchoContext*)context))
+				break;
+			return TRUE;
+		}
+		
+		// Coalescing needs a timer to end each hold.  It repeats so it can be
+		// pushed out again, but as far as this is concerned it's idle.
+		if (((EchoContext*)context)->_options.coalesceDelay > 0) {
+		
+			((EchoContext*)context)->_flushTimer = CFRunLoopTimerCreate(((EchoContext*)context)->_alloc,
+													kFlushTimerIdle,
+													kFlushTimerIdle,	// interval
+													0,					// flags
+													0,					// order
+													(CFRunLoopTimerCallBack)_FlushTimerCallBack,
+													&timerCtxt);
+			
+			// Fail if unable to create the timer.
+			if (((EchoContext*)context)->_flushTimer == NULL)
+				break;
 			
-		// Schedule the streams on the current run loop and default mode.
-		CFReadStreamScheduleWithRunLoop(((EchoContext*)context)->_inStream, runLoop, kCFRunLoopCommonModes);
-		CFWriteStreamScheduleWithRunLoop(((EchoContext*)context)->_outStream, runLoop, kCFRunLoopCommonModes);
+			CFRunLoopAddTimer(runLoop, ((EchoContext*)context)->_flushTimer, kCFRunLoopCommonModes);
+		}
 		
-		// Open the stream for reading.
-		if (!CFReadStreamOpen(((EchoContext*)context)->_inStream))
-			break;
+		// Rate limits need one to lift each throttle, idle the same way.
+		if (((EchoContext*)context)->_limited) {
+		
+			((EchoContext*)context)->_throttleTimer = CFRunLoopTimerCreate(((EchoContext*)context)->_alloc,
+													   kFlushTimerIdle,
+													   kFlushTimerIdle,	// interval
+													   0,					// flags
+													   0,					// order
+													   (CFRunLoopTimerCallBack)_ThrottleTimerCallBack,
+													   &timerCtxt);
 			
-		// Open the stream for writing.
-		if (!CFWriteStreamOpen(((EchoContext*)context)->_outStream))
-			break;
+			// Fail if unable to create the timer.
+			if (((EchoContext*)context)->_throttleTimer == NULL)
+				break;
+			
+			CFRunLoopAddTimer(runLoop, ((EchoContext*)context)->_throttleTimer, kCFRunLoopCommonModes);
+		}
+		
+		// A shared wheel makes the timeout an entry on it.
+		if (((EchoContext*)context)->_options.timerWheel != NULL) {
+			TimerWheelAdd(((EchoContext*)context)->_options.timerWheel,
+						  &(((EchoContext*)context)->_timeout),
+						  _EchoContextGetDeadline((EchoContext*)context));
+			return TRUE;
+		}
 		
 		// Create the timeout timer
-		((EchoContext*)context)->_timer = CFRunLoopTimerCreate(CFGetAllocator(((EchoContext*)context)->_inStream),
-											   CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds,
+		((EchoContext*)context)->_timer = CFRunLoopTimerCreate(((EchoContext*)context)->_alloc,
+											   _EchoContextGetDeadline((EchoContext*)context),
 											   0,		// interval
 											   0,		// flags
 											   0,		// order
@@ -260,6 +642,14 @@ EchoContextOpen(EchoContextRef context) {
 EchoContextClose(EchoContextRef context) {
 
 	CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+	
+#if defined(ECHOCONTEXT_DISPATCH)
+	// Off the connection's queue, close on it, so no callback runs meanwhile.
+	if ((((EchoContext*)context)->_queue != NULL) && (dispatch_get_specific(&kQueueKey) != context)) {
+		dispatch_sync_f(((EchoContext*)context)->_queue, context, (dispatch_function_t)&_CloseCallBack);
+		return;
+	}
+#endif
 
 	// Check if the read stream exists.
 	if (((EchoContext*)context)->_inStream) {
@@ -286,152 +676,1619 @@ EchoContextClose(EchoContextRef context) {
 		// Remove the reference.
 		((EchoContext*)context)->_outStream = NULL;
 	}
+
+	// Check if the socket exists.
+	if (((EchoContext*)context)->_socket) {
+	
+		// Invalidate, which also closes the native socket, and release it.
+		CFSocketInvalidate(((EchoContext*)context)->_socket);
+		CFRelease(((EchoContext*)context)->_socket);
+		
+		// Remove the reference.
+		((EchoContext*)context)->_socket = NULL;
+	}
+	
+	// Take it off the event engine before the descriptor goes away.
+	EventEngineRemove(&(((EchoContext*)context)->_watch));
+	
+	// Likewise the dispatch sources, which take the descriptor with them.
+	_EchoContextCloseDispatch((EchoContext*)context);
+	
+	// Close the native socket if it was never handed off.
+	if (((EchoContext*)context)->_nativeSocket != -1) {
+		close(((EchoContext*)context)->_nativeSocket);
+		((EchoContext*)context)->_nativeSocket = -1;
+	}
     
     if (((EchoContext*)context)->_timer != NULL) {
         CFRunLoopTimerInvalidate(((EchoContext*)context)->_timer);
         CFRelease(((EchoContext*)context)->_timer);
         ((EchoContext*)context)->_timer = NULL;
     }
+    
+    // Likewise the flush timer.
+    if (((EchoContext*)context)->_flushTimer != NULL) {
+        CFRunLoopTimerInvalidate(((EchoContext*)context)->_flushTimer);
+        CFRelease(((EchoContext*)context)->_flushTimer);
+        ((EchoContext*)context)->_flushTimer = NULL;
+    }
+    
+    // And the throttle timer.
+    if (((EchoContext*)context)->_throttleTimer != NULL) {
+        CFRunLoopTimerInvalidate(((EchoContext*)context)->_throttleTimer);
+        CFRelease(((EchoContext*)context)->_throttleTimer);
+        ((EchoContext*)context)->_throttleTimer = NULL;
+    }
+
+    // Take the timeout off the shared wheel, and the connection out of the registry.
+    TimerWheelRemove(&(((EchoContext*)context)->_timeout));
+    ConnectionRegistryRemove(&(((EchoContext*)context)->_entry));
+    
+    // Let the address's buckets go with the last of its connections.
+    if (((EchoContext*)context)->_client != NULL) {
+        RateLimiterDetach(((EchoContext*)context)->_options.rateLimiter, ((EchoContext*)context)->_client);
+        ((EchoContext*)context)->_client = NULL;
+    }
+    
+    // Nothing will be echoed now, so the receive storage can go back.
+    EchoBufferConsume(&(((EchoContext*)context)->_rcvdBytes), EchoBufferGetLength(&(((EchoContext*)context)->_rcvdBytes)));
+    ((EchoContext*)context)->_ready = ((EchoContext*)context)->_scanned = 0;
+    _EchoContextTrim((EchoContext*)context);
+    
+    // Count it closed, once.
+    if (((EchoContext*)context)->_isOpen) {
+        ((EchoContext*)context)->_isOpen = FALSE;
+        _EchoContextCount((EchoContext*)context, kStatisticsCloses, 1);
+        _EchoContextCount((EchoContext*)context, kStatisticsMemoryFreed, sizeof(EchoContext));
+        ECHOTRACE_CONN_CLOSE(context, ((EchoContext*)context)->_written);
+        
+        if (((EchoContext*)context)->_recorderShard != NULL)
+            TrafficRecorderClose(((EchoContext*)context)->_recorderShard, ((EchoContext*)context)->_recorded);
+    }
 }
 
 
 #pragma mark -
 #pragma mark Static Function Definitions
 
-/* static */ void
-_EchoContextHandleHasBytesAvailable(EchoContext* context) {
+/* static */ Boolean
+_EchoContextOpenStreams(EchoContext* context, CFRunLoopRef runLoop) {
 
-	UInt8 buffer[2048];
+	Boolean didSet;
+	CFStreamClientContext streamCtxt = {0, context, (void*(*)(void*))&EchoContextRetain, (void(*)(void*))&EchoContextRelease, NULL};
 	
-	// Try reading the bytes into the buffer.
-	CFIndex bytesRead = CFReadStreamRead(context->_inStream, buffer, sizeof(buffer));
+	// Set the client on the read stream.
+	didSet = CFReadStreamSetClient(context->_inStream,
+								   kReadEvents,
+								   (CFReadStreamClientCallBack)&_ReadStreamCallBack,
+								   &streamCtxt);
+								   
+	// Fail if unable to set the client.
+	if (!didSet)
+		return FALSE;
 	
-	// Reset the timeout.
-	CFRunLoopTimerSetNextFireDate(context->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
+	// Set the client on the write stream.
+	didSet = CFWriteStreamSetClient(context->_outStream,
+									kWriteEvents,
+									(CFWriteStreamClientCallBack)&_WriteStreamCallBack,
+									&streamCtxt);
 	
-	// If there wasn't an error (-1) and not end (0), process the data.
-	if (bytesRead > 0) {
+	// Fail if unable to set the client.
+	if (!didSet)
+		return FALSE;
 		
-		// Add the bytes of data to the receive buffer.
-		CFDataAppendBytes(context->_rcvdBytes, buffer, bytesRead);
+	// Schedule the streams on the current run loop and default mode.
+	CFReadStreamScheduleWithRunLoop(context->_inStream, runLoop, kCFRunLoopCommonModes);
+	CFWriteStreamScheduleWithRunLoop(context->_outStream, runLoop, kCFRunLoopCommonModes);
+	
+	// Open the stream for reading.
+	if (!CFReadStreamOpen(context->_inStream))
+		return FALSE;
 		
-		// If the ouput stream can write, try sending the bytes.
-		if (CFWriteStreamCanAcceptBytes(context->_outStream))
-			_EchoContextHandleCanAcceptBytes(context);
-	}
+	// Open the stream for writing.
+	return CFWriteStreamOpen(context->_outStream);
 }
 
 
-/* static */ void
-_EchoContextHandleEndEncountered(EchoContext* context) {
+/* static */ Boolean
+_EchoContextOpenSocket(EchoContext* context, CFRunLoopRef runLoop) {
 
-	// End was hit, so destroy the context.
-    EchoContextClose((EchoContextRef)context);
-	EchoContextRelease((EchoContextRef)context);
+	CFRunLoopSourceRef src;
+	CFSocketContext socketCtxt = {0, context, (const void*(*)(const void*))&EchoContextRetain, (void(*)(const void*))&EchoContextRelease, NULL};
+	
+	// Reads and writes go straight to the socket.
+	if (!_EchoContextPrepareNative(context->_nativeSocket))
+		return FALSE;
+	
+	// Wrap the socket for run loop notifications.
+	context->_socket = CFSocketCreateWithNative(context->_alloc,
+												context->_nativeSocket,
+												kSocketEvents,
+												(CFSocketCallBack)&_SocketCallBack,
+												&socketCtxt);
+	
+	// Fail if unable to create the socket.
+	if (context->_socket == NULL)
+		return FALSE;
+	
+	// The socket owns the native handle from here on.
+	context->_nativeSocket = -1;
+	
+	// Reads are wanted continuously, but writes only when output backs up.
+	CFSocketSetSocketFlags(context->_socket, kCFSocketAutomaticallyReenableReadCallBack | kCFSocketCloseOnInvalidate);
+	CFSocketDisableCallBacks(context->_socket, kCFSocketWriteCallBack);
+	
+	// Create the run loop source for putting on the run loop.
+	src = CFSocketCreateRunLoopSource(context->_alloc, context->_socket, 0);
+	if (src == NULL)
+		return FALSE;
+	
+	// Add the run loop source to the current run loop and default mode.
+	CFRunLoopAddSource(runLoop, src, kCFRunLoopCommonModes);
+	CFRelease(src);
+	
+	return TRUE;
 }
 
 
-/* static */ void
-_EchoContextHandleCanAcceptBytes(EchoContext* context) {
+/* static */ Boolean
+_EchoContextOpenEvents(EchoContext* context) {
+
+	// The engine belongs to the thread, like the run loop it's on.
+	EventEngineRef engine = EventEngineGetCurrent();
 	
-	/*
-	** Echo looks for a '/n' in the data.  If one is found, all bytes up to and including
-	** the linefeed are sent back to the client.  The write of this buffer may not send
-	** all of the data, so the bytes that are successfully sent are removed from the
-	** buffer.  When told that the stream can accept bytes again, the whole process will
-	** fire again.
-	*/
+	// Fail if there's no engine on this system.
+	if (engine == NULL)
+		return FALSE;
+	
+	// Reads and writes go straight to the socket.
+	if (!_EchoContextPrepareNative(context->_nativeSocket))
+		return FALSE;
 	
-	// Get the start of the buffer to send.
-	const UInt8* start = CFDataGetBytePtr(context->_rcvdBytes);
+	// Watch for reads; writes are only asked for when output backs up.
+	EventEngineWatchInit(&(context->_watch), context->_nativeSocket, (EventEngineCallBack)&_EventCallBack, context);
 	
-	// Find the linefeed if it exists.
-	const UInt8* lf = (const UInt8*)memchr(start, '\n', CFDataGetLength(context->_rcvdBytes));
+	return EventEngineAdd(engine, &(context->_watch), kEventEngineReadEvent);
+}
+
 
-	// Writing resets the timer.
-	CFRunLoopTimerSetNextFireDate(context->_timer, CFAbsoluteTimeGetCurrent() + kTimeOutInSeconds);
+/* static */ Boolean
+_EchoContextOpenDispatch(EchoContext* context) {
+
+#if defined(ECHOCONTEXT_DISPATCH)
+	// Reads and writes go straight to the socket.
+	if (!_EchoContextPrepareNative(context->_nativeSocket))
+		return FALSE;
 	
-	// If there was a linefeed, take care of sending the data.
-	if (lf != NULL) {
+	// Set aside now what closing will need, so closing can't fail.
+	context->_closer = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(context->_closer[0]), 0);
+	if (context->_closer == NULL)
+		return FALSE;
+	
+	context->_closer->_sources = 0;
+	
+	// A serial queue keeps the connection's callbacks in order, and the
+	// concurrent queue it targets runs connections side by side.
+	context->_queue = dispatch_queue_create("EchoContext", DISPATCH_QUEUE_SERIAL);
+	if (context->_queue == NULL)
+		return FALSE;
+	
+	dispatch_set_target_queue(context->_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+	dispatch_queue_set_specific(context->_queue, &kQueueKey, context, NULL);
+	
+	// Sources start out suspended, and stay that way until started.
+	context->_readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, context->_nativeSocket, 0, context->_queue);
+	if (context->_readSource == NULL)
+		return FALSE;
+	
+	// Each source holds the context until it has finished cancelling.
+	context->_readSuspended = TRUE;
+	dispatch_set_context(context->_readSource, EchoContextRetain((EchoContextRef)context));
+	dispatch_source_set_event_handler_f(context->_readSource, (dispatch_function_t)&_ReadSourceCallBack);
+	
+	context->_writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, context->_nativeSocket, 0, context->_queue);
+	if (context->_writeSource == NULL)
+		return FALSE;
+	
+	context->_writeSuspended = TRUE;
+	dispatch_set_context(context->_writeSource, EchoContextRetain((EchoContextRef)context));
+	dispatch_source_set_event_handler_f(context->_writeSource, (dispatch_function_t)&_WriteSourceCallBack);
+	
+	return TRUE;
+#else
+	// Fail if there's no dispatch on this system.
+	return FALSE;
+#endif
+}
+
+
+/* static */ Boolean
+_EchoContextStartDispatch(EchoContext* context) {
+
+#if defined(ECHOCONTEXT_DISPATCH)
+	// The timeout is a timer on the same queue, so it never races a callback.
+	context->_timeOutSource = _EchoContextCreateTimerSource(context, (dispatch_function_t)&_TimeOutSourceCallBack);
+	if (context->_timeOutSource == NULL)
+		return FALSE;
+	
+	// Coalescing needs another to end each hold; until then it's idle.
+	if (context->_options.coalesceDelay > 0) {
+		context->_flushSource = _EchoContextCreateTimerSource(context, (dispatch_function_t)&_FlushSourceCallBack);
+		if (context->_flushSource == NULL)
+			return FALSE;
+	}
+	
+	// Likewise rate limits, to lift each throttle.
+	if (context->_limited) {
+		context->_throttleSource = _EchoContextCreateTimerSource(context, (dispatch_function_t)&_ThrottleSourceCallBack);
+		if (context->_throttleSource == NULL)
+			return FALSE;
+	}
+	
+	// Every source is still suspended.  Starting them on the queue means no
+	// callback can run until the opener is done with the context, and none
+	// sees the suspended flags half changed.
+	dispatch_async_f(context->_queue, EchoContextRetain((EchoContextRef)context), (dispatch_function_t)&_StartCallBack);
+	
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+
+/* static */ void
+_EchoContextCloseDispatch(EchoContext* context) {
+
+#if defined(ECHOCONTEXT_DISPATCH)
+	dispatch_source_t sources[2] = {context->_readSource, context->_writeSource};
+	Boolean suspended[2] = {context->_readSuspended, context->_writeSuspended};
+	dispatch_source_t timers[3] = {context->_timeOutSource, context->_flushSource, context->_throttleSource};
+	CFIndex i;
+	
+	// Whatever thread the queue is on now is the one counting.
+	if (context->_queue != NULL)
+		_EchoContextEnterQueue(context);
+	
+	// Cancelled from the queue, the timers' handlers won't run again.  Each
+	// lets go of the context from its cancel handler, which a timer that was
+	// never started only reaches once resumed.
+	for (i = 0; i < 3; i++) {
+	
+		if (timers[i] == NULL)
+			continue;
+		
+		dispatch_source_cancel(timers[i]);
+		if (!context->_started)
+			dispatch_resume(timers[i]);
+		dispatch_release(timers[i]);
+	}
+	
+	context->_timeOutSource = NULL;
+	context->_flushSource = NULL;
+	context->_throttleSource = NULL;
+	
+	// The descriptor can't close while either source still watches it, so
+	// each counts down as it finishes cancelling and the last one closes it.
+	// Each still holds the context, and gives it up through the closer.
+	for (i = 0; i < 2; i++) {
+	
+		if (sources[i] == NULL)
+			continue;
+		
+		if (context->_closer->_sources++ == 0) {
+			context->_closer->_nativeSocket = context->_nativeSocket;
+			context->_closer->_context = context;
+			context->_nativeSocket = -1;
+		}
+		
+		dispatch_set_context(sources[i], context->_closer);
+		dispatch_source_set_cancel_handler_f(sources[i], (dispatch_function_t)&_SourceCancelCallBack);
+		dispatch_source_cancel(sources[i]);
 		
-		// Write all of the bytes inbetween and including the linefeed.
-		CFIndex bytesWritten = CFWriteStreamWrite(context->_outStream, start, lf - start + 1);
+		// A suspended source never gets as far as its cancel handler.
+		if (suspended[i])
+			dispatch_resume(sources[i]);
 		
-		// If successfully sent the data, remove the bytes from the buffer.
-		if (bytesWritten > 0)
-			CFDataDeleteBytes(context->_rcvdBytes, CFRangeMake(0, bytesWritten));
+		dispatch_release(sources[i]);
 	}
+	
+	context->_readSource = NULL;
+	context->_writeSource = NULL;
+	
+	// The sources own it if they were given it.
+	if ((context->_closer != NULL) && (context->_closer->_sources == 0))
+		CFAllocatorDeallocate(kCFAllocatorDefault, context->_closer);
+	
+	context->_closer = NULL;
+#endif
 }
 
 
-/* static */ void
-_EchoContextHandleErrorOccurred(EchoContext* context) {
+/* static */ Boolean
+_EchoContextPrepareNative(CFSocketNativeHandle nativeSocket) {
 
-	// Hit an error, so destroy the context which will close the streams.
-	EchoContextRelease((EchoContextRef)context);
+	int flags, yes = 1;
+	
+	// Reads and writes must never block.
+	flags = fcntl(nativeSocket, F_GETFL, 0);
+	if ((flags == -1) || (fcntl(nativeSocket, F_SETFL, flags | O_NONBLOCK) == -1))
+		return FALSE;
+	
+#if defined(SO_NOSIGPIPE)
+	// A closed peer should show up as EPIPE and not kill the process.
+	setsockopt(nativeSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#else
+	(void)yes;
+#endif
+	
+	return TRUE;
 }
 
 
-/* static */ void
-_EchoContextHandleTimeOut(EchoContext* context) {
+/* static */ CFSocketNativeHandle
+_EchoContextGetNative(EchoContext* context) {
 
-	// Haven't heard from the client so kill everything.
-    EchoContextClose((EchoContextRef)context);
-	EchoContextRelease((EchoContextRef)context);
+	// A CFSocket owns the descriptor once it wraps it.
+	return (context->_socket != NULL) ? CFSocketGetNative(context->_socket) : context->_nativeSocket;
 }
 
 
 /* static */ void
-_ReadStreamCallBack(CFReadStreamRef inStream, CFStreamEventType type, EchoContext* context) {
+_EchoContextUpdateEvents(EchoContext* context) {
 
-	assert(inStream == context->_inStream);
+	// Reads unless paused or throttled, and writes only while something is waiting to go.
+	CFOptionFlags events = ((context->_paused || context->_throttled) ? 0 : kEventEngineReadEvent) |
+						   (((context->_ready > 0) && !context->_holding) ? kEventEngineWriteEvent : 0);
 	
-	// Dispatch the event properly.
-    switch (type) {
-        case kCFStreamEventHasBytesAvailable:
-            _EchoContextHandleHasBytesAvailable(context);
-            break;
-			
-        case kCFStreamEventEndEncountered:
-			_EchoContextHandleEndEncountered(context);
-            break;
-       
-        case kCFStreamEventErrorOccurred:
-			_EchoContextHandleErrorOccurred(context);
-			break;
-            
-        default:
-            break;
-    }
+	if (context->_options.ioMode == kEchoContextIODispatch)
+		_EchoContextUpdateSources(context, events);
+	else
+		EventEngineSetEvents(&(context->_watch), events);
 }
 
 
 /* static */ void
-_WriteStreamCallBack(CFWriteStreamRef outStream, CFStreamEventType type, EchoContext* context) {
+_EchoContextUpdateSources(EchoContext* context, CFOptionFlags events) {
 
-	assert(outStream == context->_outStream);
+#if defined(ECHOCONTEXT_DISPATCH)
+	Boolean wantRead = (events & kEventEngineReadEvent) != 0;
+	Boolean wantWrite = (events & kEventEngineWriteEvent) != 0;
+	
+	// Suspends and resumes must balance, so only change what differs, and
+	// note the change before making it.
+	if ((context->_readSource != NULL) && (wantRead == context->_readSuspended)) {
+		context->_readSuspended = !wantRead;
+		if (wantRead)
+			dispatch_resume(context->_readSource);
+		else
+			dispatch_suspend(context->_readSource);
+	}
+	
+	if ((context->_writeSource != NULL) && (wantWrite == context->_writeSuspended)) {
+		context->_writeSuspended = !wantWrite;
+		if (wantWrite)
+			dispatch_resume(context->_writeSource);
+		else
+			dispatch_suspend(context->_writeSource);
+	}
+#endif
+}
 
-	// Dispatch the event properly.
-    switch (type) {
-		case kCFStreamEventCanAcceptBytes:
-			_EchoContextHandleCanAcceptBytes(context);
-			break;
-			
-        case kCFStreamEventErrorOccurred:
+
+/* static */ CFIndex
+_EchoContextReadStream(EchoContext* context, CFIndex budget) {
+
+	CFIndex total = 0;
+	
+	/*
+	** Bytes are read straight into the free space of the receive buffer.  Reading
+	** continues while the stream has more, up to the budget, so a fast sender
+	** doesn't cost a trip through the run loop for every read.  The budget is the
+	** read budget, or less where a rate limit allows less.
+	*/
+	do {
+		CFIndex length, bytesRead;
+		UInt8* space;
+		
+		// Make sure there is room for a full read.  If the buffer can't grow,
+		// there's no way to keep echoing correctly, so give up.
+		if (!_EchoContextReserve(context)) {
 			_EchoContextHandleErrorOccurred(context);
+			return -1;
+		}
+		
+		space = EchoBufferGetFreePtr(&(context->_rcvdBytes), &length);
+		if (length > context->_options.readSize)
+			length = context->_options.readSize;
+		if (length > (budget - total))
+			length = budget - total;
+		
+		// Try reading the bytes into the buffer.
+		bytesRead = CFReadStreamRead(context->_inStream, space, length);
+		
+		// Stop on an error (-1) or the end (0).  Both are reported as events.
+		if (bytesRead <= 0)
 			break;
-            
-        default:
-            break;
-    }
+		
+		// Add the bytes of data to the receive buffer.
+		EchoBufferCommit(&(context->_rcvdBytes), bytesRead);
+		total += bytesRead;
+		
+		if (context->_recorderShard != NULL) {
+			struct iovec vector = {space, bytesRead};
+			TrafficRecorderRecordData(context->_recorderShard, context->_recorded, &vector, 1, bytesRead);
+		}
+		
+	} while ((total < budget) &&
+			 (EchoBufferGetLength(&(context->_rcvdBytes)) < context->_options.highWaterMark) &&
+			 CFReadStreamHasBytesAvailable(context->_inStream));
+	
+	return total;
 }
 
 
-/* static */ void
-_TimerCallBack(CFRunLoopTimerRef timer, EchoContext* context) {
-
-	assert(timer == context->_timer);
+/* static */ CFIndex
+_EchoContextReadSocket(EchoContext* context, CFIndex budget) {
 
-	// Dispatch the timer event.
-	_EchoContextHandleTimeOut(context);
-}
+	CFIndex total = 0;
+	
+	/*
+	** Same as the stream case, except the read is a readv covering all of the free
+	** space up to the read size, including the part that wraps to the front of the
+	** ring.  A short read means the socket is drained, so that ends the loop without
+	** paying for a read that would only return EAGAIN.
+	*/
+	while ((total < budget) &&
+		   (EchoBufferGetLength(&(context->_rcvdBytes)) < context->_options.highWaterMark))
+	{
+		struct iovec vectors[2];
+		CFIndex count;
+		ssize_t bytesRead;
+		size_t requested;
+		
+		// Make sure there is room for a full read.
+		if (!_EchoContextReserve(context)) {
+			_EchoContextHandleErrorOccurred(context);
+			return -1;
+		}
+		
+		count = EchoBufferGetFreeVectors(&(context->_rcvdBytes),
+										 (context->_options.readSize < (budget - total)) ? context->_options.readSize : (budget - total),
+										 vectors);
+		requested = vectors[0].iov_len + ((count > 1) ? vectors[1].iov_len : 0);
+		
+		// Read directly into the ring.
+		bytesRead = readv(_EchoContextGetNative(context), vectors, (int)count);
+		
+		if (bytesRead > 0) {
+		
+			// Add the bytes of data to the receive buffer.
+			EchoBufferCommit(&(context->_rcvdBytes), bytesRead);
+			total += bytesRead;
+			
+			// The vectors still describe where the bytes landed.
+			if (context->_recorderShard != NULL)
+				TrafficRecorderRecordData(context->_recorderShard, context->_recorded, vectors, count, bytesRead);
+			
+			// Nothing more waiting.
+			if ((size_t)bytesRead < requested)
+				break;
+		}
+		
+		// Zero is the peer closing its end.
+		else if (bytesRead == 0) {
+			_EchoContextHandleEndEncountered(context);
+			return -1;
+		}
+		
+		// Out of data for now.
+		else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			break;
+		
+		// Anything other than an interruption is fatal.
+		else if (errno != EINTR) {
+			_EchoContextHandleErrorOccurred(context);
+			return -1;
+		}
+	}
+	
+	return total;
+}
+
+
+/* static */ Boolean
+_EchoContextWriteStream(EchoContext* context) {
+
+	CFIndex ready = context->_ready;
+	
+	do {
+		// Get the start of the buffer to send and how much of it is contiguous.
+		CFIndex length;
+		const UInt8* start = EchoBufferGetBytePtr(&(context->_rcvdBytes), &length);
+		CFIndex bytesWritten;
+		
+		if (length > context->_ready)
+			length = context->_ready;
+		
+		// Write as much as the stream will take.
+		bytesWritten = CFWriteStreamWrite(context->_outStream, start, length);
+		
+		// Errors are reported through the stream callback.
+		if (bytesWritten <= 0)
+			break;
+			
+		// Remove the bytes that were sent from the buffer.  The cursors
+		// are relative to the head, so they move back by the same amount.
+		EchoBufferConsume(&(context->_rcvdBytes), bytesWritten);
+		context->_ready -= bytesWritten;
+		context->_scanned -= bytesWritten;
+	
+	// Keep going only while the stream can take more without blocking.
+	} while ((context->_ready > 0) && CFWriteStreamCanAcceptBytes(context->_outStream));
+	
+	// Any progress counts as activity.
+	if (context->_ready < ready) {
+		context->_lastWrite = CFAbsoluteTimeGetCurrent();
+		_EchoContextNoteWritten(context, ready - context->_ready, context->_lastWrite);
+		_EchoContextResetTimeOut(context);
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_EchoContextWriteSocket(EchoContext* context) {
+
+	CFIndex ready = context->_ready;
+	
+	while (context->_ready > 0) {
+	
+		// Describe the ready bytes, both sides of the wrap, for one gathered send.
+		struct iovec vectors[2];
+		struct msghdr msg;
+		ssize_t bytesWritten;
+		
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vectors;
+		msg.msg_iovlen = (int)EchoBufferGetVectors(&(context->_rcvdBytes), context->_ready, vectors);
+		
+		bytesWritten = sendmsg(_EchoContextGetNative(context), &msg, kSendFlags);
+		
+		if (bytesWritten > 0) {
+		
+			// Remove the bytes that were sent from the buffer.
+			EchoBufferConsume(&(context->_rcvdBytes), bytesWritten);
+			context->_ready -= bytesWritten;
+			context->_scanned -= bytesWritten;
+		}
+		
+		// The socket is full, so get called back once it drains.
+		else if ((bytesWritten == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			break;
+		
+		// Anything other than an interruption is fatal.
+		else if ((bytesWritten == -1) && (errno != EINTR)) {
+			_EchoContextHandleErrorOccurred(context);
+			return FALSE;
+		}
+	}
+	
+	// Ask for a write callback only while there is something left to send.
+	// A CFSocket's is one shot; the engine's has to be turned off again.
+	if (context->_socket == NULL)
+		_EchoContextUpdateEvents(context);
+	else if (context->_ready > 0)
+		CFSocketEnableCallBacks(context->_socket, kCFSocketWriteCallBack);
+	
+	// Any progress counts as activity.
+	if (context->_ready < ready) {
+		context->_lastWrite = CFAbsoluteTimeGetCurrent();
+		_EchoContextNoteWritten(context, ready - context->_ready, context->_lastWrite);
+		_EchoContextResetTimeOut(context);
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_EchoContextFrame(EchoContext* context) {
+
+	CFIndex length = EchoBufferGetLength(&(context->_rcvdBytes));
+	CFIndex ready = context->_ready;
+	CFIndex frames = 0;
+	
+	// Have the protocol find the end of the complete frames.  The count is
+	// only wanted for the statistics and the rate limits.
+	if (context->_protocol.frame != NULL) {
+		ready = context->_protocol.frame(&(context->_rcvdBytes),
+										 ready,
+										 context->_scanned,
+										 ((context->_shard != NULL) || context->_limited) ? &frames : NULL,
+										 context->_protocol.info);
+	}
+	
+	// Without framing, whatever arrived is ready and counts as one.
+	else if (length > ready) {
+		ready = length;
+		frames = 1;
+	}
+	
+	// Everything in the buffer has now been searched.
+	context->_scanned = length;
+	
+	// The frame still waiting on its end has run past the limit.
+	if (EchoFramingIsOverflowing(length, ready, context->_options.maxLineLength)) {
+	
+		_EchoContextCount(context, kStatisticsOverflows, 1);
+		
+		if (context->_options.overflowPolicy == kEchoContextOverflowClose) {
+			_EchoContextHandleErrorOccurred(context);
+			return FALSE;
+		}
+		
+		// Send it as it stands.
+		ready = length;
+		frames++;
+	}
+	
+	// Nothing new to send.
+	if (ready == context->_ready)
+		return TRUE;
+	
+	// Output that had been idle starts its stall clock now, and when
+	// coalescing, its hold.
+	if (context->_ready == 0) {
+	
+		context->_lastWrite = CFAbsoluteTimeGetCurrent();
+		
+		if (context->_flushTimer != NULL) {
+			context->_holding = TRUE;
+			CFRunLoopTimerSetNextFireDate(context->_flushTimer, context->_lastWrite + context->_options.coalesceDelay);
+		}
+#if defined(ECHOCONTEXT_DISPATCH)
+		else if (context->_flushSource != NULL) {
+			context->_holding = TRUE;
+			dispatch_source_set_timer(context->_flushSource,
+									  _EchoContextGetDispatchTime(context->_lastWrite + context->_options.coalesceDelay),
+									  DISPATCH_TIME_FOREVER,
+									  0);
+		}
+#endif
+	}
+	
+	// Enough has gathered to be worth the write.
+	if (context->_holding && (ready >= context->_options.coalesceBytes))
+		context->_holding = FALSE;
+	
+	// Give the protocol its chance at the new frames before any is written.
+	if (context->_protocol.transform != NULL)
+		_EchoContextTransform(context, context->_ready, ready);
+	
+	// Keep track of the new frames for the statistics, and pay for them.
+	if (context->_shard != NULL)
+		_EchoContextNoteLines(context, frames, ready);
+	
+	if (context->_limited)
+		_EchoContextCharge(context, 0, frames);
+	
+	context->_ready = ready;
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_EchoContextTransform(EchoContext* context, CFIndex from, CFIndex to) {
+
+	struct iovec vectors[2];
+	CFIndex count = EchoBufferGetVectors(&(context->_rcvdBytes), to, vectors);
+	
+	// Skip past the bytes that have already been through.
+	if ((CFIndex)vectors[0].iov_len <= from) {
+		from -= vectors[0].iov_len;
+		vectors[0] = vectors[1];
+		count--;
+	}
+	
+	vectors[0].iov_base = (UInt8*)vectors[0].iov_base + from;
+	vectors[0].iov_len -= from;
+	
+	context->_protocol.transform(vectors, count, context->_protocol.info);
+}
+
+
+/* static */ CFIndex
+_EchoContextFrameLines(const EchoBuffer* buffer, CFIndex ready, CFIndex scanned, CFIndex* frames, void* info) {
+
+	// Only the bytes not yet searched can hold a new linefeed, and only the
+	// last one matters.
+	CFIndex lf = EchoBufferFindLastByte(buffer, scanned, '\n');
+	
+	if (frames != NULL) {
+	
+		CFIndex at = scanned;
+		
+		// Counting means finding the others as well.
+		*frames = 0;
+		while ((lf != kCFNotFound) && (at <= lf)) {
+			at = EchoBufferFindByte(buffer, at, '\n') + 1;
+			(*frames)++;
+		}
+	}
+	
+	// All of the bytes inbetween and including the linefeed are ready to go.
+	return (lf != kCFNotFound) ? (lf + 1) : ready;
+}
+
+
+/* static */ CFIndex
+_EchoContextFrameLengths(const EchoBuffer* buffer, CFIndex ready, CFIndex scanned, CFIndex* frames, void* info) {
+
+	CFIndex length = EchoBufferGetLength(buffer);
+	CFIndex count = 0;
+	
+	// Walk whole frames from the end of the last complete one.
+	while ((length - ready) >= 4) {
+	
+		UInt8 header[4];
+		UInt32 size;
+		
+		EchoBufferCopyBytes(buffer, ready, sizeof(header), header);
+		size = ((UInt32)header[0] << 24) | ((UInt32)header[1] << 16) | ((UInt32)header[2] << 8) | header[3];
+		
+		// Not all here yet.
+		if ((UInt64)(length - ready - sizeof(header)) < size)
+			break;
+		
+		ready += sizeof(header) + size;
+		count++;
+	}
+	
+	if (frames != NULL)
+		*frames = count;
+	
+	return ready;
+}
+
+
+/* static */ void
+_EchoContextStopReading(EchoContext* context) {
+
+	// Leaving the bytes in the kernel lets the socket's window close on the sender.
+	if ((context->_options.ioMode == kEchoContextIOEvent) || (context->_options.ioMode == kEchoContextIODispatch))
+		_EchoContextUpdateEvents(context);
+	
+	else if (context->_socket != NULL) {
+		CFSocketSetSocketFlags(context->_socket, CFSocketGetSocketFlags(context->_socket) & ~kCFSocketAutomaticallyReenableReadCallBack);
+		CFSocketDisableCallBacks(context->_socket, kCFSocketReadCallBack);
+	}
+	else
+		CFReadStreamUnscheduleFromRunLoop(context->_inStream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+}
+
+
+/* static */ void
+_EchoContextStartReading(EchoContext* context) {
+
+	// A socket reports readable again on its own once re-enabled.
+	if ((context->_options.ioMode == kEchoContextIOEvent) || (context->_options.ioMode == kEchoContextIODispatch))
+		_EchoContextUpdateEvents(context);
+	
+	else if (context->_socket != NULL) {
+		CFSocketSetSocketFlags(context->_socket, CFSocketGetSocketFlags(context->_socket) | kCFSocketAutomaticallyReenableReadCallBack);
+		CFSocketEnableCallBacks(context->_socket, kCFSocketReadCallBack);
+	}
+	
+	// A stream that stopped mid-budget already said it had bytes and won't say
+	// so again until read, so pick up where it left off.
+	else {
+		CFReadStreamScheduleWithRunLoop(context->_inStream, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+		if (CFReadStreamHasBytesAvailable(context->_inStream))
+			_EchoContextHandleHasBytesAvailable(context);
+	}
+}
+
+
+/* static */ void
+_EchoContextPauseReading(EchoContext* context) {
+
+	context->_paused = TRUE;
+	_EchoContextCount(context, kStatisticsPauses, 1);
+	
+	// A throttle may have stopped it already.
+	if (!context->_throttled)
+		_EchoContextStopReading(context);
+}
+
+
+/* static */ void
+_EchoContextResumeReading(EchoContext* context) {
+
+	context->_paused = FALSE;
+	
+	// Still throttled, it starts once the throttle lifts.
+	if (!context->_throttled)
+		_EchoContextStartReading(context);
+}
+
+
+/* static */ CFIndex
+_EchoContextGetReadBudget(EchoContext* context) {
+
+	double budget = context->_options.readBudget;
+	
+	if (context->_limited) {
+	
+		CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+		double bytes = RateLimiterBucketGetTokens(&(context->_byteBucket), now);
+		
+		// No more than every limit on bytes allows.
+		if (bytes < budget)
+			budget = bytes;
+		
+		if (context->_client != NULL) {
+			bytes = RateLimiterGetBytes(context->_options.rateLimiter, context->_client, now);
+			if (bytes < budget)
+				budget = bytes;
+		}
+		
+		// Lines can only be paid for once read, so any debt has to go first,
+		// the address's as well as the connection's.
+		if (RateLimiterBucketGetTokens(&(context->_lineBucket), now) < 1.0)
+			budget = 0;
+		
+		else if ((context->_client != NULL) &&
+				 (RateLimiterGetLines(context->_options.rateLimiter, context->_client, now) < 1.0))
+		{
+			budget = 0;
+		}
+	}
+	
+	return (budget > 0) ? (CFIndex)budget : 0;
+}
+
+
+/* static */ void
+_EchoContextCharge(EchoContext* context, CFIndex bytes, CFIndex lines) {
+
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	CFTimeInterval delay, wait;
+	
+	// Whichever limit takes longest to recover decides.
+	delay = RateLimiterBucketTake(&(context->_byteBucket), bytes, now);
+	
+	wait = RateLimiterBucketTake(&(context->_lineBucket), lines, now);
+	if (wait > delay)
+		delay = wait;
+	
+	if (context->_client != NULL) {
+		wait = RateLimiterTake(context->_options.rateLimiter, context->_client, bytes, lines, now);
+		if (wait > delay)
+			delay = wait;
+	}
+	
+	if (delay > 0)
+		_EchoContextThrottle(context, now + delay);
+}
+
+
+/* static */ void
+_EchoContextThrottle(EchoContext* context, CFAbsoluteTime until) {
+
+	// Already held off for at least that long.
+	if (context->_throttled && (until <= context->_throttledUntil))
+		return;
+	
+	context->_throttledUntil = until;
+	
+	if (context->_throttleTimer != NULL)
+		CFRunLoopTimerSetNextFireDate(context->_throttleTimer, until);
+#if defined(ECHOCONTEXT_DISPATCH)
+	else if (context->_throttleSource != NULL)
+		dispatch_source_set_timer(context->_throttleSource, _EchoContextGetDispatchTime(until), DISPATCH_TIME_FOREVER, 0);
+#endif
+	
+	if (!context->_throttled) {
+	
+		context->_throttled = TRUE;
+		_EchoContextCount(context, kStatisticsThrottles, 1);
+		
+		// Deferring the reads leaves the bytes with TCP, so nothing is lost
+		// and the client is slowed down rather than cut off.
+		if (!context->_paused)
+			_EchoContextStopReading(context);
+	}
+}
+
+
+/* static */ void
+_EchoContextLiftThrottle(EchoContext* context) {
+
+	if (!context->_throttled)
+		return;
+	
+	context->_throttled = FALSE;
+	
+	// Still over the low water mark, the writes start it once it drains.
+	if (!context->_paused)
+		_EchoContextStartReading(context);
+}
+
+
+/* static */ CFAbsoluteTime
+_EchoContextGetDeadline(EchoContext* context) {
+
+	CFAbsoluteTime deadline;
+	
+	// Until the client says something, it only gets the first byte allowance.
+	if (context->_lastRead == 0)
+		deadline = context->_opened + context->_options.firstByteTimeOut;
+	
+	// After that, traffic either way keeps it alive.
+	else {
+		CFAbsoluteTime last = (context->_lastRead > context->_lastWrite) ? context->_lastRead : context->_lastWrite;
+		deadline = last + context->_options.idleTimeOut;
+	}
+	
+	// Echoes the client isn't reading have a clock of their own.
+	if ((context->_ready > 0) && ((context->_lastWrite + context->_options.writeStallTimeOut) < deadline))
+		deadline = context->_lastWrite + context->_options.writeStallTimeOut;
+	
+	return deadline;
+}
+
+
+/* static */ void
+_EchoContextCount(EchoContext* context, StatisticsCounter counter, UInt64 amount) {
+
+	if (context->_shard != NULL)
+		StatisticsAdd(context->_shard, counter, amount);
+}
+
+
+/* static */ void
+_EchoContextNoteLines(EchoContext* context, CFIndex lines, CFIndex ready) {
+
+	// Add them as a batch that is done once its last byte is written.
+	if (context->_batchCount < kMaxLineBatches) {
+	
+		EchoContextLineBatch* batch = &(context->_batches[context->_batchCount++]);
+		
+		batch->_end = context->_written + ready;
+		batch->_received = context->_lastRead;
+		batch->_lines = lines;
+	}
+	
+	// If output is that far behind, fold them into the newest batch.  Their
+	// latency is then measured from a little earlier than it should be.
+	else {
+	
+		EchoContextLineBatch* batch = &(context->_batches[kMaxLineBatches - 1]);
+		
+		batch->_end = context->_written + ready;
+		batch->_lines += lines;
+	}
+}
+
+
+/* static */ void
+_EchoContextNoteWritten(EchoContext* context, CFIndex length, CFAbsoluteTime now) {
+
+	CFIndex done = 0;
+	
+	context->_written += length;
+	
+	if (context->_shard == NULL)
+		return;
+	
+	_EchoContextCount(context, kStatisticsBytesOut, length);
+	
+	// Every batch whose last byte went out is echoed.
+	while ((done < context->_batchCount) && (context->_batches[done]._end <= context->_written)) {
+	
+		EchoContextLineBatch* batch = &(context->_batches[done++]);
+		
+		StatisticsAdd(context->_shard, kStatisticsLines, batch->_lines);
+		StatisticsRecordLatency(context->_shard, now - batch->_received, batch->_lines);
+	}
+	
+	// Drop them from the front.
+	if (done > 0) {
+		context->_batchCount -= done;
+		memmove(&(context->_batches[0]), &(context->_batches[done]), context->_batchCount * sizeof(context->_batches[0]));
+	}
+}
+
+
+/* static */ Boolean
+_EchoContextReserve(EchoContext* context) {
+
+	CFIndex capacity = EchoBufferGetCapacity(&(context->_rcvdBytes));
+	CFIndex needed = EchoBufferGetLength(&(context->_rcvdBytes)) + context->_options.readSize;
+	
+	// Already room, which is the usual case.
+	if (needed <= capacity)
+		return TRUE;
+	
+	// Growing takes new storage, copies the bytes over and frees the old.
+	ECHOTRACE_GROW_START(context, needed);
+	
+	if (!EchoBufferReserve(&(context->_rcvdBytes), context->_options.readSize)) {
+		ECHOTRACE_GROW_DONE(context, -1);
+		return FALSE;
+	}
+	
+	ECHOTRACE_GROW_DONE(context, EchoBufferGetCapacity(&(context->_rcvdBytes)));
+	
+	// Count both sides of it.
+	_EchoContextCount(context, kStatisticsMemoryAllocated, EchoBufferGetCapacity(&(context->_rcvdBytes)));
+	_EchoContextCount(context, kStatisticsMemoryFreed, capacity);
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_EchoContextTrim(EchoContext* context) {
+
+	// Storage is only held while there are bytes to echo.  It goes back to
+	// the allocator, usually a pool shared by every connection, so the next
+	// read anywhere can reuse it.
+	CFIndex freed = EchoBufferTrim(&(context->_rcvdBytes));
+	
+	if (freed > 0)
+		_EchoContextCount(context, kStatisticsMemoryFreed, freed);
+}
+
+
+/* static */ void
+_EchoContextResetTimeOut(EchoContext* context) {
+
+	CFAbsoluteTime deadline = _EchoContextGetDeadline(context);
+	
+	// A private timer has to be moved; a wheel entry just notes the time.
+	if (context->_timer != NULL)
+		CFRunLoopTimerSetNextFireDate(context->_timer, deadline);
+#if defined(ECHOCONTEXT_DISPATCH)
+	// A dispatch timer is treated like a wheel entry, only moved earlier; it
+	// looks at the deadline again when it fires.
+	else if (context->_timeOutSource != NULL) {
+		if (deadline < context->_armed)
+			_EchoContextArmTimeOut(context, deadline);
+	}
+#endif
+	else
+		TimerWheelEntrySetDeadline(&(context->_timeout), deadline);
+}
+
+
+#if defined(ECHOCONTEXT_DISPATCH)
+
+/* static */ void
+_EchoContextArmTimeOut(EchoContext* context, CFAbsoluteTime deadline) {
+
+	context->_armed = deadline;
+	dispatch_source_set_timer(context->_timeOutSource,
+							  _EchoContextGetDispatchTime(deadline),
+							  DISPATCH_TIME_FOREVER,
+							  (uint64_t)(kTimeOutLeeway * NSEC_PER_SEC));
+}
+
+
+/* static */ dispatch_time_t
+_EchoContextGetDispatchTime(CFAbsoluteTime time) {
+
+	// Dispatch counts from now, in nanoseconds.
+	CFTimeInterval delta = time - CFAbsoluteTimeGetCurrent();
+	
+	return dispatch_time(DISPATCH_TIME_NOW, (delta > 0) ? (int64_t)(delta * NSEC_PER_SEC) : 0);
+}
+
+
+/* static */ dispatch_source_t
+_EchoContextCreateTimerSource(EchoContext* context, dispatch_function_t handler) {
+
+	dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, context->_queue);
+	
+	if (source == NULL)
+		return NULL;
+	
+	// Held until it has cancelled, and idle until it's set.
+	dispatch_set_context(source, EchoContextRetain((EchoContextRef)context));
+	dispatch_source_set_event_handler_f(source, handler);
+	dispatch_source_set_cancel_handler_f(source, (dispatch_function_t)&_TimerCancelCallBack);
+	dispatch_source_set_timer(source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+	
+	return source;
+}
+
+
+/* static */ void
+_EchoContextEnterQueue(EchoContext* context) {
+
+	// The queue hops between threads, so count on whichever this is.
+	if (context->_options.statistics != NULL)
+		context->_shard = StatisticsGetShard(context->_options.statistics);
+}
+
+#endif
+
+
+/* static */ void
+_EchoContextHandleHasBytesAvailable(EchoContext* context) {
+
+	CFIndex total, budget = _EchoContextGetReadBudget(context);
+	
+	// Out of allowance, so wait for it to refill rather than read.
+	if (budget == 0) {
+		_EchoContextCharge(context, 0, 0);
+		return;
+	}
+	
+	// Pull in as much as the path allows.  Negative means the context went away.
+	ECHOTRACE_READ_START(context);
+	total = (context->_inStream == NULL) ? _EchoContextReadSocket(context, budget) : _EchoContextReadStream(context, budget);
+	ECHOTRACE_READ_DONE(context, total);
+	
+	if (total < 0)
+		return;
+	
+	// If any data arrived, process it.
+	if (total > 0) {
+		
+		// Reset the timeout.
+		context->_lastRead = CFAbsoluteTimeGetCurrent();
+		_EchoContextResetTimeOut(context);
+		
+		_EchoContextCount(context, kStatisticsBytesIn, total);
+		
+		// Pay for what was read; going past a limit holds off the next read.
+		if (context->_limited)
+			_EchoContextCharge(context, total, 0);
+		
+		// Stop taking input while too much is buffered.
+		if (EchoBufferGetLength(&(context->_rcvdBytes)) >= context->_options.highWaterMark)
+			_EchoContextPauseReading(context);
+		
+		// Frame now so an overlong line is caught even while output is blocked.
+		if (!_EchoContextFrame(context))
+			return;
+		
+		// If the output can write, try sending the bytes.  A socket is simply
+		// tried; a short write asks for a callback.
+		if ((context->_inStream == NULL) || CFWriteStreamCanAcceptBytes(context->_outStream))
+			_EchoContextHandleCanAcceptBytes(context);
+	}
+	
+	// A wakeup with nothing to read leaves the storage taken for it unused.
+	else
+		_EchoContextTrim(context);
+}
+
+
+/* static */ void
+_EchoContextHandleEndEncountered(EchoContext* context) {
+
+	// End was hit, so destroy the context.
+    EchoContextClose((EchoContextRef)context);
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_EchoContextHandleCanAcceptBytes(EchoContext* context) {
+	
+	/*
+	** Echo looks for the last '/n' in the data.  If one is found, all bytes up to and
+	** including that linefeed, which covers every complete line received so far, are
+	** sent back to the client.  The write of this buffer may not send all of the data,
+	** so the bytes that are successfully sent are removed from the buffer.  Writing
+	** continues for as long as the output will accept bytes.  When told that it can
+	** accept bytes again, the whole process will fire again.
+	**
+	** The receive buffer is a ring, so removing sent bytes only moves its head.  The
+	** data may wrap around the end of the storage.  Streams send the piece up to the
+	** end first and the rest follows; sockets hand both pieces to a single writev.
+	**
+	** Bytes that have already been searched are remembered, so a long line arriving in
+	** many reads is only ever scanned once.
+	**
+	** Once writing has drained the buffer to the low water mark, reading picks up
+	** again if it had been paused.
+	**
+	** When coalescing, output that becomes ready is held until enough has gathered
+	** or the flush timer ends the hold.
+	*/
+	
+	// Frame any bytes not yet searched.
+	if (!_EchoContextFrame(context))
+		return;
+	
+	// If there was a linefeed, take care of sending the data.
+	if ((context->_ready > 0) && !context->_holding) {
+		
+		CFIndex ready = context->_ready;
+		Boolean alive;
+		
+		ECHOTRACE_WRITE_START(context, ready);
+		alive = (context->_inStream == NULL) ? _EchoContextWriteSocket(context) : _EchoContextWriteStream(context);
+		ECHOTRACE_WRITE_DONE(context, alive ? (ready - context->_ready) : -1);
+		
+		if (!alive)
+			return;
+	}
+	
+	// Everything echoed, so the connection holds no storage while idle.
+	_EchoContextTrim(context);
+	
+	// Enough has gone out to take more in.
+	if (context->_paused && (EchoBufferGetLength(&(context->_rcvdBytes)) <= context->_options.lowWaterMark))
+		_EchoContextResumeReading(context);
+}
+
+
+/* static */ void
+_EchoContextHandleErrorOccurred(EchoContext* context) {
+
+	// Hit an error, so close the i/o and destroy the context.  Closing first
+	// drops the references held by the stream clients, socket and timer.
+	_EchoContextCount(context, kStatisticsErrors, 1);
+    EchoContextClose((EchoContextRef)context);
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_EchoContextHandleTimeOut(EchoContext* context) {
+
+	// Haven't heard from the client so kill everything.
+	ECHOTRACE_TIMEOUT(context, EchoBufferGetLength(&(context->_rcvdBytes)));
+	_EchoContextCount(context, kStatisticsTimeOuts, 1);
+    EchoContextClose((EchoContextRef)context);
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_EchoContextHandleSweep(EchoContext* context) {
+
+	// The server is going away, or draining, so destroy the context.
+    EchoContextClose((EchoContextRef)context);
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_ReadStreamCallBack(CFReadStreamRef inStream, CFStreamEventType type, EchoContext* context) {
+
+	assert(inStream == context->_inStream);
+	
+	// Dispatch the event properly.
+    switch (type) {
+        case kCFStreamEventHasBytesAvailable:
+            _EchoContextHandleHasBytesAvailable(context);
+            break;
+			
+        case kCFStreamEventEndEncountered:
+			_EchoContextHandleEndEncountered(context);
+            break;
+       
+        case kCFStreamEventErrorOccurred:
+			_EchoContextHandleErrorOccurred(context);
+			break;
+            
+        default:
+            break;
+    }
+}
+
+
+/* static */ void
+_WriteStreamCallBack(CFWriteStreamRef outStream, CFStreamEventType type, EchoContext* context) {
+
+	assert(outStream == context->_outStream);
+
+	// Dispatch the event properly.
+    switch (type) {
+		case kCFStreamEventCanAcceptBytes:
+			_EchoContextHandleCanAcceptBytes(context);
+			break;
+			
+        case kCFStreamEventErrorOccurred:
+			_EchoContextHandleErrorOccurred(context);
+			break;
+            
+        default:
+            break;
+    }
+}
+
+
+/* static */ void
+_SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void* data, EchoContext* context) {
+
+	assert(sock == context->_socket);
+
+	// Dispatch the event properly.
+	switch (type) {
+		case kCFSocketReadCallBack:
+			_EchoContextHandleHasBytesAvailable(context);
+			break;
+			
+		case kCFSocketWriteCallBack:
+			_EchoContextHandleCanAcceptBytes(context);
+			break;
+			
+		default:
+			break;
+	}
+}
+
+
+/* static */ void
+_EventCallBack(EventEngineWatch* watch, CFOptionFlags events, EchoContext* context) {
+
+	assert(watch == &(context->_watch));
+	
+	// Dispatch the event properly.  Reading may tear the context down, and
+	// writes any echoes itself, so a write that came with it waits for the
+	// next time around; the engine is level triggered.
+	if (events & kEventEngineReadEvent)
+		_EchoContextHandleHasBytesAvailable(context);
+	
+	else if (events & kEventEngineWriteEvent)
+		_EchoContextHandleCanAcceptBytes(context);
+}
+
+
+/* static */ void
+_FlushTimerCallBack(CFRunLoopTimerRef timer, EchoContext* context) {
+
+	assert(timer == context->_flushTimer);
+	
+	// Back to idle until the next hold.
+	CFRunLoopTimerSetNextFireDate(timer, kFlushTimerIdle);
+	
+	if (!context->_holding)
+		return;
+	
+	// Time's up; send whatever gathered, if there's room for it.
+	context->_holding = FALSE;
+	
+	if ((context->_outStream == NULL) || CFWriteStreamCanAcceptBytes(context->_outStream))
+		_EchoContextHandleCanAcceptBytes(context);
+}
+
+
+/* static */ void
+_ThrottleTimerCallBack(CFRunLoopTimerRef timer, EchoContext* context) {
+
+	assert(timer == context->_throttleTimer);
+	
+	// Back to idle until the next throttle.
+	CFRunLoopTimerSetNextFireDate(timer, kFlushTimerIdle);
+	
+	_EchoContextLiftThrottle(context);
+}
+
+
+/* static */ void
+_TimerCallBack(CFRunLoopTimerRef timer, EchoContext* context) {
+
+	assert(timer == context->_timer);
+
+	// Dispatch the timer event.
+	_EchoContextHandleTimeOut(context);
+}
+
+
+/* static */ void
+_TimerWheelCallBack(TimerWheelEntry* entry, EchoContext* context) {
+
+	assert(entry == &(context->_timeout));
+
+	// Dispatch the timer event.
+	_EchoContextHandleTimeOut(context);
+}
+
+
+/* static */ void
+_RegistryCloseCallBack(ConnectionRegistryEntry* entry, EchoContext* context) {
+
+	assert(entry == &(context->_entry));
+
+	// Dispatch the sweep.
+	_EchoContextHandleSweep(context);
+}
+
+
+/* static */ Boolean
+_RegistryIsIdleCallBack(ConnectionRegistryEntry* entry, EchoContext* context) {
+
+	assert(entry == &(context->_entry));
+
+	// Nothing received that would be lost.
+	return (EchoBufferGetLength(&(context->_rcvdBytes)) == 0);
+}
+
+
+#if defined(ECHOCONTEXT_DISPATCH)
+
+/* static */ void
+_ReadSourceCallBack(EchoContext* context) {
+
+	_EchoContextEnterQueue(context);
+	_EchoContextHandleHasBytesAvailable(context);
+}
+
+
+/* static */ void
+_WriteSourceCallBack(EchoContext* context) {
+
+	_EchoContextEnterQueue(context);
+	_EchoContextHandleCanAcceptBytes(context);
+}
+
+
+/* static */ void
+_TimeOutSourceCallBack(EchoContext* context) {
+
+	CFAbsoluteTime deadline = _EchoContextGetDeadline(context);
+	
+	_EchoContextEnterQueue(context);
+	
+	// Activity since it was set only pushed the deadline out; go back to sleep.
+	if (deadline > CFAbsoluteTimeGetCurrent()) {
+		_EchoContextArmTimeOut(context, deadline);
+		return;
+	}
+	
+	// Dispatch the timer event.
+	_EchoContextHandleTimeOut(context);
+}
+
+
+/* static */ void
+_FlushSourceCallBack(EchoContext* context) {
+
+	// Back to idle until the next hold.
+	dispatch_source_set_timer(context->_flushSource, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+	
+	if (!context->_holding)
+		return;
+	
+	// Time's up; send whatever gathered.
+	_EchoContextEnterQueue(context);
+	context->_holding = FALSE;
+	_EchoContextHandleCanAcceptBytes(context);
+}
+
+
+/* static */ void
+_ThrottleSourceCallBack(EchoContext* context) {
+
+	// Back to idle until the next throttle.
+	dispatch_source_set_timer(context->_throttleSource, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+	
+	_EchoContextEnterQueue(context);
+	_EchoContextLiftThrottle(context);
+}
+
+
+/* static */ void
+_StartCallBack(EchoContext* context) {
+
+	_EchoContextEnterQueue(context);
+	
+	// Only listed now, so sweeps come in on the queue after this.  One it
+	// can't be listed for goes, since nothing could drain it.
+	if ((context->_timeOutSource != NULL) && (context->_options.registry != NULL) &&
+		!ConnectionRegistryAdd(context->_options.registry, &(context->_entry)))
+	{
+		_EchoContextHandleSweep(context);
+	}
+	
+	// Unless it closed before it got going, start the timers and then
+	// resume the read source, which is what lets the callbacks start.
+	if (context->_timeOutSource != NULL) {
+	
+		context->_started = TRUE;
+		
+		_EchoContextArmTimeOut(context, _EchoContextGetDeadline(context));
+		dispatch_resume(context->_timeOutSource);
+		
+		if (context->_flushSource != NULL)
+			dispatch_resume(context->_flushSource);
+		
+		if (context->_throttleSource != NULL)
+			dispatch_resume(context->_throttleSource);
+		
+		_EchoContextUpdateEvents(context);
+	}
+	
+	// Let go of the retain taken to get here.
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_CloseCallBack(EchoContext* context) {
+
+	// Now on the connection's queue.
+	EchoContextClose((EchoContextRef)context);
+}
+
+
+/* static */ void
+_SweepCallBack(EchoContext* context) {
+
+	// Unless it has closed since, or was already swept.
+	if (context->_entry._registry != NULL)
+		_EchoContextHandleSweep(context);
+	
+	// Let go of the retain taken to get here.
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_IdleSweepCallBack(EchoContext* context) {
+
+	// Only here can the buffer be looked at.
+	if ((context->_entry._registry != NULL) && _RegistryIsIdleCallBack(&(context->_entry), context))
+		_EchoContextHandleSweep(context);
+	
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_RegistryQueueCloseCallBack(ConnectionRegistryEntry* entry, EchoContext* context) {
+
+	assert(entry == &(context->_entry));
+	
+	// Still listed, so still here to retain.  It closes on its own queue,
+	// since the registry is locked until this returns.
+	dispatch_async_f(context->_queue, EchoContextRetain((EchoContextRef)context), (dispatch_function_t)&_SweepCallBack);
+}
+
+
+/* static */ Boolean
+_RegistryQueueIsIdleCallBack(ConnectionRegistryEntry* entry, EchoContext* context) {
+
+	assert(entry == &(context->_entry));
+	
+	// The queue looks for itself, and closes it if idle.
+	dispatch_async_f(context->_queue, EchoContextRetain((EchoContextRef)context), (dispatch_function_t)&_IdleSweepCallBack);
+	
+	return FALSE;
+}
+
+
+/* static */ void
+_TimerCancelCallBack(EchoContext* context) {
+
+	// The timer held the context until now.
+	EchoContextRelease((EchoContextRef)context);
+}
+
+
+/* static */ void
+_SourceCancelCallBack(EchoContextDispatchClose* closer) {
+
+	EchoContextRef context = (EchoContextRef)closer->_context;
+	
+	// Both sources cancel on the same serial queue, so counting needs no lock.
+	if (--closer->_sources == 0) {
+		close(closer->_nativeSocket);
+		CFAllocatorDeallocate(kCFAllocatorDefault, closer);
+	}
+	
+	// Each source held the context until it was done.
+	EchoContextRelease(context);
+}
+
+#endif
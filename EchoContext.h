@@ -4,6 +4,14 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 
+#include "EchoBuffer.h"
+#include "TimerWheel.h"
+#include "EventEngine.h"
+#include "Statistics.h"
+#include "ConnectionRegistry.h"
+#include "RateLimiter.h"
+#include "TrafficCapture.h"
+
 
 #if defined(__cplusplus)
 extern "C" {
@@ -13,7 +21,259 @@ extern "C" {
 typedef struct __EchoContext* EchoContextRef;
 
 
-EchoContextRef EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket);
+/*
+** EchoContextIOMode
+**
+** How a connection moves its bytes.
+**
+** kEchoContextIOStream		CFReadStream/CFWriteStream pair.  Portable and
+**							the default.
+**
+** kEchoContextIOSocket		readv/writev on the native socket, watched by a
+**							CFSocket.  Bytes go from the kernel into the
+**							receive buffer and back out of it with no
+**							intermediate copies.
+**
+** kEchoContextIOEvent		The same reads and writes, but watched by the
+**							thread's EventEngine (kqueue, or epoll on
+**							Linux) rather than a CFSocket each.  Beyond
+**							its descriptor, a connection is only the
+**							context and an entry in the kernel's queue.
+**							Opening fails where neither exists.
+**
+** kEchoContextIODispatch	The same reads and writes, watched by dispatch
+**							sources on a serial queue of the connection's
+**							own.  The queues target a global concurrent
+**							queue, so connections spread over every core
+**							with no thread of their own.  Timeouts are
+**							dispatch timers rather than a wheel, and the
+**							context may be closed from any thread.
+**							Opening fails where dispatch doesn't exist.
+*/
+typedef enum {
+	kEchoContextIOStream = 0,
+	kEchoContextIOSocket = 1,
+	kEchoContextIOEvent = 2,
+	kEchoContextIODispatch = 3
+} EchoContextIOMode;
+
+
+/*
+** EchoContextProtocol
+**
+** How the stream is cut into frames.  Bytes are held until the frame they
+** belong to is complete and then echoed.  The structure is copied when
+** the context is created; info is retained and released with the given
+** functions, if any, and used from the connection's thread.
+**
+** version		Must be 0.
+**
+** frame		Finds where the complete frames end.  Called after every
+**				read with ready, the offset just past the frames found
+**				so far, and scanned, how much of the buffer the last call
+**				saw, both relative to the head.  Returns the new ready
+**				offset, at least ready.  If frames is not NULL, sets it to
+**				the number of frames completed by this call.  NULL echoes
+**				bytes as soon as they arrive, with no scan at all.
+**
+** transform	Called with newly completed frames, as gather vectors over
+**				the receive buffer, before they are first written.  It may
+**				rewrite the bytes in place but not change their number.
+**				NULL echoes them as they came.
+*/
+typedef struct {
+	CFIndex		version;
+	void*		info;
+	const void*	(*retain)(const void* info);
+	void		(*release)(const void* info);
+	CFStringRef	(*copyDescription)(const void* info);
+	CFIndex		(*frame)(const EchoBuffer* buffer, CFIndex ready, CFIndex scanned, CFIndex* frames, void* info);
+	void		(*transform)(struct iovec* vectors, CFIndex count, void* info);
+} EchoContextProtocol;
+
+
+/*
+** Protocols provided.
+**
+** kEchoContextLineProtocol		Lines ending in a linefeed, CRLF included,
+**								found with a backwards scan of only the new
+**								bytes.  The default.
+**
+** kEchoContextRawProtocol		No framing; every byte is echoed as soon as
+**								it arrives.  The fastest path.
+**
+** kEchoContextLengthProtocol	Binary frames, each a 32 bit big-endian
+**								length followed by that many bytes, echoed
+**								header and all.
+*/
+extern const EchoContextProtocol kEchoContextLineProtocol;
+extern const EchoContextProtocol kEchoContextRawProtocol;
+extern const EchoContextProtocol kEchoContextLengthProtocol;
+
+
+/*
+** EchoContextOverflowPolicy
+**
+** What to do with a line that grows past maxLineLength before its
+** linefeed arrives, or any frame before it is complete.
+**
+** kEchoContextOverflowClose	Drop the connection.  The default.
+**
+** kEchoContextOverflowEcho		Echo what has arrived as though it were a
+**								line and start over with the bytes that
+**								follow.  Only sensible with lines, since
+**								binary framing can't find its place again.
+*/
+typedef enum {
+	kEchoContextOverflowClose = 0,
+	kEchoContextOverflowEcho = 1
+} EchoContextOverflowPolicy;
+
+
+/*
+** EchoContextOptions
+**
+** Tuning for a connection.  Any field left at zero takes its default.
+**
+** readSize		Largest single read from the socket.  Bytes are read
+**				straight into the receive buffer's free space.
+**
+** readBudget	Most bytes read in one readable event before returning
+**				to the run loop, so one busy client can't starve the
+**				others.
+**
+** ioMode		Which i/o path to use.
+**
+** timerWheel	Wheel to keep the connection's timeout on, usually the
+**				one from ServerGetTimerWheel.  Activity then only
+**				records a new deadline.  NULL gives the connection a
+**				run loop timer of its own.  Ignored with
+**				kEchoContextIODispatch.
+**
+** idleTimeOut	Seconds without traffic in either direction before the
+**				connection is dropped.  Defaults to 60.  Any traffic
+**				starts it over, so busy sessions can last indefinitely.
+**
+** firstByteTimeOut
+**				Seconds the client has to send its first byte after
+**				the connection opens.  Defaults to idleTimeOut.  A
+**				short value reclaims connections that never speak.
+**
+** writeStallTimeOut
+**				Seconds echoed bytes may sit unsent without the client
+**				reading any of them.  Defaults to idleTimeOut.
+**
+** highWaterMark
+**				Buffered bytes at which the connection stops reading,
+**				so TCP flow control pushes back on a client that sends
+**				faster than it reads its echoes.  Defaults to 1MB.
+**
+** lowWaterMark	Buffered bytes at or below which reading starts again.
+**				Defaults to half of highWaterMark.
+**
+** maxLineLength
+**				Longest line, or frame, held while waiting for its end.
+**				It has to be less than highWaterMark, because reading
+**				stops there; one less, the default, is the most allowed.
+**
+** overflowPolicy
+**				What happens to a line longer than maxLineLength.
+**
+** statistics	Where to count the connection's traffic, usually the
+**				server's from ServerGetStatistics.  NULL counts nothing
+**				and skips the per-line bookkeeping entirely.
+**
+** protocol		How to frame the stream.  NULL means lines.
+**
+** noDelay		Set TCP_NODELAY on the connection, so small echoes go out
+**				right away instead of waiting, by Nagle's algorithm, for
+**				the previous segment to be acknowledged.  For clients that
+**				care about latency.
+**
+** coalesceDelay
+**				Seconds to hold output once something is ready to echo,
+**				so that more can gather and go out in one write.  For
+**				clients that care about throughput.  Zero, the default,
+**				writes as soon as anything is ready.
+**
+** coalesceBytes
+**				Bytes ready to echo that end the hold early.  Defaults
+**				to readSize.
+**
+** registry		Where to list the connection while it is open, usually
+**				the one from ServerGetRegistry, so the server can count
+**				it and close it in a sweep.  It is idle to a sweep when
+**				nothing received is waiting to be echoed.  NULL lists
+**				it nowhere.  Ignored with kEchoContextIODispatch, since
+**				a registry belongs to one thread.
+**
+** byteRate		Bytes a second the connection may read, on average.
+**				Past that, reading is deferred until the allowance
+**				refills, so TCP pushes back on the client and nothing
+**				is dropped.  Zero means no limit.
+**
+** byteBurst	Bytes it may read at once after a quiet spell.  Zero,
+**				the default, allows one second's worth.
+**
+** lineRate		Lines, or frames, a second, held to the same way.
+**
+** lineBurst	Lines that may arrive at once after a quiet spell.
+**
+** rateLimiter	Limits shared with every other connection from the same
+**				address, as well as the connection's own.  NULL shares
+**				none.
+**
+** recorder		Capture to log the connection's traffic to, for a
+**				replay later.  Each read is recorded as it returned.
+**				NULL captures nothing.
+*/
+typedef struct {
+	CFIndex				readSize;
+	CFIndex				readBudget;
+	EchoContextIOMode	ioMode;
+	TimerWheelRef		timerWheel;
+	CFTimeInterval		idleTimeOut;
+	CFTimeInterval		firstByteTimeOut;
+	CFTimeInterval		writeStallTimeOut;
+	CFIndex				highWaterMark;
+	CFIndex				lowWaterMark;
+	CFIndex				maxLineLength;
+	EchoContextOverflowPolicy overflowPolicy;
+	StatisticsRef		statistics;
+	const EchoContextProtocol* protocol;
+	Boolean				noDelay;
+	CFTimeInterval		coalesceDelay;
+	CFIndex				coalesceBytes;
+	ConnectionRegistryRef registry;
+	double				byteRate;
+	CFIndex				byteBurst;
+	double				lineRate;
+	CFIndex				lineBurst;
+	RateLimiterRef		rateLimiter;
+	TrafficRecorderRef	recorder;
+} EchoContextOptions;
+
+
+/*
+** EchoContextCreate
+**
+** Create a new echo connection for an accepted socket.  The context
+** takes ownership of the socket.
+**
+** alloc		Allocator to use for allocating.  NULL indicates
+**				the default allocator.  Receive storage comes from it
+**				as well, and is only held while bytes wait to be
+**				echoed, so with a pool shared by every connection an
+**				idle one costs just the context.  What is held is
+**				counted on the statistics as MemoryAllocated and
+**				MemoryFreed.
+**
+** nativeSocket	Connected socket to echo on.
+**
+** options		Tuning for the connection, copied into the context.
+**				NULL indicates the defaults.
+*/
+EchoContextRef EchoContextCreate(CFAllocatorRef alloc, CFSocketNativeHandle nativeSocket, const EchoContextOptions* options);
 
 EchoContextRef EchoContextRetain(EchoContextRef context);
 void EchoContextRelease(EchoContextRef context);
@@ -0,0 +1,47 @@
+#ifndef __ECHOFRAMING__
+#define __ECHOFRAMING__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+** EchoFramingGetMaxLength
+**
+** Returns the longest unfinished frame a connection may hold before it
+** counts as an overflow.  That is maxLength, unless it is zero or doesn't
+** leave room under the high water mark, in which case it is one byte
+** short of the mark: reading pauses once the mark is buffered, so a frame
+** has to be found too long before then or the connection would stall.
+**
+** maxLength		Longest frame asked for, or zero for no limit of its own.
+**
+** highWaterMark	Bytes buffered at which reading pauses.
+*/
+CFIndex EchoFramingGetMaxLength(CFIndex maxLength, CFIndex highWaterMark);
+
+
+/*
+** EchoFramingIsOverflowing
+**
+** Returns TRUE if the frame still waiting on its end, whatever is
+** buffered past the bytes ready to send, has run past maxLength.
+**
+** length		Bytes buffered.
+**
+** ready		Bytes of them in complete frames.
+**
+** maxLength	As returned by EchoFramingGetMaxLength.
+*/
+Boolean EchoFramingIsOverflowing(CFIndex length, CFIndex ready, CFIndex maxLength);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __ECHOFRAMING__ */
@@ -0,0 +1,836 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  EchoReplay.c
+ *
+ *	Plays a capture written by the server's TrafficRecorder back against a
+ *	server, any build of it, so a change can be measured on real traffic.
+ *	Connections open and close where they did, and each recorded read is
+ *	sent as one write, either at its recorded time or, with -f, as fast as
+ *	the server takes them.  Captures without payloads are replayed with
+ *	lines of lowercase letters of the recorded sizes.  Each segment is
+ *	timed from when it was due until the server has echoed through its
+ *	last byte, and the summary goes to stdout as "name value" lines, the
+ *	same as EchoBench's.
+ */
+
+#pragma mark Includes
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "Statistics.h"
+#include "TrafficCapture.h"
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kReadSize			(64 * 1024)
+#define kMaxQueued			(16 * 1024 * 1024)	// Bytes sent and not yet echoed, across all connections
+#define kBatchRecords		64			// Records sent per pass when replaying fast
+#define kFinishTimeOut		10			// Seconds to wait for the last echoes
+#define kBlockedInterval	0.01		// Seconds between checks while held back
+
+static const CFAbsoluteTime kTimerIdle = 1.0e12;
+
+// A server that goes away must show up as EPIPE, not kill the client.
+#if defined(MSG_NOSIGNAL)
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+	const char*			host;			// Server to connect to
+	const char*			port;			// Its port
+	const char*			path;			// Capture to replay
+	Boolean				fast;			// Ignore the recorded timing
+} ReplayOptions;
+
+typedef struct Replay Replay;
+
+typedef struct {
+	UInt64				end;			// Stream offset just past its last byte
+	CFAbsoluteTime		due;			// When it was to be sent
+} ReplaySegment;
+
+typedef struct {
+	Replay*				_replay;		// Run the connection belongs to
+	CFSocketRef			_socket;		// Connection to the server, NULL once closed
+	
+	UInt8*				_pending;		// Bytes queued, from _pendingStart to _pendingEnd
+	CFIndex				_pendingStart;	// First byte not yet written
+	CFIndex				_pendingEnd;	// Just past the last byte queued
+	CFIndex				_pendingCapacity;	// Size of _pending
+	
+	ReplaySegment*		_segments;		// Segments not yet echoed, from _firstSegment on
+	CFIndex				_firstSegment;	// Index of the oldest
+	CFIndex				_segmentCount;	// Number not yet echoed
+	CFIndex				_segmentCapacity;	// Size of _segments
+	
+	UInt64				_sent;			// Bytes queued so far
+	UInt64				_echoed;		// Bytes echoed so far
+	Boolean				_closing;		// The capture closed it, so shut down once written
+	Boolean				_shutdown;		// Nothing more will be written
+} ReplayConnection;
+
+struct Replay {
+	ReplayOptions		_options;		// What to run
+	StatisticsShardRef	_shard;			// Where to count it
+	TrafficReaderRef	_reader;		// Capture being replayed
+	CFRunLoopTimerRef	_timer;			// Fires when the next record is due
+	
+	struct sockaddr_storage _address;	// Where to connect
+	socklen_t			_addressLength;	// Length of _address
+	
+	CFAbsoluteTime		_captureStart;	// When the capture started
+	CFAbsoluteTime		_start;			// When the replay started
+	CFAbsoluteTime		_end;			// When the capture ran out
+	
+	TrafficCaptureRecord _record;		// Next record, if _hasRecord
+	Boolean				_hasRecord;		// A record has been read but not yet sent
+	CFAbsoluteTime		_due;			// When it's to be sent
+	
+	ReplayConnection**	_connections;	// Every connection, by its number in the capture
+	CFIndex				_connectionCapacity;	// Size of _connections
+	CFIndex				_alive;			// Connections still open
+	
+	UInt64				_records;		// Records replayed
+	UInt64				_queued;		// Bytes sent and not yet echoed
+	Boolean				_finished;		// The capture has run out
+	Boolean				_timedOut;		// And the echoes didn't all come back
+};
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static Boolean ReplayParseOptions(int argc, char* const argv[], ReplayOptions* options);
+static Boolean ReplayCopyAddress(const ReplayOptions* options, struct sockaddr_storage* address, socklen_t* length);
+static void ReplayAdvance(Replay* replay);
+static void ReplayApply(Replay* replay, const TrafficCaptureRecord* record, CFAbsoluteTime due);
+static void ReplayFinish(Replay* replay);
+static ReplayConnection* ReplayGetConnection(Replay* replay, UInt64 number);
+static ReplayConnection* ReplayOpenConnection(Replay* replay, UInt64 number);
+static void ReplayCloseConnection(ReplayConnection* connection, Boolean failed);
+static Boolean ReplayQueueSegment(ReplayConnection* connection, const TrafficCaptureRecord* record, CFAbsoluteTime due);
+static void ReplayHandleRead(ReplayConnection* connection);
+static void ReplayHandleWrite(ReplayConnection* connection);
+static void ReplayReport(Replay* replay, StatisticsRef stats, CFTimeInterval elapsed);
+static SInt64 ReplayGetNumber(CFDictionaryRef dict, CFStringRef key);
+
+static void SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, ReplayConnection* connection);
+static void TimerCallBack(CFRunLoopTimerRef timer, Replay* replay);
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ Boolean
+ReplayParseOptions(int argc, char* const argv[], ReplayOptions* options) {
+
+	int ch;
+	
+	options->host = "localhost";
+	options->port = NULL;
+	options->path = NULL;
+	options->fast = FALSE;
+	
+	while ((ch = getopt(argc, argv, "fh:p:")) != -1) {
+	
+		switch (ch) {
+			case 'f': options->fast = TRUE; break;
+			case 'h': options->host = optarg; break;
+			case 'p': options->port = optarg; break;
+			default: return FALSE;
+		}
+	}
+	
+	// The capture is the one argument left.
+	if ((optind + 1) != argc)
+		return FALSE;
+	
+	options->path = argv[optind];
+	
+	return (options->port != NULL);
+}
+
+
+/* static */ Boolean
+ReplayCopyAddress(const ReplayOptions* options, struct sockaddr_storage* address, socklen_t* length) {
+
+	struct addrinfo hints, *found = NULL;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	
+	if ((getaddrinfo(options->host, options->port, &hints, &found) != 0) || (found == NULL))
+		return FALSE;
+	
+	// Take the first address; every connection goes to the same one.
+	memcpy(address, found->ai_addr, found->ai_addrlen);
+	*length = found->ai_addrlen;
+	
+	freeaddrinfo(found);
+	
+	return TRUE;
+}
+
+
+/* static */ void
+ReplayAdvance(Replay* replay) {
+
+	CFIndex batch = 0;
+	
+	while (!replay->_finished) {
+	
+		CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+		
+		if (!replay->_hasRecord) {
+		
+			if (!TrafficReaderNext(replay->_reader, &(replay->_record))) {
+				ReplayFinish(replay);
+				break;
+			}
+			
+			replay->_hasRecord = TRUE;
+			replay->_due = replay->_start + (replay->_record.time - replay->_captureStart);
+		}
+		
+		// A fast replay is due whenever it gets to a record, but lets the
+		// run loop in between batches so echoes are timed as they arrive.
+		if (replay->_options.fast) {
+		
+			if (batch++ == kBatchRecords) {
+				CFRunLoopTimerSetNextFireDate(replay->_timer, now);
+				break;
+			}
+			
+			replay->_due = now;
+		}
+		
+		// Come back when it's due.
+		else if (replay->_due > now) {
+			CFRunLoopTimerSetNextFireDate(replay->_timer, replay->_due);
+			break;
+		}
+		
+		// Too much is waiting on the server, so let it catch up.  Each read
+		// tries again, and so does the timer in case nothing more is read.
+		if ((replay->_record.type == kTrafficCaptureData) && (replay->_queued >= kMaxQueued)) {
+			CFRunLoopTimerSetNextFireDate(replay->_timer, now + kBlockedInterval);
+			break;
+		}
+		
+		replay->_hasRecord = FALSE;
+		replay->_records++;
+		
+		ReplayApply(replay, &(replay->_record), replay->_due);
+	}
+}
+
+
+/* static */ void
+ReplayApply(Replay* replay, const TrafficCaptureRecord* record, CFAbsoluteTime due) {
+
+	ReplayConnection* connection = ReplayGetConnection(replay, record->connection);
+	
+	switch (record->type) {
+	
+		case kTrafficCaptureOpen:
+			if ((connection == NULL) && (ReplayOpenConnection(replay, record->connection) == NULL)) {
+				fprintf(stderr, "EchoReplay - Couldn't open connection %llu (%d)\n", (unsigned long long)record->connection, errno);
+				StatisticsAdd(replay->_shard, kStatisticsErrors, 1);
+			}
+			break;
+		
+		// Records for a connection that couldn't be opened are passed over.
+		case kTrafficCaptureData:
+			if ((connection != NULL) && (connection->_socket != NULL) && !connection->_closing && (record->length > 0)) {
+			
+				if (ReplayQueueSegment(connection, record, due))
+					ReplayHandleWrite(connection);
+				else
+					ReplayCloseConnection(connection, TRUE);
+			}
+			break;
+		
+		case kTrafficCaptureClose:
+			if ((connection != NULL) && (connection->_socket != NULL) && !connection->_closing) {
+				connection->_closing = TRUE;
+				ReplayHandleWrite(connection);
+			}
+			break;
+	}
+}
+
+
+/* static */ void
+ReplayFinish(Replay* replay) {
+
+	CFIndex i;
+	
+	replay->_finished = TRUE;
+	replay->_end = CFAbsoluteTimeGetCurrent();
+	
+	// Connections the capture left open are done too.
+	for (i = 0; i < replay->_connectionCapacity; i++) {
+	
+		ReplayConnection* connection = replay->_connections[i];
+		
+		if ((connection != NULL) && (connection->_socket != NULL) && !connection->_closing) {
+			connection->_closing = TRUE;
+			ReplayHandleWrite(connection);
+		}
+	}
+	
+	// Give the last echoes a while, then report what came back.
+	if (replay->_alive == 0)
+		CFRunLoopStop(CFRunLoopGetCurrent());
+	else
+		CFRunLoopTimerSetNextFireDate(replay->_timer, replay->_end + kFinishTimeOut);
+}
+
+
+/* static */ ReplayConnection*
+ReplayGetConnection(Replay* replay, UInt64 number) {
+
+	if (number >= (UInt64)replay->_connectionCapacity)
+		return NULL;
+	
+	return replay->_connections[number];
+}
+
+
+/* static */ ReplayConnection*
+ReplayOpenConnection(Replay* replay, UInt64 number) {
+
+	ReplayConnection* connection = NULL;
+	CFSocketNativeHandle native = -1;
+	
+	do {
+		int yes = 1, flags;
+		CFRunLoopSourceRef src;
+		CFSocketContext socketCtxt = {0, NULL, NULL, NULL, NULL};
+		
+		// Connections are numbered densely, so they're kept by number.
+		if (number >= (UInt64)replay->_connectionCapacity) {
+		
+			CFIndex capacity = replay->_connectionCapacity ? replay->_connectionCapacity : 64;
+			ReplayConnection** connections;
+			
+			while ((UInt64)capacity <= number)
+				capacity *= 2;
+			
+			connections = realloc(replay->_connections, capacity * sizeof(connections[0]));
+			if (connections == NULL)
+				break;
+			
+			memset(connections + replay->_connectionCapacity, 0, (capacity - replay->_connectionCapacity) * sizeof(connections[0]));
+			replay->_connections = connections;
+			replay->_connectionCapacity = capacity;
+		}
+		
+		// Kept until the end, even once closed, since a callback may still
+		// be on its way out when it closes.
+		connection = calloc(1, sizeof(connection[0]));
+		if (connection == NULL)
+			break;
+		
+		connection->_replay = replay;
+		replay->_connections[number] = connection;
+		
+		native = socket(replay->_address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+		if (native == -1)
+			break;
+		
+		// Connecting synchronously keeps setup simple; it's not what's measured.
+		if (connect(native, (const struct sockaddr*)&(replay->_address), replay->_addressLength) == -1)
+			break;
+		
+		// Each segment must go out as it's sent, the way the client sent it.
+		setsockopt(native, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		
+#if defined(SO_NOSIGPIPE)
+		setsockopt(native, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+		
+		flags = fcntl(native, F_GETFL, 0);
+		if ((flags == -1) || (fcntl(native, F_SETFL, flags | O_NONBLOCK) == -1))
+			break;
+		
+		socketCtxt.info = connection;
+		
+		// Reads re-enable themselves; writes are asked for when a write falls short.
+		connection->_socket = CFSocketCreateWithNative(kCFAllocatorDefault,
+													   native,
+													   kCFSocketReadCallBack | kCFSocketWriteCallBack,
+													   (CFSocketCallBack)&SocketCallBack,
+													   &socketCtxt);
+		if (connection->_socket == NULL)
+			break;
+		
+		// The socket owns the descriptor now.
+		native = -1;
+		
+		src = CFSocketCreateRunLoopSource(kCFAllocatorDefault, connection->_socket, 0);
+		if (src == NULL)
+			break;
+		
+		CFRunLoopAddSource(CFRunLoopGetCurrent(), src, kCFRunLoopDefaultMode);
+		CFRelease(src);
+		
+		StatisticsAdd(replay->_shard, kStatisticsOpens, 1);
+		replay->_alive++;
+		
+		return connection;
+	
+	} while (0);
+	
+	if (native != -1)
+		close(native);
+	
+	if ((connection != NULL) && (connection->_socket != NULL)) {
+		CFSocketInvalidate(connection->_socket);
+		CFRelease(connection->_socket);
+		connection->_socket = NULL;
+	}
+	
+	return NULL;
+}
+
+
+/* static */ void
+ReplayCloseConnection(ReplayConnection* connection, Boolean failed) {
+
+	Replay* replay = connection->_replay;
+	
+	if (connection->_socket == NULL)
+		return;
+	
+	CFSocketInvalidate(connection->_socket);
+	CFRelease(connection->_socket);
+	connection->_socket = NULL;
+	
+	StatisticsAdd(replay->_shard, kStatisticsCloses, 1);
+	if (failed)
+		StatisticsAdd(replay->_shard, kStatisticsErrors, 1);
+	
+	// What it still owed no longer holds up the others.
+	if (connection->_sent > connection->_echoed)
+		replay->_queued -= connection->_sent - connection->_echoed;
+	
+	free(connection->_pending);
+	connection->_pending = NULL;
+	connection->_pendingStart = connection->_pendingEnd = connection->_pendingCapacity = 0;
+	
+	free(connection->_segments);
+	connection->_segments = NULL;
+	connection->_firstSegment = connection->_segmentCount = connection->_segmentCapacity = 0;
+	
+	// Nothing left to measure once the capture is done and every connection is gone.
+	if ((--replay->_alive == 0) && replay->_finished)
+		CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+
+/* static */ Boolean
+ReplayQueueSegment(ReplayConnection* connection, const TrafficCaptureRecord* record, CFAbsoluteTime due) {
+
+	Replay* replay = connection->_replay;
+	CFIndex i, length = record->length;
+	ReplaySegment* segment;
+	
+	// Make room for the bytes, first by sliding down what's left.
+	if ((connection->_pendingEnd + length) > connection->_pendingCapacity) {
+	
+		memmove(connection->_pending, connection->_pending + connection->_pendingStart, connection->_pendingEnd - connection->_pendingStart);
+		connection->_pendingEnd -= connection->_pendingStart;
+		connection->_pendingStart = 0;
+		
+		if ((connection->_pendingEnd + length) > connection->_pendingCapacity) {
+		
+			CFIndex capacity = connection->_pendingCapacity ? (connection->_pendingCapacity * 2) : kReadSize;
+			UInt8* pending;
+			
+			while (capacity < (connection->_pendingEnd + length))
+				capacity *= 2;
+			
+			pending = realloc(connection->_pending, capacity);
+			if (pending == NULL)
+				return FALSE;
+			
+			connection->_pending = pending;
+			connection->_pendingCapacity = capacity;
+		}
+	}
+	
+	// And for the segment.
+	if ((connection->_firstSegment + connection->_segmentCount) == connection->_segmentCapacity) {
+	
+		if (connection->_firstSegment > 0) {
+			memmove(connection->_segments, connection->_segments + connection->_firstSegment, connection->_segmentCount * sizeof(segment[0]));
+			connection->_firstSegment = 0;
+		}
+		
+		else {
+		
+			CFIndex capacity = connection->_segmentCapacity ? (connection->_segmentCapacity * 2) : 64;
+			ReplaySegment* segments = realloc(connection->_segments, capacity * sizeof(segments[0]));
+			
+			if (segments == NULL)
+				return FALSE;
+			
+			connection->_segments = segments;
+			connection->_segmentCapacity = capacity;
+		}
+	}
+	
+	// The bytes as they came, or a line of the same size in their place.
+	if (record->payload != NULL)
+		memcpy(connection->_pending + connection->_pendingEnd, record->payload, length);
+	
+	else {
+		for (i = 0; i < length; i++)
+			connection->_pending[connection->_pendingEnd + i] = (i == (length - 1)) ? '\n' : ('a' + (i % 26));
+	}
+	
+	connection->_pendingEnd += length;
+	connection->_sent += length;
+	replay->_queued += length;
+	
+	segment = &(connection->_segments[connection->_firstSegment + connection->_segmentCount++]);
+	segment->end = connection->_sent;
+	segment->due = due;
+	
+	return TRUE;
+}
+
+
+/* static */ void
+ReplayHandleRead(ReplayConnection* connection) {
+
+	Replay* replay = connection->_replay;
+	CFIndex segments = 0;
+	CFAbsoluteTime now;
+	UInt8 buffer[kReadSize];
+	
+	ssize_t bytesRead = read(CFSocketGetNative(connection->_socket), buffer, sizeof(buffer));
+	
+	if (bytesRead <= 0) {
+	
+		// The end is only expected once nothing more was to be sent, or
+		// nothing more was to come back.
+		if (bytesRead == 0)
+			ReplayCloseConnection(connection, !connection->_shutdown && (connection->_segmentCount > 0));
+		
+		else if ((errno != EAGAIN) && (errno != EINTR))
+			ReplayCloseConnection(connection, TRUE);
+		
+		// The others may have been waiting on this one.
+		if (replay->_hasRecord && (replay->_queued < kMaxQueued))
+			ReplayAdvance(replay);
+		
+		return;
+	}
+	
+	now = CFAbsoluteTimeGetCurrent();
+	StatisticsAdd(replay->_shard, kStatisticsBytesIn, bytesRead);
+	
+	// The server echoed more than was sent.
+	if ((connection->_echoed + bytesRead) > connection->_sent) {
+		ReplayCloseConnection(connection, TRUE);
+		return;
+	}
+	
+	connection->_echoed += bytesRead;
+	replay->_queued -= bytesRead;
+	
+	// Every segment echoed through its last byte is done.
+	while ((connection->_segmentCount > 0) && (connection->_segments[connection->_firstSegment].end <= connection->_echoed)) {
+	
+		StatisticsRecordLatency(replay->_shard, now - connection->_segments[connection->_firstSegment].due, 1);
+		connection->_firstSegment++;
+		connection->_segmentCount--;
+		segments++;
+	}
+	
+	StatisticsAdd(replay->_shard, kStatisticsLines, segments);
+	
+	// Room again for a record that was held back.
+	if (replay->_hasRecord && (replay->_queued < kMaxQueued) && !replay->_finished)
+		ReplayAdvance(replay);
+}
+
+
+/* static */ void
+ReplayHandleWrite(ReplayConnection* connection) {
+
+	Replay* replay = connection->_replay;
+	
+	while (connection->_pendingStart < connection->_pendingEnd) {
+	
+		ssize_t bytesWritten = send(CFSocketGetNative(connection->_socket),
+									connection->_pending + connection->_pendingStart,
+									connection->_pendingEnd - connection->_pendingStart,
+									kSendFlags);
+		
+		if (bytesWritten > 0) {
+			connection->_pendingStart += bytesWritten;
+			StatisticsAdd(replay->_shard, kStatisticsBytesOut, bytesWritten);
+		}
+		
+		// Full, so wait to hear that there's room.
+		else if ((bytesWritten == -1) && (errno == EAGAIN)) {
+			CFSocketEnableCallBacks(connection->_socket, kCFSocketWriteCallBack);
+			return;
+		}
+		
+		else if ((bytesWritten == -1) && (errno == EINTR))
+			continue;
+		
+		else {
+			ReplayCloseConnection(connection, TRUE);
+			return;
+		}
+	}
+	
+	// Everything's out, so once the capture has closed it, say so and wait
+	// for the rest of the echoes and the server's end.
+	if (connection->_closing && !connection->_shutdown) {
+		connection->_shutdown = TRUE;
+		shutdown(CFSocketGetNative(connection->_socket), SHUT_WR);
+	}
+}
+
+
+/* static */ void
+ReplayReport(Replay* replay, StatisticsRef stats, CFTimeInterval elapsed) {
+
+	CFDictionaryRef totals = StatisticsCopyDictionary(stats);
+	CFDictionaryRef latency;
+	SInt64 segments, bytes;
+	
+	if (totals == NULL)
+		return;
+	
+	latency = (CFDictionaryRef)CFDictionaryGetValue(totals, CFSTR("LineLatency"));
+	segments = ReplayGetNumber(totals, CFSTR("Lines"));
+	bytes = ReplayGetNumber(totals, CFSTR("BytesIn"));
+	
+	printf("connections %ld\n", (long)ReplayGetNumber(totals, CFSTR("Opens")));
+	printf("errors %ld\n", (long)ReplayGetNumber(totals, CFSTR("Errors")));
+	printf("unfinished %ld\n", (long)replay->_alive);
+	printf("records %llu\n", (unsigned long long)replay->_records);
+	printf("fast %d\n", replay->_options.fast ? 1 : 0);
+	printf("seconds %.3f\n", elapsed);
+	
+	// Segments are counted as msgs, so the two tools' results line up.
+	printf("msgs %lld\n", (long long)segments);
+	printf("msgs_per_sec %.0f\n", segments / elapsed);
+	printf("mb_per_sec %.2f\n", bytes / elapsed / (1024.0 * 1024.0));
+	
+	if (latency != NULL) {
+		printf("rtt_p50_us %lld\n", (long long)ReplayGetNumber(latency, CFSTR("P50")));
+		printf("rtt_p90_us %lld\n", (long long)ReplayGetNumber(latency, CFSTR("P90")));
+		printf("rtt_p99_us %lld\n", (long long)ReplayGetNumber(latency, CFSTR("P99")));
+		printf("rtt_p999_us %lld\n", (long long)ReplayGetNumber(latency, CFSTR("P999")));
+		printf("rtt_max_us %lld\n", (long long)ReplayGetNumber(latency, CFSTR("Max")));
+	}
+	
+	CFRelease(totals);
+}
+
+
+/* static */ SInt64
+ReplayGetNumber(CFDictionaryRef dict, CFStringRef key) {
+
+	SInt64 value = 0;
+	CFNumberRef number = (CFNumberRef)CFDictionaryGetValue(dict, key);
+	
+	if (number != NULL)
+		CFNumberGetValue(number, kCFNumberSInt64Type, &value);
+	
+	return value;
+}
+
+
+#pragma mark -
+#pragma mark Static Callback Functions
+
+/* static */ void
+SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, ReplayConnection* connection) {
+
+	// Closed connections stay around, but their sockets don't.
+	if (connection->_socket == NULL)
+		return;
+	
+	if (type == kCFSocketReadCallBack)
+		ReplayHandleRead(connection);
+	
+	// Reading may have closed it.
+	else if ((type == kCFSocketWriteCallBack) && (connection->_socket != NULL))
+		ReplayHandleWrite(connection);
+}
+
+
+/* static */ void
+TimerCallBack(CFRunLoopTimerRef timer, Replay* replay) {
+
+	// Past the capture, firing means the stragglers are out of time.
+	if (replay->_finished) {
+		replay->_timedOut = TRUE;
+		CFRunLoopStop(CFRunLoopGetCurrent());
+	}
+	
+	else
+		ReplayAdvance(replay);
+}
+
+
+#pragma mark -
+
+int main (int argc, char * const argv[]) {
+
+	Replay replay;
+	StatisticsRef stats = NULL;
+	int result = 1;
+	
+	memset(&replay, 0, sizeof(replay));
+	
+	if (!ReplayParseOptions(argc, argv, &(replay._options))) {
+		fprintf(stderr, "usage: EchoReplay [-f] [-h host] -p port capture\n"
+						"       -f sends each record as soon as the server takes it, not when it was recorded.\n");
+		return 2;
+	}
+	
+	do {
+		CFRunLoopTimerContext timerCtxt = {0, &replay, NULL, NULL, NULL};
+		
+		replay._reader = TrafficReaderCreate(kCFAllocatorDefault, replay._options.path);
+		if (replay._reader == NULL) {
+			fprintf(stderr, "EchoReplay - Couldn't read the capture %s\n", replay._options.path);
+			break;
+		}
+		
+		if (!ReplayCopyAddress(&(replay._options), &(replay._address), &(replay._addressLength))) {
+			fprintf(stderr, "EchoReplay - Couldn't find the server\n");
+			break;
+		}
+		
+		stats = StatisticsCreate(kCFAllocatorDefault);
+		if ((stats == NULL) || ((replay._shard = StatisticsGetShard(stats)) == NULL))
+			break;
+		
+		replay._captureStart = TrafficReaderGetStartTime(replay._reader);
+		replay._start = CFAbsoluteTimeGetCurrent();
+		
+		// The first pass happens on the run loop, like every one after it.
+		replay._timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+											 replay._start,
+											 kTimerIdle,	// interval
+											 0,				// flags
+											 0,				// order
+											 (CFRunLoopTimerCallBack)&TimerCallBack,
+											 &timerCtxt);
+		if (replay._timer == NULL)
+			break;
+		
+		CFRunLoopAddTimer(CFRunLoopGetCurrent(), replay._timer, kCFRunLoopDefaultMode);
+		
+		CFRunLoopRun();
+		
+		ReplayReport(&replay, stats, CFAbsoluteTimeGetCurrent() - replay._start);
+		
+		// Gate on a clean run where every echo came back.
+		if (!replay._timedOut && (replay._alive == 0) && (replay._records > 0)) {
+			CFDictionaryRef totals = StatisticsCopyDictionary(stats);
+			if (totals != NULL) {
+				if (ReplayGetNumber(totals, CFSTR("Errors")) == 0)
+					result = 0;
+				CFRelease(totals);
+			}
+		}
+	
+	} while (0);
+	
+	if (replay._timer != NULL) {
+		CFRunLoopTimerInvalidate(replay._timer);
+		CFRelease(replay._timer);
+	}
+	
+	if (replay._connections != NULL) {
+	
+		CFIndex i;
+		
+		for (i = 0; i < replay._connectionCapacity; i++) {
+			if (replay._connections[i] != NULL) {
+				ReplayCloseConnection(replay._connections[i], FALSE);
+				free(replay._connections[i]);
+			}
+		}
+		
+		free(replay._connections);
+	}
+	
+	if (replay._reader != NULL)
+		TrafficReaderRelease(replay._reader);
+	
+	if (stats != NULL)
+		StatisticsRelease(stats);
+	
+	return result;
+}
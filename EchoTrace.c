@@ -0,0 +1,90 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  EchoTrace.c
+ *
+ *	The log that os_signpost intervals are recorded against.  Everything
+ *	else is macros in EchoTrace.h; where signposts aren't available this
+ *	file compiles to nothing.
+ */
+
+#pragma mark Includes
+#include "EchoTrace.h"
+
+#if defined(ECHOTRACE_SIGNPOST)
+#include <pthread.h>
+
+
+#pragma mark -
+#pragma mark Static Variable Definitions
+
+static pthread_once_t gLogOnce = PTHREAD_ONCE_INIT;
+static os_log_t gLog = NULL;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void _EchoTraceCreateLog(void);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ os_log_t
+EchoTraceGetLog(void) {
+
+	// Made once, on first use, and kept for the life of the process.
+	pthread_once(&gLogOnce, &_EchoTraceCreateLog);
+	
+	return gLog;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ void
+_EchoTraceCreateLog(void) {
+
+	// Points of interest show up in Instruments' own track.
+	gLog = os_log_create("Echo", OS_LOG_CATEGORY_POINTS_OF_INTEREST);
+}
+
+#endif
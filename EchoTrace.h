@@ -0,0 +1,157 @@
+
+#ifndef __ECHOTRACE__
+#define __ECHOTRACE__
+
+#include <stdint.h>
+
+/*
+** Where the tracing comes from.  The USDT probes are the echo provider in
+** EchoProbes.d, whose header Xcode generates; elsewhere the same probes go
+** through <sys/sdt.h> when it's there.  Either way a probe nobody is
+** watching is a nop in the instruction stream.  Signpost intervals are
+** added where the deployment target has os_signpost.  Define
+** ECHOTRACE_DISABLE to compile all of it out.
+*/
+#if !defined(ECHOTRACE_DISABLE) && defined(__has_include)
+#if defined(__APPLE__) && __has_include("EchoProbes.h")
+#define ECHOTRACE_DTRACE 1
+#include "EchoProbes.h"
+#elif __has_include(<sys/sdt.h>)
+#define ECHOTRACE_SDT 1
+#include <sys/sdt.h>
+#endif
+#if defined(__APPLE__) && __has_include(<os/signpost.h>)
+#include <AvailabilityMacros.h>
+#if MAC_OS_X_VERSION_MIN_REQUIRED >= 101400
+#define ECHOTRACE_SIGNPOST 1
+#include <os/signpost.h>
+#endif
+#endif
+#endif
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+#if defined(ECHOTRACE_DTRACE)
+#define _ECHOTRACE_PROBE1(PROBE, probe, a)		ECHO_##PROBE(a)
+#define _ECHOTRACE_PROBE2(PROBE, probe, a, b)	ECHO_##PROBE(a, b)
+#elif defined(ECHOTRACE_SDT)
+#define _ECHOTRACE_PROBE1(PROBE, probe, a)		DTRACE_PROBE1(echo, probe, a)
+#define _ECHOTRACE_PROBE2(PROBE, probe, a, b)	DTRACE_PROBE2(echo, probe, a, b)
+#else
+#define _ECHOTRACE_PROBE1(PROBE, probe, a)		((void)(a))
+#define _ECHOTRACE_PROBE2(PROBE, probe, a, b)	((void)(a), (void)(b))
+#endif
+
+
+#if defined(ECHOTRACE_SIGNPOST)
+
+/*
+** EchoTraceGetLog
+**
+** Returns the log the signposts are recorded against.  It's made on first
+** use and never released.
+*/
+os_log_t EchoTraceGetLog(void);
+
+// Zero isn't a valid signpost identifier, so keys are offset by one.
+#define _ECHOTRACE_ID(key)		os_signpost_id_make_with_pointer(EchoTraceGetLog(), (const void*)((uintptr_t)(key) + 1))
+#define _ECHOTRACE_BEGIN(key, name, ...)	os_signpost_interval_begin(EchoTraceGetLog(), _ECHOTRACE_ID(key), name, __VA_ARGS__)
+#define _ECHOTRACE_END(key, name, ...)		os_signpost_interval_end(EchoTraceGetLog(), _ECHOTRACE_ID(key), name, __VA_ARGS__)
+#define _ECHOTRACE_EVENT(key, name, ...)	os_signpost_event_emit(EchoTraceGetLog(), _ECHOTRACE_ID(key), name, __VA_ARGS__)
+
+#else
+
+#define _ECHOTRACE_BEGIN(key, name, ...)	((void)0)
+#define _ECHOTRACE_END(key, name, ...)		((void)0)
+#define _ECHOTRACE_EVENT(key, name, ...)	((void)0)
+
+#endif
+
+
+/*
+** Trace points
+**
+** Each is a USDT probe of the same name in the echo provider, with the
+** arguments in the order given, and the start and done pairs are also a
+** signpost interval.  A connection is identified by its context's address,
+** which conn__open ties to the socket.
+**
+** ECHOTRACE_ACCEPT_START(sock)			accept__start: an accepted socket
+**										is about to be admitted and handed
+**										to the callback.
+** ECHOTRACE_ACCEPT_DONE(sock, admitted)	accept__done: the callback is
+**										done, or the socket was shed.
+** ECHOTRACE_CONN_OPEN(conn, sock)		conn__open: the connection opened.
+** ECHOTRACE_CONN_CLOSE(conn, bytes)	conn__close: it closed, having
+**										echoed that many bytes.
+** ECHOTRACE_READ_START(conn)			read__start: reading begins.
+** ECHOTRACE_READ_DONE(conn, bytes)		read__done: this many bytes were
+**										read; negative if the connection
+**										went away.
+** ECHOTRACE_WRITE_START(conn, bytes)	write__start: this many bytes are
+**										ready to be echoed.
+** ECHOTRACE_WRITE_DONE(conn, bytes)	write__done: this many went out;
+**										negative if the connection went
+**										away.
+** ECHOTRACE_GROW_START(conn, bytes)	grow__start: the receive buffer
+**										needs room for this many bytes and
+**										is being reallocated and copied.
+** ECHOTRACE_GROW_DONE(conn, capacity)	grow__done: its new capacity, or
+**										negative if that failed.
+** ECHOTRACE_TIMEOUT(conn, bytes)		timeout: the connection timed out
+**										with this many bytes buffered.
+*/
+#define ECHOTRACE_ACCEPT_START(sock)	\
+	do { _ECHOTRACE_PROBE1(ACCEPT_START, accept__start, (int)(sock)); \
+		 _ECHOTRACE_BEGIN((sock), "Accept", "socket=%d", (int)(sock)); } while (0)
+
+#define ECHOTRACE_ACCEPT_DONE(sock, admitted)	\
+	do { _ECHOTRACE_PROBE2(ACCEPT_DONE, accept__done, (int)(sock), (int)(admitted)); \
+		 _ECHOTRACE_END((sock), "Accept", "admitted=%d", (int)(admitted)); } while (0)
+
+#define ECHOTRACE_CONN_OPEN(conn, sock)	\
+	do { _ECHOTRACE_PROBE2(CONN_OPEN, conn__open, (uintptr_t)(conn), (int)(sock)); \
+		 _ECHOTRACE_EVENT((uintptr_t)(conn), "Open", "socket=%d", (int)(sock)); } while (0)
+
+#define ECHOTRACE_CONN_CLOSE(conn, bytes)	\
+	do { _ECHOTRACE_PROBE2(CONN_CLOSE, conn__close, (uintptr_t)(conn), (long)(bytes)); \
+		 _ECHOTRACE_EVENT((uintptr_t)(conn), "Close", "bytes=%ld", (long)(bytes)); } while (0)
+
+#define ECHOTRACE_READ_START(conn)	\
+	do { _ECHOTRACE_PROBE1(READ_START, read__start, (uintptr_t)(conn)); \
+		 _ECHOTRACE_BEGIN((uintptr_t)(conn), "Read", ""); } while (0)
+
+#define ECHOTRACE_READ_DONE(conn, bytes)	\
+	do { _ECHOTRACE_PROBE2(READ_DONE, read__done, (uintptr_t)(conn), (long)(bytes)); \
+		 _ECHOTRACE_END((uintptr_t)(conn), "Read", "bytes=%ld", (long)(bytes)); } while (0)
+
+#define ECHOTRACE_WRITE_START(conn, bytes)	\
+	do { _ECHOTRACE_PROBE2(WRITE_START, write__start, (uintptr_t)(conn), (long)(bytes)); \
+		 _ECHOTRACE_BEGIN((uintptr_t)(conn), "Write", "ready=%ld", (long)(bytes)); } while (0)
+
+#define ECHOTRACE_WRITE_DONE(conn, bytes)	\
+	do { _ECHOTRACE_PROBE2(WRITE_DONE, write__done, (uintptr_t)(conn), (long)(bytes)); \
+		 _ECHOTRACE_END((uintptr_t)(conn), "Write", "bytes=%ld", (long)(bytes)); } while (0)
+
+#define ECHOTRACE_GROW_START(conn, bytes)	\
+	do { _ECHOTRACE_PROBE2(GROW_START, grow__start, (uintptr_t)(conn), (long)(bytes)); \
+		 _ECHOTRACE_BEGIN((uintptr_t)(conn), "Grow", "needed=%ld", (long)(bytes)); } while (0)
+
+#define ECHOTRACE_GROW_DONE(conn, capacity)	\
+	do { _ECHOTRACE_PROBE2(GROW_DONE, grow__done, (uintptr_t)(conn), (long)(capacity)); \
+		 _ECHOTRACE_END((uintptr_t)(conn), "Grow", "capacity=%ld", (long)(capacity)); } while (0)
+
+#define ECHOTRACE_TIMEOUT(conn, bytes)	\
+	do { _ECHOTRACE_PROBE2(TIMEOUT, timeout, (uintptr_t)(conn), (long)(bytes)); \
+		 _ECHOTRACE_EVENT((uintptr_t)(conn), "TimeOut", "buffered=%ld", (long)(bytes)); } while (0)
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __ECHOTRACE__ */
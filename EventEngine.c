@@ -0,0 +1,441 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  EventEngine.c
+ *
+ *	A per-thread readiness engine.  Descriptors are registered with a kqueue,
+ *	or an epoll descriptor on Linux, and that one descriptor is what the run
+ *	loop watches, through a CFFileDescriptor.  When it becomes readable, a
+ *	batch of events is collected without blocking and each is handed to its
+ *	watch's callback.
+ */
+
+#pragma mark Includes
+#include "EventEngine.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define EVENTENGINE_KQUEUE 1
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(__linux__)
+#define EVENTENGINE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kEventBatch		256				// Events collected per trip through the run loop
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+#if defined(EVENTENGINE_KQUEUE)
+typedef struct kevent EventEngineEvent;
+#elif defined(EVENTENGINE_EPOLL)
+typedef struct epoll_event EventEngineEvent;
+#endif
+
+#if defined(EVENTENGINE_KQUEUE) || defined(EVENTENGINE_EPOLL)
+
+typedef struct __EventEngine {
+	int					_queue;			// kqueue or epoll descriptor
+	CFFileDescriptorRef	_queueRef;		// Run loop notifications for the queue
+	
+	CFIndex				_count;			// Events in the batch being dispatched
+	CFIndex				_next;			// Next event in the batch to dispatch
+	EventEngineEvent	_events[kEventBatch];	// The batch
+} EventEngine;
+
+
+#pragma mark -
+#pragma mark Static Variable Definitions
+
+static pthread_once_t gEngineOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gEngineKey;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static void _EventEngineCreateKey(void);
+static EventEngine* _EventEngineCreate(void);
+static void _EventEngineDestroy(EventEngine* engine);
+static Boolean _EventEngineApply(EventEngine* engine, EventEngineWatch* watch, CFOptionFlags events, Boolean adding);
+static EventEngineWatch* _EventEngineGetWatch(EventEngineEvent* event);
+static void _EventEngineSetWatch(EventEngineEvent* event, EventEngineWatch* watch);
+static CFOptionFlags _EventEngineGetEvents(EventEngineEvent* event);
+static void _EventEngineDispatch(EventEngine* engine);
+
+static void _QueueCallBack(CFFileDescriptorRef queueRef, CFOptionFlags types, EventEngine* engine);
+
+#endif
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ EventEngineRef
+EventEngineGetCurrent(void) {
+
+#if defined(EVENTENGINE_KQUEUE) || defined(EVENTENGINE_EPOLL)
+	EventEngine* engine;
+	
+	pthread_once(&gEngineOnce, &_EventEngineCreateKey);
+	
+	// Create the thread's engine the first time it's asked for.
+	engine = pthread_getspecific(gEngineKey);
+	if (engine == NULL) {
+	
+		engine = _EventEngineCreate();
+		
+		if (engine != NULL)
+			pthread_setspecific(gEngineKey, engine);
+	}
+	
+	return (EventEngineRef)engine;
+#else
+	return NULL;
+#endif
+}
+
+
+/* extern */ void
+EventEngineWatchInit(EventEngineWatch* watch, int fd, EventEngineCallBack callback, void* info) {
+
+	memset(watch, 0, sizeof(watch[0]));
+	
+	watch->_fd = fd;
+	watch->_callback = callback;
+	watch->_info = info;
+}
+
+
+/* extern */ Boolean
+EventEngineAdd(EventEngineRef engine, EventEngineWatch* watch, CFOptionFlags events) {
+
+#if defined(EVENTENGINE_KQUEUE) || defined(EVENTENGINE_EPOLL)
+	// Take it off wherever it is now.
+	EventEngineRemove(watch);
+	
+	if (!_EventEngineApply((EventEngine*)engine, watch, events, TRUE))
+		return FALSE;
+	
+	watch->_engine = engine;
+	watch->_events = events;
+	
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+
+/* extern */ Boolean
+EventEngineSetEvents(EventEngineWatch* watch, CFOptionFlags events) {
+
+#if defined(EVENTENGINE_KQUEUE) || defined(EVENTENGINE_EPOLL)
+	// Nothing to do if it isn't on an engine or nothing changed.
+	if ((watch->_engine == NULL) || (watch->_events == events))
+		return (watch->_engine != NULL);
+	
+	if (!_EventEngineApply((EventEngine*)watch->_engine, watch, events, FALSE))
+		return FALSE;
+	
+	watch->_events = events;
+	
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+
+/* extern */ void
+EventEngineRemove(EventEngineWatch* watch) {
+
+#if defined(EVENTENGINE_KQUEUE) || defined(EVENTENGINE_EPOLL)
+	EventEngine* engine = (EventEngine*)watch->_engine;
+	CFIndex i;
+	
+	// Only if it's on an engine.
+	if (engine == NULL)
+		return;
+	
+#if defined(EVENTENGINE_KQUEUE)
+	{
+		struct kevent changes[2];
+		
+		EV_SET(&changes[0], watch->_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		EV_SET(&changes[1], watch->_fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		
+		kevent(engine->_queue, changes, 2, NULL, 0, NULL);
+	}
+#else
+	{
+		// Old kernels insist on an event even though it's ignored.
+		struct epoll_event event = {0};
+		epoll_ctl(engine->_queue, EPOLL_CTL_DEL, watch->_fd, &event);
+	}
+#endif
+	
+	// Anything still waiting in the current batch must not reach it.
+	for (i = engine->_next; i < engine->_count; i++) {
+		if (_EventEngineGetWatch(&(engine->_events[i])) == watch)
+			_EventEngineSetWatch(&(engine->_events[i]), NULL);
+	}
+	
+	watch->_engine = NULL;
+	watch->_events = 0;
+#endif
+}
+
+
+#if defined(EVENTENGINE_KQUEUE) || defined(EVENTENGINE_EPOLL)
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ void
+_EventEngineCreateKey(void) {
+
+	// Engines go away with their threads.
+	pthread_key_create(&gEngineKey, (void(*)(void*))&_EventEngineDestroy);
+}
+
+
+/* static */ EventEngine*
+_EventEngineCreate(void) {
+
+	EventEngine* engine = NULL;
+	
+	do {
+		CFRunLoopSourceRef src;
+		CFFileDescriptorContext queueCtxt = {0, NULL, NULL, NULL, NULL};
+		
+		// Allocate the engine.
+		engine = CFAllocatorAllocate(kCFAllocatorDefault, sizeof(engine[0]), 0);
+		
+		// Fail if unable to create the engine.
+		if (engine == NULL)
+			break;
+		
+		memset(engine, 0, sizeof(engine[0]));
+		
+		// Create the kernel queue.
+#if defined(EVENTENGINE_KQUEUE)
+		engine->_queue = kqueue();
+#else
+		engine->_queue = epoll_create(kEventBatch);
+#endif
+		
+		if (engine->_queue == -1)
+			break;
+		
+		// Wrap it for run loop notifications.  Invalidating closes it.
+		queueCtxt.info = engine;
+		engine->_queueRef = CFFileDescriptorCreate(kCFAllocatorDefault,
+												   engine->_queue,
+												   TRUE,
+												   (CFFileDescriptorCallBack)&_QueueCallBack,
+												   &queueCtxt);
+		
+		if (engine->_queueRef == NULL)
+			break;
+		
+		// Add it to the current run loop.
+		src = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, engine->_queueRef, 0);
+		if (src == NULL)
+			break;
+		
+		CFRunLoopAddSource(CFRunLoopGetCurrent(), src, kCFRunLoopCommonModes);
+		CFRelease(src);
+		
+		CFFileDescriptorEnableCallBacks(engine->_queueRef, kCFFileDescriptorReadCallBack);
+		
+		return engine;
+		
+	} while (0);
+	
+	// Something failed, so clean up.
+	if (engine != NULL)
+		_EventEngineDestroy(engine);
+	
+	return NULL;
+}
+
+
+/* static */ void
+_EventEngineDestroy(EventEngine* engine) {
+
+	// Invalidate and release the queue's wrapper, which closes the queue.
+	if (engine->_queueRef != NULL) {
+		CFFileDescriptorInvalidate(engine->_queueRef);
+		CFRelease(engine->_queueRef);
+	}
+	
+	// Otherwise close the queue directly.
+	else if (engine->_queue != -1)
+		close(engine->_queue);
+	
+	// Free the memory in use by the engine.
+	CFAllocatorDeallocate(kCFAllocatorDefault, engine);
+}
+
+
+/* static */ Boolean
+_EventEngineApply(EventEngine* engine, EventEngineWatch* watch, CFOptionFlags events, Boolean adding) {
+
+#if defined(EVENTENGINE_KQUEUE)
+	struct kevent changes[2];
+	
+	// Both filters are always registered; interest is turned on and off.
+	EV_SET(&changes[0], watch->_fd, EVFILT_READ,
+		   EV_ADD | ((events & kEventEngineReadEvent) ? EV_ENABLE : EV_DISABLE), 0, 0, watch);
+	EV_SET(&changes[1], watch->_fd, EVFILT_WRITE,
+		   EV_ADD | ((events & kEventEngineWriteEvent) ? EV_ENABLE : EV_DISABLE), 0, 0, watch);
+	
+	(void)adding;
+	
+	return (kevent(engine->_queue, changes, 2, NULL, 0, NULL) != -1);
+#else
+	struct epoll_event event;
+	
+	memset(&event, 0, sizeof(event));
+	
+	event.events = ((events & kEventEngineReadEvent) ? EPOLLIN : 0) | ((events & kEventEngineWriteEvent) ? EPOLLOUT : 0);
+	event.data.ptr = watch;
+	
+	return (epoll_ctl(engine->_queue, adding ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, watch->_fd, &event) != -1);
+#endif
+}
+
+
+/* static */ EventEngineWatch*
+_EventEngineGetWatch(EventEngineEvent* event) {
+
+#if defined(EVENTENGINE_KQUEUE)
+	return (EventEngineWatch*)event->udata;
+#else
+	return (EventEngineWatch*)event->data.ptr;
+#endif
+}
+
+
+/* static */ void
+_EventEngineSetWatch(EventEngineEvent* event, EventEngineWatch* watch) {
+
+#if defined(EVENTENGINE_KQUEUE)
+	event->udata = (void*)watch;
+#else
+	event->data.ptr = watch;
+#endif
+}
+
+
+/* static */ CFOptionFlags
+_EventEngineGetEvents(EventEngineEvent* event) {
+
+#if defined(EVENTENGINE_KQUEUE)
+	return (event->filter == EVFILT_WRITE) ? kEventEngineWriteEvent : kEventEngineReadEvent;
+#else
+	CFOptionFlags events = 0;
+	
+	// Hang ups and errors show up to the reader as the end or an error.
+	if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		events |= kEventEngineReadEvent;
+	
+	if (event->events & EPOLLOUT)
+		events |= kEventEngineWriteEvent;
+	
+	return events;
+#endif
+}
+
+
+/* static */ void
+_EventEngineDispatch(EventEngine* engine) {
+
+	int count;
+	
+	// Collect whatever is ready without waiting.
+#if defined(EVENTENGINE_KQUEUE)
+	struct timespec zero = {0, 0};
+	count = kevent(engine->_queue, NULL, 0, engine->_events, kEventBatch, &zero);
+#else
+	count = epoll_wait(engine->_queue, engine->_events, kEventBatch, 0);
+#endif
+	
+	engine->_count = (count > 0) ? count : 0;
+	
+	// Hand each one out.  Removing a watch clears its later events.
+	for (engine->_next = 0; engine->_next < engine->_count; ) {
+	
+		EventEngineEvent* event = &(engine->_events[engine->_next++]);
+		EventEngineWatch* watch = _EventEngineGetWatch(event);
+		
+		if (watch != NULL)
+			watch->_callback(watch, _EventEngineGetEvents(event), watch->_info);
+	}
+	
+	engine->_count = engine->_next = 0;
+}
+
+
+/* static */ void
+_QueueCallBack(CFFileDescriptorRef queueRef, CFOptionFlags types, EventEngine* engine) {
+
+	assert(queueRef == engine->_queueRef);
+	
+	// Dispatch the events.
+	_EventEngineDispatch(engine);
+	
+	// CFFileDescriptor callbacks are one shot.
+	CFFileDescriptorEnableCallBacks(engine->_queueRef, kCFFileDescriptorReadCallBack);
+}
+
+#endif
@@ -0,0 +1,97 @@
+
+#ifndef __EVENTENGINE__
+#define __EVENTENGINE__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+typedef struct __EventEngine* EventEngineRef;
+
+typedef struct EventEngineWatch EventEngineWatch;
+typedef void (*EventEngineCallBack)(EventEngineWatch* watch, CFOptionFlags events, void* info);
+
+enum {
+	kEventEngineReadEvent = 1,
+	kEventEngineWriteEvent = 2
+};
+
+
+/*
+** EventEngineWatch
+**
+** One descriptor on an engine.  Watches are embedded in their owner
+** rather than allocated by the engine, so a connection costs nothing
+** beyond this and its entry in the kernel's queue.  Treat the fields
+** as private.
+*/
+struct EventEngineWatch {
+	EventEngineRef		_engine;		// Engine the watch is on, if any
+	int					_fd;			// Descriptor being watched
+	CFOptionFlags		_events;		// Events currently asked for
+	EventEngineCallBack	_callback;		// Function to call on events
+	void*				_info;			// Passed to the callback
+};
+
+
+/*
+** EventEngineGetCurrent
+**
+** Returns the engine for the current thread, creating it on first use.
+** The engine is one kqueue, or epoll descriptor on Linux, whose readiness
+** is watched in the current run loop's common modes, so every descriptor
+** on it costs the run loop a single source.  It lasts as long as the
+** thread and is not retained.  Returns NULL where neither kqueue nor epoll
+** exists.
+*/
+EventEngineRef EventEngineGetCurrent(void);
+
+
+/*
+** EventEngineWatchInit
+**
+** Prepares a watch for the descriptor.  An initialized watch not on an
+** engine may be removed any number of times.
+*/
+void EventEngineWatchInit(EventEngineWatch* watch, int fd, EventEngineCallBack callback, void* info);
+
+
+/*
+** EventEngineAdd
+**
+** Puts the watch on the engine, asking for the given events.  Events are
+** level triggered: the callback is called each time through the run
+** loop for as long as the descriptor stays readable or writable.  All
+** calls for a watch must happen on the engine's thread.
+*/
+Boolean EventEngineAdd(EventEngineRef engine, EventEngineWatch* watch, CFOptionFlags events);
+
+
+/*
+** EventEngineSetEvents
+**
+** Changes the events a watch asks for.  Does nothing if they are the
+** same, so it is cheap to call after every read or write.
+*/
+Boolean EventEngineSetEvents(EventEngineWatch* watch, CFOptionFlags events);
+
+
+/*
+** EventEngineRemove
+**
+** Takes the watch off its engine, if it is on one.  Events already
+** collected for it are dropped, so it is safe to remove, and free, a
+** watch from inside any callback.  Remove before closing the descriptor.
+*/
+void EventEngineRemove(EventEngineWatch* watch);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __EVENTENGINE__ */
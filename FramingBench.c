@@ -0,0 +1,507 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  FramingBench.c
+ *
+ *	In-process benchmark of the receive buffer and line framing, with no
+ *	sockets involved.  Synthetic streams are fed through an EchoBuffer in
+ *	the same steps EchoContext takes: reads land in the free space, the new
+ *	bytes are searched for the last linefeed, and writes of random size take
+ *	ready bytes off the front.  For comparison the same streams also go
+ *	through the original CFMutableData code, which read at most 2K at a time,
+ *	then searched from the front and deleted one line at a time.  Define
+ *	ECHOBUFFER_NO_SIMD when building to see what the vector search is worth.
+ */
+
+#pragma mark Includes
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "EchoBuffer.h"
+#include "EchoFraming.h"
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kStreamLength		(64 * 1024 * 1024)	// Bytes per run
+#define kLegacyLength		(8 * 1024 * 1024)	// Bytes per run of the original code
+#define kLegacyReadSize		2048				// What the original read at a time
+#define kMaxWrite			(256 * 1024)		// Largest write
+#define kRuns				3					// Best of this many is reported
+
+// Reading pauses at the high water mark, as EchoContext's does.
+#define kHighWaterMark		(64 * 1024)
+#define kBoundaryReadSize	4096
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+	const char*			name;			// Shown in the report
+	CFIndex				minLine;		// Line lengths, including the linefeed
+	CFIndex				maxLine;
+	CFIndex				minRead;		// Read sizes
+	CFIndex				maxRead;
+} FramingCase;
+
+typedef enum {
+	kFramingEchoed = 0,					// Every line came out
+	kFramingWaiting,					// A line is held, but reading goes on
+	kFramingOverflowed,					// A line was found too long
+	kFramingStalled						// Reading paused with nothing to echo
+} FramingOutcome;
+
+typedef struct {
+	UInt64				bytes;			// Bytes echoed
+	UInt64				lines;			// Lines echoed
+	CFTimeInterval		elapsed;		// Seconds taken
+} FramingResult;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static UInt32 FramingRandom(UInt32* seed);
+static UInt8* FramingCreateStream(const FramingCase* test, CFIndex length, UInt64* lines, CFIndex* framed);
+static Boolean FramingRunRing(const FramingCase* test, const UInt8* stream, CFIndex length, UInt8* sink, FramingResult* result);
+static Boolean FramingRunLegacy(const FramingCase* test, const UInt8* stream, CFIndex length, UInt8* sink, FramingResult* result);
+static void FramingReport(const char* name, const char* path, const FramingResult* result);
+static FramingOutcome FramingFeedLine(CFIndex length, Boolean terminated, CFIndex maxLength);
+static Boolean FramingCheckBoundary(void);
+
+
+#pragma mark -
+#pragma mark Static Variable Definitions
+
+static const FramingCase kCases[] = {
+	{"tiny-lines",			2,			16,			64 * 1024,	64 * 1024},
+	{"short-lines",			32,			128,		64 * 1024,	64 * 1024},
+	{"megabyte-lines",		1 << 20,	1 << 20,	64 * 1024,	64 * 1024},
+	{"random",				1,			8192,		1,			64 * 1024},
+	{"random-tiny-reads",	1,			256,		1,			64}
+};
+
+// Line limits to ask for, at and around where they get clamped.
+static const CFIndex kAskedLengths[] = {0, 1000, kHighWaterMark - 1, kHighWaterMark, 2 * kHighWaterMark};
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ UInt32
+FramingRandom(UInt32* seed) {
+
+	// xorshift32; repeatable from run to run, which is all that matters here.
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	
+	return *seed;
+}
+
+
+/* static */ UInt8*
+FramingCreateStream(const FramingCase* test, CFIndex length, UInt64* lines, CFIndex* framed) {
+
+	UInt32 seed = 0x9E3779B9;
+	UInt8* stream = malloc(length);
+	CFIndex at = 0;
+	
+	if (stream == NULL)
+		return NULL;
+	
+	*lines = 0;
+	*framed = 0;
+	
+	// Lines of letters, each ending in a linefeed, with the last one cut off
+	// wherever the stream ends.
+	while (at < length) {
+	
+		CFIndex line = test->minLine + (FramingRandom(&seed) % (test->maxLine - test->minLine + 1));
+		CFIndex end = at + line - 1;
+		
+		for (; (at < end) && (at < length); at++)
+			stream[at] = 'a' + (at % 26);
+		
+		if (at < length) {
+			stream[at++] = '\n';
+			*framed = at;
+			(*lines)++;
+		}
+	}
+	
+	return stream;
+}
+
+
+/* static */ Boolean
+FramingRunRing(const FramingCase* test, const UInt8* stream, CFIndex length, UInt8* sink, FramingResult* result) {
+
+	EchoBuffer buffer;
+	UInt32 seed = 0x2545F491;
+	CFIndex scanned = 0, ready = 0, at = 0;
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	
+	EchoBufferInit(&buffer, kCFAllocatorDefault);
+	
+	result->bytes = 0;
+	result->lines = 0;
+	
+	while ((at < length) || (ready > 0)) {
+	
+		CFIndex read = test->minRead + (FramingRandom(&seed) % (test->maxRead - test->minRead + 1));
+		CFIndex write = 1 + (FramingRandom(&seed) % kMaxWrite);
+		CFIndex lf;
+		
+		if (read > (length - at))
+			read = length - at;
+		
+		// Read straight into the free space, as the socket path does.
+		while (read > 0) {
+		
+			CFIndex room;
+			UInt8* space;
+		
+			if (!EchoBufferReserve(&buffer, read)) {
+				EchoBufferDestroy(&buffer);
+				return FALSE;
+			}
+			
+			space = EchoBufferGetFreePtr(&buffer, &room);
+			if (room > read)
+				room = read;
+			
+			memcpy(space, stream + at, room);
+			EchoBufferCommit(&buffer, room);
+			
+			at += room;
+			read -= room;
+		}
+		
+		// Frame: search only the new bytes for the last linefeed.
+		lf = EchoBufferFindLastByte(&buffer, scanned, '\n');
+		scanned = EchoBufferGetLength(&buffer);
+		
+		if (lf != kCFNotFound)
+			ready = lf + 1;
+		
+		// Write out some of what's ready, gathering across the wrap.
+		if (write > ready)
+			write = ready;
+		
+		if (write > 0) {
+		
+			struct iovec vectors[2];
+			CFIndex i, count = EchoBufferGetVectors(&buffer, write, vectors);
+			UInt8* to = sink;
+			
+			// Stands in for the kernel's copy.
+			for (i = 0; i < count; i++) {
+				memcpy(to, vectors[i].iov_base, vectors[i].iov_len);
+				to += vectors[i].iov_len;
+			}
+			
+			// What came out must be the stream, in order, and not just the
+			// right amount of it.
+			if (memcmp(sink, stream + result->bytes, write) != 0) {
+				fprintf(stderr, "%s: echoed bytes that differ from the stream at %llu\n", test->name, (unsigned long long)result->bytes);
+				EchoBufferDestroy(&buffer);
+				return FALSE;
+			}
+			
+			EchoBufferConsume(&buffer, write);
+			
+			result->bytes += write;
+			ready -= write;
+			scanned -= write;
+		}
+	}
+	
+	result->elapsed = CFAbsoluteTimeGetCurrent() - start;
+	
+	EchoBufferDestroy(&buffer);
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+FramingRunLegacy(const FramingCase* test, const UInt8* stream, CFIndex length, UInt8* sink, FramingResult* result) {
+
+	CFMutableDataRef buffer = CFDataCreateMutable(kCFAllocatorDefault, 0);
+	UInt32 seed = 0x2545F491;
+	CFIndex at = 0;
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	
+	if (buffer == NULL)
+		return FALSE;
+	
+	result->bytes = 0;
+	result->lines = 0;
+	
+	while (at < length) {
+	
+		const UInt8* bytes;
+		const UInt8* lf;
+		CFIndex read = test->minRead + (FramingRandom(&seed) % (test->maxRead - test->minRead + 1));
+		
+		// Same reads as the ring gets, except none bigger than the original's.
+		if (read > kLegacyReadSize)
+			read = kLegacyReadSize;
+		
+		if (read > (length - at))
+			read = length - at;
+		
+		// The original read path: a copy onto the end of the data.
+		CFDataAppendBytes(buffer, stream + at, read);
+		at += read;
+		
+		// And the original write path: search from the front, write one
+		// line, delete it from the front, again for every line.
+		bytes = CFDataGetBytePtr(buffer);
+		while ((lf = memchr(bytes, '\n', CFDataGetLength(buffer))) != NULL) {
+		
+			CFIndex write = (lf - bytes) + 1;
+			
+			memcpy(sink, bytes, (write > kMaxWrite) ? kMaxWrite : write);
+			CFDataDeleteBytes(buffer, CFRangeMake(0, write));
+			
+			result->bytes += write;
+			result->lines++;
+			
+			bytes = CFDataGetBytePtr(buffer);
+		}
+	}
+	
+	result->elapsed = CFAbsoluteTimeGetCurrent() - start;
+	
+	CFRelease(buffer);
+	
+	return TRUE;
+}
+
+
+/* static */ void
+FramingReport(const char* name, const char* path, const FramingResult* result) {
+
+	printf("%-18s %-7s %10.1f MB/s %12.0f lines/s %8.2f ns/byte\n",
+		   name,
+		   path,
+		   result->bytes / result->elapsed / (1024.0 * 1024.0),
+		   result->lines / result->elapsed,
+		   (result->elapsed * 1e9) / (result->bytes ? result->bytes : 1));
+}
+
+
+/* static */ FramingOutcome
+FramingFeedLine(CFIndex length, Boolean terminated, CFIndex maxLength) {
+
+	EchoBuffer buffer;
+	CFIndex scanned = 0, ready = 0, at = 0;
+	FramingOutcome outcome = kFramingWaiting;
+	UInt8 bytes[kBoundaryReadSize];
+	
+	EchoBufferInit(&buffer, kCFAllocatorDefault);
+	memset(bytes, 'a', sizeof(bytes));
+	
+	// One line, read the way EchoContext reads: never once the high water
+	// mark is buffered.
+	while (outcome == kFramingWaiting) {
+	
+		CFIndex lf, read = length - at;
+		
+		if (EchoBufferGetLength(&buffer) >= kHighWaterMark) {
+			outcome = kFramingStalled;
+			break;
+		}
+		
+		// All of it is in; what's held is held.
+		if (read == 0)
+			break;
+		
+		if (read > kBoundaryReadSize)
+			read = kBoundaryReadSize;
+		
+		// The linefeed, if there is one, is the line's last byte.
+		if (terminated && ((at + read) == length))
+			bytes[read - 1] = '\n';
+		
+		if (!EchoBufferAppendBytes(&buffer, bytes, read))
+			break;
+		
+		at += read;
+		
+		lf = EchoBufferFindLastByte(&buffer, scanned, '\n');
+		scanned = EchoBufferGetLength(&buffer);
+		
+		if (lf != kCFNotFound)
+			ready = lf + 1;
+		
+		// The same test _EchoContextFrame makes.
+		if (EchoFramingIsOverflowing(EchoBufferGetLength(&buffer), ready, maxLength))
+			outcome = kFramingOverflowed;
+		
+		// Echo whatever is ready.
+		else if (ready > 0) {
+			EchoBufferConsume(&buffer, ready);
+			scanned -= ready;
+			ready = 0;
+			
+			if (at == length)
+				outcome = kFramingEchoed;
+		}
+	}
+	
+	EchoBufferDestroy(&buffer);
+	
+	return outcome;
+}
+
+
+/* static */ Boolean
+FramingCheckBoundary(void) {
+
+	Boolean result = TRUE;
+	size_t i;
+	
+	for (i = 0; i < (sizeof(kAskedLengths) / sizeof(kAskedLengths[0])); i++) {
+	
+		// The limit as EchoContext sets it from what it was asked for.
+		CFIndex asked = kAskedLengths[i];
+		CFIndex maxLength = EchoFramingGetMaxLength(asked, kHighWaterMark);
+		
+		// A line that fills the buffer without ending must be caught, not
+		// left to sit until the idle timeout.
+		if (FramingFeedLine(kHighWaterMark, FALSE, maxLength) != kFramingOverflowed) {
+			fprintf(stderr, "boundary: asked for %ld, an unterminated line of %d bytes wasn't caught\n", (long)asked, kHighWaterMark);
+			result = FALSE;
+		}
+		
+		// The longest line allowed still goes through.
+		if (FramingFeedLine(maxLength + 1, TRUE, maxLength) != kFramingEchoed) {
+			fprintf(stderr, "boundary: asked for %ld, a line of %ld bytes and its linefeed wasn't echoed\n", (long)asked, (long)maxLength);
+			result = FALSE;
+		}
+		
+		// And one byte short of that is held with reading still going.
+		if (FramingFeedLine(maxLength, FALSE, maxLength) != kFramingWaiting) {
+			fprintf(stderr, "boundary: asked for %ld, an unterminated line of %ld bytes wasn't held\n", (long)asked, (long)maxLength);
+			result = FALSE;
+		}
+	}
+	
+	return result;
+}
+
+
+#pragma mark -
+
+int main (int argc, const char * argv[]) {
+
+	UInt8* sink = malloc(kMaxWrite);
+	size_t c;
+	int result = 0;
+	
+	if (sink == NULL)
+		return 1;
+	
+	// The overflow limit, right at the edge, before any timing.
+	if (!FramingCheckBoundary())
+		result = 1;
+	
+	for (c = 0; c < (sizeof(kCases) / sizeof(kCases[0])); c++) {
+	
+		const FramingCase* test = &(kCases[c]);
+		UInt64 lines;
+		CFIndex framed;
+		UInt8* stream = FramingCreateStream(test, kStreamLength, &lines, &framed);
+		FramingResult best, run;
+		int i;
+		
+		if (stream == NULL) {
+			result = 1;
+			break;
+		}
+		
+		best.elapsed = 0;
+		
+		for (i = 0; i < kRuns; i++) {
+		
+			if (!FramingRunRing(test, stream, kStreamLength, sink, &run))
+				result = 1;
+			
+			// Everything up to the last linefeed must come out, and no more.
+			else if (run.bytes != (UInt64)framed) {
+				fprintf(stderr, "%s: echoed %llu bytes of %llu\n", test->name, (unsigned long long)run.bytes, (unsigned long long)framed);
+				result = 1;
+			}
+			
+			else if ((best.elapsed == 0) || (run.elapsed < best.elapsed))
+				best = run;
+		}
+		
+		// Each pass echoes every line once.
+		best.lines = lines;
+		
+		if (best.elapsed > 0)
+			FramingReport(test->name, "ring", &best);
+		
+		// The original is quadratic in whatever piles up, so it gets less.
+		best.elapsed = 0;
+		
+		for (i = 0; i < kRuns; i++) {
+			if (FramingRunLegacy(test, stream, kLegacyLength, sink, &run) && ((best.elapsed == 0) || (run.elapsed < best.elapsed)))
+				best = run;
+		}
+		
+		if (best.elapsed > 0)
+			FramingReport(test->name, "cfdata", &best);
+		
+		free(stream);
+	}
+	
+	free(sink);
+	
+	return result;
+}
@@ -0,0 +1,334 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  PoolAllocator.c
+ *
+ *	A CFAllocator with segregated free lists.  Sizes are rounded up to a power
+ *	of two and every block carries a small header recording its class, since
+ *	CFAllocator's deallocate isn't told the size.  Freed blocks are pushed on
+ *	the list for their class, with the link kept in the block's own bytes.
+ */
+
+#pragma mark Includes
+#include "PoolAllocator.h"
+
+#include <pthread.h>
+#include <string.h>
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kMinShift		6				// Smallest class is 64 bytes
+#define kMaxClasses		32
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef union {
+	struct {
+		CFIndex			_class;			// Size class, or -1 when not pooled
+		CFIndex			_size;			// Usable bytes following the header
+	} _info;
+	UInt8				_align[16];		// Keeps the usable bytes 16 byte aligned
+} PoolBlockHeader;
+
+typedef struct {
+	CFAllocatorRef		_backing;		// Allocator the memory comes from
+	UInt32				_rc;			// Number of times retained.
+	
+	CFIndex				_classes;		// Number of pooled size classes
+	CFIndex				_maxCached;		// Most bytes kept on the free lists
+	
+	pthread_mutex_t		_lock;			// Guards everything below
+	CFIndex				_cached;		// Bytes currently on the free lists
+	void*				_free[kMaxClasses];	// Free list heads, by class
+} Pool;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static CFIndex _PoolGetClass(Pool* pool, CFIndex size);
+static void* _PoolAllocate(CFIndex size, CFOptionFlags hint, Pool* pool);
+static void* _PoolReallocate(void* ptr, CFIndex newSize, CFOptionFlags hint, Pool* pool);
+static void _PoolDeallocate(void* ptr, Pool* pool);
+static CFIndex _PoolPreferredSize(CFIndex size, CFOptionFlags hint, Pool* pool);
+static const void* _PoolRetain(Pool* pool);
+static void _PoolRelease(Pool* pool);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ CFAllocatorRef
+PoolAllocatorCreate(CFAllocatorRef backing, CFIndex maxBlockSize, CFIndex maxCached) {
+
+	CFAllocatorRef alloc = NULL;
+	Pool* pool = NULL;
+	
+	do {
+		CFAllocatorContext allocCtxt = {0,
+										NULL,
+										(const void*(*)(const void*))&_PoolRetain,
+										(void(*)(const void*))&_PoolRelease,
+										NULL,
+										(CFAllocatorAllocateCallBack)&_PoolAllocate,
+										(CFAllocatorReallocateCallBack)&_PoolReallocate,
+										(CFAllocatorDeallocateCallBack)&_PoolDeallocate,
+										(CFAllocatorPreferredSizeCallBack)&_PoolPreferredSize};
+		
+		// Allocate the pool itself from the backing allocator.
+		pool = CFAllocatorAllocate(backing, sizeof(pool[0]), 0);
+		
+		// Fail if unable to create the pool.
+		if (pool == NULL)
+			break;
+		
+		memset(pool, 0, sizeof(pool[0]));
+		
+		// Save the allocator for deallocating later.
+		if (backing)
+			pool->_backing = CFRetain(backing);
+		
+		pthread_mutex_init(&(pool->_lock), NULL);
+		
+		// Work out how many classes it takes to reach the largest pooled size.
+		while ((pool->_classes < kMaxClasses) && (((CFIndex)1 << (pool->_classes + kMinShift)) < maxBlockSize))
+			pool->_classes++;
+		
+		if ((maxBlockSize > 0) && (pool->_classes < kMaxClasses))
+			pool->_classes++;
+		
+		pool->_maxCached = maxCached;
+		
+		// The allocator holds the pool.  Hold it here too until creation is done.
+		_PoolRetain(pool);
+		
+		allocCtxt.info = pool;
+		alloc = CFAllocatorCreate(backing, &allocCtxt);
+		
+	} while (0);
+	
+	// Let go of the creation hold.  Without an allocator, this frees the pool.
+	if (pool != NULL)
+		_PoolRelease(pool);
+	
+	return alloc;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ CFIndex
+_PoolGetClass(Pool* pool, CFIndex size) {
+
+	CFIndex c = 0;
+	
+	// Find the smallest class that holds the size.
+	while ((c < pool->_classes) && (((CFIndex)1 << (c + kMinShift)) < size))
+		c++;
+	
+	// Too big to pool.
+	if (c == pool->_classes)
+		return -1;
+	
+	return c;
+}
+
+
+/* static */ void*
+_PoolAllocate(CFIndex size, CFOptionFlags hint, Pool* pool) {
+
+	CFIndex c = _PoolGetClass(pool, size);
+	PoolBlockHeader* block = NULL;
+	
+	// Take a block off the free list if one is waiting.
+	if (c != -1) {
+	
+		pthread_mutex_lock(&(pool->_lock));
+		
+		block = pool->_free[c];
+		if (block != NULL) {
+			pool->_free[c] = *((void**)(block + 1));
+			pool->_cached -= block->_info._size;
+		}
+		
+		pthread_mutex_unlock(&(pool->_lock));
+		
+		// Pooled blocks always get the whole class.
+		size = (CFIndex)1 << (c + kMinShift);
+	}
+	
+	// Otherwise get a new one.
+	if (block == NULL) {
+	
+		block = CFAllocatorAllocate(pool->_backing, sizeof(block[0]) + size, 0);
+		if (block == NULL)
+			return NULL;
+		
+		block->_info._class = c;
+		block->_info._size = size;
+	}
+	
+	return block + 1;
+}
+
+
+/* static */ void*
+_PoolReallocate(void* ptr, CFIndex newSize, CFOptionFlags hint, Pool* pool) {
+
+	PoolBlockHeader* block = ((PoolBlockHeader*)ptr) - 1;
+	void* result;
+	
+	// Still fits, so nothing to do.
+	if (newSize <= block->_info._size)
+		return ptr;
+	
+	// Unpooled blocks that stay unpooled can be grown in place.
+	if ((block->_info._class == -1) && (_PoolGetClass(pool, newSize) == -1)) {
+	
+		block = CFAllocatorReallocate(pool->_backing, block, sizeof(block[0]) + newSize, 0);
+		if (block == NULL)
+			return NULL;
+		
+		block->_info._size = newSize;
+		
+		return block + 1;
+	}
+	
+	// Anything else moves to a block of the right class.
+	result = _PoolAllocate(newSize, hint, pool);
+	if (result == NULL)
+		return NULL;
+	
+	memcpy(result, ptr, block->_info._size);
+	_PoolDeallocate(ptr, pool);
+	
+	return result;
+}
+
+
+/* static */ void
+_PoolDeallocate(void* ptr, Pool* pool) {
+
+	PoolBlockHeader* block = ((PoolBlockHeader*)ptr) - 1;
+	CFIndex c = block->_info._class;
+	
+	// Keep pooled blocks while there's room under the limit.
+	if (c != -1) {
+	
+		pthread_mutex_lock(&(pool->_lock));
+		
+		if ((pool->_cached + block->_info._size) <= pool->_maxCached) {
+		
+			*((void**)ptr) = pool->_free[c];
+			pool->_free[c] = block;
+			pool->_cached += block->_info._size;
+			
+			pthread_mutex_unlock(&(pool->_lock));
+			return;
+		}
+		
+		pthread_mutex_unlock(&(pool->_lock));
+	}
+	
+	CFAllocatorDeallocate(pool->_backing, block);
+}
+
+
+/* static */ CFIndex
+_PoolPreferredSize(CFIndex size, CFOptionFlags hint, Pool* pool) {
+
+	CFIndex c = _PoolGetClass(pool, size);
+	
+	// A pooled request gets the whole class anyway.
+	return (c == -1) ? size : ((CFIndex)1 << (c + kMinShift));
+}
+
+
+/* static */ const void*
+_PoolRetain(Pool* pool) {
+
+	pthread_mutex_lock(&(pool->_lock));
+	pool->_rc++;
+	pthread_mutex_unlock(&(pool->_lock));
+	
+	return pool;
+}
+
+
+/* static */ void
+_PoolRelease(Pool* pool) {
+
+	UInt32 rc;
+	
+	pthread_mutex_lock(&(pool->_lock));
+	rc = --(pool->_rc);
+	pthread_mutex_unlock(&(pool->_lock));
+	
+	// Destroy the pool once nothing holds it.
+	if (rc == 0) {
+	
+		CFIndex c;
+		
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef backing = pool->_backing;
+		
+		// Give back everything on the free lists.
+		for (c = 0; c < pool->_classes; c++) {
+			while (pool->_free[c] != NULL) {
+				PoolBlockHeader* block = pool->_free[c];
+				pool->_free[c] = *((void**)(block + 1));
+				CFAllocatorDeallocate(backing, block);
+			}
+		}
+		
+		pthread_mutex_destroy(&(pool->_lock));
+		
+		// Free the memory in use by the pool.
+		CFAllocatorDeallocate(backing, pool);
+		
+		// Release the allocator.
+		if (backing)
+			CFRelease(backing);
+	}
+}
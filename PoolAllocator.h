@@ -0,0 +1,41 @@
+
+#ifndef __POOLALLOCATOR__
+#define __POOLALLOCATOR__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+** PoolAllocatorCreate
+**
+** Create an allocator that keeps freed blocks on free lists, one per
+** power of two size, and hands them out again instead of going back to
+** the backing allocator.  Objects that come and go with every connection,
+** like contexts and their receive buffers, are then recycled rather than
+** malloced and freed each time.  The allocator is thread safe.
+**
+** backing		Allocator to get memory from.  NULL indicates the
+**				default allocator.
+**
+** maxBlockSize	Largest request that is pooled.  Anything bigger goes
+**				straight to the backing allocator.
+**
+** maxCached	Most bytes held on the free lists.  Blocks freed beyond
+**				that go back to the backing allocator.
+**
+** Release the result with CFRelease.  Its cached blocks are freed once
+** the last object allocated from it is gone.
+*/
+CFAllocatorRef PoolAllocatorCreate(CFAllocatorRef backing, CFIndex maxBlockSize, CFIndex maxCached);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __POOLALLOCATOR__ */
@@ -0,0 +1,424 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ *  RateLimiter.c
+ *
+ *	Token buckets, and a table of them by client address.  Addresses are
+ *	kept as sixteen bytes, IPv4 mapped into IPv6, so a client is the same
+ *	client whichever listener it came in on.  The table is a fixed set of
+ *	hash chains split over a few stripes, each with its own lock; a lookup
+ *	only happens on attach, after which a connection goes straight to its
+ *	client and the one lock that covers it.
+ */
+
+#pragma mark Includes
+#include "RateLimiter.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kStripes			16
+#define kChainsPerStripe	64
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct __RateLimiterClient {
+	struct __RateLimiterClient* _next;	// Next client in the same chain
+	UInt32				_hash;			// Hash of the address, for finding its stripe
+	UInt32				_refs;			// Connections attached
+	UInt8				_address[16];	// IPv6 address, or IPv4 mapped
+	RateLimiterBucket	_bytes;			// Bytes read, across its connections
+	RateLimiterBucket	_lines;			// Lines received, likewise
+} RateLimiterClient;
+
+typedef struct {
+	pthread_mutex_t		_lock;			// Guards the chains and their clients' buckets
+	RateLimiterClient*	_chains[kChainsPerStripe];	// Clients, by hash
+} RateLimiterStripe;
+
+typedef struct __RateLimiter {
+	CFAllocatorRef		_alloc;			// Allocator used to allocate this
+	pthread_mutex_t		_lock;			// Guards the retain count
+	UInt32				_rc;			// Number of times retained.
+	
+	RateLimiterOptions	_options;		// Limits for each client
+	RateLimiterStripe	_stripes[kStripes];	// The table, split by lock
+} RateLimiter;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static Boolean _RateLimiterGetKey(const struct sockaddr* address, UInt8 key[16]);
+static UInt32 _RateLimiterHash(const UInt8 key[16]);
+static RateLimiterStripe* _RateLimiterGetStripe(RateLimiter* limiter, UInt32 hash);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ void
+RateLimiterBucketInit(RateLimiterBucket* bucket, double rate, CFIndex burst) {
+
+	memset(bucket, 0, sizeof(bucket[0]));
+	
+	// Without a rate there's nothing to fill.
+	if (rate <= 0)
+		return;
+	
+	bucket->_rate = rate;
+	bucket->_burst = (burst > 0) ? (double)burst : rate;
+	
+	// Less than one token of room would never allow anything.
+	if (bucket->_burst < 1.0)
+		bucket->_burst = 1.0;
+	
+	bucket->_tokens = bucket->_burst;
+	bucket->_refilled = CFAbsoluteTimeGetCurrent();
+}
+
+
+/* extern */ double
+RateLimiterBucketGetTokens(RateLimiterBucket* bucket, CFAbsoluteTime now) {
+
+	if (bucket->_rate <= 0)
+		return HUGE_VAL;
+	
+	// Top up for the time that passed, to no more than the burst.  A clock
+	// that steps back just waits for it to catch up.
+	if (now > bucket->_refilled) {
+		bucket->_tokens += (now - bucket->_refilled) * bucket->_rate;
+		if (bucket->_tokens > bucket->_burst)
+			bucket->_tokens = bucket->_burst;
+		bucket->_refilled = now;
+	}
+	
+	return bucket->_tokens;
+}
+
+
+/* extern */ CFTimeInterval
+RateLimiterBucketTake(RateLimiterBucket* bucket, double amount, CFAbsoluteTime now) {
+
+	if (bucket->_rate <= 0)
+		return 0;
+	
+	RateLimiterBucketGetTokens(bucket, now);
+	bucket->_tokens -= amount;
+	
+	// Time to work off the debt and earn back a whole token.
+	return (bucket->_tokens >= 1.0) ? 0 : ((1.0 - bucket->_tokens) / bucket->_rate);
+}
+
+
+/* extern */ RateLimiterRef
+RateLimiterCreate(CFAllocatorRef alloc, const RateLimiterOptions* options) {
+
+	CFIndex i;
+	
+	// Allocate the buffer for the limiter.
+	RateLimiter* limiter = CFAllocatorAllocate(alloc, sizeof(limiter[0]), 0);
+	
+	// Fail if unable to create the limiter.
+	if (limiter == NULL)
+		return NULL;
+	
+	memset(limiter, 0, sizeof(limiter[0]));
+	
+	// Save the allocator for deallocating later.
+	limiter->_alloc = alloc ? CFRetain(alloc) : NULL;
+	
+	memcpy(&(limiter->_options), options, sizeof(limiter->_options));
+	
+	pthread_mutex_init(&(limiter->_lock), NULL);
+	for (i = 0; i < kStripes; i++)
+		pthread_mutex_init(&(limiter->_stripes[i]._lock), NULL);
+	
+	// Bump the retain count.
+	return RateLimiterRetain((RateLimiterRef)limiter);
+}
+
+
+/* extern */ RateLimiterRef
+RateLimiterRetain(RateLimiterRef limiter) {
+
+	RateLimiter* l = (RateLimiter*)limiter;
+	
+	pthread_mutex_lock(&(l->_lock));
+	l->_rc++;
+	pthread_mutex_unlock(&(l->_lock));
+	
+	return limiter;
+}
+
+
+/* extern */ void
+RateLimiterRelease(RateLimiterRef limiter) {
+
+	RateLimiter* l = (RateLimiter*)limiter;
+	UInt32 rc;
+	
+	pthread_mutex_lock(&(l->_lock));
+	rc = --(l->_rc);
+	pthread_mutex_unlock(&(l->_lock));
+	
+	// Destroy the object if not being held.
+	if (rc == 0) {
+	
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef alloc = l->_alloc;
+		CFIndex i, j;
+		
+		// Attached connections hold the limiter, so every chain is empty.
+		for (i = 0; i < kStripes; i++) {
+			for (j = 0; j < kChainsPerStripe; j++)
+				assert(l->_stripes[i]._chains[j] == NULL);
+			pthread_mutex_destroy(&(l->_stripes[i]._lock));
+		}
+		
+		pthread_mutex_destroy(&(l->_lock));
+		
+		// Free the memory in use by the limiter.
+		CFAllocatorDeallocate(alloc, l);
+		
+		// Release the allocator.
+		if (alloc)
+			CFRelease(alloc);
+	}
+}
+
+
+/* extern */ RateLimiterClientRef
+RateLimiterAttach(RateLimiterRef limiter, const struct sockaddr* address) {
+
+	RateLimiter* l = (RateLimiter*)limiter;
+	RateLimiterClient* client;
+	RateLimiterStripe* stripe;
+	RateLimiterClient** chain;
+	UInt8 key[16];
+	UInt32 hash;
+	
+	// Only internet addresses name a client.
+	if (!_RateLimiterGetKey(address, key))
+		return NULL;
+	
+	hash = _RateLimiterHash(key);
+	stripe = _RateLimiterGetStripe(l, hash);
+	chain = &(stripe->_chains[(hash / kStripes) % kChainsPerStripe]);
+	
+	pthread_mutex_lock(&(stripe->_lock));
+	
+	// Another connection from there shares its buckets.
+	for (client = *chain; client != NULL; client = client->_next) {
+		if ((client->_hash == hash) && (memcmp(client->_address, key, sizeof(key)) == 0))
+			break;
+	}
+	
+	// Otherwise it's the first, and starts out full.
+	if (client == NULL) {
+	
+		client = CFAllocatorAllocate(l->_alloc, sizeof(client[0]), 0);
+		
+		if (client != NULL) {
+		
+			memset(client, 0, sizeof(client[0]));
+			
+			client->_hash = hash;
+			memcpy(client->_address, key, sizeof(key));
+			RateLimiterBucketInit(&(client->_bytes), l->_options.byteRate, l->_options.byteBurst);
+			RateLimiterBucketInit(&(client->_lines), l->_options.lineRate, l->_options.lineBurst);
+			
+			client->_next = *chain;
+			*chain = client;
+		}
+	}
+	
+	if (client != NULL)
+		client->_refs++;
+	
+	pthread_mutex_unlock(&(stripe->_lock));
+	
+	return (RateLimiterClientRef)client;
+}
+
+
+/* extern */ void
+RateLimiterDetach(RateLimiterRef limiter, RateLimiterClientRef client) {
+
+	RateLimiter* l = (RateLimiter*)limiter;
+	RateLimiterClient* c = (RateLimiterClient*)client;
+	RateLimiterStripe* stripe = _RateLimiterGetStripe(l, c->_hash);
+	
+	pthread_mutex_lock(&(stripe->_lock));
+	
+	// The last one out unlinks it.
+	if (--(c->_refs) == 0) {
+	
+		RateLimiterClient** link = &(stripe->_chains[(c->_hash / kStripes) % kChainsPerStripe]);
+		
+		while (*link != c)
+			link = &((*link)->_next);
+		
+		*link = c->_next;
+	}
+	else
+		c = NULL;
+	
+	pthread_mutex_unlock(&(stripe->_lock));
+	
+	// Free it outside the lock.
+	if (c != NULL)
+		CFAllocatorDeallocate(l->_alloc, c);
+}
+
+
+/* extern */ double
+RateLimiterGetBytes(RateLimiterRef limiter, RateLimiterClientRef client, CFAbsoluteTime now) {
+
+	RateLimiterClient* c = (RateLimiterClient*)client;
+	RateLimiterStripe* stripe;
+	double bytes;
+	
+	// Nothing to look up without a byte limit.
+	if (c->_bytes._rate <= 0)
+		return HUGE_VAL;
+	
+	stripe = _RateLimiterGetStripe((RateLimiter*)limiter, c->_hash);
+	
+	pthread_mutex_lock(&(stripe->_lock));
+	bytes = RateLimiterBucketGetTokens(&(c->_bytes), now);
+	pthread_mutex_unlock(&(stripe->_lock));
+	
+	return bytes;
+}
+
+
+/* extern */ double
+RateLimiterGetLines(RateLimiterRef limiter, RateLimiterClientRef client, CFAbsoluteTime now) {
+
+	RateLimiterClient* c = (RateLimiterClient*)client;
+	RateLimiterStripe* stripe;
+	double lines;
+	
+	// Nothing to look up without a line limit.
+	if (c->_lines._rate <= 0)
+		return HUGE_VAL;
+	
+	stripe = _RateLimiterGetStripe((RateLimiter*)limiter, c->_hash);
+	
+	pthread_mutex_lock(&(stripe->_lock));
+	lines = RateLimiterBucketGetTokens(&(c->_lines), now);
+	pthread_mutex_unlock(&(stripe->_lock));
+	
+	return lines;
+}
+
+
+/* extern */ CFTimeInterval
+RateLimiterTake(RateLimiterRef limiter, RateLimiterClientRef client, CFIndex bytes, CFIndex lines, CFAbsoluteTime now) {
+
+	RateLimiterClient* c = (RateLimiterClient*)client;
+	RateLimiterStripe* stripe = _RateLimiterGetStripe((RateLimiter*)limiter, c->_hash);
+	CFTimeInterval byteDelay, lineDelay;
+	
+	pthread_mutex_lock(&(stripe->_lock));
+	byteDelay = RateLimiterBucketTake(&(c->_bytes), bytes, now);
+	lineDelay = RateLimiterBucketTake(&(c->_lines), lines, now);
+	pthread_mutex_unlock(&(stripe->_lock));
+	
+	// Both have to recover.
+	return (byteDelay > lineDelay) ? byteDelay : lineDelay;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ Boolean
+_RateLimiterGetKey(const struct sockaddr* address, UInt8 key[16]) {
+
+	if (address->sa_family == AF_INET6) {
+		memcpy(key, &(((const struct sockaddr_in6*)address)->sin6_addr), 16);
+		return TRUE;
+	}
+	
+	// The same client over either family, as ::ffff:a.b.c.d.
+	if (address->sa_family == AF_INET) {
+		memset(key, 0, 10);
+		key[10] = key[11] = 0xFF;
+		memcpy(key + 12, &(((const struct sockaddr_in*)address)->sin_addr), 4);
+		return TRUE;
+	}
+	
+	return FALSE;
+}
+
+
+/* static */ UInt32
+_RateLimiterHash(const UInt8 key[16]) {
+
+	UInt32 hash = 2166136261U;
+	CFIndex i;
+	
+	// FNV-1a, which spreads even addresses differing only in the last byte.
+	for (i = 0; i < 16; i++) {
+		hash ^= key[i];
+		hash *= 16777619U;
+	}
+	
+	return hash;
+}
+
+
+/* static */ RateLimiterStripe*
+_RateLimiterGetStripe(RateLimiter* limiter, UInt32 hash) {
+
+	return &(limiter->_stripes[hash % kStripes]);
+}
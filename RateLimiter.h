@@ -0,0 +1,161 @@
+
+#ifndef __RATELIMITER__
+#define __RATELIMITER__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <sys/socket.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+** RateLimiterBucket
+**
+** A token bucket.  It fills at rate tokens a second up to burst.  Taking
+** more than it holds leaves it in debt rather than failing, so work that
+** has already been done can always be paid for; the debt is worked off
+** before it allows anything more.  Meant to be embedded in its owner;
+** treat the fields as private.
+*/
+typedef struct {
+	double				_rate;			// Tokens added per second, zero for no limit
+	double				_burst;			// Most tokens held
+	double				_tokens;		// Tokens held, negative while in debt
+	CFAbsoluteTime		_refilled;		// When _tokens was last brought up to date
+} RateLimiterBucket;
+
+
+/*
+** RateLimiterBucketInit
+**
+** Prepares a bucket, full.
+**
+** rate		Tokens a second.  Zero or less means no limit.
+**
+** burst	Most tokens it holds.  Zero, the default, allows one
+**			second's worth.  It is never less than one.
+*/
+void RateLimiterBucketInit(RateLimiterBucket* bucket, double rate, CFIndex burst);
+
+
+/*
+** RateLimiterBucketGetTokens
+**
+** Tops the bucket up for the time that passed and returns what it holds.
+** Without a limit that is HUGE_VAL.
+*/
+double RateLimiterBucketGetTokens(RateLimiterBucket* bucket, CFAbsoluteTime now);
+
+
+/*
+** RateLimiterBucketTake
+**
+** Tops the bucket up, then takes amount tokens from it.  Returns the
+** seconds until it holds a whole token again, zero if it still does.
+*/
+CFTimeInterval RateLimiterBucketTake(RateLimiterBucket* bucket, double amount, CFAbsoluteTime now);
+
+
+/*
+** RateLimiterOptions
+**
+** Limits shared by every connection from one address.  Any field left at
+** zero means no limit, or for a burst, one second's worth.
+**
+** byteRate		Bytes a second read from the address.
+**
+** byteBurst	Bytes that may be read at once after a quiet spell.
+**
+** lineRate		Lines, or frames, a second.
+**
+** lineBurst	Lines that may arrive at once after a quiet spell.
+*/
+typedef struct {
+	double				byteRate;
+	CFIndex				byteBurst;
+	double				lineRate;
+	CFIndex				lineBurst;
+} RateLimiterOptions;
+
+
+typedef struct __RateLimiter* RateLimiterRef;
+typedef struct __RateLimiterClient* RateLimiterClientRef;
+
+
+/*
+** RateLimiterCreate
+**
+** Create a table of buckets by client address.  Connections attach to
+** their address's buckets, which last while any of them does.  The
+** table is split into stripes, each behind its own lock, so threads
+** charging different clients seldom meet.  Every call is safe from any
+** thread.
+**
+** alloc		Allocator to use for allocating.  NULL indicates
+**				the default allocator.
+**
+** options		The limits.  Must be non-NULL.
+*/
+RateLimiterRef RateLimiterCreate(CFAllocatorRef alloc, const RateLimiterOptions* options);
+
+RateLimiterRef RateLimiterRetain(RateLimiterRef limiter);
+void RateLimiterRelease(RateLimiterRef limiter);
+
+
+/*
+** RateLimiterAttach
+**
+** Returns the buckets for the address, an IPv4 or IPv6 socket address,
+** creating them full if this is the first connection from it.  Returns
+** NULL for any other kind of address, or if they could not be created.
+** Each attach must be balanced by a detach.
+*/
+RateLimiterClientRef RateLimiterAttach(RateLimiterRef limiter, const struct sockaddr* address);
+
+
+/*
+** RateLimiterDetach
+**
+** Lets go of the buckets.  They are freed with the last connection, so an
+** address that comes back later starts full.
+*/
+void RateLimiterDetach(RateLimiterRef limiter, RateLimiterClientRef client);
+
+
+/*
+** RateLimiterGetBytes
+**
+** Returns the bytes the client may have read now.  Without a byte limit
+** that is HUGE_VAL.
+*/
+double RateLimiterGetBytes(RateLimiterRef limiter, RateLimiterClientRef client, CFAbsoluteTime now);
+
+
+/*
+** RateLimiterGetLines
+**
+** Returns the lines the client may have received now.  Without a line
+** limit that is HUGE_VAL.
+*/
+double RateLimiterGetLines(RateLimiterRef limiter, RateLimiterClientRef client, CFAbsoluteTime now);
+
+
+/*
+** RateLimiterTake
+**
+** Charges the client for bytes read and lines received.  Returns the
+** seconds until neither bucket is short of a whole token, zero if
+** neither is now.
+*/
+CFTimeInterval RateLimiterTake(RateLimiterRef limiter, RateLimiterClientRef client, CFIndex bytes, CFIndex lines, CFAbsoluteTime now);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __RATELIMITER__ */
@@ -48,38 +48,170 @@
  */
 
 #pragma mark Includes
+
+// recvmmsg and sendmmsg are GNU extensions to glibc.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "Server.h"
+#include "EchoTrace.h"
+#include "PoolAllocator.h"
 
 #include <CoreServices/CoreServices.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(__APPLE__)
+#define SERVER_DISPATCH 1
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
 
 
 #pragma mark -
 #pragma mark Type Declarations
 
+typedef struct __Server Server;
+
+typedef struct {
+	Server*				_server;		// Server the worker belongs to
+	pthread_t			_thread;		// Thread running the worker's run loop
+	Boolean				_started;		// Thread was created
+	
+	pthread_mutex_t		_lock;			// Guards everything below
+	pthread_cond_t		_ready;			// Signalled once the run loop is set up
+	CFRunLoopRef		_runLoop;		// Worker's run loop, once running
+	Boolean				_stopping;		// Run loop should exit
+	CFAbsoluteTime		_drain;			// Deadline of a drain to start, or zero
+	Boolean				_unlisten;		// Listeners should be released
+	
+	CFRunLoopSourceRef	_source;		// Signalled when sockets are handed over
+	TimerWheelRef		_timers;		// Timeouts for the worker's connections
+	ConnectionRegistryRef _registry;	// The worker's connections
+	
+	CFSocketNativeHandle* _pending;		// Accepted sockets not yet picked up
+	CFIndex				_pendingCount;	// Number of pending sockets
+	CFIndex				_pendingCapacity;	// Room in _pending
+	Boolean				_wake;			// Server thread only: queued to during this batch
+	
+	CFSocketRef			_sockets[2];	// Worker's own listeners, with reusePort; its thread's once running
+	
+	CFIndex				_cpu;			// CPU the thread is pinned to, or -1
+	CFAllocatorRef		_allocator;		// Worker's own pool, with workerAllocators
+} ServerWorker;
+
+#if defined(SERVER_DISPATCH)
 typedef struct {
+	Server*				_server;		// Server the listener belongs to
+	CFSocketRef			_socket;		// One of the server's sockets
+	dispatch_source_t	_source;		// Readable notifications for it
+} ServerListener;
+#endif
+
+struct __Server {
 	CFAllocatorRef		_alloc;			// Allocator used to allocate this
 	UInt32				_rc;			// Number of times retained.
 	
+	ServerOptions		_options;		// Configuration, with defaults filled in
+	
 	CFSocketRef			_sockets[2];	// Server sockets listening for connections
+	CFSocketRef			_statsSocket;	// Loopback listener serving the statistics
+	CFSocketRef			_handOffSocket;	// UNIX listener a successor takes the sockets from
+	Boolean				_adopted;		// _sockets came from a predecessor, already listening
 	
 	CFStringRef			_name;			// Name that is being registered
 	CFStringRef			_type;			// Service type that is being registered
     UInt32				_port;			// Port being serviced
 	CFNetServiceRef		_service;		// Registered service on the network
+	CFRunLoopTimerRef	_retryTimer;	// Next registration attempt, if one is waiting
+	CFTimeInterval		_retryDelay;	// Wait before that attempt
+	CFAbsoluteTime		_registered;	// When the current attempt started
+	
+	TimerWheelRef		_timers;		// Shared timeouts for connections
+	ConnectionRegistryRef _registry;	// Connections on the server's run loop, or on dispatch
+	StatisticsRef		_statistics;	// Counters for the server and its connections
+	
+	pthread_mutex_t		_admitLock;		// Guards the two below, for every accepting thread
+	double				_tokens;		// Connections the accept rate allows right now
+	CFAbsoluteTime		_refilled;		// When the tokens were last topped up
+	
+	pthread_mutex_t		_reserveLock;	// Guards the one below, for every accepting thread
+	int					_reserve;		// Spare descriptor, given up to shed a connection when out of them
+	
+	ServerWorker*		_workers;		// Worker threads, if configured
+	CFIndex				_nextWorker;	// Next worker for round robin
+	
+#if defined(SERVER_DISPATCH)
+	dispatch_queue_t	_queue;			// Concurrent queue the listeners run on, with dispatch
+	dispatch_semaphore_t _cancelled;	// Signalled as each listener finishes cancelling
+	ServerListener		_listeners[2];	// Dispatch sources for _sockets
+#endif
 	
 	ServerCallBack		_callback;		// User's callback function
 	ServerContext		_ctxt;			// User's context info
-} Server;
+};
 
 
 #pragma mark -
 #pragma mark Constant Definitions
 
+static const CFTimeInterval kTimerResolution = 0.25;
+
+// Version byte sent along with the listeners, and how long to wait for them.
+#define kHandOffVersion	1
+static const int kHandOffTimeOut = 5;
+
+// Registration retries back off between these, doubling each time.
+static const CFTimeInterval kRetryDelayMin = 1.0;
+static const CFTimeInterval kRetryDelayMax = 60.0;
+
+// Per-worker pools, with workerAllocators.
+static const CFIndex kWorkerPoolMaxBlockSize = 256 * 1024;
+static const CFIndex kWorkerPoolMaxCached = 16 * 1024 * 1024;
+
+#define kHandOffBatch	64				// Sockets a worker takes per lock
+#define kAcceptBatch	64				// Sockets accepted before calling back
+
+#define kDatagramBatch	32				// Datagrams moved per system call
+#define kDatagramSize	2048			// Largest datagram echoed
+#define kDatagramBudget	8				// Full batches per read callback
+
+// A client that goes away mid-report must not kill the process.
+#if defined(MSG_NOSIGNAL)
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+// Sharing a port only spreads the load where the kernel balances its
+// listeners: SO_REUSEPORT_LB on FreeBSD, SO_REUSEPORT on Linux.  Darwin and
+// the other BSDs hand every connection to the last socket bound, so there
+// the workers are fed by the server's own listeners instead.
+#if defined(SO_REUSEPORT_LB)
+#define kServerReusePort	SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT) && defined(__linux__)
+#define kServerReusePort	SO_REUSEPORT
+#endif
+
+#if defined(SERVER_DISPATCH)
+// Its address marks the server's queue.
+static char kQueueKey;
+#endif
 
 #pragma mark -
 #pragma mark Static Function Declarations
@@ -88,23 +220,63 @@ static CFStringRef _ServerCopyDescription(Server* server);
 static void _ServerReleaseNetService(Server* server);
 static void _ServerReleaseSocket(Server* server);
 static Boolean _ServerCreateAndRegisterNetService(Server* server);
+static void _ServerScheduleRegistration(Server* server);
+static void _ServerReleaseRetryTimer(Server* server);
 static void _ServerHandleAccept(Server* server, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerAdmitConnection(Server* server);
+static Boolean _ServerPrepareListener(Server* server, CFSocketRef sock);
+static void _ServerPrepareConnection(Server* server, CFSocketNativeHandle nativeSocket);
+static CFIndex _ServerAcceptBatch(Server* server, CFSocketRef sock, CFSocketNativeHandle* batch, CFIndex max);
+static Boolean _ServerShedPending(Server* server, CFSocketNativeHandle listener);
+static void _ServerEchoDatagrams(Server* server, CFSocketNativeHandle nativeSocket);
 static void _ServerHandleNetServiceError(Server* server, CFStreamError* error);
+static Boolean _ServerServeStatistics(Server* server, UInt32 port);
+static void _ServerSendStatistics(Server* server, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerAdoptListener(Server* server, unsigned index, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerSendListeners(Server* server, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerIsPeerTrusted(CFSocketNativeHandle nativeSocket);
+static void _ServerHandOffListeners(Server* server, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerStartSources(Server* server);
+static void _ServerStopSources(Server* server);
+
+static Boolean _ServerStartWorkers(Server* server);
+static void _ServerStopWorkers(Server* server);
+static ServerWorker* _ServerGetCurrentWorker(Server* server);
+static ServerWorker* _ServerChooseWorker(Server* server, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerPinThread(CFIndex cpu);
+static void _ServerHandOff(Server* server, const CFSocketNativeHandle* sockets, CFIndex count);
+static Boolean _ServerWorkerEnqueue(ServerWorker* worker, CFSocketNativeHandle nativeSocket);
+static Boolean _ServerWorkerListen(ServerWorker* worker, UInt32 port);
+static void _ServerWorkerReleaseSockets(ServerWorker* worker);
+static void _ServerWorkerStopListening(ServerWorker* worker);
+static CFSocketRef _ServerWorkerCreateListener(ServerWorker* worker, int family, UInt32 port);
+static void* _ServerWorkerMain(ServerWorker* worker);
+static void _ServerWorkerPerform(ServerWorker* worker);
 
 static void _SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server);
+static void _WorkerSocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, ServerWorker* worker);
 static void _NetServiceCallBack(CFNetServiceRef service, CFStreamError* error, Server* server);
+static void _RetryTimerCallBack(CFRunLoopTimerRef timer, Server* server);
+static void _StatisticsSocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server);
+static void _HandOffSocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server);
+#if defined(SERVER_DISPATCH)
+static void _ListenerSourceCallBack(ServerListener* listener);
+static void _ListenerCancelCallBack(ServerListener* listener);
+#endif
 
 
 #pragma mark -
 #pragma mark Extern Function Definitions (API)
 
 /* extern */ ServerRef
-ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* context) {
+ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* context, const ServerOptions* options) {
     
     Server* server = NULL;
 	    
 	do {
 		int yes = 1;
+		int type, protocol;
+		CFOptionFlags events;
 		CFSocketContext socketCtxt = {0,
 									  NULL,
 									  (const void*(*)(const void*))&ServerRetain,
@@ -120,21 +292,59 @@ ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* conte
 		
 		memset(server, 0, sizeof(server[0]));
 		
+		// Ready before anything that fails can get to ServerRelease.
+		pthread_mutex_init(&(server->_admitLock), NULL);
+		pthread_mutex_init(&(server->_reserveLock), NULL);
+		
+		// Held back so a full descriptor table can't leave a connection stuck
+		// in the listen queue, keeping the listener readable.
+		server->_reserve = open("/dev/null", O_RDONLY);
+		
 		// Save the allocator for deallocating later.
 		server->_alloc = alloc ? CFRetain(alloc) : NULL;
 		
+		// Copy the options and fill in defaults for anything unspecified.
+		if (options)
+			memcpy(&(server->_options), options, sizeof(server->_options));
+		
+		if (server->_options.workerCount < 0)
+			server->_options.workerCount = 0;
+		
+		// Dispatch spreads the work by itself, and only ever accepts by hand.
+		if (server->_options.dispatch) {
+			server->_options.workerCount = 0;
+			server->_options.batchAccept = TRUE;
+		}
+		
+		if (server->_options.acceptRate < 0)
+			server->_options.acceptRate = 0;
+		
+		if (server->_options.acceptBurst <= 0)
+			server->_options.acceptBurst = (CFIndex)ceil(server->_options.acceptRate);
+		
+		// Start out with a full bucket.
+		server->_tokens = server->_options.acceptBurst;
+		server->_refilled = CFAbsoluteTimeGetCurrent();
+		
         // Bump the retain count.
         ServerRetain((ServerRef)server);
         
 		// Make sure the server is saved for the callback.
 		socketCtxt.info = server;
 		
+		// Batches are accepted by hand when the listener turns readable, and
+		// datagrams are always read by hand.
+		events = (server->_options.batchAccept || server->_options.datagram) ? kCFSocketReadCallBack : kCFSocketAcceptCallBack;
+		
+		type = server->_options.datagram ? SOCK_DGRAM : SOCK_STREAM;
+		protocol = server->_options.datagram ? IPPROTO_UDP : IPPROTO_TCP;
+		
 		// Create the IPv4 server socket.
 		server->_sockets[0] = CFSocketCreate(alloc,
 										 PF_INET,
-										 SOCK_STREAM,
-										 IPPROTO_TCP,
-										 kCFSocketAcceptCallBack,
+										 type,
+										 protocol,
+										 events,
 										 (CFSocketCallBack)&_SocketCallBack,
 										 &socketCtxt);
 		
@@ -145,9 +355,9 @@ ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* conte
 		// Create the IPv6 server socket.
 		server->_sockets[1] = CFSocketCreate(alloc,
 						     PF_INET6,
-										 SOCK_STREAM,
-										 IPPROTO_TCP,
-										 kCFSocketAcceptCallBack,
+										 type,
+										 protocol,
+										 events,
 										 (CFSocketCallBack)&_SocketCallBack,
 										 &socketCtxt);
 		
@@ -160,6 +370,39 @@ ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* conte
 		// being supplied by the OS opposed to being specified by the user.
 		setsockopt(CFSocketGetNative(server->_sockets[0]), SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 		setsockopt(CFSocketGetNative(server->_sockets[1]), SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		
+#if defined(kServerReusePort)
+		// Workers will be binding to the same port, and all of them have to ask.
+		if (server->_options.reusePort && (server->_options.workerCount > 0)) {
+			setsockopt(CFSocketGetNative(server->_sockets[0]), SOL_SOCKET, kServerReusePort, &yes, sizeof(yes));
+			setsockopt(CFSocketGetNative(server->_sockets[1]), SOL_SOCKET, kServerReusePort, &yes, sizeof(yes));
+		}
+#endif
+		
+		// Create the wheel that drives all of the connection timeouts.
+		server->_timers = TimerWheelCreate(alloc, kTimerResolution);
+		
+		// If the wheel couldn't create, bail.
+		if (server->_timers == NULL)
+			break;
+		
+		// And the registry the connections are listed in.  Dispatch lists
+		// them from its threads, so that one takes a lock.
+		if (server->_options.dispatch)
+			server->_registry = ConnectionRegistryCreateShared(alloc);
+		else
+			server->_registry = ConnectionRegistryCreate(alloc);
+		
+		// If it couldn't create, bail.
+		if (server->_registry == NULL)
+			break;
+		
+		// Create the counters.
+		server->_statistics = StatisticsCreate(alloc);
+		
+		// If they couldn't create, bail.
+		if (server->_statistics == NULL)
+			break;
         
 		// Save the user's callback in context.
 		server->_callback = callback;
@@ -211,6 +454,16 @@ ServerRelease(ServerRef server) {
 		
 		// Invalidate the server which will release the socket and service.
 		ServerInvalidate(server);
+		
+		// The statistics outlive invalidation so they can still be read.
+		if (s->_statistics)
+			StatisticsRelease(s->_statistics);
+		
+		pthread_mutex_destroy(&(s->_admitLock));
+		
+		if (s->_reserve != -1)
+			close(s->_reserve);
+		pthread_mutex_destroy(&(s->_reserveLock));
 			
 		// Free the memory in use by the server.
 		CFAllocatorDeallocate(alloc, server);
@@ -260,7 +513,8 @@ ServerConnect(ServerRef server, CFStringRef name, CFStringRef type, UInt32 port)
         if (name == NULL)
             name = CFSTR("");
 
-        for (i = 0; i < (sizeof(s->_sockets) / sizeof(s->_sockets[0])); i++) {
+        // With dispatch, the listeners get sources of their own once bound.
+        for (i = 0; !s->_options.dispatch && (i < (sizeof(s->_sockets) / sizeof(s->_sockets[0]))); i++) {
 
             // Create the run loop source for putting on the run loop.
             CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(alloc, s->_sockets[i], 0);
@@ -272,47 +526,89 @@ ServerConnect(ServerRef server, CFStringRef name, CFStringRef type, UInt32 port)
             CFRelease(src);
         }
 
-        bzero(addr4, sizeof(addr4[0]));
+        // Turn the timeout wheel on the same run loop.
+        if (!TimerWheelScheduleWithRunLoop(s->_timers, rl, kCFRunLoopCommonModes))
+            break;
 
-        // Put the local port and address into the native address.
-        addr4->sin_len = sizeof(addr4[0]);
-        addr4->sin_family = AF_INET;
-        addr4->sin_port = htons((UInt16)port);
-        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        // Get the workers running before any connection can arrive.
+        if (!_ServerStartWorkers(s))
+            break;
 
-        // Wrap the native address structure for CFSocketCreate.
-        address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)addr4, addr4->sin_len, kCFAllocatorNull);
+        if (s->_adopted) {
 
-        // If it failed to create the address data, bail.
-        if (address == NULL)
-            break;
+            // The predecessor's sockets are bound and listening already, so take its port.
+            address = CFSocketCopyAddress(s->_sockets[0]);
+            if (address == NULL)
+                break;
 
-        // Set the local binding which causes the socket to start listening.
-        if (CFSocketSetAddress(s->_sockets[0], address) != kCFSocketSuccess)
-            break;
+            memcpy(addr4, CFDataGetBytePtr(address), CFDataGetLength(address));
+            port = ntohs(addr4->sin_port);
+        }
+        else {
+            bzero(addr4, sizeof(addr4[0]));
 
-        CFRelease(address);
+            // Put the local port and address into the native address.
+            addr4->sin_len = sizeof(addr4[0]);
+            addr4->sin_family = AF_INET;
+            addr4->sin_port = htons((UInt16)port);
+            addr4->sin_addr.s_addr = htonl(INADDR_ANY);
 
-        address = CFSocketCopyAddress(s->_sockets[0]);
-        memcpy(addr4, CFDataGetBytePtr(address), CFDataGetLength(address));
+            // Wrap the native address structure for CFSocketCreate.
+            address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)addr4, addr4->sin_len, kCFAllocatorNull);
 
-        port = ntohs(addr4->sin_port);
+            // If it failed to create the address data, bail.
+            if (address == NULL)
+                break;
 
-        CFRelease(address);
+            // Set the local binding which causes the socket to start listening.
+            if (CFSocketSetAddress(s->_sockets[0], address) != kCFSocketSuccess)
+                break;
+
+            CFRelease(address);
+
+            address = CFSocketCopyAddress(s->_sockets[0]);
+            memcpy(addr4, CFDataGetBytePtr(address), CFDataGetLength(address));
+
+            port = ntohs(addr4->sin_port);
+
+            CFRelease(address);
+
+            bzero(addr6, sizeof(addr6[0]));
+
+            // Put the local port and address into the native address.
+            addr6->sin6_len = sizeof(addr6[0]);
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_port = htons((UInt16)port);
+            memcpy(&(addr6->sin6_addr), &in6addr_any, sizeof(addr6->sin6_addr));
+
+            // Wrap the native address structure for CFSocketCreate.
+            address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)addr6, addr6->sin6_len, kCFAllocatorNull);
+
+            // Set the local binding which causes the socket to start listening.
+            if (CFSocketSetAddress(s->_sockets[1], address) != kCFSocketSuccess)
+                break;
+        }
+
+
+        // Apply the backlog and accept mode.
+        if (!_ServerPrepareListener(s, s->_sockets[0]) || !_ServerPrepareListener(s, s->_sockets[1]))
+            break;
 
-        bzero(addr6, sizeof(addr6[0]));
+        // Start watching them on dispatch if asked to.
+        if (s->_options.dispatch && !_ServerStartSources(s))
+            break;
 
-        // Put the local port and address into the native address.
-        addr6->sin6_len = sizeof(addr6[0]);
-        addr6->sin6_family = AF_INET6;
-        addr6->sin6_port = htons((UInt16)port);
-        memcpy(&(addr6->sin6_addr), &in6addr_any, sizeof(addr6->sin6_addr));
+        // Open the workers' listeners now that the port is settled.
+        for (i = 0; i < s->_options.workerCount; i++) {
+            if (!_ServerWorkerListen(&(s->_workers[i]), port))
+                break;
+        }
 
-        // Wrap the native address structure for CFSocketCreate.
-        address = CFDataCreateWithBytesNoCopy(alloc, (const UInt8*)addr6, addr6->sin6_len, kCFAllocatorNull);
+        if (i < s->_options.workerCount)
+            break;
 
-        // Set the local binding which causes the socket to start listening.
-        if (CFSocketSetAddress(s->_sockets[1], address) != kCFSocketSuccess)
+        // Serve the statistics if asked to.
+        if ((s->_options.statisticsPort != 0) && !_ServerServeStatistics(s, s->_options.statisticsPort))
             break;
 
         // Save the name, service type and port.
@@ -320,9 +616,10 @@ ServerConnect(ServerRef server, CFStringRef name, CFStringRef type, UInt32 port)
         s->_type = type ? CFRetain(type) : NULL;
         s->_port = port;
 
-        // Attempt to register the service on the network.
+        // Attempt to register the service on the network.  The sockets are
+        // already listening, so a failure only means trying again later.
         if (type && !_ServerCreateAndRegisterNetService(s))
-            break;
+            _ServerScheduleRegistration(s);
 
         // Release this since it's not needed any longer.
         CFRelease(address);
@@ -337,18 +634,325 @@ ServerConnect(ServerRef server, CFStringRef name, CFStringRef type, UInt32 port)
 	if (address)
 		CFRelease(address);
 		
-	// Kill the socket if it was created.
+	// Kill the socket if it was created, once no source is watching it.
+	_ServerStopSources(s);
 	_ServerReleaseSocket(s);
+	
+	// Stop any workers that started.
+	_ServerStopWorkers(s);
+		
+	return FALSE;
+}
+
+
+/* extern */ Boolean
+ServerAdoptListeners(ServerRef server, const char* path) {
+
+	Server* s = (Server*)server;
+	CFSocketNativeHandle sock = -1;
+	int fds[2] = {-1, -1};
+	unsigned i;
+	
+	do {
+		UInt8 version = 0;
+		struct iovec iov = {&version, sizeof(version)};
+		struct timeval timeOut = {kHandOffTimeOut, 0};
+		struct sockaddr_un addr;
+		struct msghdr msg;
+		struct cmsghdr* cmsg;
+		union {
+			struct cmsghdr	header;
+			UInt8			space[CMSG_SPACE(sizeof(fds))];
+		} control;
+		
+		// Make sure the path fits.
+		if (strlen(path) >= sizeof(addr.sun_path))
+			break;
+		
+		sock = socket(PF_LOCAL, SOCK_STREAM, 0);
+		if (sock == -1)
+			break;
+		
+		// A predecessor that is wedged must not wedge this one too.
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeOut, sizeof(timeOut));
+		
+		bzero(&addr, sizeof(addr));
+		addr.sun_family = AF_LOCAL;
+		strcpy(addr.sun_path, path);
+		
+		// Nobody listening is the usual case on a first start.
+		if (connect(sock, (struct sockaddr*)&addr, SUN_LEN(&addr)) == -1)
+			break;
+		
+		// Only listeners from a server run by the same user are taken.
+		if (!_ServerIsPeerTrusted(sock))
+			break;
+		
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+		
+		if (recvmsg(sock, &msg, 0) != sizeof(version))
+			break;
+		
+		// Take the descriptors first, so they get closed if anything is off.
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+			(cmsg->cmsg_len != CMSG_LEN(sizeof(fds))))
+		{
+			break;
+		}
+		
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		
+		if ((version != kHandOffVersion) || ((msg.msg_flags & MSG_CTRUNC) != 0))
+			break;
+		
+		// Swap them in for the unbound sockets from ServerCreate.
+		for (i = 0; i < (sizeof(fds) / sizeof(fds[0])); i++) {
+			if (!_ServerAdoptListener(s, i, fds[i]))
+				break;
+			fds[i] = -1;
+		}
+		
+		if (i < (sizeof(fds) / sizeof(fds[0])))
+			break;
+		
+		s->_adopted = TRUE;
+		
+		close(sock);
+		
+		return TRUE;
+	
+	} while (0);
+	
+	// Close whatever didn't end up in a CFSocket.
+	for (i = 0; i < (sizeof(fds) / sizeof(fds[0])); i++) {
+		if (fds[i] != -1)
+			close(fds[i]);
+	}
+	
+	if (sock != -1)
+		close(sock);
+	
+	return FALSE;
+}
+
+
+/* extern */ Boolean
+ServerServeHandOff(ServerRef server, const char* path) {
+
+	Server* s = (Server*)server;
+	CFDataRef address = NULL;
+	CFRunLoopSourceRef src = NULL;
+	
+	do {
+		mode_t mask;
+		CFSocketError bound;
+		struct sockaddr_un addr;
+		CFSocketContext socketCtxt = {0,
+									  s,
+									  (const void*(*)(const void*))&ServerRetain,
+									  (void(*)(const void*))&ServerRelease,
+									  (CFStringRef(*)(const void *))&_ServerCopyDescription};
+		
+		// Only one at a time, and the path has to fit.
+		if ((s->_handOffSocket != NULL) || (strlen(path) >= sizeof(addr.sun_path)))
+			break;
+		
+#if defined(kServerReusePort)
+		// The workers' own listeners can't go over, and what waits in their
+		// queues would be lost, so that's no hand-off at all.
+		if (s->_options.reusePort && (s->_options.workerCount > 0))
+			break;
+#endif
+		
+		// Create the listener.
+		s->_handOffSocket = CFSocketCreate(s->_alloc,
+										   PF_LOCAL,
+										   SOCK_STREAM,
+										   0,
+										   kCFSocketAcceptCallBack,
+										   (CFSocketCallBack)&_HandOffSocketCallBack,
+										   &socketCtxt);
+		
+		// If the socket couldn't create, bail.
+		if (s->_handOffSocket == NULL)
+			break;
+		
+		bzero(&addr, sizeof(addr));
+		addr.sun_family = AF_LOCAL;
+		strcpy(addr.sun_path, path);
+		
+		// Whatever is there belongs to a predecessor that is done with it.
+		unlink(path);
+		
+		// Wrap the native address structure for CFSocketSetAddress.
+		address = CFDataCreateWithBytesNoCopy(s->_alloc, (const UInt8*)&addr, SUN_LEN(&addr), kCFAllocatorNull);
+		
+		// If it failed to create the address data, bail.
+		if (address == NULL)
+			break;
+		
+		// Set the local binding which causes the socket to start listening.
+		// Whoever connects gets the listeners, so only the same user may,
+		// from the moment the socket exists.
+		mask = umask(S_IRWXG | S_IRWXO);
+		bound = CFSocketSetAddress(s->_handOffSocket, address);
+		umask(mask);
+		
+		if (bound != kCFSocketSuccess)
+			break;
+		
+		// Create the run loop source for putting on the run loop.
+		src = CFSocketCreateRunLoopSource(s->_alloc, s->_handOffSocket, 0);
+		if (src == NULL)
+			break;
+		
+		CFRunLoopAddSource(CFRunLoopGetCurrent(), src, kCFRunLoopCommonModes);
 		
+		CFRelease(src);
+		CFRelease(address);
+		
+		return TRUE;
+	
+	} while (0);
+	
+	// Release the address data if it was created.
+	if (address)
+		CFRelease(address);
+	
+	// Kill the listener if it was created.
+	if (s->_handOffSocket != NULL) {
+		CFSocketInvalidate(s->_handOffSocket);
+		CFRelease(s->_handOffSocket);
+		s->_handOffSocket = NULL;
+	}
+	
 	return FALSE;
 }
 
 
+/* extern */ TimerWheelRef
+ServerGetTimerWheel(ServerRef server) {
+
+	Server* s = (Server*)server;
+	ServerWorker* worker = _ServerGetCurrentWorker(s);
+	
+	// A worker's connections time out on the worker's own wheel.
+	return (worker != NULL) ? worker->_timers : s->_timers;
+}
+
+
+/* extern */ CFAllocatorRef
+ServerGetAllocator(ServerRef server) {
+
+	ServerWorker* worker = _ServerGetCurrentWorker((Server*)server);
+	
+	// Only workers have allocators of their own.
+	return (worker != NULL) ? worker->_allocator : NULL;
+}
+
+
+/* extern */ ConnectionRegistryRef
+ServerGetRegistry(ServerRef server) {
+
+	Server* s = (Server*)server;
+	ServerWorker* worker = _ServerGetCurrentWorker(s);
+	
+	// Like the wheels, a worker's connections are its own.
+	return (worker != NULL) ? worker->_registry : s->_registry;
+}
+
+
+/* extern */ CFIndex
+ServerGetConnectionCount(ServerRef server) {
+
+	Server* s = (Server*)server;
+	CFIndex i, count = (s->_registry != NULL) ? ConnectionRegistryGetCount(s->_registry) : 0;
+	
+	for (i = 0; (s->_workers != NULL) && (i < s->_options.workerCount); i++)
+		count += ConnectionRegistryGetCount(s->_workers[i]._registry);
+	
+	return count;
+}
+
+
+/* extern */ StatisticsRef
+ServerGetStatistics(ServerRef server) {
+
+	return ((Server*)server)->_statistics;
+}
+
+
+/* extern */ CFDictionaryRef
+ServerCopyStatistics(ServerRef server) {
+
+	return StatisticsCopyDictionary(((Server*)server)->_statistics);
+}
+
+
+/* extern */ void
+ServerDrain(ServerRef server, CFTimeInterval timeout) {
+
+	Server* s = (Server*)server;
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeout;
+	CFIndex i;
+	
+	// Stop advertising, so no new clients come looking.
+	_ServerReleaseNetService(s);
+	_ServerReleaseRetryTimer(s);
+	
+	// Close the listeners, and the hand off listener since there's nothing
+	// left to hand off.  The statistics stay up to watch the drain.
+	_ServerStopSources(s);
+	
+	for (i = 0; i < (sizeof(s->_sockets) / sizeof(s->_sockets[0])); i++) {
+		if (s->_sockets[i] != NULL) {
+			CFSocketInvalidate(s->_sockets[i]);
+			CFRelease(s->_sockets[i]);
+			s->_sockets[i] = NULL;
+		}
+	}
+	
+	if (s->_handOffSocket != NULL) {
+		CFSocketInvalidate(s->_handOffSocket);
+		CFRelease(s->_handOffSocket);
+		s->_handOffSocket = NULL;
+	}
+	
+	// Each worker sweeps its own connections, from its own run loop.
+	for (i = 0; (s->_workers != NULL) && (i < s->_options.workerCount); i++) {
+	
+		ServerWorker* worker = &(s->_workers[i]);
+		
+		pthread_mutex_lock(&(worker->_lock));
+		worker->_unlisten = TRUE;
+		worker->_drain = deadline;
+		pthread_mutex_unlock(&(worker->_lock));
+		
+		CFRunLoopSourceSignal(worker->_source);
+		CFRunLoopWakeUp(worker->_runLoop);
+	}
+	
+	// And these are on this one.
+	if (s->_registry != NULL)
+		ConnectionRegistryDrain(s->_registry, deadline);
+}
+
+
 /* extern */ void
 ServerInvalidate(ServerRef server) {
 	
 	Server* s = (Server*)server;
 	
+	// Stop the workers and any dispatch sources first, so none is in the
+	// callback below.
+	_ServerStopWorkers(s);
+	_ServerStopSources(s);
+	
 	// Release the user's context info pointer.
 	if (s->_ctxt.info && s->_ctxt.release)
 		s->_ctxt.release(s->_ctxt.info);
@@ -359,8 +963,9 @@ ServerInvalidate(ServerRef server) {
 	// Guarantee that there will be no user callback.
 	s->_callback = NULL;
     
-    // Release the net service.
+    // Release the net service and any attempt still waiting.
     _ServerReleaseNetService(s);
+    _ServerReleaseRetryTimer(s);
 
     if (s->_name) {
         CFRelease(s->_name);
@@ -374,6 +979,20 @@ ServerInvalidate(ServerRef server) {
 
     // Release the socket.
     _ServerReleaseSocket(s);
+
+    // Close whatever connections are left, and release the registry.
+    if (s->_registry) {
+        ConnectionRegistryCloseAll(s->_registry);
+        ConnectionRegistryRelease(s->_registry);
+        s->_registry = NULL;
+    }
+
+    // Stop and release the timeout wheel.
+    if (s->_timers) {
+        TimerWheelInvalidate(s->_timers);
+        TimerWheelRelease(s->_timers);
+        s->_timers = NULL;
+    }
 }
 
 
@@ -452,6 +1071,20 @@ _ServerReleaseSocket(Server* server) {
             server->_sockets[i] = NULL;
         }
     }
+
+    // Likewise the statistics listener.
+    if (server->_statsSocket != NULL) {
+        CFSocketInvalidate(server->_statsSocket);
+        CFRelease(server->_statsSocket);
+        server->_statsSocket = NULL;
+    }
+
+    // And the hand off listener.
+    if (server->_handOffSocket != NULL) {
+        CFSocketInvalidate(server->_handOffSocket);
+        CFRelease(server->_handOffSocket);
+        server->_handOffSocket = NULL;
+    }
 }
 
 
@@ -479,6 +1112,9 @@ _ServerCreateAndRegisterNetService(Server* server) {
             port = ntohs(nativeAddr->sin_port);
         }
         
+        // Note the start, so a long lived service earns a fresh backoff.
+        server->_registered = CFAbsoluteTimeGetCurrent();
+        
         // Create the service for registration.
         server->_service = CFNetServiceCreate(server->_alloc,
                                               CFSTR(""),
@@ -521,52 +1157,1423 @@ _ServerCreateAndRegisterNetService(Server* server) {
 
 
 /* static */ void
-_ServerHandleAccept(Server* server, CFSocketNativeHandle nativeSocket) {
+_ServerScheduleRegistration(Server* server) {
+
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	CFRunLoopTimerContext timerCtxt = {0,
+									   server,
+									   (const void*(*)(const void*))&ServerRetain,
+									   (void(*)(const void*))&ServerRelease,
+									   (CFStringRef(*)(const void*))&_ServerCopyDescription};
 	
-	// Inform the user of an incoming connection.
-	if (server->_callback != NULL) {
-		CFStreamError error = {0, 0};
-		server->_callback((ServerRef)server, nativeSocket, &error, server->_ctxt.info);
-	}
+	// Only one attempt waits at a time, and only while there's a service.
+	if ((server->_retryTimer != NULL) || (server->_type == NULL))
+		return;
+	
+	// Double the wait each time, unless the last attempt held up for a while.
+	if ((server->_retryDelay == 0) || ((now - server->_registered) > kRetryDelayMax))
+		server->_retryDelay = kRetryDelayMin;
+	else if ((server->_retryDelay *= 2) > kRetryDelayMax)
+		server->_retryDelay = kRetryDelayMax;
+	
+	// One shot timer for the next attempt.
+	server->_retryTimer = CFRunLoopTimerCreate(server->_alloc,
+											   now + server->_retryDelay,
+											   0,		// interval
+											   0,		// flags
+											   0,		// order
+											   (CFRunLoopTimerCallBack)&_RetryTimerCallBack,
+											   &timerCtxt);
+	
+	// Without a timer the service stays unregistered, but accepting goes on.
+	if (server->_retryTimer != NULL)
+		CFRunLoopAddTimer(CFRunLoopGetCurrent(), server->_retryTimer, kCFRunLoopCommonModes);
 }
 
 
 /* static */ void
-_ServerHandleNetServiceError(Server* server, CFStreamError* error) {
-
-	// No matter what happened, tear down the service.
-	_ServerReleaseNetService(server);
+_ServerReleaseRetryTimer(Server* server) {
 
-	// Handle the error.
-    if (error->error != 0) {
-    
-		// Kill the underlying socket to prevent callbacks.
-		_ServerReleaseSocket(server);
-	
-		// Inform the user of the error.
-		if (server->_callback != NULL)
-			server->_callback((ServerRef)server, (CFSocketNativeHandle)(-1), error, server->_ctxt.info);
+	// Invalidate and release the timer if there is one.
+	if (server->_retryTimer != NULL) {
+		CFRunLoopTimerInvalidate(server->_retryTimer);
+		CFRelease(server->_retryTimer);
+		server->_retryTimer = NULL;
 	}
 }
 
 
 /* static */ void
-_SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server) {
-
-    assert((sock == server->_sockets[0]) || (sock == server->_sockets[1]));
-
-	// Only care about accept callbacks.
-    if (type == kCFSocketAcceptCallBack) {
-    
-		assert((data != NULL) && (*((CFSocketNativeHandle*)data) != -1));
+_ServerHandleAccept(Server* server, CFSocketNativeHandle nativeSocket) {
+	
+	StatisticsShardRef shard = StatisticsGetShard(server->_statistics);
+	
+	ECHOTRACE_ACCEPT_START(nativeSocket);
+	
+	// Count it on whichever thread took it.
+	if (shard != NULL)
+		StatisticsAdd(shard, kStatisticsAccepts, 1);
+	
+	// Over the limits, get rid of it before anything is built on it.
+	if (!_ServerAdmitConnection(server)) {
+	
+		struct linger linger = {1, 0};
+		
+		// Reset instead of a graceful close, so nothing lingers in the kernel either.
+		setsockopt(nativeSocket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		close(nativeSocket);
 		
-		// Dispatch the accept event.
-		_ServerHandleAccept(server, *((CFSocketNativeHandle*)data));
+		if (shard != NULL)
+			StatisticsAdd(shard, kStatisticsRejects, 1);
+		
+		ECHOTRACE_ACCEPT_DONE(nativeSocket, FALSE);
+		return;
+	}
+	
+	// Tune the socket before anything is built on it.
+	_ServerPrepareConnection(server, nativeSocket);
+	
+	// Inform the user of an incoming connection.
+	if (server->_callback != NULL) {
+		CFStreamError error = {0, 0};
+		server->_callback((ServerRef)server, nativeSocket, &error, server->_ctxt.info);
 	}
+	
+	ECHOTRACE_ACCEPT_DONE(nativeSocket, TRUE);
 }
 
 
-/* static */ void
+/* static */ Boolean
+_ServerAdmitConnection(Server* server) {
+
+	const ServerOptions* options = &(server->_options);
+	
+	if (options->maxConnections > 0) {
+	
+		// Closes first, so a connection opening in between can't make it negative.
+		UInt64 closes = StatisticsGetTotal(server->_statistics, kStatisticsCloses);
+		UInt64 opens = StatisticsGetTotal(server->_statistics, kStatisticsOpens);
+		
+		if ((opens - closes) >= (UInt64)options->maxConnections)
+			return FALSE;
+	}
+	
+	// Only what got past the cap spends a token.
+	if (options->acceptRate > 0) {
+	
+		Boolean admit;
+		CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+		
+		pthread_mutex_lock(&(server->_admitLock));
+		
+		// Top up for the time that passed, to no more than the burst.
+		server->_tokens += (now - server->_refilled) * options->acceptRate;
+		if (server->_tokens > options->acceptBurst)
+			server->_tokens = options->acceptBurst;
+		server->_refilled = now;
+		
+		admit = (server->_tokens >= 1.0);
+		if (admit)
+			server->_tokens -= 1.0;
+		
+		pthread_mutex_unlock(&(server->_admitLock));
+		
+		return admit;
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_ServerPrepareListener(Server* server, CFSocketRef sock) {
+
+	CFSocketNativeHandle native = CFSocketGetNative(sock);
+	
+	// Listening again on a bound socket just changes the queue length.
+	if (!server->_options.datagram && (server->_options.listenBacklog > 0) &&
+		(listen(native, (int)server->_options.listenBacklog) == -1))
+	{
+		return FALSE;
+	}
+	
+	// Draining the queue needs an accept, or a read, that fails instead of blocking.
+	if (server->_options.batchAccept || server->_options.datagram) {
+		int flags = fcntl(native, F_GETFL, 0);
+		if ((flags == -1) || (fcntl(native, F_SETFL, flags | O_NONBLOCK) == -1))
+			return FALSE;
+	}
+	
+	// The window offered in the handshake comes from the listener's buffer.
+	if (server->_options.receiveBufferSize > 0) {
+		int size = (int)server->_options.receiveBufferSize;
+		setsockopt(native, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	
+	// A datagram socket does all its own sending too.
+	if (server->_options.datagram && (server->_options.sendBufferSize > 0)) {
+		int size = (int)server->_options.sendBufferSize;
+		setsockopt(native, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_ServerPrepareConnection(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	const ServerOptions* options = &(server->_options);
+	
+	// None of this is worth dropping a connection over, so failures are
+	// ignored and the system defaults stand.
+	
+	if (options->sendBufferSize > 0) {
+		int size = (int)options->sendBufferSize;
+		setsockopt(nativeSocket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	
+	if (options->receiveBufferSize > 0) {
+		int size = (int)options->receiveBufferSize;
+		setsockopt(nativeSocket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	
+	if (options->keepAliveIdle > 0) {
+	
+		int yes = 1;
+		int idle = (int)options->keepAliveIdle;
+		
+		setsockopt(nativeSocket, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+		
+		// Darwin calls the idle time TCP_KEEPALIVE; Linux calls it TCP_KEEPIDLE.
+#if defined(TCP_KEEPALIVE)
+		setsockopt(nativeSocket, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+#elif defined(TCP_KEEPIDLE)
+		setsockopt(nativeSocket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#else
+		(void)idle;
+#endif
+		
+#if defined(TCP_KEEPINTVL)
+		if (options->keepAliveInterval > 0) {
+			int interval = (int)options->keepAliveInterval;
+			setsockopt(nativeSocket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+		}
+#endif
+		
+#if defined(TCP_KEEPCNT)
+		if (options->keepAliveCount > 0) {
+			int count = (int)options->keepAliveCount;
+			setsockopt(nativeSocket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+		}
+#endif
+	}
+}
+
+
+/* static */ CFIndex
+_ServerAcceptBatch(Server* server, CFSocketRef sock, CFSocketNativeHandle* batch, CFIndex max) {
+
+	CFIndex count = 0;
+	CFSocketNativeHandle listener = CFSocketGetNative(sock);
+	
+	while (count < max) {
+	
+		int flags;
+		CFSocketNativeHandle accepted = accept(listener, NULL, NULL);
+		
+		if (accepted == -1) {
+		
+			// A client that gave up while queued, or a signal, doesn't end the batch.
+			if ((errno == ECONNABORTED) || (errno == EINTR))
+				continue;
+			
+			// Out of descriptors, the connection would stay queued and the
+			// listener readable, so the run loop would spin.  Turn it away
+			// instead, and the rest of the queue after it.
+			if (((errno == EMFILE) || (errno == ENFILE)) && _ServerShedPending(server, listener))
+				continue;
+			
+			// The queue is empty; try again on the next event.
+			break;
+		}
+		
+		// Accepted sockets inherit non-blocking from the listener.  Hand them on
+		// the way CFSocket's accept callback would.
+		flags = fcntl(accepted, F_GETFL, 0);
+		if (flags != -1)
+			fcntl(accepted, F_SETFL, flags & ~O_NONBLOCK);
+		
+		batch[count++] = accepted;
+	}
+	
+	return count;
+}
+
+
+/* static */ Boolean
+_ServerShedPending(Server* server, CFSocketNativeHandle listener) {
+
+	Boolean shed = FALSE;
+	
+	pthread_mutex_lock(&(server->_reserveLock));
+	
+	// Give up the spare for just long enough to take the connection off the queue.
+	if (server->_reserve != -1) {
+	
+		CFSocketNativeHandle accepted;
+		
+		close(server->_reserve);
+		accepted = accept(listener, NULL, NULL);
+		
+		if (accepted != -1) {
+		
+			struct linger linger = {1, 0};
+			StatisticsShardRef shard = StatisticsGetShard(server->_statistics);
+			
+			// Reset, the same as a connection over the admission limits.
+			setsockopt(accepted, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+			close(accepted);
+			
+			if (shard != NULL) {
+				StatisticsAdd(shard, kStatisticsAccepts, 1);
+				StatisticsAdd(shard, kStatisticsRejects, 1);
+			}
+			
+			shed = TRUE;
+		}
+		
+		// Another thread may have taken the slot, in which case the next try
+		// finds no spare and waits for the next event like before.
+		server->_reserve = open("/dev/null", O_RDONLY);
+	}
+	
+	pthread_mutex_unlock(&(server->_reserveLock));
+	
+	return shed;
+}
+
+
+#if defined(MSG_WAITFORONE)
+
+/* static */ void
+_ServerEchoDatagrams(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	CFIndex i, count, kept, sent, batches = 0;
+	UInt64 bytesIn = 0, bytesOut = 0, dropped = 0;
+	StatisticsShardRef shard = StatisticsGetShard(server->_statistics);
+	
+	UInt8 buffers[kDatagramBatch][kDatagramSize];
+	struct sockaddr_storage peers[kDatagramBatch];
+	struct iovec vectors[kDatagramBatch];
+	struct mmsghdr messages[kDatagramBatch];
+	
+	do {
+		// Every datagram gets a buffer and room for its sender's address.
+		for (i = 0; i < kDatagramBatch; i++) {
+		
+			vectors[i].iov_base = buffers[i];
+			vectors[i].iov_len = kDatagramSize;
+			
+			bzero(&(messages[i]), sizeof(messages[i]));
+			messages[i].msg_hdr.msg_name = &(peers[i]);
+			messages[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+			messages[i].msg_hdr.msg_iov = &(vectors[i]);
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		
+		count = recvmmsg(nativeSocket, messages, kDatagramBatch, MSG_DONTWAIT, NULL);
+		if (count <= 0)
+			break;
+		
+		// Send back exactly what came in, to whoever sent it, leaving out
+		// anything that didn't fit.
+		for (i = 0, kept = 0; i < count; i++) {
+		
+			bytesIn += messages[i].msg_len;
+			
+			if ((messages[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+				dropped++;
+				continue;
+			}
+			
+			vectors[i].iov_len = messages[i].msg_len;
+			messages[kept++] = messages[i];
+		}
+		
+		// A full send buffer loses the rest, as the network might have anyway.
+		for (sent = 0; sent < kept; ) {
+		
+			int n = sendmmsg(nativeSocket, &(messages[sent]), (unsigned int)(kept - sent), MSG_DONTWAIT);
+			if (n <= 0)
+				break;
+			
+			for (i = sent; i < (sent + n); i++)
+				bytesOut += messages[i].msg_len;
+			
+			sent += n;
+		}
+	
+	// Keep going while batches come back full, but give the run loop a turn.
+	} while ((count == kDatagramBatch) && (++batches < kDatagramBudget));
+	
+	if (shard != NULL) {
+		StatisticsAdd(shard, kStatisticsBytesIn, bytesIn);
+		StatisticsAdd(shard, kStatisticsBytesOut, bytesOut);
+		StatisticsAdd(shard, kStatisticsOverflows, dropped);
+	}
+}
+
+#else
+
+/* static */ void
+_ServerEchoDatagrams(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	CFIndex i, count, batches = 0;
+	UInt64 bytesIn = 0, bytesOut = 0, dropped = 0;
+	StatisticsShardRef shard = StatisticsGetShard(server->_statistics);
+	
+	UInt8 buffers[kDatagramBatch][kDatagramSize];
+	struct sockaddr_storage peers[kDatagramBatch];
+	struct iovec vectors[kDatagramBatch];
+	struct msghdr messages[kDatagramBatch];
+	
+	do {
+		// Without recvmmsg, read the batch one datagram at a time.
+		for (count = 0; count < kDatagramBatch; count++) {
+		
+			ssize_t length;
+			
+			vectors[count].iov_base = buffers[count];
+			vectors[count].iov_len = kDatagramSize;
+			
+			bzero(&(messages[count]), sizeof(messages[count]));
+			messages[count].msg_name = &(peers[count]);
+			messages[count].msg_namelen = sizeof(peers[count]);
+			messages[count].msg_iov = &(vectors[count]);
+			messages[count].msg_iovlen = 1;
+			
+			length = recvmsg(nativeSocket, &(messages[count]), MSG_DONTWAIT);
+			if (length < 0)
+				break;
+			
+			bytesIn += length;
+			vectors[count].iov_len = length;
+		}
+		
+		// Then send each back, giving up on the batch once the send buffer fills.
+		for (i = 0; i < count; i++) {
+		
+			if ((messages[i].msg_flags & MSG_TRUNC) != 0) {
+				dropped++;
+				continue;
+			}
+			
+			if (sendmsg(nativeSocket, &(messages[i]), MSG_DONTWAIT) < 0)
+				break;
+			
+			bytesOut += vectors[i].iov_len;
+		}
+	
+	// Keep going while batches come back full, but give the run loop a turn.
+	} while ((count == kDatagramBatch) && (++batches < kDatagramBudget));
+	
+	if (shard != NULL) {
+		StatisticsAdd(shard, kStatisticsBytesIn, bytesIn);
+		StatisticsAdd(shard, kStatisticsBytesOut, bytesOut);
+		StatisticsAdd(shard, kStatisticsOverflows, dropped);
+	}
+}
+
+#endif
+
+
+/* static */ void
+_ServerHandleNetServiceError(Server* server, CFStreamError* error) {
+
+	// No matter what happened, tear down the service.
+	_ServerReleaseNetService(server);
+
+	// The listeners carry on regardless; registration is tried again later,
+	// which also covers mDNSResponder going away and coming back.
+    if (error->error != 0)
+		_ServerScheduleRegistration(server);
+}
+
+
+/* static */ Boolean
+_ServerServeStatistics(Server* server, UInt32 port) {
+
+	CFDataRef address = NULL;
+	CFRunLoopSourceRef src = NULL;
+	
+	do {
+		int yes = 1;
+		struct sockaddr_in addr;
+		CFSocketContext socketCtxt = {0,
+									  server,
+									  (const void*(*)(const void*))&ServerRetain,
+									  (void(*)(const void*))&ServerRelease,
+									  (CFStringRef(*)(const void *))&_ServerCopyDescription};
+		
+		// Make sure the port is valid (0 - 65535).
+		if ((port & 0xFFFF0000U) != 0)
+			break;
+		
+		// Create the listener.
+		server->_statsSocket = CFSocketCreate(server->_alloc,
+											  PF_INET,
+											  SOCK_STREAM,
+											  IPPROTO_TCP,
+											  kCFSocketAcceptCallBack,
+											  (CFSocketCallBack)&_StatisticsSocketCallBack,
+											  &socketCtxt);
+		
+		// If the socket couldn't create, bail.
+		if (server->_statsSocket == NULL)
+			break;
+		
+		setsockopt(CFSocketGetNative(server->_statsSocket), SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		
+		bzero(&addr, sizeof(addr));
+		
+		// Only the local machine gets to look.
+		addr.sin_len = sizeof(addr);
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((UInt16)port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		
+		// Wrap the native address structure for CFSocketSetAddress.
+		address = CFDataCreateWithBytesNoCopy(server->_alloc, (const UInt8*)&addr, sizeof(addr), kCFAllocatorNull);
+		
+		// If it failed to create the address data, bail.
+		if (address == NULL)
+			break;
+		
+		// Set the local binding which causes the socket to start listening.
+		if (CFSocketSetAddress(server->_statsSocket, address) != kCFSocketSuccess)
+			break;
+		
+		// Create the run loop source for putting on the run loop.
+		src = CFSocketCreateRunLoopSource(server->_alloc, server->_statsSocket, 0);
+		if (src == NULL)
+			break;
+		
+		// Reports are cheap, so they're served from the server's own run loop.
+		CFRunLoopAddSource(CFRunLoopGetCurrent(), src, kCFRunLoopCommonModes);
+		
+		CFRelease(src);
+		CFRelease(address);
+		
+		return TRUE;
+	
+	} while (0);
+	
+	// Release the address data if it was created.
+	if (address)
+		CFRelease(address);
+	
+	// The caller tears down the listener along with the others.
+	return FALSE;
+}
+
+
+/* static */ void
+_ServerSendStatistics(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	CFDataRef report = StatisticsCopyReport(server->_statistics);
+	int flags = fcntl(nativeSocket, F_GETFL, 0);
+	
+#if defined(SO_NOSIGPIPE)
+	int yes = 1;
+	setsockopt(nativeSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+	
+	// This is the run loop's thread, and a client that doesn't read mustn't
+	// hold up everything else on it.
+	if ((flags == -1) || (fcntl(nativeSocket, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		close(nativeSocket);
+		nativeSocket = -1;
+	}
+	
+	if ((report != NULL) && (nativeSocket != -1)) {
+	
+		const UInt8* bytes = CFDataGetBytePtr(report);
+		CFIndex length = CFDataGetLength(report);
+		
+		// The report is a couple of kilobytes at most, which a fresh socket
+		// takes whole.  Anything short, or a full buffer, is the client's loss.
+		while (length > 0) {
+		
+			ssize_t sent = send(nativeSocket, bytes, length, kSendFlags);
+			
+			if (sent > 0) {
+				bytes += sent;
+				length -= sent;
+			}
+			else if ((sent == -1) && (errno == EINTR))
+				continue;
+			else
+				break;
+		}
+	}
+	
+	if (report != NULL)
+		CFRelease(report);
+	
+	if (nativeSocket != -1)
+		close(nativeSocket);
+}
+
+
+/* static */ Boolean
+_ServerAdoptListener(Server* server, unsigned index, CFSocketNativeHandle nativeSocket) {
+
+	CFSocketRef sock;
+	CFSocketContext socketCtxt = {0,
+								  server,
+								  (const void*(*)(const void*))&ServerRetain,
+								  (void(*)(const void*))&ServerRelease,
+								  (CFStringRef(*)(const void *))&_ServerCopyDescription};
+	
+	// Same callbacks as the sockets ServerCreate made.
+	sock = CFSocketCreateWithNative(server->_alloc,
+									nativeSocket,
+									(server->_options.batchAccept || server->_options.datagram) ? kCFSocketReadCallBack : kCFSocketAcceptCallBack,
+									(CFSocketCallBack)&_SocketCallBack,
+									&socketCtxt);
+	
+	if (sock == NULL)
+		return FALSE;
+	
+	// Replace the one that is there.
+	if (server->_sockets[index] != NULL) {
+		CFSocketInvalidate(server->_sockets[index]);
+		CFRelease(server->_sockets[index]);
+	}
+	
+	server->_sockets[index] = sock;
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_ServerSendListeners(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	UInt8 version = kHandOffVersion;
+	struct iovec iov = {&version, sizeof(version)};
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	int fds[2];
+	union {
+		struct cmsghdr	header;
+		UInt8			space[CMSG_SPACE(sizeof(fds))];
+	} control;
+	
+	// Nothing to give if not listening.
+	if ((server->_sockets[0] == NULL) || (server->_sockets[1] == NULL))
+		return FALSE;
+	
+	fds[0] = CFSocketGetNative(server->_sockets[0]);
+	fds[1] = CFSocketGetNative(server->_sockets[1]);
+	
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.space;
+	msg.msg_controllen = sizeof(control.space);
+	
+	// The descriptors ride along with the version byte.
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	
+	return (sendmsg(nativeSocket, &msg, kSendFlags) == sizeof(version));
+}
+
+
+/* static */ Boolean
+_ServerIsPeerTrusted(CFSocketNativeHandle nativeSocket) {
+
+	uid_t uid;
+	
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t length = sizeof(cred);
+	
+	if (getsockopt(nativeSocket, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1)
+		return FALSE;
+	
+	uid = cred.uid;
+#else
+	gid_t gid;
+	
+	if (getpeereid(nativeSocket, &uid, &gid) == -1)
+		return FALSE;
+#endif
+	
+	// The other end must be running as this process is.
+	return (uid == geteuid());
+}
+
+
+/* static */ void
+_ServerHandOffListeners(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	CFIndex i;
+	CFStreamError error = {0, 0};
+	
+	// Anyone else asking gets nothing.
+	Boolean sent = _ServerIsPeerTrusted(nativeSocket) && _ServerSendListeners(server, nativeSocket);
+	
+	close(nativeSocket);
+	
+	// Keep on as before if the successor didn't get them.
+	if (!sent)
+		return;
+	
+	// The successor registers the service now, so stop advertising it here.
+	_ServerReleaseNetService(server);
+	_ServerReleaseRetryTimer(server);
+	
+	if (server->_type) {
+		CFRelease(server->_type);
+		server->_type = NULL;
+	}
+	
+	// Its copies keep the sockets and their accept queues alive, so these
+	// can close.  Worker listeners aren't handed over, so anything waiting
+	// in their queues is lost.
+	_ServerStopSources(server);
+	_ServerReleaseSocket(server);
+	
+	for (i = 0; (server->_workers != NULL) && (i < server->_options.workerCount); i++)
+		_ServerWorkerStopListening(&(server->_workers[i]));
+	
+	// No more connections are coming; the user decides how to drain.
+	if (server->_callback != NULL)
+		server->_callback((ServerRef)server, (CFSocketNativeHandle)(-1), &error, server->_ctxt.info);
+}
+
+
+/* static */ Boolean
+_ServerStartSources(Server* server) {
+
+#if defined(SERVER_DISPATCH)
+	unsigned i;
+	
+	// Sources on a concurrent queue let both listeners, and every
+	// connection they hand out, run on whatever cores are free.
+	server->_queue = dispatch_queue_create("Server", DISPATCH_QUEUE_CONCURRENT);
+	if (server->_queue == NULL)
+		return FALSE;
+	
+	dispatch_queue_set_specific(server->_queue, &kQueueKey, server, NULL);
+	
+	// Stopping waits on this for each source to be done.
+	server->_cancelled = dispatch_semaphore_create(0);
+	if (server->_cancelled == NULL)
+		return FALSE;
+	
+	for (i = 0; i < (sizeof(server->_listeners) / sizeof(server->_listeners[0])); i++) {
+	
+		ServerListener* listener = &(server->_listeners[i]);
+		
+		listener->_server = server;
+		listener->_socket = server->_sockets[i];
+		listener->_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
+												   CFSocketGetNative(server->_sockets[i]),
+												   0,
+												   server->_queue);
+		if (listener->_source == NULL)
+			return FALSE;
+		
+		dispatch_set_context(listener->_source, listener);
+		dispatch_source_set_event_handler_f(listener->_source, (dispatch_function_t)&_ListenerSourceCallBack);
+		dispatch_source_set_cancel_handler_f(listener->_source, (dispatch_function_t)&_ListenerCancelCallBack);
+		dispatch_resume(listener->_source);
+	}
+	
+	return TRUE;
+#else
+	// Fail if there's no dispatch on this system.
+	return FALSE;
+#endif
+}
+
+
+/* static */ void
+_ServerStopSources(Server* server) {
+
+#if defined(SERVER_DISPATCH)
+	unsigned i;
+	
+	// Waiting from one of the listeners' own callbacks would never end.
+	assert((server->_queue == NULL) || (dispatch_get_specific(&kQueueKey) != server));
+	
+	for (i = 0; i < (sizeof(server->_listeners) / sizeof(server->_listeners[0])); i++) {
+		if (server->_listeners[i]._source != NULL)
+			dispatch_source_cancel(server->_listeners[i]._source);
+	}
+	
+	// A cancel handler runs only once any callback in progress is done, so
+	// after this nothing is using the server or its sockets.
+	for (i = 0; i < (sizeof(server->_listeners) / sizeof(server->_listeners[0])); i++) {
+		if (server->_listeners[i]._source != NULL) {
+			dispatch_semaphore_wait(server->_cancelled, DISPATCH_TIME_FOREVER);
+			dispatch_release(server->_listeners[i]._source);
+			server->_listeners[i]._source = NULL;
+		}
+	}
+	
+	if (server->_cancelled != NULL) {
+		dispatch_release(server->_cancelled);
+		server->_cancelled = NULL;
+	}
+	
+	if (server->_queue != NULL) {
+		dispatch_release(server->_queue);
+		server->_queue = NULL;
+	}
+#endif
+}
+
+
+/* static */ Boolean
+_ServerStartWorkers(Server* server) {
+
+	CFIndex i, count = server->_options.workerCount;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	// Nothing to do without workers.
+	if (count == 0)
+		return TRUE;
+	
+	if (cpus < 1)
+		cpus = 1;
+	
+	// Allocate the workers.
+	server->_workers = CFAllocatorAllocate(server->_alloc, count * sizeof(server->_workers[0]), 0);
+	if (server->_workers == NULL)
+		return FALSE;
+	
+	memset(server->_workers, 0, count * sizeof(server->_workers[0]));
+	
+	for (i = 0; i < count; i++) {
+	
+		ServerWorker* worker = &(server->_workers[i]);
+		CFRunLoopSourceContext sourceCtxt = {0, worker, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+											 (void(*)(void*))&_ServerWorkerPerform};
+		
+		worker->_server = server;
+		worker->_cpu = server->_options.pinWorkers ? ((server->_options.firstCPU + i) % cpus) : -1;
+		pthread_mutex_init(&(worker->_lock), NULL);
+		pthread_cond_init(&(worker->_ready), NULL);
+		
+		// Create the source for handing over sockets and the wheel for timeouts.
+		// Both go on the worker's run loop once its thread is up.
+		worker->_source = CFRunLoopSourceCreate(server->_alloc, 0, &sourceCtxt);
+		worker->_timers = TimerWheelCreate(server->_alloc, kTimerResolution);
+		worker->_registry = ConnectionRegistryCreate(server->_alloc);
+		
+		if ((worker->_source == NULL) || (worker->_timers == NULL) || (worker->_registry == NULL))
+			return FALSE;
+		
+		// Start the thread.
+		if (pthread_create(&(worker->_thread), NULL, (void*(*)(void*))&_ServerWorkerMain, worker) != 0)
+			return FALSE;
+		
+		worker->_started = TRUE;
+		
+		// Wait for the run loop, so sockets can be handed over.
+		pthread_mutex_lock(&(worker->_lock));
+		while (worker->_runLoop == NULL)
+			pthread_cond_wait(&(worker->_ready), &(worker->_lock));
+		pthread_mutex_unlock(&(worker->_lock));
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_ServerStopWorkers(Server* server) {
+
+	CFIndex i;
+	
+	// Nothing to do without workers.
+	if (server->_workers == NULL)
+		return;
+	
+	for (i = 0; i < server->_options.workerCount; i++) {
+	
+		ServerWorker* worker = &(server->_workers[i]);
+		
+		// Ask the worker to stop, from its own run loop, and wait for it.
+		// It lets go of its listeners on the way out.
+		if (worker->_started) {
+		
+			pthread_mutex_lock(&(worker->_lock));
+			worker->_stopping = TRUE;
+			pthread_mutex_unlock(&(worker->_lock));
+			
+			CFRunLoopSourceSignal(worker->_source);
+			CFRunLoopWakeUp(worker->_runLoop);
+			
+			pthread_join(worker->_thread, NULL);
+		}
+		
+		// With the thread gone, whatever it didn't get to can go from here.
+		_ServerWorkerReleaseSockets(worker);
+		
+		// Anything handed over but never picked up still has to be closed.
+		while (worker->_pendingCount > 0)
+			close(worker->_pending[--(worker->_pendingCount)]);
+		
+		if (worker->_pending != NULL)
+			CFAllocatorDeallocate(server->_alloc, worker->_pending);
+		
+		if (worker->_source != NULL) {
+			CFRunLoopSourceInvalidate(worker->_source);
+			CFRelease(worker->_source);
+		}
+		
+		if (worker->_timers != NULL) {
+			TimerWheelInvalidate(worker->_timers);
+			TimerWheelRelease(worker->_timers);
+		}
+		
+		// The worker closed its connections on the way out.
+		if (worker->_registry != NULL)
+			ConnectionRegistryRelease(worker->_registry);
+		
+		if (worker->_runLoop != NULL)
+			CFRelease(worker->_runLoop);
+		
+		// Its blocks go once the last connection using them does.
+		if (worker->_allocator != NULL)
+			CFRelease(worker->_allocator);
+		
+		pthread_cond_destroy(&(worker->_ready));
+		pthread_mutex_destroy(&(worker->_lock));
+	}
+	
+	CFAllocatorDeallocate(server->_alloc, server->_workers);
+	server->_workers = NULL;
+}
+
+
+/* static */ ServerWorker*
+_ServerGetCurrentWorker(Server* server) {
+
+	CFIndex i;
+	pthread_t self = pthread_self();
+	
+	for (i = 0; (server->_workers != NULL) && (i < server->_options.workerCount); i++) {
+		if (server->_workers[i]._started && pthread_equal(server->_workers[i]._thread, self))
+			return &(server->_workers[i]);
+	}
+	
+	return NULL;
+}
+
+
+/* static */ ServerWorker*
+_ServerChooseWorker(Server* server, CFSocketNativeHandle nativeSocket) {
+
+	CFIndex i, count = server->_options.workerCount;
+	ServerWorker* best = &(server->_workers[server->_nextWorker]);
+	
+	// Round robin moves on each time.  It is also where ties start from.
+	server->_nextWorker = (server->_nextWorker + 1) % count;
+	
+#if defined(SO_INCOMING_CPU)
+	if ((server->_options.workerPolicy == kServerWorkerIncomingCPU) && server->_options.pinWorkers) {
+	
+		int cpu = -1;
+		socklen_t length = sizeof(cpu);
+		
+		// Workers sit on consecutive CPUs from the first one, wrapping.
+		if ((getsockopt(nativeSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0) && (cpu >= 0)) {
+			for (i = 0; i < count; i++) {
+				if (server->_workers[i]._cpu == cpu)
+					return &(server->_workers[i]);
+			}
+		}
+	}
+#else
+	(void)nativeSocket;
+#endif
+	
+	if (server->_options.workerPolicy == kServerWorkerLeastLoaded) {
+	
+		CFIndex least = -1;
+		
+		for (i = 0; i < count; i++) {
+		
+			ServerWorker* worker = &(server->_workers[i]);
+			CFIndex load;
+			
+			// Connections it has plus ones on their way to it.
+			pthread_mutex_lock(&(worker->_lock));
+			load = worker->_pendingCount;
+			pthread_mutex_unlock(&(worker->_lock));
+			
+			load += ConnectionRegistryGetCount(worker->_registry);
+			
+			if ((least == -1) || (load < least)) {
+				least = load;
+				best = worker;
+			}
+		}
+	}
+	
+	return best;
+}
+
+
+/* static */ void
+_ServerHandOff(Server* server, const CFSocketNativeHandle* sockets, CFIndex count) {
+
+	CFIndex i;
+	
+	// Queue each one on its worker.
+	for (i = 0; i < count; i++) {
+	
+		ServerWorker* worker = _ServerChooseWorker(server, sockets[i]);
+		
+		// No way to hand it over, so drop the connection.
+		if (!_ServerWorkerEnqueue(worker, sockets[i]))
+			close(sockets[i]);
+		else
+			worker->_wake = TRUE;
+	}
+	
+	// Then let each worker that got any know, once.
+	for (i = 0; i < server->_options.workerCount; i++) {
+	
+		ServerWorker* worker = &(server->_workers[i]);
+		
+		if (worker->_wake) {
+			worker->_wake = FALSE;
+			CFRunLoopSourceSignal(worker->_source);
+			CFRunLoopWakeUp(worker->_runLoop);
+		}
+	}
+}
+
+
+/* static */ Boolean
+_ServerPinThread(CFIndex cpu) {
+
+#if defined(__linux__)
+	cpu_set_t set;
+	
+	CPU_ZERO(&set);
+	CPU_SET((int)cpu, &set);
+	
+	return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+#elif defined(__APPLE__)
+	// Mach has no hard binding; threads with different tags are kept on
+	// different cores, and the tag is as close as it gets.
+	thread_affinity_policy_data_t policy = {(integer_t)(cpu + 1)};
+	
+	return (thread_policy_set(pthread_mach_thread_np(pthread_self()),
+							  THREAD_AFFINITY_POLICY,
+							  (thread_policy_t)&policy,
+							  THREAD_AFFINITY_POLICY_COUNT) == KERN_SUCCESS);
+#else
+	(void)cpu;
+	return FALSE;
+#endif
+}
+
+
+/* static */ Boolean
+_ServerWorkerEnqueue(ServerWorker* worker, CFSocketNativeHandle nativeSocket) {
+
+	pthread_mutex_lock(&(worker->_lock));
+	
+	// Make room if the queue is full.
+	if (worker->_pendingCount == worker->_pendingCapacity) {
+	
+		CFIndex capacity = worker->_pendingCapacity ? (2 * worker->_pendingCapacity) : kHandOffBatch;
+		CFSocketNativeHandle* pending = CFAllocatorReallocate(worker->_server->_alloc,
+															  worker->_pending,
+															  capacity * sizeof(pending[0]),
+															  0);
+		
+		if (pending == NULL) {
+			pthread_mutex_unlock(&(worker->_lock));
+			return FALSE;
+		}
+		
+		worker->_pending = pending;
+		worker->_pendingCapacity = capacity;
+	}
+	
+	worker->_pending[worker->_pendingCount++] = nativeSocket;
+	
+	pthread_mutex_unlock(&(worker->_lock));
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_ServerWorkerListen(ServerWorker* worker, UInt32 port) {
+
+#if defined(kServerReusePort)
+	unsigned i;
+	
+	// Only when asked for.
+	if (!worker->_server->_options.reusePort)
+		return TRUE;
+	
+	worker->_sockets[0] = _ServerWorkerCreateListener(worker, PF_INET, port);
+	worker->_sockets[1] = _ServerWorkerCreateListener(worker, PF_INET6, port);
+	
+	if ((worker->_sockets[0] == NULL) || (worker->_sockets[1] == NULL))
+		return FALSE;
+	
+	for (i = 0; i < (sizeof(worker->_sockets) / sizeof(worker->_sockets[0])); i++) {
+	
+		// Accepts happen on the worker's run loop, not the server's.
+		CFRunLoopSourceRef src = CFSocketCreateRunLoopSource(worker->_server->_alloc, worker->_sockets[i], 0);
+		if (src == NULL)
+			return FALSE;
+		
+		CFRunLoopAddSource(worker->_runLoop, src, kCFRunLoopCommonModes);
+		CFRelease(src);
+	}
+	
+	CFRunLoopWakeUp(worker->_runLoop);
+#else
+	(void)worker;
+	(void)port;
+#endif
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_ServerWorkerReleaseSockets(ServerWorker* worker) {
+
+	unsigned i;
+	
+	for (i = 0; i < (sizeof(worker->_sockets) / sizeof(worker->_sockets[0])); i++) {
+	
+		// Invalidate and release the socket if there is one.
+		if (worker->_sockets[i] != NULL) {
+			CFSocketInvalidate(worker->_sockets[i]);
+			CFRelease(worker->_sockets[i]);
+			worker->_sockets[i] = NULL;
+		}
+	}
+}
+
+
+/* static */ void
+_ServerWorkerStopListening(ServerWorker* worker) {
+
+	// The worker may be accepting on them right now, so it lets go of them
+	// itself, from its own run loop.
+	pthread_mutex_lock(&(worker->_lock));
+	worker->_unlisten = TRUE;
+	pthread_mutex_unlock(&(worker->_lock));
+	
+	CFRunLoopSourceSignal(worker->_source);
+	CFRunLoopWakeUp(worker->_runLoop);
+}
+
+
+/* static */ CFSocketRef
+_ServerWorkerCreateListener(ServerWorker* worker, int family, UInt32 port) {
+
+	int yes = 1;
+	CFDataRef address;
+	CFSocketError err;
+	CFSocketRef sock;
+	
+	UInt8 buffer[SOCK_MAXADDRLEN];
+	struct sockaddr_in* addr4 = (struct sockaddr_in*)&(buffer[0]);
+	struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&(buffer[0]);
+	
+	// The worker is owned by the server and outlives the socket, so no retain.
+	CFSocketContext socketCtxt = {0, worker, NULL, NULL, NULL};
+	
+	sock = CFSocketCreate(worker->_server->_alloc,
+						  family,
+						  worker->_server->_options.datagram ? SOCK_DGRAM : SOCK_STREAM,
+						  worker->_server->_options.datagram ? IPPROTO_UDP : IPPROTO_TCP,
+						  (worker->_server->_options.batchAccept || worker->_server->_options.datagram) ? kCFSocketReadCallBack : kCFSocketAcceptCallBack,
+						  (CFSocketCallBack)&_WorkerSocketCallBack,
+						  &socketCtxt);
+	
+	if (sock == NULL)
+		return NULL;
+	
+	// Join the others on the port.
+	setsockopt(CFSocketGetNative(sock), SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#if defined(kServerReusePort)
+	setsockopt(CFSocketGetNative(sock), SOL_SOCKET, kServerReusePort, &yes, sizeof(yes));
+#endif
+	
+#if defined(SO_INCOMING_CPU)
+	// Have the kernel pick, among the port's listeners, the one on the CPU
+	// the connection came in on.
+	if ((worker->_cpu != -1) && (worker->_server->_options.workerPolicy == kServerWorkerIncomingCPU)) {
+		int cpu = (int)worker->_cpu;
+		setsockopt(CFSocketGetNative(sock), SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+	}
+#endif
+	
+	bzero(buffer, sizeof(buffer));
+	
+	// Put the local port and address into the native address.
+	if (family == PF_INET) {
+		addr4->sin_len = sizeof(addr4[0]);
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons((UInt16)port);
+		addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+	}
+	else {
+		addr6->sin6_len = sizeof(addr6[0]);
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons((UInt16)port);
+		memcpy(&(addr6->sin6_addr), &in6addr_any, sizeof(addr6->sin6_addr));
+	}
+	
+	// Wrap the native address structure for CFSocketSetAddress.
+	address = CFDataCreateWithBytesNoCopy(worker->_server->_alloc,
+										  buffer,
+										  (family == PF_INET) ? sizeof(addr4[0]) : sizeof(addr6[0]),
+										  kCFAllocatorNull);
+	
+	if (address == NULL) {
+		CFSocketInvalidate(sock);
+		CFRelease(sock);
+		return NULL;
+	}
+	
+	// Bind, which starts the socket listening.
+	err = CFSocketSetAddress(sock, address);
+	CFRelease(address);
+	
+	if ((err != kCFSocketSuccess) || !_ServerPrepareListener(worker->_server, sock)) {
+		CFSocketInvalidate(sock);
+		CFRelease(sock);
+		return NULL;
+	}
+	
+	return sock;
+}
+
+
+/* static */ void*
+_ServerWorkerMain(ServerWorker* worker) {
+
+	CFRunLoopRef rl;
+	
+	// Settle where the thread runs before it allocates anything.  Not
+	// getting the CPU only costs locality, so it's not fatal.
+	if (worker->_cpu != -1)
+		_ServerPinThread(worker->_cpu);
+	
+	// Pages the pool first touches from here land on this CPU's node.
+	if (worker->_server->_options.workerAllocators)
+		worker->_allocator = PoolAllocatorCreate(worker->_server->_alloc, kWorkerPoolMaxBlockSize, kWorkerPoolMaxCached);
+	
+	rl = CFRunLoopGetCurrent();
+	
+	// Hook up the hand-over source and the timeouts.
+	CFRunLoopAddSource(rl, worker->_source, kCFRunLoopCommonModes);
+	TimerWheelScheduleWithRunLoop(worker->_timers, rl, kCFRunLoopCommonModes);
+	
+	// Tell the server the worker is ready.
+	pthread_mutex_lock(&(worker->_lock));
+	worker->_runLoop = (CFRunLoopRef)CFRetain(rl);
+	pthread_cond_signal(&(worker->_ready));
+	pthread_mutex_unlock(&(worker->_lock));
+	
+	// Run until asked to stop.
+	CFRunLoopRun();
+	
+	return NULL;
+}
+
+
+/* static */ void
+_ServerWorkerPerform(ServerWorker* worker) {
+
+	CFSocketNativeHandle batch[kHandOffBatch];
+	CFIndex i, count;
+	
+	do {
+		Boolean stopping, unlisten;
+		CFAbsoluteTime drain;
+		
+		// Take a batch of sockets off the front of the queue.
+		pthread_mutex_lock(&(worker->_lock));
+		
+		stopping = worker->_stopping;
+		unlisten = worker->_unlisten;
+		worker->_unlisten = FALSE;
+		drain = worker->_drain;
+		worker->_drain = 0;
+		
+		count = (worker->_pendingCount < kHandOffBatch) ? worker->_pendingCount : kHandOffBatch;
+		memcpy(batch, worker->_pending, count * sizeof(batch[0]));
+		
+		worker->_pendingCount -= count;
+		memmove(worker->_pending, worker->_pending + count, worker->_pendingCount * sizeof(batch[0]));
+		
+		pthread_mutex_unlock(&(worker->_lock));
+		
+		// Here nothing can be accepting on the listeners.
+		if (unlisten || stopping)
+			_ServerWorkerReleaseSockets(worker);
+		
+		// Stopping is only noticed here, on the worker's own run loop.
+		if (stopping) {
+			for (i = 0; i < count; i++)
+				close(batch[i]);
+			
+			// Connections can only be closed here, so take them all down.
+			ConnectionRegistryCloseAll(worker->_registry);
+			
+			CFRunLoopStop(CFRunLoopGetCurrent());
+			return;
+		}
+		
+		// Give each one to the user on this thread.
+		for (i = 0; i < count; i++)
+			_ServerHandleAccept(worker->_server, batch[i]);
+		
+		// Likewise only here can the worker's connections be swept.
+		if (drain != 0)
+			ConnectionRegistryDrain(worker->_registry, drain);
+	
+	} while (count == kHandOffBatch);
+}
+
+
+/* static */ void
+_SocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server) {
+
+    assert((sock == server->_sockets[0]) || (sock == server->_sockets[1]));
+
+	// Only care about accept callbacks.
+    if (type == kCFSocketAcceptCallBack) {
+    
+		assert((data != NULL) && (*((CFSocketNativeHandle*)data) != -1));
+		
+		// Dispatch the accept event, on a worker if there are any.
+		if (server->_workers != NULL)
+			_ServerHandOff(server, (const CFSocketNativeHandle*)data, 1);
+		else
+			_ServerHandleAccept(server, *((CFSocketNativeHandle*)data));
+	}
+	
+	// In datagram mode, readable means there are datagrams to echo.
+	else if ((type == kCFSocketReadCallBack) && server->_options.datagram)
+		_ServerEchoDatagrams(server, CFSocketGetNative(sock));
+	
+	// In batch mode, readable means there are connections to accept.
+	else if (type == kCFSocketReadCallBack) {
+	
+		CFSocketNativeHandle batch[kAcceptBatch];
+		CFIndex i, count;
+		
+		// Keep going while batches come back full.
+		do {
+			count = _ServerAcceptBatch(server, sock, batch, kAcceptBatch);
+			
+			if (server->_workers != NULL)
+				_ServerHandOff(server, batch, count);
+			else {
+				for (i = 0; i < count; i++)
+					_ServerHandleAccept(server, batch[i]);
+			}
+		
+		} while (count == kAcceptBatch);
+	}
+}
+
+
+/* static */ void
+_WorkerSocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, ServerWorker* worker) {
+
+	assert((sock == worker->_sockets[0]) || (sock == worker->_sockets[1]));
+	
+	// Only care about accept callbacks.
+	if (type == kCFSocketAcceptCallBack) {
+	
+		assert((data != NULL) && (*((CFSocketNativeHandle*)data) != -1));
+		
+		// Already on the worker's thread, so no hand-over is needed.
+		_ServerHandleAccept(worker->_server, *((CFSocketNativeHandle*)data));
+	}
+	
+	// In datagram mode, readable means there are datagrams to echo.
+	else if ((type == kCFSocketReadCallBack) && worker->_server->_options.datagram)
+		_ServerEchoDatagrams(worker->_server, CFSocketGetNative(sock));
+	
+	// In batch mode, readable means there are connections to accept.
+	else if (type == kCFSocketReadCallBack) {
+	
+		CFSocketNativeHandle batch[kAcceptBatch];
+		CFIndex i, count;
+		
+		// Keep going while batches come back full.
+		do {
+			count = _ServerAcceptBatch(worker->_server, sock, batch, kAcceptBatch);
+			
+			for (i = 0; i < count; i++)
+				_ServerHandleAccept(worker->_server, batch[i]);
+		
+		} while (count == kAcceptBatch);
+	}
+}
+
+
+/* static */ void
+_StatisticsSocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server) {
+
+	assert(sock == server->_statsSocket);
+	
+	// Only care about accept callbacks.
+	if (type == kCFSocketAcceptCallBack) {
+	
+		assert((data != NULL) && (*((CFSocketNativeHandle*)data) != -1));
+		
+		// Answer and hang up.
+		_ServerSendStatistics(server, *((CFSocketNativeHandle*)data));
+	}
+}
+
+
+/* static */ void
+_HandOffSocketCallBack(CFSocketRef sock, CFSocketCallBackType type, CFDataRef address, const void *data, Server* server) {
+
+	assert(sock == server->_handOffSocket);
+	
+	// Only care about accept callbacks.
+	if (type == kCFSocketAcceptCallBack) {
+	
+		assert((data != NULL) && (*((CFSocketNativeHandle*)data) != -1));
+		
+		// Give the successor the listeners.
+		_ServerHandOffListeners(server, *((CFSocketNativeHandle*)data));
+	}
+}
+
+
+/* static */ void
 _NetServiceCallBack(CFNetServiceRef service, CFStreamError* error, Server* server) {
     
     assert(service == server->_service);
@@ -574,3 +2581,55 @@ _NetServiceCallBack(CFNetServiceRef service, CFStreamError* error, Server* serve
 	// Dispatch the registration error.
     _ServerHandleNetServiceError(server, error);
 }
+
+
+/* static */ void
+_RetryTimerCallBack(CFRunLoopTimerRef timer, Server* server) {
+
+	assert(timer == server->_retryTimer);
+	
+	// Done with this one; a failure below schedules another.
+	_ServerReleaseRetryTimer(server);
+	
+	if (!_ServerCreateAndRegisterNetService(server))
+		_ServerScheduleRegistration(server);
+}
+
+
+#if defined(SERVER_DISPATCH)
+
+/* static */ void
+_ListenerSourceCallBack(ServerListener* listener) {
+
+	Server* server = listener->_server;
+	
+	// In datagram mode, readable means there are datagrams to echo.
+	if (server->_options.datagram)
+		_ServerEchoDatagrams(server, CFSocketGetNative(listener->_socket));
+	
+	// Otherwise there are connections to accept.
+	else {
+	
+		CFSocketNativeHandle batch[kAcceptBatch];
+		CFIndex i, count;
+		
+		// Keep going while batches come back full.
+		do {
+			count = _ServerAcceptBatch(server, listener->_socket, batch, kAcceptBatch);
+			
+			for (i = 0; i < count; i++)
+				_ServerHandleAccept(server, batch[i]);
+		
+		} while (count == kAcceptBatch);
+	}
+}
+
+
+/* static */ void
+_ListenerCancelCallBack(ServerListener* listener) {
+
+	// Let the stopping thread know this one is done.
+	dispatch_semaphore_signal(listener->_server->_cancelled);
+}
+
+#endif
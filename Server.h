@@ -4,6 +4,10 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 
+#include "TimerWheel.h"
+#include "Statistics.h"
+#include "ConnectionRegistry.h"
+
 
 #if defined(__cplusplus)
 extern "C" {
@@ -21,6 +25,184 @@ typedef struct {
 typedef void (*ServerCallBack)(ServerRef server, CFSocketNativeHandle sock, CFStreamError* error, void* info);
 
 
+/*
+** ServerWorkerPolicy
+**
+** How accepted connections are spread over the worker threads.
+**
+** kServerWorkerRoundRobin		Each worker in turn.  The default.
+**
+** kServerWorkerLeastLoaded		The worker with the fewest connections,
+**								counted as the entries on its timer wheel
+**								plus sockets not yet picked up.
+**
+** kServerWorkerIncomingCPU		The worker pinned to the CPU that took in
+**								the connection's packets, as reported by
+**								SO_INCOMING_CPU, so the connection stays
+**								where its NIC queue delivers.  Needs
+**								pinWorkers.  With reusePort the workers'
+**								listeners ask the kernel for the same
+**								steering.  Round robin where the socket
+**								doesn't say, which is everywhere but
+**								Linux, or no worker is on that CPU.
+*/
+typedef enum {
+	kServerWorkerRoundRobin = 0,
+	kServerWorkerLeastLoaded = 1,
+	kServerWorkerIncomingCPU = 2
+} ServerWorkerPolicy;
+
+
+/*
+** ServerOptions
+**
+** Configuration for a server.  Any field left at zero takes its default.
+**
+** workerCount	Number of worker threads, each with a run loop of its
+**				own.  Accepted sockets are handed to a worker and the
+**				callback is called on that worker's thread, so anything
+**				scheduled on the current run loop from the callback
+**				runs there.  Zero, the default, keeps everything on the
+**				run loop given to ServerConnect.
+**
+** workerPolicy	How a worker is chosen for each connection.
+**
+** reusePort	Give every worker listening sockets of its own on the
+**				server's port, so the kernel spreads incoming
+**				connections over the workers' accept queues instead of
+**				funnelling them through one thread.  The server's own
+**				sockets keep listening too, and still hand what they
+**				accept to a worker.  Only one service is registered
+**				either way.  This needs a kernel that balances a port's
+**				listeners: SO_REUSEPORT_LB where it exists, as on
+**				FreeBSD, or SO_REUSEPORT on Linux.  Darwin and the other
+**				BSDs give every connection to the last socket bound, so
+**				there, and without workers, it is ignored and the
+**				server's listeners hand connections out as usual.
+**				Where it applies, ServerServeHandOff can't be used.
+**
+** batchAccept	Accept natively instead of through CFSocket's accept
+**				callback, which takes one connection per trip through
+**				the run loop.  Each readable event drains the listen
+**				queue until it would block, and the callbacks for the
+**				batch follow.  With workers, every worker gets its
+**				share of a batch with a single wakeup.
+**
+** listenBacklog
+**				Length of the listen queue.  Zero leaves CFSocket's
+**				default.  The kernel may cap it (kern.ipc.somaxconn).
+**
+** statisticsPort
+**				Loopback TCP port on which to serve the statistics.
+**				Each connection gets the StatisticsCopyReport text and
+**				is closed, so "nc localhost <port>" shows the numbers.
+**				Zero, the default, serves nothing.
+**
+** sendBufferSize
+** receiveBufferSize
+**				Kernel buffer sizes for accepted sockets, SO_SNDBUF and
+**				SO_RCVBUF, so high bandwidth-delay paths can keep the
+**				pipe full.  The receive size is set on the listeners too,
+**				because the window scale is settled during the handshake
+**				and accepted sockets start from the listener's.  The
+**				kernel may cap both (kern.ipc.maxsockbuf, net.core.*mem_max).
+**				Zero leaves the system defaults.
+**
+** keepAliveIdle
+**				Seconds a connection may sit idle before TCP starts
+**				probing it, so dead peers are found by the kernel without
+**				waking the server.  Zero, the default, leaves keepalive
+**				off.
+**
+** keepAliveInterval
+**				Seconds between probes.  Zero leaves the system default.
+**
+** keepAliveCount
+**				Unanswered probes before the connection is dropped.  Zero
+**				leaves the system default.
+**
+** maxConnections
+**				Most connections open at once, counted as the Opens less
+**				the Closes on the server's statistics, so connections have
+**				to count on ServerGetStatistics for it to work.  Sockets
+**				still on their way to a worker are not counted, so a burst
+**				can overshoot by up to a batch.  Zero means no limit.
+**
+** acceptRate
+**				Most connections admitted per second, on average.  Zero
+**				means no limit.
+**
+** acceptBurst
+**				Connections that may be admitted at once after a quiet
+**				spell.  Zero, the default, allows one second's worth.
+**
+**				A connection over either limit is shed before the callback
+**				ever sees it: it is closed at once with SO_LINGER zero, so
+**				the client gets a reset and the server keeps no state, and
+**				counted as a reject.
+**
+** datagram		Listen on UDP instead of TCP and echo every datagram back
+**				to its sender from the read callback, with no connection
+**				or per-peer state and no callback per datagram.  They are
+**				moved in batches, with recvmmsg and sendmmsg where those
+**				exist.  Datagrams over 2K are dropped and counted as
+**				overflows.  Workers only share the load with reusePort,
+**				each reading its own sockets, and only where reusePort
+**				takes effect; elsewhere the server's own sockets echo
+**				every datagram.  The connection options don't apply.
+**				Register as a _udp. service type.
+**
+** dispatch		Watch the listeners with dispatch sources on a concurrent
+**				queue of the server's own instead of the run loop, so
+**				accepting, and the callback, happen on whichever of
+**				dispatch's threads is free.  Pair it with
+**				kEchoContextIODispatch so the connections follow.
+**				Workers are ignored and batchAccept is implied, and
+**				the registry is a shared one, since the connections
+**				come and go on dispatch's threads.
+**				ServerConnect fails where dispatch doesn't exist.
+**
+** pinWorkers	Keep each worker thread on a CPU of its own, starting at
+**				firstCPU and wrapping around the CPUs online, so its run
+**				loop, its connections and their memory stay on one core
+**				and node.  Line firstCPU up with the cores the NIC's
+**				queues interrupt.  Linux pins hard; Mach only takes
+**				affinity hints, so there each worker just gets a tag of
+**				its own and the scheduler keeps tags apart.  The thread
+**				calling ServerConnect is left where it is.
+**
+** firstCPU		CPU the first worker is pinned to.  Zero by default.
+**
+** workerAllocators
+**				Give each worker a pool allocator of its own, made on its
+**				thread, for ServerGetAllocator to hand out.  Pages are
+**				placed on the node that first touches them, so with
+**				pinWorkers the connections' memory is local to the
+**				worker.
+*/
+typedef struct {
+	CFIndex				workerCount;
+	ServerWorkerPolicy	workerPolicy;
+	Boolean				reusePort;
+	Boolean				batchAccept;
+	CFIndex				listenBacklog;
+	UInt32				statisticsPort;
+	CFIndex				sendBufferSize;
+	CFIndex				receiveBufferSize;
+	CFTimeInterval		keepAliveIdle;
+	CFTimeInterval		keepAliveInterval;
+	CFIndex				keepAliveCount;
+	CFIndex				maxConnections;
+	double				acceptRate;
+	CFIndex				acceptBurst;
+	Boolean				datagram;
+	Boolean				dispatch;
+	Boolean				pinWorkers;
+	CFIndex				firstCPU;
+	Boolean				workerAllocators;
+} ServerOptions;
+
+
 /*
 ** ServerCreate
 **
@@ -34,9 +216,13 @@ typedef void (*ServerCallBack)(ServerRef server, CFSocketNativeHandle sock, CFSt
 ** callback	Function to call as incoming connections are accepted
 **
 ** context	Reference to a context block which will be copied into
-**			the server context for the callbacks.
+**			the server context for the callbacks.  With workers, the
+**			info is used from their threads as well.
+**
+** options	Configuration, copied into the server.  NULL indicates
+**			the defaults.
 */
-ServerRef ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* context);
+ServerRef ServerCreate(CFAllocatorRef alloc, ServerCallBack callback, ServerContext* context, const ServerOptions* options);
 
 
 /*
@@ -95,16 +281,170 @@ void ServerShow(ServerRef server);
 **
 ** port		TCP port on which to listen.  If a well-known port is
 **			not required, set to zero and one will be assigned.
+**			Ignored if ServerAdoptListeners took over a predecessor's
+**			sockets, which keep the port they have.
+**
+** This is also where worker threads start.
+**
+** Registration goes on in the background and does not hold up or
+** endanger the listeners.  If it fails, or the service is lost later,
+** it is tried again with a backoff from one second up to a minute.
 */
 Boolean ServerConnect(ServerRef server, CFStringRef name, CFStringRef type, UInt32 port);
 
 
+/*
+** ServerAdoptListeners
+**
+** Takes over the listening sockets of a running server that called
+** ServerServeHandOff with the same path, for a restart that never stops
+** accepting.  Connections waiting in the accept queues carry over too.
+** Call it between ServerCreate and ServerConnect; returns FALSE, leaving
+** the server as it was, if there is no predecessor to take them from.
+**
+** server Reference to the server.  Must be non-NULL.
+**
+** path		File system path of the predecessor's UNIX socket.
+**
+** The predecessor must be running as the same user; anyone else's
+** socket at the path is refused.
+*/
+Boolean ServerAdoptListeners(ServerRef server, const char* path);
+
+
+/*
+** ServerServeHandOff
+**
+** Listens on a UNIX socket at the given path, replacing anything there,
+** for a successor to call ServerAdoptListeners on.  Once it has the
+** sockets, this server stops listening, drops its service registration
+** for the successor to make, and calls back with a socket of -1 and an
+** error of zero.  Connections already accepted are left alone to finish;
+** how long to give them is up to the callback.  Only listeners made by
+** the server itself can be handed over, so where reusePort gives the
+** workers listeners of their own this fails rather than lose whatever
+** sits in their queues.
+**
+** The socket is created accessible only by the same user, and a peer
+** running as anyone else is refused without being sent anything.
+**
+** server Reference to the server.  Must be non-NULL.
+**
+** path		File system path for the UNIX socket.
+*/
+Boolean ServerServeHandOff(ServerRef server, const char* path);
+
+
+/*
+** ServerGetTimerWheel
+**
+** Returns the timer wheel the server keeps for its connections' timeouts.
+** It turns on the run loop given to ServerConnect.  Called on a worker
+** thread, it returns that worker's own wheel instead.  The reference is
+** not retained and is NULL once the server is invalidated.
+**
+** server Reference to the server.  Must be non-NULL.
+*/
+TimerWheelRef ServerGetTimerWheel(ServerRef server);
+
+
+/*
+** ServerGetAllocator
+**
+** Returns the allocator to create a connection's objects from.  Called
+** on a worker thread with workerAllocators, that's the worker's own pool;
+** otherwise it's NULL, for the caller to use its own choice.  The
+** reference is not retained.
+**
+** server Reference to the server.  Must be non-NULL.
+*/
+CFAllocatorRef ServerGetAllocator(ServerRef server);
+
+
+/*
+** ServerGetRegistry
+**
+** Returns the registry for listing the connections accepted on the current
+** thread: the worker's own on a worker thread, otherwise the one for the
+** run loop given to ServerConnect.  In dispatch mode that one is shared,
+** as made by ConnectionRegistryCreateShared, and sweeping it hands each
+** close to the connection's queue.  Connections listed there are counted
+** by ServerGetConnectionCount, swept by ServerDrain and closed by
+** ServerInvalidate.  The reference is not retained and is NULL once the
+** server is invalidated.
+**
+** server Reference to the server.  Must be non-NULL.
+*/
+ConnectionRegistryRef ServerGetRegistry(ServerRef server);
+
+
+/*
+** ServerGetConnectionCount
+**
+** Returns the number of connections listed in the server's registries.
+** With workers it's an estimate, since each one's count moves on its own
+** thread.
+**
+** server Reference to the server.  Must be non-NULL.
+*/
+CFIndex ServerGetConnectionCount(ServerRef server);
+
+
+/*
+** ServerGetStatistics
+**
+** Returns the statistics the server counts accepts on, for connections
+** to count the rest of their traffic on.  Every thread counts on its own
+** shard, so sharing it between workers costs nothing on the hot path.
+** The reference is not retained and lasts as long as the server.
+**
+** server Reference to the server.  Must be non-NULL.
+*/
+StatisticsRef ServerGetStatistics(ServerRef server);
+
+
+/*
+** ServerCopyStatistics
+**
+** Returns a snapshot of the statistics as a dictionary, as described for
+** StatisticsCopyDictionary.  It's safe to call from any thread.
+**
+** server Reference to the server.  Must be non-NULL.
+*/
+CFDictionaryRef ServerCopyStatistics(ServerRef server);
+
+
+/*
+** ServerDrain
+**
+** Stops accepting and winds down the connections there are.  The
+** listeners close and the service is withdrawn, then every registered
+** connection that is idle closes at once and the rest as they go idle.
+** Any still open after the timeout are closed regardless.  Each worker
+** sweeps its own from its thread.  Watch ServerGetConnectionCount to
+** know when they are all gone; the statistics service keeps answering
+** until the server is invalidated.  Like ServerInvalidate, this must not
+** be called from the callback in dispatch mode.  There the sweeps run
+** from the run loop given to ServerConnect and each connection closes on
+** its own queue.
+**
+** server	Reference to the server.  Must be non-NULL.
+**
+** timeout	Seconds to give busy connections.
+*/
+void ServerDrain(ServerRef server, CFTimeInterval timeout);
+
+
 /*
 ** ServerInvalidate
 **
 ** Removes the client and its associated data from the server reference.
 ** This ensures that the client will no longer get callbacks associated
-** with this instance of the object.
+** with this instance of the object.  Worker threads are stopped and
+** joined, and dispatch sources waited out, so this must not be called
+** from one of them or from the callback in dispatch mode.  Connections
+** still in the server's registries are closed, each on its own thread,
+** which for dispatch connections is their queue, shortly afterwards.
 **
 ** server Reference to the server.  Must be non-NULL.
 */
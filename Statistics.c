@@ -0,0 +1,537 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ *  Statistics.c
+ *
+ *	Counters sharded by thread.  Each shard is written only by its own thread,
+ *	with plain adds, and found through a thread specific key.  A snapshot adds
+ *	up every shard.  Latencies go into log bucketed histograms in the style of
+ *	HdrHistogram: the top bit of the value picks a group of eight buckets and
+ *	the next three bits pick the bucket within it.
+ */
+
+#pragma mark Includes
+#include "Statistics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kSubBits			3
+#define kSubBuckets			(1 << kSubBits)
+#define kLatencyBuckets		(kSubBuckets * 40)		// Up to about twelve days in microseconds
+
+#define kReportSize			2048
+
+static const CFStringRef kCounterNames[kStatisticsCounterCount] = {
+	CFSTR("Accepts"),
+	CFSTR("Opens"),
+	CFSTR("Closes"),
+	CFSTR("BytesIn"),
+	CFSTR("BytesOut"),
+	CFSTR("Lines"),
+	CFSTR("TimeOuts"),
+	CFSTR("Errors"),
+	CFSTR("Overflows"),
+	CFSTR("Pauses"),
+	CFSTR("Rejects"),
+	CFSTR("MemoryAllocated"),
+	CFSTR("MemoryFreed"),
+	CFSTR("Throttles")
+};
+
+static const char* kReportNames[kStatisticsCounterCount] = {
+	"accepts",
+	"opens",
+	"closes",
+	"bytes_in",
+	"bytes_out",
+	"lines",
+	"timeouts",
+	"errors",
+	"overflows",
+	"pauses",
+	"rejects",
+	"memory_allocated_bytes",
+	"memory_freed_bytes",
+	"throttles"
+};
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct __StatisticsShard {
+	struct __StatisticsShard*	_next;	// Next shard of the same statistics
+	UInt64				_counters[kStatisticsCounterCount];	// Counts by counter
+	UInt64				_latency[kLatencyBuckets];			// Line latency histogram
+} StatisticsShard;
+
+typedef struct __Statistics {
+	CFAllocatorRef		_alloc;			// Allocator used to allocate this
+	pthread_key_t		_key;			// Finds the current thread's shard
+	
+	pthread_mutex_t		_lock;			// Guards everything below
+	UInt32				_rc;			// Number of times retained.
+	StatisticsShard*	_shards;		// Every thread's shard
+} Statistics;
+
+typedef struct {
+	UInt64				_counters[kStatisticsCounterCount];
+	UInt64				_latency[kLatencyBuckets];
+	UInt64				_samples;		// Total latency samples
+} StatisticsSnapshot;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static CFIndex _StatisticsGetBucket(UInt64 value);
+static UInt64 _StatisticsGetBucketValue(CFIndex bucket);
+static void _StatisticsTakeSnapshot(Statistics* stats, StatisticsSnapshot* snapshot);
+static UInt64 _StatisticsGetPercentile(const StatisticsSnapshot* snapshot, double percentile);
+static void _StatisticsSetNumber(CFMutableDictionaryRef dict, CFStringRef key, UInt64 value);
+static UInt64 _StatisticsGetMemoryInUse(const StatisticsSnapshot* snapshot, UInt64* perConnection);
+static void _StatisticsPrint(char* report, CFIndex* length, const char* format, ...);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ StatisticsRef
+StatisticsCreate(CFAllocatorRef alloc) {
+
+	Statistics* stats = NULL;
+	
+	do {
+		// Allocate the statistics.
+		stats = CFAllocatorAllocate(alloc, sizeof(stats[0]), 0);
+		
+		// Fail if unable to create the statistics.
+		if (stats == NULL)
+			break;
+		
+		memset(stats, 0, sizeof(stats[0]));
+		
+		// A key per instance; shards outlive their threads, so no destructor.
+		if (pthread_key_create(&(stats->_key), NULL) != 0)
+			break;
+		
+		pthread_mutex_init(&(stats->_lock), NULL);
+		
+		// Save the allocator for deallocating later.
+		if (alloc)
+			stats->_alloc = CFRetain(alloc);
+		
+		// Bump the retain count.
+		stats->_rc = 1;
+		
+		return (StatisticsRef)stats;
+	
+	} while (0);
+	
+	// Something failed, so clean up.
+	if (stats != NULL)
+		CFAllocatorDeallocate(alloc, stats);
+	
+	return NULL;
+}
+
+
+/* extern */ StatisticsRef
+StatisticsRetain(StatisticsRef stats) {
+
+	Statistics* s = (Statistics*)stats;
+	
+	pthread_mutex_lock(&(s->_lock));
+	s->_rc++;
+	pthread_mutex_unlock(&(s->_lock));
+	
+	return stats;
+}
+
+
+/* extern */ void
+StatisticsRelease(StatisticsRef stats) {
+
+	Statistics* s = (Statistics*)stats;
+	UInt32 rc;
+	
+	pthread_mutex_lock(&(s->_lock));
+	rc = --(s->_rc);
+	pthread_mutex_unlock(&(s->_lock));
+	
+	// Destroy the object if not being held.
+	if (rc == 0) {
+	
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef alloc = s->_alloc;
+		
+		// Free every shard.
+		while (s->_shards != NULL) {
+			StatisticsShard* shard = s->_shards;
+			s->_shards = shard->_next;
+			CFAllocatorDeallocate(alloc, shard);
+		}
+		
+		pthread_key_delete(s->_key);
+		pthread_mutex_destroy(&(s->_lock));
+		
+		// Free the memory in use by the statistics.
+		CFAllocatorDeallocate(alloc, s);
+		
+		// Release the allocator.
+		if (alloc)
+			CFRelease(alloc);
+	}
+}
+
+
+/* extern */ StatisticsShardRef
+StatisticsGetShard(StatisticsRef stats) {
+
+	Statistics* s = (Statistics*)stats;
+	StatisticsShard* shard = pthread_getspecific(s->_key);
+	
+	// First time on this thread, so make it a shard.
+	if (shard == NULL) {
+	
+		shard = CFAllocatorAllocate(s->_alloc, sizeof(shard[0]), 0);
+		if (shard == NULL)
+			return NULL;
+		
+		memset(shard, 0, sizeof(shard[0]));
+		
+		// Put it where snapshots can find it.
+		pthread_mutex_lock(&(s->_lock));
+		shard->_next = s->_shards;
+		s->_shards = shard;
+		pthread_mutex_unlock(&(s->_lock));
+		
+		pthread_setspecific(s->_key, shard);
+	}
+	
+	return (StatisticsShardRef)shard;
+}
+
+
+/* extern */ void
+StatisticsAdd(StatisticsShardRef shard, StatisticsCounter counter, UInt64 amount) {
+
+	((StatisticsShard*)shard)->_counters[counter] += amount;
+}
+
+
+/* extern */ void
+StatisticsRecordLatency(StatisticsShardRef shard, CFTimeInterval latency, UInt64 count) {
+
+	// Microseconds, never negative.
+	UInt64 micros = (latency > 0) ? (UInt64)(latency * 1.0e6) : 0;
+	
+	((StatisticsShard*)shard)->_latency[_StatisticsGetBucket(micros)] += count;
+}
+
+
+/* extern */ UInt64
+StatisticsGetTotal(StatisticsRef stats, StatisticsCounter counter) {
+
+	StatisticsShard* shard;
+	UInt64 result = 0;
+	
+	pthread_mutex_lock(&(((Statistics*)stats)->_lock));
+	
+	for (shard = ((Statistics*)stats)->_shards; shard != NULL; shard = shard->_next)
+		result += shard->_counters[counter];
+	
+	pthread_mutex_unlock(&(((Statistics*)stats)->_lock));
+	
+	return result;
+}
+
+
+/* extern */ CFDictionaryRef
+StatisticsCopyDictionary(StatisticsRef stats) {
+
+	StatisticsSnapshot snapshot;
+	CFMutableDictionaryRef result, latency;
+	UInt64 inUse, perConnection;
+	CFIndex i;
+	
+	_StatisticsTakeSnapshot((Statistics*)stats, &snapshot);
+	
+	result = CFDictionaryCreateMutable(((Statistics*)stats)->_alloc, 0,
+									   &kCFTypeDictionaryKeyCallBacks,
+									   &kCFTypeDictionaryValueCallBacks);
+	if (result == NULL)
+		return NULL;
+	
+	// Every counter by name.
+	for (i = 0; i < kStatisticsCounterCount; i++)
+		_StatisticsSetNumber(result, kCounterNames[i], snapshot._counters[i]);
+	
+	// The footprint worked out from them.
+	inUse = _StatisticsGetMemoryInUse(&snapshot, &perConnection);
+	_StatisticsSetNumber(result, CFSTR("MemoryInUse"), inUse);
+	_StatisticsSetNumber(result, CFSTR("MemoryPerConnection"), perConnection);
+	
+	// And the latency summary.
+	latency = CFDictionaryCreateMutable(((Statistics*)stats)->_alloc, 0,
+										&kCFTypeDictionaryKeyCallBacks,
+										&kCFTypeDictionaryValueCallBacks);
+	if (latency != NULL) {
+	
+		_StatisticsSetNumber(latency, CFSTR("Count"), snapshot._samples);
+		_StatisticsSetNumber(latency, CFSTR("P50"), _StatisticsGetPercentile(&snapshot, 50.0));
+		_StatisticsSetNumber(latency, CFSTR("P90"), _StatisticsGetPercentile(&snapshot, 90.0));
+		_StatisticsSetNumber(latency, CFSTR("P99"), _StatisticsGetPercentile(&snapshot, 99.0));
+		_StatisticsSetNumber(latency, CFSTR("P999"), _StatisticsGetPercentile(&snapshot, 99.9));
+		_StatisticsSetNumber(latency, CFSTR("Max"), _StatisticsGetPercentile(&snapshot, 100.0));
+		
+		CFDictionarySetValue(result, CFSTR("LineLatency"), latency);
+		CFRelease(latency);
+	}
+	
+	return result;
+}
+
+
+/* extern */ CFDataRef
+StatisticsCopyReport(StatisticsRef stats) {
+
+	StatisticsSnapshot snapshot;
+	char report[kReportSize];
+	UInt64 inUse, perConnection;
+	CFIndex i, length = 0;
+	
+	_StatisticsTakeSnapshot((Statistics*)stats, &snapshot);
+	
+	// Every counter by name.
+	for (i = 0; i < kStatisticsCounterCount; i++) {
+		_StatisticsPrint(report, &length, "%s %llu\n",
+						 kReportNames[i], (unsigned long long)snapshot._counters[i]);
+	}
+	
+	// The footprint worked out from them.
+	inUse = _StatisticsGetMemoryInUse(&snapshot, &perConnection);
+	_StatisticsPrint(report, &length,
+					 "memory_in_use_bytes %llu\n"
+					 "memory_per_connection_bytes %llu\n",
+					 (unsigned long long)inUse,
+					 (unsigned long long)perConnection);
+	
+	// And the latency summary.
+	_StatisticsPrint(report, &length,
+					 "line_latency_count %llu\n"
+					 "line_latency_p50_us %llu\n"
+					 "line_latency_p90_us %llu\n"
+					 "line_latency_p99_us %llu\n"
+					 "line_latency_p999_us %llu\n"
+					 "line_latency_max_us %llu\n",
+					 (unsigned long long)snapshot._samples,
+					 (unsigned long long)_StatisticsGetPercentile(&snapshot, 50.0),
+					 (unsigned long long)_StatisticsGetPercentile(&snapshot, 90.0),
+					 (unsigned long long)_StatisticsGetPercentile(&snapshot, 99.0),
+					 (unsigned long long)_StatisticsGetPercentile(&snapshot, 99.9),
+					 (unsigned long long)_StatisticsGetPercentile(&snapshot, 100.0));
+	
+	return CFDataCreate(((Statistics*)stats)->_alloc, (const UInt8*)report, length);
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ CFIndex
+_StatisticsGetBucket(UInt64 value) {
+
+	CFIndex top = 0, bucket;
+	
+	// Small values get a bucket each.
+	if (value < kSubBuckets)
+		return (CFIndex)value;
+	
+	// Find the top bit.
+	while ((value >> (top + 1)) != 0)
+		top++;
+	
+	// Group by the top bit, then by the bits just under it.
+	bucket = ((top - kSubBits + 1) << kSubBits) + (CFIndex)((value >> (top - kSubBits)) & (kSubBuckets - 1));
+	
+	return (bucket < kLatencyBuckets) ? bucket : (kLatencyBuckets - 1);
+}
+
+
+/* static */ UInt64
+_StatisticsGetBucketValue(CFIndex bucket) {
+
+	CFIndex top;
+	
+	if (bucket < kSubBuckets)
+		return (UInt64)bucket;
+	
+	// The smallest value that falls in the bucket.
+	top = (bucket >> kSubBits) + kSubBits - 1;
+	
+	return ((UInt64)(kSubBuckets + (bucket & (kSubBuckets - 1)))) << (top - kSubBits);
+}
+
+
+/* static */ void
+_StatisticsTakeSnapshot(Statistics* stats, StatisticsSnapshot* snapshot) {
+
+	StatisticsShard* shard;
+	CFIndex i;
+	
+	memset(snapshot, 0, sizeof(snapshot[0]));
+	
+	// Add up the shards.  They keep changing underneath, which is fine for totals.
+	pthread_mutex_lock(&(stats->_lock));
+	
+	for (shard = stats->_shards; shard != NULL; shard = shard->_next) {
+	
+		for (i = 0; i < kStatisticsCounterCount; i++)
+			snapshot->_counters[i] += shard->_counters[i];
+		
+		for (i = 0; i < kLatencyBuckets; i++)
+			snapshot->_latency[i] += shard->_latency[i];
+	}
+	
+	pthread_mutex_unlock(&(stats->_lock));
+	
+	for (i = 0; i < kLatencyBuckets; i++)
+		snapshot->_samples += snapshot->_latency[i];
+}
+
+
+/* static */ UInt64
+_StatisticsGetPercentile(const StatisticsSnapshot* snapshot, double percentile) {
+
+	UInt64 seen = 0, wanted;
+	CFIndex i, last = 0;
+	
+	if (snapshot->_samples == 0)
+		return 0;
+	
+	// The sample with this rank or more, counting from one.
+	wanted = (UInt64)((percentile / 100.0) * snapshot->_samples + 0.5);
+	if (wanted == 0)
+		wanted = 1;
+	
+	for (i = 0; i < kLatencyBuckets; i++) {
+	
+		if (snapshot->_latency[i] == 0)
+			continue;
+		
+		last = i;
+		seen += snapshot->_latency[i];
+		
+		if (seen >= wanted)
+			break;
+	}
+	
+	// Report the top of the bucket, so percentiles never understate.
+	if (last == (kLatencyBuckets - 1))
+		return _StatisticsGetBucketValue(last);
+	
+	return _StatisticsGetBucketValue(last + 1) - 1;
+}
+
+
+/* static */ void
+_StatisticsSetNumber(CFMutableDictionaryRef dict, CFStringRef key, UInt64 value) {
+
+	SInt64 number = (SInt64)value;
+	CFNumberRef num = CFNumberCreate(CFGetAllocator(dict), kCFNumberSInt64Type, &number);
+	
+	if (num != NULL) {
+		CFDictionarySetValue(dict, key, num);
+		CFRelease(num);
+	}
+}
+
+
+/* static */ UInt64
+_StatisticsGetMemoryInUse(const StatisticsSnapshot* snapshot, UInt64* perConnection) {
+
+	const UInt64* counters = snapshot->_counters;
+	UInt64 inUse = 0, open = 0;
+	
+	// Shards are read one after another, so either side may be a little
+	// ahead; don't let that wrap around.
+	if (counters[kStatisticsMemoryAllocated] > counters[kStatisticsMemoryFreed])
+		inUse = counters[kStatisticsMemoryAllocated] - counters[kStatisticsMemoryFreed];
+	
+	if (counters[kStatisticsOpens] > counters[kStatisticsCloses])
+		open = counters[kStatisticsOpens] - counters[kStatisticsCloses];
+	
+	*perConnection = (open > 0) ? (inUse / open) : 0;
+	
+	return inUse;
+}
+
+
+/* static */ void
+_StatisticsPrint(char* report, CFIndex* length, const char* format, ...) {
+
+	va_list args;
+	int printed;
+	
+	// Already full; whatever would follow is cut off too.
+	if (*length >= (kReportSize - 1))
+		return;
+	
+	va_start(args, format);
+	printed = vsnprintf(report + *length, kReportSize - *length, format, args);
+	va_end(args);
+	
+	// Nothing written.
+	if (printed < 0)
+		return;
+	
+	// Cut short, so stop at what fit rather than past the end of the report.
+	if ((*length + printed) > (kReportSize - 1))
+		*length = kReportSize - 1;
+	else
+		*length += printed;
+}
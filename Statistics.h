@@ -0,0 +1,144 @@
+
+#ifndef __STATISTICS__
+#define __STATISTICS__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+typedef struct __Statistics* StatisticsRef;
+typedef struct __StatisticsShard* StatisticsShardRef;
+
+
+/*
+** StatisticsCounter
+**
+** What is counted.
+**
+** kStatisticsAccepts		Connections accepted by the server.
+** kStatisticsOpens			Connections that opened successfully.
+** kStatisticsCloses		Connections closed for any reason.
+** kStatisticsBytesIn		Bytes read from clients.
+** kStatisticsBytesOut		Bytes echoed back.
+** kStatisticsLines			Lines echoed back.
+** kStatisticsTimeOuts		Connections dropped for a timeout.
+** kStatisticsErrors		Connections dropped for an error.
+** kStatisticsOverflows		Lines longer than the limit.
+** kStatisticsPauses		Times reading paused for backpressure.
+** kStatisticsRejects		Connections shed by admission control, or for
+**							want of a descriptor.
+** kStatisticsMemoryAllocated
+**							Bytes of connection memory taken: the
+**							contexts and their receive storage.
+** kStatisticsMemoryFreed	Bytes of it given back.
+** kStatisticsThrottles		Times reading was deferred for a rate limit.
+*/
+typedef enum {
+	kStatisticsAccepts = 0,
+	kStatisticsOpens,
+	kStatisticsCloses,
+	kStatisticsBytesIn,
+	kStatisticsBytesOut,
+	kStatisticsLines,
+	kStatisticsTimeOuts,
+	kStatisticsErrors,
+	kStatisticsOverflows,
+	kStatisticsPauses,
+	kStatisticsRejects,
+	kStatisticsMemoryAllocated,
+	kStatisticsMemoryFreed,
+	kStatisticsThrottles,
+	kStatisticsCounterCount
+} StatisticsCounter;
+
+
+/*
+** StatisticsCreate
+**
+** Create a set of counters and a latency histogram.  Each thread that
+** records gets a shard of its own, so recording never contends; reading
+** adds the shards up.
+**
+** alloc	Allocator to use for allocating.  NULL indicates
+**			the default allocator.
+*/
+StatisticsRef StatisticsCreate(CFAllocatorRef alloc);
+
+
+/*
+** StatisticsRetain and StatisticsRelease may be called from any thread.
+*/
+StatisticsRef StatisticsRetain(StatisticsRef stats);
+void StatisticsRelease(StatisticsRef stats);
+
+
+/*
+** StatisticsGetShard
+**
+** Returns the current thread's shard, creating it on first use, or NULL
+** if it couldn't be created.  A shard must only be recorded into from its
+** own thread, and is valid for as long as the statistics are.
+*/
+StatisticsShardRef StatisticsGetShard(StatisticsRef stats);
+
+
+/*
+** StatisticsAdd
+**
+** Adds amount to a counter in the shard.
+*/
+void StatisticsAdd(StatisticsShardRef shard, StatisticsCounter counter, UInt64 amount);
+
+
+/*
+** StatisticsRecordLatency
+**
+** Records count samples of the given latency in the shard's histogram.
+** Buckets are logarithmic, eight to each power of two microseconds, so
+** any sample is placed within about 12% of its value.
+*/
+void StatisticsRecordLatency(StatisticsShardRef shard, CFTimeInterval latency, UInt64 count);
+
+
+/*
+** StatisticsGetTotal
+**
+** Returns one counter added up over the shards.  Like the snapshots, it
+** may miss whatever other threads are recording at that moment.
+*/
+UInt64 StatisticsGetTotal(StatisticsRef stats, StatisticsCounter counter);
+
+
+/*
+** StatisticsCopyDictionary
+**
+** Returns a snapshot of the totals, keyed by counter name, with the line
+** latency summarized in microseconds under "LineLatency" (Count, P50, P90,
+** P99, P999 and Max).  Shards are read while other threads may still be
+** recording, so the totals are close to, not exactly, one instant.
+**
+** Two figures are worked out from the counters for sizing hosts:
+** "MemoryInUse", the connection memory allocated less that freed, and
+** "MemoryPerConnection", that over the connections open (Opens less
+** Closes).
+*/
+CFDictionaryRef StatisticsCopyDictionary(StatisticsRef stats);
+
+
+/*
+** StatisticsCopyReport
+**
+** Returns the same snapshot as plain text, one "name value" pair per line.
+*/
+CFDataRef StatisticsCopyReport(StatisticsRef stats);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __STATISTICS__ */
@@ -0,0 +1,446 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ *  TimerWheel.c
+ *
+ *	A two level hashed timer wheel.  The inner level has one slot per tick and
+ *	the outer level one slot per turn of the inner level.  Entries are only
+ *	looked at when their slot comes due; one whose deadline has since moved out
+ *	is put back on the wheel at its new place instead of firing.  That keeps a
+ *	reset on every packet down to a store while still touching each entry
+ *	only a handful of times over its life.
+ */
+
+#pragma mark Includes
+#include "TimerWheel.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kInnerBits		8
+#define kInnerSlots		(1 << kInnerBits)
+#define kInnerMask		(kInnerSlots - 1)
+
+#define kOuterSlots		64
+#define kOuterMask		(kOuterSlots - 1)
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct __TimerWheel {
+	CFAllocatorRef		_alloc;			// Allocator used to allocate this
+	UInt32				_rc;			// Number of times retained.
+	
+	CFTimeInterval		_resolution;	// Seconds per tick
+	UInt64				_current;		// Last tick that was processed
+	CFIndex				_count;			// Number of entries on the wheel
+	
+	CFRunLoopTimerRef	_timer;			// Timer that drives the ticks
+	
+	TimerWheelEntry		_inner[kInnerSlots];	// List heads, one per tick
+	TimerWheelEntry		_outer[kOuterSlots];	// List heads, one per inner turn
+} TimerWheel;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static UInt64 _TimerWheelGetTick(TimerWheel* wheel, CFAbsoluteTime time);
+static void _TimerWheelLink(TimerWheelEntry* head, TimerWheelEntry* entry);
+static void _TimerWheelUnlink(TimerWheelEntry* entry);
+static void _TimerWheelMoveAll(TimerWheelEntry* from, TimerWheelEntry* to);
+static void _TimerWheelInsert(TimerWheel* wheel, TimerWheelEntry* entry);
+static void _TimerWheelAdvance(TimerWheel* wheel, UInt64 target);
+
+static void _TimerCallBack(CFRunLoopTimerRef timer, TimerWheel* wheel);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ TimerWheelRef
+TimerWheelCreate(CFAllocatorRef alloc, CFTimeInterval resolution) {
+
+	TimerWheel* wheel = NULL;
+	
+	do {
+		unsigned i;
+		CFRunLoopTimerContext timerCtxt = {0, NULL, (const void*(*)(const void*))&TimerWheelRetain, (void(*)(const void*))&TimerWheelRelease, NULL};
+		
+		// A wheel has to turn.
+		if (resolution <= 0)
+			break;
+		
+		// Allocate the buffer for the wheel.
+		wheel = CFAllocatorAllocate(alloc, sizeof(wheel[0]), 0);
+		
+		// Fail if unable to create the wheel.
+		if (wheel == NULL)
+			break;
+		
+		memset(wheel, 0, sizeof(wheel[0]));
+		
+		// Save the allocator for deallocating later.
+		wheel->_alloc = alloc ? CFRetain(alloc) : NULL;
+		
+		// Bump the retain count.
+		TimerWheelRetain((TimerWheelRef)wheel);
+		
+		// Every slot starts out as an empty list.
+		for (i = 0; i < kInnerSlots; i++)
+			wheel->_inner[i]._next = wheel->_inner[i]._prev = &(wheel->_inner[i]);
+		
+		for (i = 0; i < kOuterSlots; i++)
+			wheel->_outer[i]._next = wheel->_outer[i]._prev = &(wheel->_outer[i]);
+		
+		// Start counting ticks from now.
+		wheel->_resolution = resolution;
+		wheel->_current = (UInt64)floor(CFAbsoluteTimeGetCurrent() / resolution);
+		
+		// Make sure the wheel is saved for the callback.
+		timerCtxt.info = wheel;
+		
+		// Create the repeating timer that turns the wheel.
+		wheel->_timer = CFRunLoopTimerCreate(alloc,
+											 CFAbsoluteTimeGetCurrent() + resolution,
+											 resolution,
+											 0,		// flags
+											 0,		// order
+											 (CFRunLoopTimerCallBack)&_TimerCallBack,
+											 &timerCtxt);
+		
+		// Fail if unable to create the timer.
+		if (wheel->_timer == NULL)
+			break;
+		
+		return (TimerWheelRef)wheel;
+		
+	} while (0);
+	
+	// Something failed, so clean up.
+	if (wheel)
+		TimerWheelRelease((TimerWheelRef)wheel);
+	
+	return NULL;
+}
+
+
+/* extern */ TimerWheelRef
+TimerWheelRetain(TimerWheelRef wheel) {
+
+	// Bump the retain count.
+	((TimerWheel*)wheel)->_rc++;
+	
+	return wheel;
+}
+
+
+/* extern */ void
+TimerWheelRelease(TimerWheelRef wheel) {
+
+	TimerWheel* w = (TimerWheel*)wheel;
+	
+	// Decrease the retain count.
+	w->_rc--;
+	
+	// Destroy the object if not being held.
+	if (w->_rc == 0) {
+	
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef alloc = w->_alloc;
+		
+		// Entry owners hold the wheel, so none can be left at this point.
+		assert(w->_count == 0);
+		
+		// Stop and release the timer.
+		TimerWheelInvalidate(wheel);
+		
+		// Free the memory in use by the wheel.
+		CFAllocatorDeallocate(alloc, w);
+		
+		// Release the allocator.
+		if (alloc)
+			CFRelease(alloc);
+	}
+}
+
+
+/* extern */ Boolean
+TimerWheelScheduleWithRunLoop(TimerWheelRef wheel, CFRunLoopRef runLoop, CFStringRef mode) {
+
+	TimerWheel* w = (TimerWheel*)wheel;
+	
+	// Can't schedule once invalidated.
+	if (w->_timer == NULL)
+		return FALSE;
+	
+	CFRunLoopAddTimer(runLoop, w->_timer, mode);
+	
+	return TRUE;
+}
+
+
+/* extern */ void
+TimerWheelInvalidate(TimerWheelRef wheel) {
+
+	TimerWheel* w = (TimerWheel*)wheel;
+	
+	// Invalidate and release the timer if there is one.
+	if (w->_timer != NULL) {
+		CFRunLoopTimerRef timer = w->_timer;
+		w->_timer = NULL;
+		CFRunLoopTimerInvalidate(timer);
+		CFRelease(timer);
+	}
+}
+
+
+/* extern */ void
+TimerWheelEntryInit(TimerWheelEntry* entry, TimerWheelCallBack callback, void* info) {
+
+	memset(entry, 0, sizeof(entry[0]));
+	
+	entry->_callback = callback;
+	entry->_info = info;
+}
+
+
+/* extern */ void
+TimerWheelAdd(TimerWheelRef wheel, TimerWheelEntry* entry, CFAbsoluteTime deadline) {
+
+	// Take it off wherever it is now.
+	TimerWheelRemove(entry);
+	
+	entry->_wheel = wheel;
+	entry->_deadline = deadline;
+	
+	// Slot it in.
+	_TimerWheelInsert((TimerWheel*)wheel, entry);
+	((TimerWheel*)wheel)->_count++;
+}
+
+
+/* extern */ void
+TimerWheelEntrySetDeadline(TimerWheelEntry* entry, CFAbsoluteTime deadline) {
+
+	TimerWheel* wheel = (TimerWheel*)entry->_wheel;
+	
+	// Nothing to do for an entry that isn't on a wheel.
+	if (wheel == NULL)
+		return;
+	
+	entry->_deadline = deadline;
+	
+	// If the slot it's in would be too late, move it now.  Otherwise the
+	// new deadline gets picked up when the slot is looked at.
+	if (_TimerWheelGetTick(wheel, deadline) < entry->_tick) {
+		_TimerWheelUnlink(entry);
+		_TimerWheelInsert(wheel, entry);
+	}
+}
+
+
+/* extern */ void
+TimerWheelRemove(TimerWheelEntry* entry) {
+
+	// Only unlink if it's on a list.
+	if (entry->_wheel != NULL) {
+		_TimerWheelUnlink(entry);
+		((TimerWheel*)entry->_wheel)->_count--;
+		entry->_wheel = NULL;
+	}
+}
+
+
+/* extern */ CFIndex
+TimerWheelGetCount(TimerWheelRef wheel) {
+
+	return ((TimerWheel*)wheel)->_count;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ UInt64
+_TimerWheelGetTick(TimerWheel* wheel, CFAbsoluteTime time) {
+
+	// Round up so nothing fires early.
+	return (UInt64)ceil(time / wheel->_resolution);
+}
+
+
+/* static */ void
+_TimerWheelLink(TimerWheelEntry* head, TimerWheelEntry* entry) {
+
+	// Add to the end of the circular list.
+	entry->_next = head;
+	entry->_prev = head->_prev;
+	head->_prev->_next = entry;
+	head->_prev = entry;
+}
+
+
+/* static */ void
+_TimerWheelUnlink(TimerWheelEntry* entry) {
+
+	entry->_prev->_next = entry->_next;
+	entry->_next->_prev = entry->_prev;
+	entry->_next = entry->_prev = NULL;
+}
+
+
+/* static */ void
+_TimerWheelMoveAll(TimerWheelEntry* from, TimerWheelEntry* to) {
+
+	// Start with an empty destination.
+	to->_next = to->_prev = to;
+	
+	// Splice the whole list over.
+	if (from->_next != from) {
+		to->_next = from->_next;
+		to->_prev = from->_prev;
+		to->_next->_prev = to;
+		to->_prev->_next = to;
+		from->_next = from->_prev = from;
+	}
+}
+
+
+/* static */ void
+_TimerWheelInsert(TimerWheel* wheel, TimerWheelEntry* entry) {
+
+	UInt64 tick = _TimerWheelGetTick(wheel, entry->_deadline);
+	
+	// Anything already due goes out on the next tick.
+	if (tick <= wheel->_current)
+		tick = wheel->_current + 1;
+	
+	// Within one turn of the inner level, it gets its own tick's slot.
+	if ((tick - wheel->_current) < kInnerSlots) {
+		entry->_tick = tick;
+		_TimerWheelLink(&(wheel->_inner[tick & kInnerMask]), entry);
+	}
+	
+	// Otherwise it waits on the outer level for its turn to come around.  If
+	// even that's too far off, it waits in the last slot and gets placed again.
+	else {
+		UInt64 turn = tick >> kInnerBits;
+		UInt64 limit = (wheel->_current >> kInnerBits) + kOuterSlots;
+		
+		if (turn > limit)
+			turn = limit;
+		
+		entry->_tick = turn << kInnerBits;
+		_TimerWheelLink(&(wheel->_outer[turn & kOuterMask]), entry);
+	}
+}
+
+
+/* static */ void
+_TimerWheelAdvance(TimerWheel* wheel, UInt64 target) {
+
+	while (wheel->_current < target) {
+	
+		TimerWheelEntry pending;
+		
+		// With nothing on the wheel, there's no need to visit every tick.
+		if (wheel->_count == 0) {
+			wheel->_current = target;
+			break;
+		}
+		
+		wheel->_current++;
+		
+		// At the start of each inner turn, spread the matching outer slot out.
+		if ((wheel->_current & kInnerMask) == 0) {
+		
+			_TimerWheelMoveAll(&(wheel->_outer[(wheel->_current >> kInnerBits) & kOuterMask]), &pending);
+			
+			while (pending._next != &pending) {
+				TimerWheelEntry* entry = pending._next;
+				_TimerWheelUnlink(entry);
+				_TimerWheelInsert(wheel, entry);
+			}
+		}
+		
+		// Pull off everything in this tick's slot.
+		_TimerWheelMoveAll(&(wheel->_inner[wheel->_current & kInnerMask]), &pending);
+		
+		while (pending._next != &pending) {
+		
+			TimerWheelEntry* entry = pending._next;
+			_TimerWheelUnlink(entry);
+			
+			// Deadlines that moved out just get placed again.
+			if (_TimerWheelGetTick(wheel, entry->_deadline) > wheel->_current)
+				_TimerWheelInsert(wheel, entry);
+			
+			// Otherwise it's off the wheel and its owner hears about it.  The
+			// callback is free to add or remove any entry, including this one.
+			else {
+				wheel->_count--;
+				entry->_wheel = NULL;
+				entry->_callback(entry, entry->_info);
+			}
+		}
+	}
+}
+
+
+/* static */ void
+_TimerCallBack(CFRunLoopTimerRef timer, TimerWheel* wheel) {
+
+	assert(timer == wheel->_timer);
+	
+	// Keep the wheel around in case a callback lets go of the last reference.
+	TimerWheelRetain((TimerWheelRef)wheel);
+	
+	// Catch up to the present.
+	_TimerWheelAdvance(wheel, (UInt64)floor(CFAbsoluteTimeGetCurrent() / wheel->_resolution));
+	
+	TimerWheelRelease((TimerWheelRef)wheel);
+}
@@ -0,0 +1,125 @@
+
+#ifndef __TIMERWHEEL__
+#define __TIMERWHEEL__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+typedef struct __TimerWheel* TimerWheelRef;
+
+typedef struct TimerWheelEntry TimerWheelEntry;
+typedef void (*TimerWheelCallBack)(TimerWheelEntry* entry, void* info);
+
+
+/*
+** TimerWheelEntry
+**
+** One timeout on a wheel.  Entries are embedded in their owner rather
+** than allocated by the wheel, and adding, removing or moving one never
+** allocates.  Treat the fields as private.
+*/
+struct TimerWheelEntry {
+	TimerWheelEntry*	_next;			// Neighbours in the slot's list
+	TimerWheelEntry*	_prev;
+	TimerWheelRef		_wheel;			// Wheel the entry is on, if any
+	CFAbsoluteTime		_deadline;		// Time at which the entry expires
+	UInt64				_tick;			// Tick of the slot the entry sits in
+	TimerWheelCallBack	_callback;		// Function to call on expiry
+	void*				_info;			// Passed to the callback
+};
+
+
+/*
+** TimerWheelCreate
+**
+** Create a hierarchical timer wheel.  A single run loop timer ticks at
+** the given resolution and expires whatever has come due, so any number
+** of entries costs one timer in the run loop.
+**
+** alloc		Allocator to use for allocating.  NULL indicates
+**				the default allocator.
+**
+** resolution	Seconds per tick.  Entries fire up to one tick late.
+*/
+TimerWheelRef TimerWheelCreate(CFAllocatorRef alloc, CFTimeInterval resolution);
+
+TimerWheelRef TimerWheelRetain(TimerWheelRef wheel);
+void TimerWheelRelease(TimerWheelRef wheel);
+
+
+/*
+** TimerWheelScheduleWithRunLoop
+**
+** Starts the wheel ticking on the given run loop and mode.  Entries only
+** fire on that run loop, so all adds and removes must happen there.
+*/
+Boolean TimerWheelScheduleWithRunLoop(TimerWheelRef wheel, CFRunLoopRef runLoop, CFStringRef mode);
+
+
+/*
+** TimerWheelInvalidate
+**
+** Stops the wheel ticking.  Entries still on the wheel stay there but
+** will not fire.
+*/
+void TimerWheelInvalidate(TimerWheelRef wheel);
+
+
+/*
+** TimerWheelEntryInit
+**
+** Prepares an entry for use.  An initialized entry not on a wheel may be
+** removed any number of times.
+*/
+void TimerWheelEntryInit(TimerWheelEntry* entry, TimerWheelCallBack callback, void* info);
+
+
+/*
+** TimerWheelAdd
+**
+** Puts the entry on the wheel to fire at the deadline.  If the entry is
+** already on a wheel it is moved.  The entry is removed from the wheel
+** before its callback is called.
+*/
+void TimerWheelAdd(TimerWheelRef wheel, TimerWheelEntry* entry, CFAbsoluteTime deadline);
+
+
+/*
+** TimerWheelEntrySetDeadline
+**
+** Moves the deadline of an entry that is on a wheel.  Pushing it later,
+** which is what resetting a timeout on activity does, only records the
+** new time; the wheel looks at it again when the old slot comes due.
+** Pulling it earlier moves the entry.
+*/
+void TimerWheelEntrySetDeadline(TimerWheelEntry* entry, CFAbsoluteTime deadline);
+
+
+/*
+** TimerWheelRemove
+**
+** Takes the entry off its wheel, if it is on one.
+*/
+void TimerWheelRemove(TimerWheelEntry* entry);
+
+
+/*
+** TimerWheelGetCount
+**
+** Returns the number of entries on the wheel.  Another thread may call
+** this for an estimate, since the count is a single word that only the
+** wheel's own thread changes.
+*/
+CFIndex TimerWheelGetCount(TimerWheelRef wheel);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __TIMERWHEEL__ */
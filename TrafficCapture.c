@@ -0,0 +1,957 @@
+/*
+	Copyright: 	 Copyright 2002 Apple Computer, Inc. All rights reserved.
+
+	Disclaimer:	IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+			("Apple") in consideration of your agreement to the following terms, and your
+			use, installation, modification or redistribution of this Apple software
+			constitutes acceptance of these terms.  If you do not agree with these terms,
+			please do not use, install, modify or redistribute this Apple software.
+
+			In consideration of your agreement to abide by the following terms, and subject
+			to these terms, Apple grants you a personal, non-exclusive license, under Apples
+			copyrights in this original Apple software (the "Apple Software"), to use,
+			reproduce, modify and redistribute the Apple Software, with or without
+			modifications, in source and/or binary forms; provided that if you redistribute
+			the Apple Software in its entirety and without modifications, you must retain
+			this notice and the following text and disclaimers in all such redistributions of
+			the Apple Software.  Neither the name, trademarks, service marks or logos of
+			Apple Computer, Inc. may be used to endorse or promote products derived from the
+			Apple Software without specific prior written permission from Apple.  Except as
+			expressly stated in this notice, no other rights or licenses, express or implied,
+			are granted by Apple herein, including but not limited to any patent rights that
+			may be infringed by your derivative works or by other works in which the Apple
+			Software may be incorporated.
+
+			The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+			WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+			WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+			PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+			COMBINATION WITH YOUR PRODUCTS.
+
+			IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+			CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+			GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+			ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+			OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+			(INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+			ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ *  TrafficCapture.c
+ *
+ *	Writes and reads capture files.  Records are a few bytes each: small
+ *	numbers take one byte in LEB128, and times are deltas, which between
+ *	reads on a busy server are mostly small.  Each thread gathers records
+ *	into a shard of its own and writes it out whole as a chunk, so
+ *	capturing costs a copy on each read rather than a write, and threads
+ *	only meet when two of them write at once.  Reading merges the chunks
+ *	back into time order.
+ */
+
+#pragma mark Includes
+#include "TrafficCapture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#pragma mark -
+#pragma mark Constant Definitions
+
+#define kBufferSize			(64 * 1024)
+
+#define kHeaderSize			16
+#define kVersion			3
+#define kFlagPayloads		0x01
+
+// Starts a chunk, followed by the time its first record counts from and
+// the length of its records.
+#define kChunkMark			0
+#define kChunkHeader		13
+
+// A type byte and three numbers of at most ten bytes each.
+#define kMaxRecordHeader	31
+
+// Past this a data record is taken to be damage rather than a read.
+#define kMaxPayload			(64 * 1024 * 1024)
+
+// And past this, a chunk.
+#define kMaxChunk			(kBufferSize + kMaxPayload)
+
+static const UInt8 kMagic[4] = {'E', 'C', 'A', 'P'};
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct __TrafficRecorderShard {
+	struct __TrafficRecorderShard*	_next;	// Next shard of the same recorder
+	struct __TrafficRecorder*		_recorder;	// Recorder it writes out through
+	
+	pthread_mutex_t		_lock;			// Guards everything below
+	CFAbsoluteTime		_last;			// Time of the last record, as the reader will see it
+	CFIndex				_length;		// Bytes gathered in _buffer
+	UInt8				_buffer[kBufferSize];	// Records not yet written out
+} TrafficRecorderShard;
+
+typedef struct __TrafficRecorder {
+	CFAllocatorRef		_alloc;			// Allocator used to allocate this
+	pthread_key_t		_key;			// Finds the current thread's shard
+	Boolean				_payloads;		// Keep the bytes too
+	
+	pthread_mutex_t		_lock;			// Guards everything below
+	UInt32				_rc;			// Number of times retained.
+	UInt64				_connections;	// Connections numbered so far
+	TrafficRecorderShard*	_shards;	// Every thread's shard
+	
+	pthread_mutex_t		_writeLock;		// Guards the one below, and keeps each chunk whole
+	int					_file;			// Capture being written, or -1 once it has failed
+} TrafficRecorder;
+
+typedef struct {
+	UInt64				_offset;		// Where its records start in the file
+	CFIndex				_length;		// Bytes of them
+	CFAbsoluteTime		_start;			// Time its first record counts from
+} TrafficChunk;
+
+typedef struct {
+	UInt64				_offset;		// Where its chunk is; earlier wins a tie
+	UInt8*				_bytes;			// The chunk's records
+	CFIndex				_length;		// Bytes of them that were there
+	CFIndex				_at;			// Where the record after _next starts
+	CFAbsoluteTime		_time;			// Time of _next
+	Boolean				_hasNext;		// There is a _next
+	TrafficCaptureRecord _next;			// Next record of the chunk, its payload in _bytes
+} TrafficCursor;
+
+typedef struct __TrafficReader {
+	CFAllocatorRef		_alloc;			// Allocator used to allocate this
+	UInt32				_rc;			// Number of times retained.
+	
+	FILE*				_file;			// Capture being read
+	Boolean				_payloads;		// It kept the bytes
+	CFAbsoluteTime		_start;			// When it started
+	
+	TrafficChunk*		_chunks;		// Every chunk, by the time it starts
+	CFIndex				_chunkCount;	// Number of chunks
+	CFIndex				_chunkCapacity;	// Room in _chunks
+	CFIndex				_nextChunk;		// First chunk not yet being read
+	
+	TrafficCursor*		_cursors;		// Chunks being read, one record ahead
+	CFIndex				_cursorCount;	// Number of cursors
+	CFIndex				_cursorCapacity;	// Room in _cursors
+} TrafficReader;
+
+
+#pragma mark -
+#pragma mark Static Function Declarations
+
+static CFIndex _TrafficPutNumber(UInt8* bytes, UInt64 value);
+static Boolean _TrafficGetNumber(const UInt8* bytes, CFIndex length, CFIndex* at, UInt64* value);
+static void _TrafficPutTime(UInt8* bytes, CFAbsoluteTime time);
+static void _TrafficPutLength(UInt8* bytes, CFIndex length);
+static CFAbsoluteTime _TrafficGetTime(const UInt8* bytes);
+
+static void _TrafficRecorderBegin(TrafficRecorderShard* shard, TrafficCaptureRecordType type, UInt64 connection, CFIndex payload);
+static Boolean _TrafficRecorderWrite(TrafficRecorder* recorder, const UInt8* bytes, CFIndex length);
+static Boolean _TrafficRecorderFlush(TrafficRecorderShard* shard, const struct iovec* vectors, CFIndex count, CFIndex length);
+
+static int _TrafficCompareChunks(const void* a, const void* b);
+static Boolean _TrafficReaderIndex(TrafficReader* reader);
+static Boolean _TrafficReaderOpenChunk(TrafficReader* reader);
+static void _TrafficCursorAdvance(TrafficReader* reader, TrafficCursor* cursor);
+static Boolean _TrafficCursorIsBefore(const TrafficCursor* cursor, const TrafficCursor* other);
+
+
+#pragma mark -
+#pragma mark Extern Function Definitions (API)
+
+/* extern */ TrafficRecorderRef
+TrafficRecorderCreate(CFAllocatorRef alloc, const char* path, Boolean payloads) {
+
+	TrafficRecorder* recorder = NULL;
+	
+	do {
+		UInt8 header[kHeaderSize] = {0};
+		
+		// Allocate the buffer for the recorder.
+		recorder = CFAllocatorAllocate(alloc, sizeof(recorder[0]), 0);
+		
+		// Fail if unable to create the recorder.
+		if (recorder == NULL)
+			break;
+		
+		memset(recorder, 0, sizeof(recorder[0]));
+		
+		// A key per instance; shards outlive their threads, so no destructor.
+		if (pthread_key_create(&(recorder->_key), NULL) != 0) {
+			CFAllocatorDeallocate(alloc, recorder);
+			return NULL;
+		}
+		
+		// Save the allocator for deallocating later.
+		recorder->_alloc = alloc ? CFRetain(alloc) : NULL;
+		
+		pthread_mutex_init(&(recorder->_lock), NULL);
+		pthread_mutex_init(&(recorder->_writeLock), NULL);
+		
+		// Bump the retain count.
+		TrafficRecorderRetain((TrafficRecorderRef)recorder);
+		
+		recorder->_payloads = payloads;
+		
+		// The reads it holds are nobody else's business.
+		recorder->_file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		
+		// Fail if there's nowhere to write.
+		if (recorder->_file == -1)
+			break;
+		
+		// The header goes out first, on its own.
+		memcpy(header, kMagic, sizeof(kMagic));
+		header[4] = kVersion;
+		header[5] = payloads ? kFlagPayloads : 0;
+		_TrafficPutTime(header + 8, CFAbsoluteTimeGetCurrent());
+		
+		if (!_TrafficRecorderWrite(recorder, header, sizeof(header)))
+			break;
+		
+		return (TrafficRecorderRef)recorder;
+		
+	} while (0);
+	
+	// Something failed, so clean up.
+	if (recorder)
+		TrafficRecorderRelease((TrafficRecorderRef)recorder);
+	
+	return NULL;
+}
+
+
+/* extern */ TrafficRecorderRef
+TrafficRecorderRetain(TrafficRecorderRef recorder) {
+
+	TrafficRecorder* r = (TrafficRecorder*)recorder;
+	
+	pthread_mutex_lock(&(r->_lock));
+	r->_rc++;
+	pthread_mutex_unlock(&(r->_lock));
+	
+	return recorder;
+}
+
+
+/* extern */ void
+TrafficRecorderRelease(TrafficRecorderRef recorder) {
+
+	TrafficRecorder* r = (TrafficRecorder*)recorder;
+	UInt32 rc;
+	
+	pthread_mutex_lock(&(r->_lock));
+	rc = --(r->_rc);
+	pthread_mutex_unlock(&(r->_lock));
+	
+	// Destroy the object if not being held.
+	if (rc == 0) {
+	
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef alloc = r->_alloc;
+		
+		// Whatever gathered goes out before the file closes.
+		while (r->_shards != NULL) {
+		
+			TrafficRecorderShard* shard = r->_shards;
+			r->_shards = shard->_next;
+			
+			_TrafficRecorderFlush(shard, NULL, 0, 0);
+			
+			pthread_mutex_destroy(&(shard->_lock));
+			CFAllocatorDeallocate(alloc, shard);
+		}
+		
+		if (r->_file != -1)
+			close(r->_file);
+		
+		pthread_key_delete(r->_key);
+		pthread_mutex_destroy(&(r->_writeLock));
+		pthread_mutex_destroy(&(r->_lock));
+		
+		// Free the memory in use by the recorder.
+		CFAllocatorDeallocate(alloc, r);
+		
+		// Release the allocator.
+		if (alloc)
+			CFRelease(alloc);
+	}
+}
+
+
+/* extern */ TrafficRecorderShardRef
+TrafficRecorderGetShard(TrafficRecorderRef recorder) {
+
+	TrafficRecorder* r = (TrafficRecorder*)recorder;
+	TrafficRecorderShard* shard = pthread_getspecific(r->_key);
+	
+	// First time on this thread, so make it a shard.
+	if (shard == NULL) {
+	
+		shard = CFAllocatorAllocate(r->_alloc, sizeof(shard[0]), 0);
+		if (shard == NULL)
+			return NULL;
+		
+		memset(shard, 0, offsetof(TrafficRecorderShard, _buffer));
+		
+		shard->_recorder = r;
+		pthread_mutex_init(&(shard->_lock), NULL);
+		
+		// Put it where flushing can find it.
+		pthread_mutex_lock(&(r->_lock));
+		shard->_next = r->_shards;
+		r->_shards = shard;
+		pthread_mutex_unlock(&(r->_lock));
+		
+		pthread_setspecific(r->_key, shard);
+	}
+	
+	return (TrafficRecorderShardRef)shard;
+}
+
+
+/* extern */ UInt64
+TrafficRecorderOpen(TrafficRecorderShardRef shard) {
+
+	TrafficRecorderShard* s = (TrafficRecorderShard*)shard;
+	UInt64 connection;
+	
+	// Numbered in the order they open, across every shard.
+	pthread_mutex_lock(&(s->_recorder->_lock));
+	connection = ++(s->_recorder->_connections);
+	pthread_mutex_unlock(&(s->_recorder->_lock));
+	
+	pthread_mutex_lock(&(s->_lock));
+	_TrafficRecorderBegin(s, kTrafficCaptureOpen, connection, 0);
+	pthread_mutex_unlock(&(s->_lock));
+	
+	return connection;
+}
+
+
+/* extern */ void
+TrafficRecorderRecordData(TrafficRecorderShardRef shard, UInt64 connection, const struct iovec* vectors, CFIndex count, CFIndex length) {
+
+	TrafficRecorderShard* s = (TrafficRecorderShard*)shard;
+	CFIndex payload = s->_recorder->_payloads ? length : 0;
+	
+	pthread_mutex_lock(&(s->_lock));
+	
+	_TrafficRecorderBegin(s, kTrafficCaptureData, connection, payload);
+	
+	// The length is part of the record's header, so there is room for it.
+	s->_length += _TrafficPutNumber(s->_buffer + s->_length, length);
+	
+	// Too big to gather, so it goes straight out behind its header.
+	if (payload > (kBufferSize - s->_length))
+		_TrafficRecorderFlush(s, vectors, count, payload);
+	
+	else {
+	
+		CFIndex i;
+		
+		for (i = 0; (i < count) && (payload > 0); i++) {
+		
+			CFIndex piece = ((CFIndex)vectors[i].iov_len < payload) ? (CFIndex)vectors[i].iov_len : payload;
+			
+			memcpy(s->_buffer + s->_length, vectors[i].iov_base, piece);
+			s->_length += piece;
+			payload -= piece;
+		}
+	}
+	
+	pthread_mutex_unlock(&(s->_lock));
+}
+
+
+/* extern */ void
+TrafficRecorderClose(TrafficRecorderShardRef shard, UInt64 connection) {
+
+	TrafficRecorderShard* s = (TrafficRecorderShard*)shard;
+	
+	pthread_mutex_lock(&(s->_lock));
+	_TrafficRecorderBegin(s, kTrafficCaptureClose, connection, 0);
+	pthread_mutex_unlock(&(s->_lock));
+}
+
+
+/* extern */ Boolean
+TrafficRecorderFlush(TrafficRecorderRef recorder) {
+
+	TrafficRecorder* r = (TrafficRecorder*)recorder;
+	TrafficRecorderShard* shard;
+	Boolean result = TRUE;
+	
+	pthread_mutex_lock(&(r->_lock));
+	
+	for (shard = r->_shards; shard != NULL; shard = shard->_next) {
+	
+		pthread_mutex_lock(&(shard->_lock));
+		
+		if (!_TrafficRecorderFlush(shard, NULL, 0, 0))
+			result = FALSE;
+		
+		pthread_mutex_unlock(&(shard->_lock));
+	}
+	
+	pthread_mutex_unlock(&(r->_lock));
+	
+	return result;
+}
+
+
+/* extern */ TrafficReaderRef
+TrafficReaderCreate(CFAllocatorRef alloc, const char* path) {
+
+	TrafficReader* reader = NULL;
+	
+	do {
+		UInt8 header[kHeaderSize];
+		
+		// Allocate the buffer for the reader.
+		reader = CFAllocatorAllocate(alloc, sizeof(reader[0]), 0);
+		
+		// Fail if unable to create the reader.
+		if (reader == NULL)
+			break;
+		
+		memset(reader, 0, sizeof(reader[0]));
+		
+		// Save the allocator for deallocating later.
+		reader->_alloc = alloc ? CFRetain(alloc) : NULL;
+		
+		// Bump the retain count.
+		TrafficReaderRetain((TrafficReaderRef)reader);
+		
+		reader->_file = fopen(path, "rb");
+		if (reader->_file == NULL)
+			break;
+		
+		// Only a capture of a version this understands.
+		if ((fread(header, sizeof(header), 1, reader->_file) != 1) ||
+			(memcmp(header, kMagic, sizeof(kMagic)) != 0) ||
+			(header[4] != kVersion))
+		{
+			break;
+		}
+		
+		reader->_payloads = (header[5] & kFlagPayloads) != 0;
+		reader->_start = _TrafficGetTime(header + 8);
+		
+		// Find every chunk up front, so they can be merged back into time order.
+		if (!_TrafficReaderIndex(reader))
+			break;
+		
+		return (TrafficReaderRef)reader;
+		
+	} while (0);
+	
+	// Something failed, so clean up.
+	if (reader)
+		TrafficReaderRelease((TrafficReaderRef)reader);
+	
+	return NULL;
+}
+
+
+/* extern */ TrafficReaderRef
+TrafficReaderRetain(TrafficReaderRef reader) {
+
+	// Bump the retain count.
+	((TrafficReader*)reader)->_rc++;
+	
+	return reader;
+}
+
+
+/* extern */ void
+TrafficReaderRelease(TrafficReaderRef reader) {
+
+	TrafficReader* r = (TrafficReader*)reader;
+	
+	// Decrease the retain count.
+	r->_rc--;
+	
+	// Destroy the object if not being held.
+	if (r->_rc == 0) {
+	
+		// Hold locally so deallocation can happen and then safely release.
+		CFAllocatorRef alloc = r->_alloc;
+		
+		if (r->_file != NULL)
+			fclose(r->_file);
+		
+		while (r->_cursorCount > 0) {
+			TrafficCursor* cursor = &(r->_cursors[--(r->_cursorCount)]);
+			if (cursor->_bytes != NULL)
+				CFAllocatorDeallocate(alloc, cursor->_bytes);
+		}
+		
+		if (r->_cursors != NULL)
+			CFAllocatorDeallocate(alloc, r->_cursors);
+		
+		if (r->_chunks != NULL)
+			CFAllocatorDeallocate(alloc, r->_chunks);
+		
+		// Free the memory in use by the reader.
+		CFAllocatorDeallocate(alloc, r);
+		
+		// Release the allocator.
+		if (alloc)
+			CFRelease(alloc);
+	}
+}
+
+
+/* extern */ Boolean
+TrafficReaderHasPayloads(TrafficReaderRef reader) {
+
+	return ((TrafficReader*)reader)->_payloads;
+}
+
+
+/* extern */ CFAbsoluteTime
+TrafficReaderGetStartTime(TrafficReaderRef reader) {
+
+	return ((TrafficReader*)reader)->_start;
+}
+
+
+/* extern */ Boolean
+TrafficReaderNext(TrafficReaderRef reader, TrafficCaptureRecord* record) {
+
+	TrafficReader* r = (TrafficReader*)reader;
+	TrafficCursor* best;
+	CFIndex i;
+	
+	// Chunks that have run out go now, along with the payload handed out
+	// from them last time.
+	for (i = 0; i < r->_cursorCount; ) {
+	
+		TrafficCursor* cursor = &(r->_cursors[i]);
+		
+		if (cursor->_hasNext) {
+			i++;
+			continue;
+		}
+		
+		if (cursor->_bytes != NULL)
+			CFAllocatorDeallocate(r->_alloc, cursor->_bytes);
+		
+		*cursor = r->_cursors[--(r->_cursorCount)];
+	}
+	
+	while (1) {
+	
+		// The earliest record of the chunks being read.
+		best = NULL;
+		for (i = 0; i < r->_cursorCount; i++) {
+			if (r->_cursors[i]._hasNext && ((best == NULL) || _TrafficCursorIsBefore(&(r->_cursors[i]), best)))
+				best = &(r->_cursors[i]);
+		}
+		
+		// A chunk starting no later than that may hold an earlier one.
+		if ((r->_nextChunk == r->_chunkCount) ||
+			((best != NULL) && (r->_chunks[r->_nextChunk]._start > best->_next.time)))
+		{
+			break;
+		}
+		
+		// Out of memory is the end, the same as damage.
+		if (!_TrafficReaderOpenChunk(r))
+			return FALSE;
+	}
+	
+	// Every chunk has run out.
+	if (best == NULL)
+		return FALSE;
+	
+	*record = best->_next;
+	_TrafficCursorAdvance(r, best);
+	
+	return TRUE;
+}
+
+
+#pragma mark -
+#pragma mark Static Function Definitions
+
+/* static */ CFIndex
+_TrafficPutNumber(UInt8* bytes, UInt64 value) {
+
+	CFIndex length = 0;
+	
+	// Seven bits at a time, low first, the top bit set on all but the last.
+	do {
+		UInt8 byte = value & 0x7F;
+		value >>= 7;
+		bytes[length++] = byte | (value ? 0x80 : 0);
+	} while (value);
+	
+	return length;
+}
+
+
+/* static */ Boolean
+_TrafficGetNumber(const UInt8* bytes, CFIndex length, CFIndex* at, UInt64* value) {
+
+	unsigned shift;
+	
+	*value = 0;
+	
+	for (shift = 0; shift < 64; shift += 7) {
+	
+		UInt8 byte;
+		
+		if (*at >= length)
+			return FALSE;
+		
+		byte = bytes[(*at)++];
+		*value |= ((UInt64)(byte & 0x7F)) << shift;
+		
+		if ((byte & 0x80) == 0)
+			return TRUE;
+	}
+	
+	// More than ten bytes can't be a number this wrote.
+	return FALSE;
+}
+
+
+/* static */ void
+_TrafficPutTime(UInt8* bytes, CFAbsoluteTime time) {
+
+	UInt64 bits;
+	unsigned i;
+	
+	memcpy(&bits, &time, sizeof(bits));
+	
+	for (i = 0; i < 8; i++)
+		bytes[i] = (UInt8)(bits >> (56 - (8 * i)));
+}
+
+
+/* static */ void
+_TrafficPutLength(UInt8* bytes, CFIndex length) {
+
+	unsigned i;
+	
+	for (i = 0; i < 4; i++)
+		bytes[i] = (UInt8)(length >> (24 - (8 * i)));
+}
+
+
+/* static */ CFAbsoluteTime
+_TrafficGetTime(const UInt8* bytes) {
+
+	UInt64 bits = 0;
+	CFAbsoluteTime time;
+	unsigned i;
+	
+	for (i = 0; i < 8; i++)
+		bits = (bits << 8) | bytes[i];
+	
+	memcpy(&time, &bits, sizeof(time));
+	
+	return time;
+}
+
+
+/* static */ void
+_TrafficRecorderBegin(TrafficRecorderShard* shard, TrafficCaptureRecordType type, UInt64 connection, CFIndex payload) {
+
+	CFAbsoluteTime now;
+	CFIndex needed = kChunkHeader + kMaxRecordHeader + payload;
+	UInt64 micros = 0;
+	
+	// A payload too big to gather goes out on its own, behind its header.
+	if (needed > kBufferSize)
+		needed = kChunkHeader + kMaxRecordHeader;
+	
+	// Make sure the whole record fits, so none is split across two chunks.
+	if ((kBufferSize - shard->_length) < needed)
+		_TrafficRecorderFlush(shard, NULL, 0, 0);
+	
+	now = CFAbsoluteTimeGetCurrent();
+	
+	// Chunks from different shards land in whatever order they're written,
+	// so each starts from a time of its own.  Its length goes in as it does.
+	if (shard->_length == 0) {
+		memset(shard->_buffer, 0, kChunkHeader);
+		shard->_buffer[0] = kChunkMark;
+		_TrafficPutTime(shard->_buffer + 1, now);
+		shard->_length = kChunkHeader;
+		shard->_last = now;
+	}
+	
+	// Times only go forward; a clock stepping back reads as no time at all.
+	// Moving by whole microseconds keeps this in step with the reader.
+	if (now > shard->_last) {
+		micros = (UInt64)floor((now - shard->_last) * 1.0e6);
+		shard->_last += micros / 1.0e6;
+	}
+	
+	shard->_buffer[shard->_length++] = (UInt8)type;
+	shard->_length += _TrafficPutNumber(shard->_buffer + shard->_length, connection);
+	shard->_length += _TrafficPutNumber(shard->_buffer + shard->_length, micros);
+}
+
+
+/* static */ Boolean
+_TrafficRecorderWrite(TrafficRecorder* recorder, const UInt8* bytes, CFIndex length) {
+
+	// Already given up.
+	if (recorder->_file == -1)
+		return FALSE;
+	
+	while (length > 0) {
+	
+		ssize_t written = write(recorder->_file, bytes, length);
+		
+		if (written > 0) {
+			bytes += written;
+			length -= written;
+		}
+		else if ((written == -1) && (errno == EINTR))
+			continue;
+		
+		// The capture is lost past here, but the server carries on.
+		else {
+			close(recorder->_file);
+			recorder->_file = -1;
+			return FALSE;
+		}
+	}
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_TrafficRecorderFlush(TrafficRecorderShard* shard, const struct iovec* vectors, CFIndex count, CFIndex length) {
+
+	TrafficRecorder* recorder = shard->_recorder;
+	Boolean result;
+	CFIndex i;
+	
+	// Nothing gathered since the last time.
+	if (shard->_length == 0)
+		return (recorder->_file != -1);
+	
+	// The chunk's records, in the gathered bytes and after them.
+	_TrafficPutLength(shard->_buffer + 9, shard->_length - kChunkHeader + length);
+	
+	// One chunk at a time, and the first length bytes of the vectors with
+	// it.  Only the threads sharing this shard wait on the write; the rest
+	// carry on gathering into theirs.
+	pthread_mutex_lock(&(recorder->_writeLock));
+	
+	result = _TrafficRecorderWrite(recorder, shard->_buffer, shard->_length);
+	
+	for (i = 0; result && (i < count) && (length > 0); i++) {
+	
+		CFIndex piece = ((CFIndex)vectors[i].iov_len < length) ? (CFIndex)vectors[i].iov_len : length;
+		
+		result = _TrafficRecorderWrite(recorder, (const UInt8*)vectors[i].iov_base, piece);
+		length -= piece;
+	}
+	
+	pthread_mutex_unlock(&(recorder->_writeLock));
+	
+	// Gone either way, so the buffer can fill again.
+	shard->_length = 0;
+	
+	return result;
+}
+
+
+/* static */ int
+_TrafficCompareChunks(const void* a, const void* b) {
+
+	const TrafficChunk* chunk = (const TrafficChunk*)a;
+	const TrafficChunk* other = (const TrafficChunk*)b;
+	
+	// By when they start, and those starting together by place in the file.
+	if (chunk->_start != other->_start)
+		return (chunk->_start < other->_start) ? -1 : 1;
+	
+	return (chunk->_offset < other->_offset) ? -1 : (chunk->_offset > other->_offset);
+}
+
+
+/* static */ Boolean
+_TrafficReaderIndex(TrafficReader* reader) {
+
+	UInt64 offset = kHeaderSize;
+	
+	while (1) {
+	
+		UInt8 header[kChunkHeader];
+		TrafficChunk* chunk;
+		CFIndex length;
+		
+		// A clean end falls between chunks, and one cut short in its header
+		// is the end too.
+		if ((fread(header, sizeof(header), 1, reader->_file) != 1) || (header[0] != kChunkMark))
+			break;
+		
+		length = ((CFIndex)header[9] << 24) | ((CFIndex)header[10] << 16) | ((CFIndex)header[11] << 8) | (CFIndex)header[12];
+		
+		if (length > kMaxChunk)
+			break;
+		
+		// Grow to fit.
+		if (reader->_chunkCount == reader->_chunkCapacity) {
+		
+			CFIndex capacity = reader->_chunkCapacity ? (2 * reader->_chunkCapacity) : 64;
+			TrafficChunk* chunks = (reader->_chunks == NULL) ?
+				CFAllocatorAllocate(reader->_alloc, capacity * sizeof(chunks[0]), 0) :
+				CFAllocatorReallocate(reader->_alloc, reader->_chunks, capacity * sizeof(chunks[0]), 0);
+			
+			if (chunks == NULL)
+				return FALSE;
+			
+			reader->_chunks = chunks;
+			reader->_chunkCapacity = capacity;
+		}
+		
+		chunk = &(reader->_chunks[reader->_chunkCount++]);
+		chunk->_offset = offset + kChunkHeader;
+		chunk->_length = length;
+		chunk->_start = _TrafficGetTime(header + 1);
+		
+		// On to the next one.
+		offset = chunk->_offset + length;
+		if (fseeko(reader->_file, (off_t)offset, SEEK_SET) != 0)
+			break;
+	}
+	
+	if (reader->_chunkCount > 1)
+		qsort(reader->_chunks, reader->_chunkCount, sizeof(reader->_chunks[0]), &_TrafficCompareChunks);
+	
+	return TRUE;
+}
+
+
+/* static */ Boolean
+_TrafficReaderOpenChunk(TrafficReader* reader) {
+
+	TrafficChunk* chunk = &(reader->_chunks[reader->_nextChunk]);
+	TrafficCursor* cursor;
+	UInt8* bytes = NULL;
+	size_t got = 0;
+	
+	// Grow to fit.
+	if (reader->_cursorCount == reader->_cursorCapacity) {
+	
+		CFIndex capacity = reader->_cursorCapacity ? (2 * reader->_cursorCapacity) : 8;
+		TrafficCursor* cursors = (reader->_cursors == NULL) ?
+			CFAllocatorAllocate(reader->_alloc, capacity * sizeof(cursors[0]), 0) :
+			CFAllocatorReallocate(reader->_alloc, reader->_cursors, capacity * sizeof(cursors[0]), 0);
+		
+		if (cursors == NULL)
+			return FALSE;
+		
+		reader->_cursors = cursors;
+		reader->_cursorCapacity = capacity;
+	}
+	
+	// The whole chunk, or as much of it as made it into the file.
+	if (chunk->_length > 0) {
+	
+		bytes = CFAllocatorAllocate(reader->_alloc, chunk->_length, 0);
+		if (bytes == NULL)
+			return FALSE;
+		
+		if (fseeko(reader->_file, (off_t)chunk->_offset, SEEK_SET) == 0)
+			got = fread(bytes, 1, chunk->_length, reader->_file);
+	}
+	
+	reader->_nextChunk++;
+	
+	cursor = &(reader->_cursors[reader->_cursorCount++]);
+	memset(cursor, 0, sizeof(cursor[0]));
+	
+	cursor->_offset = chunk->_offset;
+	cursor->_bytes = bytes;
+	cursor->_length = (CFIndex)got;
+	cursor->_time = chunk->_start;
+	
+	_TrafficCursorAdvance(reader, cursor);
+	
+	return TRUE;
+}
+
+
+/* static */ void
+_TrafficCursorAdvance(TrafficReader* reader, TrafficCursor* cursor) {
+
+	TrafficCaptureRecord* record = &(cursor->_next);
+	CFIndex at = cursor->_at;
+	UInt64 connection, micros, length = 0;
+	int type;
+	
+	// Past the end, or a record cut short or damaged, ends the chunk.
+	cursor->_hasNext = FALSE;
+	
+	if (at >= cursor->_length)
+		return;
+	
+	type = cursor->_bytes[at++];
+	
+	if ((type < kTrafficCaptureOpen) || (type > kTrafficCaptureClose) ||
+		!_TrafficGetNumber(cursor->_bytes, cursor->_length, &at, &connection) ||
+		!_TrafficGetNumber(cursor->_bytes, cursor->_length, &at, &micros))
+	{
+		return;
+	}
+	
+	if ((type == kTrafficCaptureData) && (!_TrafficGetNumber(cursor->_bytes, cursor->_length, &at, &length) || (length > kMaxPayload)))
+		return;
+	
+	if ((type == kTrafficCaptureData) && reader->_payloads && (length > (UInt64)(cursor->_length - at)))
+		return;
+	
+	memset(record, 0, sizeof(record[0]));
+	
+	cursor->_time += micros / 1.0e6;
+	
+	record->type = (TrafficCaptureRecordType)type;
+	record->connection = connection;
+	record->time = cursor->_time;
+	record->length = (CFIndex)length;
+	
+	if ((type == kTrafficCaptureData) && reader->_payloads) {
+		record->payload = cursor->_bytes + at;
+		at += (CFIndex)length;
+	}
+	
+	cursor->_at = at;
+	cursor->_hasNext = TRUE;
+}
+
+
+/* static */ Boolean
+_TrafficCursorIsBefore(const TrafficCursor* cursor, const TrafficCursor* other) {
+
+	// Ties go to the chunk earlier in the file, which keeps a shard's
+	// chunks in the order it wrote them.
+	if (cursor->_next.time != other->_next.time)
+		return (cursor->_next.time < other->_next.time);
+	
+	return (cursor->_offset < other->_offset);
+}
@@ -0,0 +1,186 @@
+
+#ifndef __TRAFFICCAPTURE__
+#define __TRAFFICCAPTURE__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <sys/uio.h>
+
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+** Capture files
+**
+** A sixteen byte header, then one record after another.  The header is
+** the bytes "ECAP", a version byte, a flags byte (1 if payloads are kept)
+** and two zero bytes, then the time the capture started as a big endian
+** 64-bit CFAbsoluteTime.
+**
+** Records come in chunks, one from each time a thread's shard is written
+** out.  A chunk starts with a zero byte, the big endian time its first
+** record counts from, and the big endian 32-bit length of its records.
+** Each record is a type byte followed by unsigned LEB128 numbers: the
+** connection, then the microseconds since the record before it in the
+** chunk.  A data record adds its length and, if payloads are kept, that
+** many bytes.  Connections are numbered from one in the order they open.
+**
+** Chunks land in the order they are written, which for a quiet thread
+** can be long after the others, so the reader merges them back into time
+** order.  A connection's records all go through one shard, so they keep
+** their order.
+*/
+typedef enum {
+	kTrafficCaptureOpen = 1,
+	kTrafficCaptureData = 2,
+	kTrafficCaptureClose = 3
+} TrafficCaptureRecordType;
+
+
+/*
+** TrafficCaptureRecord
+**
+** One record as read back.
+**
+** type			What happened.
+**
+** connection	Which connection it happened on.
+**
+** time			When, as a CFAbsoluteTime.
+**
+** length		Bytes that arrived, for a data record.
+**
+** payload		Those bytes, if the capture kept them, else NULL.  Only
+**				good until the next record is read.
+*/
+typedef struct {
+	TrafficCaptureRecordType type;
+	UInt64				connection;
+	CFAbsoluteTime		time;
+	CFIndex				length;
+	const UInt8*		payload;
+} TrafficCaptureRecord;
+
+
+typedef struct __TrafficRecorder* TrafficRecorderRef;
+typedef struct __TrafficRecorderShard* TrafficRecorderShardRef;
+typedef struct __TrafficReader* TrafficReaderRef;
+
+
+/*
+** TrafficRecorderCreate
+**
+** Create a recorder writing a new capture file at path, replacing any
+** that is there, readable only by its owner.  Records gather in memory,
+** in a shard for each thread, and each shard is written out by whichever
+** thread fills it.  A failed write stops the capture rather than the
+** server.
+**
+** alloc		Allocator to use for allocating.  NULL indicates
+**				the default allocator.
+**
+** path			Where to write the capture.
+**
+** payloads		Keep the bytes as well as their sizes and times.
+*/
+TrafficRecorderRef TrafficRecorderCreate(CFAllocatorRef alloc, const char* path, Boolean payloads);
+
+TrafficRecorderRef TrafficRecorderRetain(TrafficRecorderRef recorder);
+void TrafficRecorderRelease(TrafficRecorderRef recorder);
+
+
+/*
+** TrafficRecorderGetShard
+**
+** Returns the calling thread's shard of the recorder, making it the first
+** time, or NULL if it can't be made.  A connection records everything
+** through the shard it opened on, from whatever thread, so its records
+** stay in order.  Shards last as long as the recorder.
+*/
+TrafficRecorderShardRef TrafficRecorderGetShard(TrafficRecorderRef recorder);
+
+
+/*
+** TrafficRecorderOpen
+**
+** Records a connection opening and returns its number, for the other
+** records about it.
+*/
+UInt64 TrafficRecorderOpen(TrafficRecorderShardRef shard);
+
+
+/*
+** TrafficRecorderRecordData
+**
+** Records length bytes arriving on the connection.  They are the first
+** length bytes described by the vectors, which is how a read into a ring
+** buffer finds them.
+*/
+void TrafficRecorderRecordData(TrafficRecorderShardRef shard, UInt64 connection, const struct iovec* vectors, CFIndex count, CFIndex length);
+
+
+/*
+** TrafficRecorderClose
+**
+** Records the connection closing.
+*/
+void TrafficRecorderClose(TrafficRecorderShardRef shard, UInt64 connection);
+
+
+/*
+** TrafficRecorderFlush
+**
+** Writes out whatever has gathered in every shard.  Releasing the
+** recorder does this too.  Call it every so often as well, so a quiet
+** thread's records don't wait on a full buffer and a server that is
+** killed loses little.  Returns FALSE if the capture has failed.
+*/
+Boolean TrafficRecorderFlush(TrafficRecorderRef recorder);
+
+
+/*
+** TrafficReaderCreate
+**
+** Opens a capture file for reading.  Returns NULL if it can't be opened
+** or isn't a capture.
+*/
+TrafficReaderRef TrafficReaderCreate(CFAllocatorRef alloc, const char* path);
+
+TrafficReaderRef TrafficReaderRetain(TrafficReaderRef reader);
+void TrafficReaderRelease(TrafficReaderRef reader);
+
+
+/*
+** TrafficReaderHasPayloads
+**
+** Returns TRUE if the capture kept the bytes.
+*/
+Boolean TrafficReaderHasPayloads(TrafficReaderRef reader);
+
+
+/*
+** TrafficReaderGetStartTime
+**
+** Returns when the capture started.
+*/
+CFAbsoluteTime TrafficReaderGetStartTime(TrafficReaderRef reader);
+
+
+/*
+** TrafficReaderNext
+**
+** Reads the next record, in time order across all of the chunks.
+** Returns FALSE at the end of the capture.  A chunk cut short or damaged
+** ends at the last whole record before that.
+*/
+Boolean TrafficReaderNext(TrafficReaderRef reader, TrafficCaptureRecord* record);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif	/* __TRAFFICCAPTURE__ */
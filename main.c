@@ -45,24 +45,107 @@
 
 #include "Server.h"
 #include "EchoContext.h"
+#include "PoolAllocator.h"
+#include "RateLimiter.h"
 
 
 #pragma mark -
 #pragma mark Constant Definitions
 
-#define kServiceType	CFSTR("_echo._tcp.")
+#define kDatagram		FALSE		// Echo UDP datagrams instead of TCP connections
+#define kServiceType	(kDatagram ? CFSTR("_echo._udp.") : CFSTR("_echo._tcp."))
+
+#define kReadSize		(64 * 1024)
+#define kReadBudget		(256 * 1024)
+#define kIOMode			kEchoContextIOStream
+#define kDispatch		(kIOMode == kEchoContextIODispatch)	// Accept on dispatch too when connections run there
+
+#define kIdleTimeOut		60
+#define kFirstByteTimeOut	0			// Seconds, or zero for the idle timeout; e.g. 10 against slow opens
+#define kWriteStallTimeOut	0			// Likewise; e.g. 15 against clients that never read
+
+#define kHighWaterMark		(2 * 1024 * 1024)	// Room for megabyte lines and then some
+#define kLowWaterMark		(512 * 1024)
+#define kMaxLineLength		0			// Zero for up to the high water mark, or e.g. (64 * 1024)
+#define kOverflowPolicy		kEchoContextOverflowClose
+#define kProtocol			(&kEchoContextLineProtocol)
+
+#define kNoDelay			TRUE
+#define kCoalesceDelay		0			// Seconds, e.g. 0.002 for bulk clients
+#define kCoalesceBytes		0
+
+#define kByteRate			0			// Bytes per second per connection, or zero for no limit
+#define kByteBurst			0
+#define kLineRate			0			// Lines per second per connection
+#define kLineBurst			0
+#define kClientByteRate		0			// The same, shared by every connection from an address
+#define kClientByteBurst	0
+#define kClientLineRate		0
+#define kClientLineBurst	0
+
+#define kCapturePath		NULL		// e.g. "/tmp/Echo.capture", for EchoReplay
+#define kCapturePayloads	FALSE		// Keep the bytes, not just their sizes
+#define kCaptureInterval	1.0			// Seconds between writing out the capture
+
+#define kWorkerCount		4
+#define kWorkerPolicy		kServerWorkerLeastLoaded
+#define kPinWorkers			FALSE		// One CPU per worker, from kFirstCPU
+#define kFirstCPU			0
+#define kWorkerAllocators	FALSE		// A pool per worker, local to its node
+#define kReusePort			(!kHandOff)	// Where the kernel balances a shared port; a hand-off can't carry its queues
+#define kBatchAccept		TRUE
+#define kListenBacklog		1024
+#define kStatisticsPort		0			// Loopback port for "nc localhost", or zero
+#define kSendBufferSize		0			// Bytes, or zero for the system's
+#define kReceiveBufferSize	0
+#define kKeepAliveIdle		30			// Seconds
+#define kKeepAliveInterval	5
+#define kKeepAliveCount		4
+#define kMaxConnections		10000		// Beyond this new clients are reset
+#define kAcceptRate			0			// Connections per second, or zero for no limit
+#define kAcceptBurst		0
+
+#define kHandOff			FALSE		// Restart without ever stopping accepting; one instance per path
+#define kHandOffPath		"/tmp/Echo.handoff"		// Where a restarted server takes the listeners from
+#define kDrainInterval		0.5			// Seconds between checks for the last client
+#define kDrainTimeOut		60			// Seconds the old server gives its clients
+
+#define kPoolMaxBlockSize	(256 * 1024)
+#define kPoolMaxCached		(64 * 1024 * 1024)
+
+
+#pragma mark -
+#pragma mark Type Declarations
+
+typedef struct {
+	CFAllocatorRef		allocator;		// Allocator for connections
+	EchoContextOptions	options;		// Tuning for connections
+} AcceptInfo;
+
+typedef struct {
+	ServerRef			server;			// Server being drained
+	CFIndex				ticks;			// Checks made so far
+} DrainInfo;
 
 
 #pragma mark -
 #pragma mark Static Function Declarations
 
 static void AcceptConnection(ServerRef server, CFSocketNativeHandle sock, CFStreamError* error, void* info);
+static void DrainConnections(ServerRef server);
+static void DrainTimerCallBack(CFRunLoopTimerRef timer, DrainInfo* drain);
+static void DrainInfoRelease(const void* info);
+static void CaptureTimerCallBack(CFRunLoopTimerRef timer, TrafficRecorderRef recorder);
 
 
 /* static */ void
 AcceptConnection(ServerRef server, CFSocketNativeHandle sock, CFStreamError* error, void* info) {
 
-	if (sock == ((CFSocketNativeHandle)(-1))) {
+	// A successor has the listeners, so finish with the clients there are.
+	if ((sock == ((CFSocketNativeHandle)(-1))) && (error->error == 0))
+		DrainConnections(server);
+	
+	else if (sock == ((CFSocketNativeHandle)(-1))) {
 	
 		fprintf(stderr, "AcceptConnection - Received an error (%d, %d)\n", (int)error->domain, (int)error->error);
 		
@@ -73,7 +156,17 @@ AcceptConnection(ServerRef server, CFSocketNativeHandle sock, CFStreamError* err
 	}
 	else {
 	
-		EchoContextRef echo = EchoContextCreate(NULL, sock);
+		// Share the server's timeout wheel rather than a timer per connection,
+		// count on its statistics, and list the connection so it can be drained.
+		EchoContextOptions options = ((const AcceptInfo*)info)->options;
+		options.timerWheel = ServerGetTimerWheel(server);
+		options.statistics = ServerGetStatistics(server);
+		options.registry = ServerGetRegistry(server);
+		
+		// Contexts and their buffers come from the pool, so churn recycles them.
+		// A worker with a pool of its own keeps them there instead.
+		CFAllocatorRef allocator = ServerGetAllocator(server);
+		EchoContextRef echo = EchoContextCreate(allocator ? allocator : ((const AcceptInfo*)info)->allocator, sock, &options);
 		
 		if ((echo != NULL) && !EchoContextOpen(echo))
 			EchoContextRelease(echo);
@@ -81,16 +174,199 @@ AcceptConnection(ServerRef server, CFSocketNativeHandle sock, CFStreamError* err
 }
 
 
+/* static */ void
+DrainConnections(ServerRef server) {
+
+	// Idle clients go now, busy ones once they've had their echoes.
+	ServerDrain(server, kDrainTimeOut);
+	
+	// The timer keeps its own count, and frees it when it goes.
+	DrainInfo* drain = CFAllocatorAllocate(NULL, sizeof(drain[0]), 0);
+	CFRunLoopTimerContext timerCtxt = {0, drain, NULL, &DrainInfoRelease, NULL};
+	CFRunLoopTimerRef timer = NULL;
+	
+	if (drain != NULL) {
+	
+		drain->server = server;
+		drain->ticks = 0;
+		
+		timer = CFRunLoopTimerCreate(NULL,
+									 CFAbsoluteTimeGetCurrent() + kDrainInterval,
+									 kDrainInterval,
+									 0,		// flags
+									 0,		// order
+									 (CFRunLoopTimerCallBack)&DrainTimerCallBack,
+									 &timerCtxt);
+		
+		if (timer == NULL)
+			CFAllocatorDeallocate(NULL, drain);
+	}
+	
+	// Check back until the clients are gone.  The run loop holds the timer.
+	if (timer != NULL) {
+		CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopCommonModes);
+		CFRelease(timer);
+	}
+	
+	// Without one there's no waiting, so go now.
+	else {
+		ServerInvalidate(server);
+		ServerRelease(server);
+		
+		CFRunLoopStop(CFRunLoopGetCurrent());
+	}
+}
+
+
+/* static */ void
+DrainTimerCallBack(CFRunLoopTimerRef timer, DrainInfo* drain) {
+
+	ServerRef server = drain->server;
+	
+	// Closes first, so a late open can't make it look negative.
+	StatisticsRef stats = ServerGetStatistics(server);
+	UInt64 closes = StatisticsGetTotal(stats, kStatisticsCloses);
+	UInt64 opens = StatisticsGetTotal(stats, kStatisticsOpens);
+	
+	// Done once the last client leaves, or once they've had long enough.
+	if ((opens == closes) || ((++(drain->ticks) * kDrainInterval) >= kDrainTimeOut)) {
+	
+		CFRunLoopTimerInvalidate(timer);
+		
+		ServerInvalidate(server);
+		ServerRelease(server);
+		
+		CFRunLoopStop(CFRunLoopGetCurrent());
+	}
+}
+
+
+/* static */ void
+DrainInfoRelease(const void* info) {
+
+	CFAllocatorDeallocate(NULL, (void*)info);
+}
+
+
+/* static */ void
+CaptureTimerCallBack(CFRunLoopTimerRef timer, TrafficRecorderRef recorder) {
+
+	// Quiet threads' records go out too, and not only once the server quits.
+	TrafficRecorderFlush(recorder);
+}
+
+
 #pragma mark -
 
 int main (int argc, const char * argv[]) {
     
-    ServerContext c = {NULL, NULL, NULL, NULL};
+    // Options go by name, so a new field can't shift the rest over.  The
+    // shared objects are filled in later, per connection or below.
+    AcceptInfo info = {.allocator = PoolAllocatorCreate(NULL, kPoolMaxBlockSize, kPoolMaxCached),
+					   .options = {.readSize = kReadSize,
+								   .readBudget = kReadBudget,
+								   .ioMode = kIOMode,
+								   .idleTimeOut = kIdleTimeOut,
+								   .firstByteTimeOut = kFirstByteTimeOut,
+								   .writeStallTimeOut = kWriteStallTimeOut,
+								   .highWaterMark = kHighWaterMark,
+								   .lowWaterMark = kLowWaterMark,
+								   .maxLineLength = kMaxLineLength,
+								   .overflowPolicy = kOverflowPolicy,
+								   .protocol = kProtocol,
+								   .noDelay = kNoDelay,
+								   .coalesceDelay = kCoalesceDelay,
+								   .coalesceBytes = kCoalesceBytes,
+								   .byteRate = kByteRate,
+								   .byteBurst = kByteBurst,
+								   .lineRate = kLineRate,
+								   .lineBurst = kLineBurst}};
+    RateLimiterOptions limiterOptions = {.byteRate = kClientByteRate,
+										 .byteBurst = kClientByteBurst,
+										 .lineRate = kClientLineRate,
+										 .lineBurst = kClientLineBurst};
+    ServerContext c = {&info, NULL, NULL, NULL};
+    ServerOptions serverOptions = {.workerCount = kWorkerCount,
+								   .workerPolicy = kWorkerPolicy,
+								   .reusePort = kReusePort,
+								   .batchAccept = kBatchAccept,
+								   .listenBacklog = kListenBacklog,
+								   .statisticsPort = kStatisticsPort,
+								   .sendBufferSize = kSendBufferSize,
+								   .receiveBufferSize = kReceiveBufferSize,
+								   .keepAliveIdle = kKeepAliveIdle,
+								   .keepAliveInterval = kKeepAliveInterval,
+								   .keepAliveCount = kKeepAliveCount,
+								   .maxConnections = kMaxConnections,
+								   .acceptRate = kAcceptRate,
+								   .acceptBurst = kAcceptBurst,
+								   .datagram = kDatagram,
+								   .dispatch = kDispatch,
+								   .pinWorkers = kPinWorkers,
+								   .firstCPU = kFirstCPU,
+								   .workerAllocators = kWorkerAllocators};
+    
+    ServerRef server;
+    CFRunLoopTimerRef captureTimer = NULL;
+    
+    // One set of buckets per client address, whichever worker its connections land on.
+    if ((kClientByteRate > 0) || (kClientLineRate > 0))
+        info.options.rateLimiter = RateLimiterCreate(NULL, &limiterOptions);
+    
+    // One capture for every connection, in the order things happened.
+    if (kCapturePath != NULL)
+        info.options.recorder = TrafficRecorderCreate(NULL, kCapturePath, kCapturePayloads);
+    
+    // And written out as it goes.  The recorder outlives the timer.
+    if (info.options.recorder != NULL) {
     
-    ServerRef server = ServerCreate(NULL, AcceptConnection, &c);
+        CFRunLoopTimerContext timerCtxt = {0, info.options.recorder, NULL, NULL, NULL};
+        
+        captureTimer = CFRunLoopTimerCreate(NULL,
+                                            CFAbsoluteTimeGetCurrent() + kCaptureInterval,
+                                            kCaptureInterval,
+                                            0,		// flags
+                                            0,		// order
+                                            (CFRunLoopTimerCallBack)&CaptureTimerCallBack,
+                                            &timerCtxt);
+        
+        if (captureTimer != NULL)
+            CFRunLoopAddTimer(CFRunLoopGetCurrent(), captureTimer, kCFRunLoopCommonModes);
+    }
+    
+    server = ServerCreate(NULL, AcceptConnection, &c, &serverOptions);
 
-	if (server != NULL && ServerConnect(server, NULL, kServiceType, 0))
-		CFRunLoopRun();
+	if (server != NULL) {
+	
+		// Take over from a server still running, if there is one, so
+		// restarting never stops accepting.
+		if (kHandOff)
+			ServerAdoptListeners(server, kHandOffPath);
+		
+		if (ServerConnect(server, NULL, kServiceType, 0)) {
+		
+			// And be ready to hand over to the next one in turn.
+			if (kHandOff)
+				ServerServeHandOff(server, kHandOffPath);
+			
+			CFRunLoopRun();
+		}
+	}
+    
+    if (info.allocator != NULL)
+        CFRelease(info.allocator);
+    
+    if (info.options.rateLimiter != NULL)
+        RateLimiterRelease(info.options.rateLimiter);
+    
+    if (captureTimer != NULL) {
+        CFRunLoopTimerInvalidate(captureTimer);
+        CFRelease(captureTimer);
+    }
+    
+    // Writes out the last of the capture.
+    if (info.options.recorder != NULL)
+        TrafficRecorderRelease(info.options.recorder);
     
     return 0;
 }